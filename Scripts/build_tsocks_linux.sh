@@ -0,0 +1,120 @@
+#!/bin/sh
+
+#
+#  build_tsocks_linux.sh
+#
+#  Copyright 2016 Avérous Julien-Pierre
+#
+#  This file is part of TorProxifier.
+#
+#  TorProxifier is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  TorProxifier is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with TorProxifier.  If not, see <http://www.gnu.org/licenses/>.
+#
+#
+
+# Build libtsocks as an LD_PRELOAD library, so it can be run and profiled
+# on Linux. The configuration is then read from TSOCKS_CONF_DATA,
+# TSOCKS_CONF_FILE or /etc/tsocks.conf.
+#
+# Usage: build_tsocks_linux.sh [output directory]
+
+# Get base directory
+base=$( dirname "$0" )
+base=$( cd "${base}/../" ; pwd -P )
+
+sources="${base}/TorProxifier/TorProxifier/libtsocks/tsocks"
+
+if [ -z "${CC}" ]; then
+	CC=cc
+fi
+
+if [ -z "$1" ]; then
+	target_path="/tmp/tsocks-result"
+else
+	target_path="$1"
+fi
+
+mkdir -p "${target_path}"
+
+if [ $? -ne 0 ]; then
+	echo "[-] Error: Can't create output directory."
+	exit 1
+fi
+
+# Compile.
+echo '[+] Compile libtsocks.'
+
+${CC} -std=gnu99 -O2 -fPIC -shared -Wall ${CFLAGS} \
+	-o "${target_path}/libtsocks.so" \
+	"${sources}/interpose.c" \
+	"${sources}/tsocks.c" \
+	"${sources}/conn_table.c" \
+	"${sources}/reactor.c" \
+	"${sources}/resolver.c" \
+	"${sources}/dns_mux.c" \
+	"${sources}/common.c" \
+	"${sources}/parser.c" \
+	"${sources}/route_table.c" \
+	"${sources}/dead_pool.c" \
+	-ldl -lpthread
+
+if [ $? -ne 0 ]; then
+	echo "[-] Error: Can't build libtsocks."
+	exit 1
+fi
+
+# Build the stress and benchmark programs, they load the library from
+# the same directory. Any sources after the name are linked in too.
+stress="${base}/TorProxifier/TorProxifier/libtsocks/stress"
+
+build_program()
+{
+	name="$1"
+	shift
+
+	echo "[+] Compile ${name}."
+
+	${CC} -std=gnu99 -O2 -Wall ${CFLAGS} \
+		-I"${sources}" \
+		-o "${target_path}/${name}" \
+		"${stress}/${name}.c" \
+		"${stress}/harness.c" \
+		"$@" \
+		-ldl -lpthread -lresolv
+
+	if [ $? -ne 0 ]; then
+		echo "[-] Error: Can't build ${name}."
+		exit 1
+	fi
+}
+
+build_program conn_stress
+build_program epoll_check
+build_program bench_passthrough
+build_program bench_ttfb
+build_program bench_reactor
+build_program bench_resolve
+build_program bench_pool
+build_program bench_shared
+build_program bench_cache
+build_program bench_dns
+build_program bench_startup
+build_program bench_routes \
+	"${sources}/parser.c" \
+	"${sources}/route_table.c" \
+	"${sources}/common.c"
+
+echo "[#] Use 'LD_PRELOAD=${target_path}/libtsocks.so' to load it."
+echo "[#] Run '${target_path}/conn_stress [threads] [seconds] [reactor]' to stress it."
+echo "[#] Run '${target_path}/epoll_check' to check epoll registrations."
+echo "[#] Run the '${target_path}/bench_*' programs to benchmark it."
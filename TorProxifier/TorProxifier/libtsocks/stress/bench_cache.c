@@ -0,0 +1,142 @@
+/*
+
+    bench_cache.c - What the dead pool keeps and what it forgets
+
+    Two runs against a stand-in SOCKS server answering Tor's RESOLVE.
+    The first looks up a hot name between every few of many names only
+    looked up once, far more of them than the pool holds: the hot name
+    should be resolved once however much the others churn through the
+    pool. The second looks up a name that doesn't resolve again and
+    again, with tordns_negative_ttl 0 and 30: with 30 only the first
+    lookup should cost a RESOLVE. The RESOLVE requests the server got
+    and the library's cache counters are given for each.
+
+    Usage: bench_cache [lookups]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "harness.h"
+
+#define CACHE_SIZE        256
+#define CACHE_HOT_EVERY   8       /* Lookups between the hot name's */
+#define CACHE_HOT_NAME    "api.example"
+#define CACHE_FAIL_NAME   "failing.example"
+
+static int lookup(const char *name) {
+   struct addrinfo hints, *result;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(name, "80", &hints, &result))
+      return(-1);
+   freeaddrinfo(result);
+
+   return(0);
+}
+
+static void show_stats(void) {
+   struct tsocks_stats stats;
+
+   harness_stats()(&stats);
+   printf("      hits %lu, misses %lu, evictions %lu, expirations %lu, "
+          "negative hits %lu\n", stats.dns_cache_hits, stats.dns_cache_misses,
+          stats.dns_cache_evictions, stats.dns_cache_expirations,
+          stats.dns_negative_hits);
+}
+
+int main(int argc, char **argv) {
+   static const int negative_ttl[2] = { 0, 30 };
+   char *child_argv[4], conf[512], name[64];
+   struct stand_in server;
+   unsigned long resolves;
+   long lookups, i;
+   int failed = 0, rc = 0;
+
+   lookups = (argc > 1) ? atol(argv[1]) : 4000;
+   if (lookups <= 0) {
+      fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      memset(&server, 0, sizeof(server));
+      server.resolve = 1;
+      if (stand_in_start(&server))
+         return(2);
+      child_argv[0] = argv[0];
+      child_argv[1] = argv[1] ? argv[1] : "4000";
+      child_argv[3] = NULL;
+
+      printf("%ld lookups, one in %d of %s, %d entries\n", lookups,
+             CACHE_HOT_EVERY, CACHE_HOT_NAME, CACHE_SIZE);
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n"
+               "tordns_cache_size = %d\n",
+               server.port, CACHE_SIZE);
+      child_argv[2] = "churn";
+      if (harness_run(conf, child_argv))
+         rc = 1;
+      printf("      %lu RESOLVE requests\n", server.resolves);
+
+      printf("%ld lookups of %s\n", lookups, CACHE_FAIL_NAME);
+      for (i = 0; i < 2; i++) {
+         snprintf(conf, sizeof(conf),
+                  "server = 127.0.0.1\n"
+                  "server_port = %d\n"
+                  "server_type = 5\n"
+                  "local = 127.0.0.0/255.0.0.0\n"
+                  "tordns_cache_size = %d\n"
+                  "tordns_negative_ttl = %d\n",
+                  server.port, CACHE_SIZE, negative_ttl[i]);
+         printf("  tordns_negative_ttl %d\n", negative_ttl[i]);
+         child_argv[2] = "negative";
+         resolves = server.resolves;
+         if (harness_run(conf, child_argv))
+            rc = 1;
+         printf("      %lu RESOLVE requests\n", server.resolves - resolves);
+      }
+      return(rc);
+   }
+
+   if (!harness_stats()) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+
+   if (!strcmp(argv[2], "churn")) {
+      for (i = 0; i < lookups; i++) {
+         if ((i % CACHE_HOT_EVERY) == 0)
+            snprintf(name, sizeof(name), "%s", CACHE_HOT_NAME);
+         else
+            snprintf(name, sizeof(name), "once%ld.example", i);
+         if (lookup(name))
+            failed++;
+      }
+      if (failed)
+         printf("      %d lookups failed\n", failed);
+      show_stats();
+      return(failed ? 1 : 0);
+   }
+
+   /* Every one of them should fail */
+   for (i = 0; i < lookups; i++) {
+      if (!lookup(CACHE_FAIL_NAME))
+         failed++;
+   }
+   if (failed)
+      printf("      %d lookups didn't fail\n", failed);
+   show_stats();
+
+   return(failed ? 1 : 0);
+}
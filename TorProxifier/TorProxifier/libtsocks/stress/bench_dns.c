@@ -0,0 +1,206 @@
+/*
+
+    bench_dns.c - DNS over TCP through the SOCKS server
+
+    1000 res_query() lookups, one after the other and then from 50
+    threads at once, of a nameserver the stand-in SOCKS server answers
+    for, holding each of its replies back a little as Tor would. With
+    socks_dns_connections the library pipelines them over a few
+    connections it keeps. Without it every query is a connection, and
+    so a stream through the server, of its own: glibc's resolver
+    connects from inside libc where the library can't see it, so that
+    is done here by hand, as the resolver does with RES_USEVC. The time
+    it took is given, and how many connections and queries the server
+    got.
+
+    Usage: bench_dns [delay ms] [lookups] [threads]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "harness.h"
+
+#define DNS_NAMESERVER    "10.53.0.1"
+
+static int fresh;
+static int lookups;
+static int next_lookup;
+static int failed;
+static pthread_barrier_t start;
+
+/* An A query for name, returns its length */
+static int make_query(const char *name, uint16_t id, unsigned char *buf) {
+   unsigned char *p = buf + NS_HFIXEDSZ, *label = p++;
+
+   memset(buf, 0, NS_HFIXEDSZ);
+   buf[0] = id >> 8;
+   buf[1] = id & 0xff;
+   buf[2] = 0x01;                        /* Recursion desired */
+   buf[5] = 1;                           /* One question      */
+   for (; *name; name++) {
+      if (*name == '.') {
+         *label = p - label - 1;
+         label = p++;
+      } else {
+         *p++ = *name;
+      }
+   }
+   *label = p - label - 1;
+   *p++ = 0;
+   memcpy(p, "\0\1\0\1", 4);             /* A, IN             */
+
+   return(p + 4 - buf);
+}
+
+/* What the resolver does for a query with RES_USEVC: a connection to */
+/* the nameserver for it alone                                        */
+static int fresh_query(const char *name, unsigned char *answer, int anslen) {
+   struct sockaddr_in server;
+   unsigned char query[2 + 512], length[2];
+   int fd, len, rc = -1;
+
+   memset(&server, 0, sizeof(server));
+   server.sin_family = AF_INET;
+   server.sin_port = htons(STAND_IN_DNS_PORT);
+   inet_aton(DNS_NAMESERVER, &server.sin_addr);
+
+   len = make_query(name, rand() & 0xffff, &query[2]);
+   query[0] = len >> 8;
+   query[1] = len & 0xff;
+   if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      return(-1);
+   if (!connect(fd, (struct sockaddr *) &server, sizeof(server)) &&
+       !write_all(fd, query, 2 + len) && !read_all(fd, length, 2)) {
+      len = (length[0] << 8) | length[1];
+      if ((len <= anslen) && !read_all(fd, answer, len))
+         rc = len;
+   }
+   close(fd);
+
+   return(rc);
+}
+
+static void *worker(void *arg) {
+   unsigned char answer[512];
+   unsigned int address;
+   char name[64];
+   int i, len;
+
+   /* The resolver's state is per thread */
+   res_init();
+   _res.nscount = 1;
+   _res.nsaddr_list[0].sin_family = AF_INET;
+   _res.nsaddr_list[0].sin_port = htons(STAND_IN_DNS_PORT);
+   inet_aton(DNS_NAMESERVER, &_res.nsaddr_list[0].sin_addr);
+
+   pthread_barrier_wait(&start);
+   while ((i = __atomic_fetch_add(&next_lookup, 1, __ATOMIC_RELAXED)) <
+          lookups) {
+      snprintf(name, sizeof(name), "host%d.example", i);
+      if (fresh)
+         len = fresh_query(name, answer, sizeof(answer));
+      else
+         len = res_query(name, C_IN, T_A, answer, sizeof(answer));
+      /* The one record's address comes last */
+      address = stand_in_address(name);
+      if ((len < NS_HFIXEDSZ + 4) || memcmp(&answer[len - 4], &address, 4))
+         __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+   }
+
+   return(NULL);
+}
+
+int main(int argc, char **argv) {
+   static const char *modes[2] = { "fresh", "mux" };
+   static const int connections[2] = { 0, 8 };
+   char *child_argv[6], conf[512], threads_arg[16];
+   struct stand_in server;
+   unsigned long connects, queries;
+   pthread_t *threads;
+   long long started;
+   int delay, threads_count, i, j, rc = 0;
+
+   delay = (argc > 1) ? atoi(argv[1]) : 2;
+   lookups = (argc > 2) ? atoi(argv[2]) : 1000;
+   threads_count = (argc > 3) ? atoi(argv[3]) : 50;
+   if ((delay < 0) || (lookups <= 0) || (threads_count <= 0)) {
+      fprintf(stderr, "Usage: %s [delay ms] [lookups] [threads]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      memset(&server, 0, sizeof(server));
+      server.delay_ms = delay;
+      if (stand_in_start(&server))
+         return(2);
+      printf("%d lookups, %d ms per reply\n", lookups, delay);
+      child_argv[0] = argv[0];
+      child_argv[1] = argv[1] ? argv[1] : "2";
+      child_argv[2] = (argc > 2) ? argv[2] : "1000";
+      child_argv[5] = NULL;
+      for (i = 0; i < 2; i++) {
+         snprintf(conf, sizeof(conf),
+                  "server = 127.0.0.1\n"
+                  "server_port = %d\n"
+                  "server_type = 5\n"
+                  "local = 127.0.0.0/255.0.0.0\n"
+                  "tordns_enable = false\n"
+                  "socks_dns_connections = %d\n",
+                  server.port, connections[i]);
+         printf("  socks_dns_connections %d\n", connections[i]);
+         for (j = 0; j < 2; j++) {
+            snprintf(threads_arg, sizeof(threads_arg), "%d",
+                     j ? threads_count : 1);
+            child_argv[3] = threads_arg;
+            child_argv[4] = (char *) modes[i];
+            connects = server.connects;
+            queries = server.queries;
+            if (harness_run(conf, child_argv))
+               rc = 1;
+            printf("      %lu connections, %lu queries\n",
+                   server.connects - connects, server.queries - queries);
+         }
+      }
+      return(rc);
+   }
+
+   fresh = !strcmp(argv[4], "fresh");
+   if (!harness_stats()) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+
+   if (!(threads = calloc(threads_count, sizeof(*threads))))
+      return(2);
+   pthread_barrier_init(&start, NULL, threads_count + 1);
+   for (i = 0; i < threads_count; i++) {
+      if (pthread_create(&threads[i], NULL, worker, NULL)) {
+         perror("pthread_create");
+         return(2);
+      }
+   }
+   started = now_ns();
+   pthread_barrier_wait(&start);
+   for (i = 0; i < threads_count; i++)
+      pthread_join(threads[i], NULL);
+
+   printf("    %2d thread%s %8.1f ms", threads_count,
+          (threads_count == 1) ? ": " : "s:", (now_ns() - started) / 1e6);
+   if (failed)
+      printf(", %d lookups failed", failed);
+   printf("\n");
+
+   return(failed ? 1 : 0);
+}
@@ -0,0 +1,165 @@
+/*
+
+    bench_passthrough.c - What the library costs calls it passes on
+
+    Times the intercepted calls the library only hands to libc: poll()
+    and select() on fds it isn't negotiating for, close(), getpeername()
+    on a connected socket, write(), connect() on a UDP socket and on a
+    TCP socket that is already connected. They are run once without the
+    library and once with it preloaded, and timed per call.
+
+    Usage: bench_passthrough [calls]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+static int pipe_fds[2], udp_fd, tcp_fd, null_fd;
+static struct sockaddr_in remote, peer;
+
+static void call_poll(void) {
+   struct pollfd pfd;
+
+   pfd.fd = pipe_fds[0];
+   pfd.events = POLLIN;
+   poll(&pfd, 1, 0);
+}
+
+static void call_select(void) {
+   struct timeval tv = { 0, 0 };
+   fd_set readfds;
+
+   FD_ZERO(&readfds);
+   FD_SET(pipe_fds[0], &readfds);
+   select(pipe_fds[0] + 1, &readfds, NULL, NULL, &tv);
+}
+
+static void call_close(void) {
+   close(-1);
+}
+
+static void call_getpeername(void) {
+   struct sockaddr_in address;
+   socklen_t len = sizeof(address);
+
+   getpeername(tcp_fd, (struct sockaddr *) &address, &len);
+}
+
+static void call_write(void) {
+   write(null_fd, "", 1);
+}
+
+static void call_connect_udp(void) {
+   connect(udp_fd, (struct sockaddr *) &remote, sizeof(remote));
+}
+
+static void call_connect_connected(void) {
+   connect(tcp_fd, (struct sockaddr *) &peer, sizeof(peer));
+}
+
+static const struct {
+   const char *name;
+   void (*call)(void);
+} calls[] = {
+   { "poll()", call_poll },
+   { "select()", call_select },
+   { "close(-1)", call_close },
+   { "getpeername()", call_getpeername },
+   { "write()", call_write },
+   { "connect() UDP", call_connect_udp },
+   { "connect() connected", call_connect_connected },
+};
+
+/* A loopback TCP connection, for calls on a connected socket */
+static int setup(void) {
+   struct sockaddr_in address;
+   socklen_t len = sizeof(address);
+   int listener;
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (pipe(pipe_fds) ||
+       ((null_fd = open("/dev/null", O_WRONLY)) == -1) ||
+       ((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) ||
+       ((tcp_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) ||
+       ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1) ||
+       bind(listener, (struct sockaddr *) &address, sizeof(address)) ||
+       listen(listener, 1) ||
+       getsockname(listener, (struct sockaddr *) &address, &len) ||
+       connect(tcp_fd, (struct sockaddr *) &address, sizeof(address))) {
+      perror("setup");
+      return(-1);
+   }
+   peer = address;
+
+   memset(&remote, 0, sizeof(remote));
+   remote.sin_family = AF_INET;
+   remote.sin_port = htons(53);
+   inet_aton("10.77.0.1", &remote.sin_addr);
+
+   return(0);
+}
+
+int main(int argc, char **argv) {
+   struct stand_in server;
+   char conf[512];
+   long long started;
+   long count;
+   int i, rc;
+   long j;
+
+   count = (argc > 1) ? atol(argv[1]) : 1000000;
+   if (count <= 0) {
+      fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      /* Never connected to, every destination passes it by */
+      memset(&server, 0, sizeof(server));
+      if (stand_in_start(&server))
+         return(2);
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n"
+               "tordns_enable = false\n",
+               server.port);
+      printf("%ld calls each, ns per call\n", count);
+      if ((rc = harness_run(NULL, argv)))
+         return(rc);
+      return(harness_run(conf, argv));
+   }
+
+   if (setup())
+      return(2);
+
+   printf("  %s\n", harness_stats() ? "with libtsocks" : "without libtsocks");
+   for (i = 0; i < sizeof(calls) / sizeof(calls[0]); i++) {
+      /* Warm up, then time the calls */
+      for (j = 0; j < (count / 10) + 1; j++)
+         calls[i].call();
+      started = now_ns();
+      for (j = 0; j < count; j++)
+         calls[i].call();
+      printf("    %-22s %8.1f\n", calls[i].name,
+             (double) (now_ns() - started) / count);
+   }
+
+   return(0);
+}
@@ -0,0 +1,117 @@
+/*
+
+    bench_pool.c - Dead pool lookups at several pool sizes
+
+    Fills a pool of 256, 4096 and 65536 entries with .onion names
+    through gethostbyname(), then times lookups of names picked at
+    random among them, and of their addresses with gethostbyaddr(), the
+    way connect() finds the name to send for a dead address. Every
+    lookup is answered from the pool.
+
+    Usage: bench_pool [lookups]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+/* As long as a v3 onion address */
+static void onion_name(char name[64], unsigned int i) {
+   unsigned int mixed = i * 2654435761u;
+   int j;
+
+   for (j = 0; j < 7; j++)
+      snprintf(&name[j * 8], 9, "%08x", mixed ^ (j * 0x9e3779b9u));
+   strcpy(&name[56], ".onion");
+}
+
+int main(int argc, char **argv) {
+   static const int sizes[] = { 256, 4096, 65536 };
+   struct stand_in server;
+   struct hostent *he;
+   struct in_addr *addrs;
+   char *child_argv[4], conf[512], size_arg[16], name[64];
+   long long started;
+   long lookups, i;
+   unsigned int seed = 1;
+   int size, failed = 0, rc = 0;
+
+   lookups = (argc > 1) ? atol(argv[1]) : 200000;
+   if (lookups <= 0) {
+      fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      /* Never asked, .onion names are only given dead addresses */
+      memset(&server, 0, sizeof(server));
+      if (stand_in_start(&server))
+         return(2);
+      printf("%ld lookups of names in the pool, ns per lookup\n", lookups);
+      printf("  %8s %10s %16s %16s\n", "entries", "fill", "gethostbyname",
+             "gethostbyaddr");
+      for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+         snprintf(conf, sizeof(conf),
+                  "server = 127.0.0.1\n"
+                  "server_port = %d\n"
+                  "server_type = 5\n"
+                  "local = 127.0.0.0/255.0.0.0\n"
+                  "tordns_cache_size = %d\n"
+                  "tordns_deadpool_range = 10.128.0.0/255.254.0.0\n",
+                  server.port, sizes[i]);
+         snprintf(size_arg, sizeof(size_arg), "%d", sizes[i]);
+         child_argv[0] = argv[0];
+         child_argv[1] = argv[1] ? argv[1] : "200000";
+         child_argv[2] = size_arg;
+         child_argv[3] = NULL;
+         if (harness_run(conf, child_argv))
+            rc = 1;
+      }
+      return(rc);
+   }
+
+   size = atoi(argv[2]);
+   if (!harness_stats() || !(addrs = calloc(size, sizeof(*addrs)))) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+
+   started = now_ns();
+   for (i = 0; i < size; i++) {
+      onion_name(name, i);
+      if (!(he = gethostbyname(name)) || (he->h_addrtype != AF_INET)) {
+         fprintf(stderr, "Can't look up %s\n", name);
+         return(1);
+      }
+      memcpy(&addrs[i], he->h_addr_list[0], sizeof(addrs[i]));
+   }
+   printf("  %8d %10.1f", size, (double) (now_ns() - started) / size);
+
+   started = now_ns();
+   for (i = 0; i < lookups; i++) {
+      onion_name(name, rand_r(&seed) % size);
+      if (!gethostbyname(name))
+         failed++;
+   }
+   printf(" %16.1f", (double) (now_ns() - started) / lookups);
+
+   started = now_ns();
+   for (i = 0; i < lookups; i++) {
+      if (!gethostbyaddr(&addrs[rand_r(&seed) % size], sizeof(addrs[0]),
+                         AF_INET))
+         failed++;
+   }
+   printf(" %16.1f\n", (double) (now_ns() - started) / lookups);
+   if (failed)
+      printf("  %d lookups failed\n", failed);
+
+   return(failed ? 1 : 0);
+}
@@ -0,0 +1,130 @@
+/*
+
+    bench_reactor.c - Handshake latency with and without the reactor
+
+    A program that polls its sockets only every so often, 50 ms by
+    default, starts a non blocking connect through a stand-in SOCKS
+    server answering after a short delay, then checks whether it is
+    writable each time round. Without the reactor the negotiation only
+    moves on when it checks, with it the negotiation is over before the
+    next check. The time from connect() until the socket is seen to be
+    writable is averaged, with handshake_reactor off and on.
+
+    Usage: bench_reactor [interval ms] [delay ms] [connects]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+#define REACTOR_DESTINATION  "10.77.0.1"
+#define REACTOR_PORT         80
+
+/* Nanoseconds from connect() until the socket was seen writable, */
+/* -1 if it failed                                                  */
+static long long time_once(const struct sockaddr_in *destination,
+                           int interval) {
+   struct pollfd pfd;
+   long long started, took = -1;
+   socklen_t len = sizeof(int);
+   int fd, rc, err = 0;
+
+   if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      return(-1);
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+   started = now_ns();
+   if (connect(fd, (const struct sockaddr *) destination,
+               sizeof(*destination)) && (errno != EINPROGRESS)) {
+      close(fd);
+      return(-1);
+   }
+   /* Give up after 200 checks */
+   for (rc = 0; rc < 200; rc++) {
+      usleep(interval * 1000);
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, 0) == 1) {
+         if (!getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+            took = now_ns() - started;
+         break;
+      }
+   }
+   close(fd);
+
+   return(took);
+}
+
+int main(int argc, char **argv) {
+   static const char *flags[2] = { "false", "true" };
+   struct sockaddr_in destination;
+   struct stand_in server;
+   long long took, total = 0;
+   char conf[512];
+   int interval, delay, count, i, reactor, done = 0, failed = 0;
+
+   interval = (argc > 1) ? atoi(argv[1]) : 50;
+   delay = (argc > 2) ? atoi(argv[2]) : 10;
+   count = (argc > 3) ? atoi(argv[3]) : 20;
+   if ((interval <= 0) || (delay < 0) || (count <= 0)) {
+      fprintf(stderr, "Usage: %s [interval ms] [delay ms] [connects]\n",
+              argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      memset(&server, 0, sizeof(server));
+      server.delay_ms = delay;
+      if (stand_in_start(&server))
+         return(2);
+      printf("%d connects, polled every %d ms, %d ms per reply\n", count,
+             interval, delay);
+      for (reactor = 0; reactor < 2; reactor++) {
+         snprintf(conf, sizeof(conf),
+                  "server = 127.0.0.1\n"
+                  "server_port = %d\n"
+                  "server_type = 5\n"
+                  "local = 127.0.0.0/255.0.0.0\n"
+                  "tordns_enable = false\n"
+                  "socks5_pipeline = false\n"
+                  "handshake_reactor = %s\n",
+                  server.port, flags[reactor]);
+         printf("  handshake_reactor %s\n", flags[reactor]);
+         if (harness_run(conf, argv))
+            failed = 1;
+      }
+      return(failed);
+   }
+
+   memset(&destination, 0, sizeof(destination));
+   destination.sin_family = AF_INET;
+   destination.sin_port = htons(REACTOR_PORT);
+   inet_aton(REACTOR_DESTINATION, &destination.sin_addr);
+
+   for (i = 0; i < count; i++) {
+      if ((took = time_once(&destination, interval)) == -1)
+         failed++;
+      else {
+         total += took;
+         done++;
+      }
+   }
+   if (done)
+      printf("    %.1f ms until seen connected\n",
+             (double) total / done / 1e6);
+   if (failed)
+      printf("    %d connects failed\n", failed);
+
+   return(failed ? 1 : 0);
+}
@@ -0,0 +1,138 @@
+/*
+
+    bench_resolve.c - Remote resolution of many names at once
+
+    Threads look names up with getaddrinfo(), which the library answers
+    with Tor's RESOLVE through a stand-in SOCKS server that takes a while
+    to answer each one. First 1000 distinct names, then 1000 lookups of
+    10 names no one looked up yet, 100 at a time for each of them. The
+    time it took is given, and how many RESOLVE requests the server got:
+    lookups of a name already being resolved should wait for it instead
+    of sending their own.
+
+    Usage: bench_resolve [delay ms] [threads]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "harness.h"
+
+#define RESOLVE_LOOKUPS   1000
+#define RESOLVE_NAMES     10      /* For the duplicate lookups */
+
+static int duplicates;
+static int next_lookup;
+static int failed;
+static pthread_barrier_t start;
+
+static void *worker(void *arg) {
+   struct addrinfo hints, *result;
+   char name[64];
+   int i;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+
+   pthread_barrier_wait(&start);
+   while ((i = __atomic_fetch_add(&next_lookup, 1, __ATOMIC_RELAXED)) <
+          RESOLVE_LOOKUPS) {
+      if (duplicates)
+         snprintf(name, sizeof(name), "same%d.example", i % RESOLVE_NAMES);
+      else
+         snprintf(name, sizeof(name), "host%d.example", i);
+      if (getaddrinfo(name, "80", &hints, &result))
+         __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+      else
+         freeaddrinfo(result);
+   }
+
+   return(NULL);
+}
+
+int main(int argc, char **argv) {
+   static const char *phases[2] = { "distinct", "duplicate" };
+   static const int parallel[2] = { 8, 64 };
+   char *child_argv[4], conf[512], count[16];
+   struct stand_in server;
+   unsigned long resolves;
+   pthread_t *threads;
+   long long started;
+   int delay, threads_count, i, j, rc = 0;
+
+   if (!harness_is_child()) {
+      delay = (argc > 1) ? atoi(argv[1]) : 20;
+      threads_count = (argc > 2) ? atoi(argv[2]) : 100;
+      if ((delay < 0) || (threads_count <= 0)) {
+         fprintf(stderr, "Usage: %s [delay ms] [threads]\n", argv[0]);
+         return(2);
+      }
+
+      memset(&server, 0, sizeof(server));
+      server.delay_ms = delay;
+      server.resolve = 1;
+      if (stand_in_start(&server))
+         return(2);
+      printf("%d lookups from %d threads, %d ms per RESOLVE\n",
+             RESOLVE_LOOKUPS, threads_count, delay);
+      snprintf(count, sizeof(count), "%d", threads_count);
+      for (i = 0; i < 2; i++) {
+         snprintf(conf, sizeof(conf),
+                  "server = 127.0.0.1\n"
+                  "server_port = %d\n"
+                  "server_type = 5\n"
+                  "local = 127.0.0.0/255.0.0.0\n"
+                  "tordns_cache_size = 4096\n"
+                  "tordns_resolve_parallel = %d\n",
+                  server.port, parallel[i]);
+         printf("  tordns_resolve_parallel %d\n", parallel[i]);
+         for (j = 0; j < 2; j++) {
+            child_argv[0] = argv[0];
+            child_argv[1] = (char *) phases[j];
+            child_argv[2] = count;
+            child_argv[3] = NULL;
+            resolves = server.resolves;
+            if (harness_run(conf, child_argv))
+               rc = 1;
+            printf("      %lu RESOLVE requests\n", server.resolves - resolves);
+         }
+      }
+      return(rc);
+   }
+
+   duplicates = (argc > 1) && !strcmp(argv[1], "duplicate");
+   threads_count = (argc > 2) ? atoi(argv[2]) : 100;
+   if (!harness_stats()) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+
+   if (!(threads = calloc(threads_count, sizeof(*threads))))
+      return(2);
+   pthread_barrier_init(&start, NULL, threads_count + 1);
+   for (i = 0; i < threads_count; i++) {
+      if (pthread_create(&threads[i], NULL, worker, NULL)) {
+         perror("pthread_create");
+         return(2);
+      }
+   }
+   started = now_ns();
+   pthread_barrier_wait(&start);
+   for (i = 0; i < threads_count; i++)
+      pthread_join(threads[i], NULL);
+
+   printf("    %-9s names: %7.1f ms", duplicates ? "duplicate" : "distinct",
+          (now_ns() - started) / 1e6);
+   if (failed)
+      printf(", %d lookups failed", failed);
+   printf("\n");
+
+   return(failed ? 1 : 0);
+}
@@ -0,0 +1,130 @@
+/*
+
+    bench_routes.c - Routing with and without the route table
+
+    Loads configurations of 10 and 10000 rules, half of them local
+    networks and half reach statements spread over 10 paths, and times
+    is_local() and pick_server() together for addresses across all of
+    them, once walking the lists as they did before the route table and
+    once through it. Both must agree on every address. It is linked
+    with the parser rather than the library, nothing is preloaded.
+
+    Usage: bench_routes [lookups]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "parser.h"
+#include "harness.h"
+
+#define ROUTES_PATHS      10
+
+/* What the library would have, for common.c */
+char *progname = "bench_routes";
+struct hostent *(*realgethostbyname)(const char *) = gethostbyname;
+
+/* Local networks in 10.0.0.0/8, the reach statements' in 20.0.0.0/8, */
+/* all /24s                                                          */
+static char *make_config(int rules) {
+   struct in_addr network;
+   char *config, *p;
+   int per, path, i;
+
+   per = rules / 2 / ROUTES_PATHS;
+   if (!(config = malloc(200 + rules * 80)))
+      return(NULL);
+   p = config + sprintf(config, "server = 127.0.0.1\nserver_port = 1080\n");
+   for (i = 0; i < rules / 2; i++) {
+      network.s_addr = htonl((10u << 24) | (i << 8));
+      p += sprintf(p, "local = %s/255.255.255.0\n", inet_ntoa(network));
+   }
+   for (path = 0; path < ROUTES_PATHS; path++) {
+      p += sprintf(p, "path {\nserver = 10.0.0.%d\n", path + 1);
+      for (i = 0; i < per; i++) {
+         network.s_addr = htonl((20u << 24) | ((path * per + i) << 8));
+         p += sprintf(p, "reaches = %s/255.255.255.0\n", inet_ntoa(network));
+      }
+      p += sprintf(p, "}\n");
+   }
+
+   return(config);
+}
+
+/* An address in one of the first rules*256 /32s of 10.0.0.0/8 or */
+/* 20.0.0.0/8, about half of them covered by a rule               */
+static void pick_address(struct in_addr *ip, long i, int rules) {
+   unsigned int spread = (unsigned int) i * 2654435761u;
+
+   ip->s_addr = htonl(((spread & 1) ? (20u << 24) : (10u << 24)) |
+                      ((spread >> 1) % (rules * 256u)));
+}
+
+int main(int argc, char **argv) {
+   static const int sizes[] = { 10, 10000 };
+   struct parsedfile config;
+   struct route_table *routes;
+   struct serverent *linear, *indexed;
+   struct in_addr ip;
+   volatile long sink = 0;
+   long long started;
+   long lookups, i;
+   char *text;
+   int size, mode, mismatches, rc = 0;
+
+   lookups = (argc > 1) ? atol(argv[1]) : 1000000;
+   if (lookups <= 0) {
+      fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+      return(2);
+   }
+
+   printf("%ld lookups, ns per is_local() and pick_server()\n", lookups);
+   for (size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++) {
+      memset(&config, 0, sizeof(config));
+      if (!(text = make_config(sizes[size])) ||
+          read_config(line_enumerator_buffer(text), &config) ||
+          !(routes = config.routes)) {
+         fprintf(stderr, "Can't load %d rules\n", sizes[size]);
+         return(2);
+      }
+
+      mismatches = 0;
+      for (i = 0; i < lookups / 10; i++) {
+         pick_address(&ip, i, sizes[size]);
+         config.routes = NULL;
+         pick_server(&config, &linear, &ip, 80);
+         sink = is_local(&config, &ip);
+         config.routes = routes;
+         pick_server(&config, &indexed, &ip, 80);
+         if ((linear != indexed) || (sink != is_local(&config, &ip)))
+            mismatches++;
+      }
+
+      printf("  %5d rules\n", sizes[size]);
+      for (mode = 0; mode < 2; mode++) {
+         config.routes = mode ? routes : NULL;
+         started = now_ns();
+         for (i = 0; i < lookups; i++) {
+            pick_address(&ip, i, sizes[size]);
+            sink += is_local(&config, &ip);
+            pick_server(&config, &linear, &ip, 80);
+            sink += (long) linear;
+         }
+         printf("    %-12s %10.1f\n", mode ? "route table" : "lists",
+                (double) (now_ns() - started) / lookups);
+      }
+      if (mismatches) {
+         printf("    %d addresses routed differently\n", mismatches);
+         rc = 1;
+      }
+      free(text);
+   }
+
+   return(rc);
+}
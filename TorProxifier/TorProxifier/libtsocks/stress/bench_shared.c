@@ -0,0 +1,196 @@
+/*
+
+    bench_shared.c - Dead pool lookups from many processes at once
+
+    The pool is shared with the processes a program forks. This one
+    fills it with .onion names, then forks 1, 8 and 32 workers that all
+    look up the same new names at once, each in its own order, and then
+    names picked at random among all of them. Every worker must have
+    been given the same address for a name, and no two names the same
+    address. How many lookups a second they managed between them is
+    given.
+
+    Usage: bench_shared [lookups per worker]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "harness.h"
+
+#define SHARED_FILLED     1000    /* Names in the pool before forking */
+#define SHARED_NEW        256     /* Names the workers add together   */
+#define SHARED_WORKERS    32
+
+static void onion_name(char name[64], const char *prefix, int i) {
+   snprintf(name, 64, "%s%d.onion", prefix, i);
+}
+
+/* Looks the new names up, then random ones. Returns how many failed */
+static int work(int worker, long lookups, unsigned int *addresses) {
+   struct hostent *he;
+   unsigned int seed = worker + 1;
+   char name[64];
+   long i;
+   int n, failed = 0;
+
+   for (i = 0; i < SHARED_NEW; i++) {
+      /* Workers start at different names and go different ways */
+      n = (worker & 1) ? (SHARED_NEW - 1 - ((i + worker * 7) % SHARED_NEW)) :
+                         ((i + worker * 7) % SHARED_NEW);
+      onion_name(name, "new", n);
+      if (!(he = gethostbyname(name)))
+         failed++;
+      else
+         memcpy(&addresses[n], he->h_addr_list[0], sizeof(addresses[n]));
+   }
+   for (i = 0; i < lookups; i++) {
+      n = rand_r(&seed) % (SHARED_FILLED + SHARED_NEW);
+      if (n < SHARED_FILLED)
+         onion_name(name, "filled", n);
+      else
+         onion_name(name, "new", n - SHARED_FILLED);
+      if (!gethostbyname(name))
+         failed++;
+   }
+
+   return(failed);
+}
+
+/* Names given more than one address, and addresses given to more */
+/* than one name                                                  */
+static int check(const unsigned int *addresses, int workers,
+                 const unsigned int *filled) {
+   int i, j, bad = 0;
+
+   for (i = 0; i < SHARED_NEW; i++) {
+      for (j = 1; j < workers; j++) {
+         if (addresses[j * SHARED_NEW + i] != addresses[i]) {
+            bad++;
+            break;
+         }
+      }
+      for (j = 0; j < i; j++) {
+         if (addresses[j] == addresses[i])
+            bad++;
+      }
+      for (j = 0; j < SHARED_FILLED; j++) {
+         if (filled[j] == addresses[i])
+            bad++;
+      }
+   }
+
+   return(bad);
+}
+
+static int run(int workers, long lookups, const unsigned int *filled) {
+   unsigned int *addresses;
+   long long started;
+   char go;
+   int gate[2], status, i, failed = 0, bad;
+   pid_t pid;
+
+   addresses = mmap(NULL, sizeof(*addresses) * SHARED_NEW * SHARED_WORKERS,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                    -1, 0);
+   if ((addresses == MAP_FAILED) || pipe(gate))
+      return(-1);
+
+   for (i = 0; i < workers; i++) {
+      if ((pid = fork()) == -1)
+         return(-1);
+      if (pid == 0) {
+         close(gate[1]);
+         /* Until every worker is there and the gate closes */
+         read(gate[0], &go, 1);
+         _exit(work(i, lookups, &addresses[i * SHARED_NEW]) ? 1 : 0);
+      }
+   }
+   close(gate[0]);
+   started = now_ns();
+   close(gate[1]);
+   while (wait(&status) > 0) {
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+         failed++;
+   }
+
+   printf("  %2d workers: %10.0f lookups/s", workers,
+          (double) workers * (lookups + SHARED_NEW) * 1e9 /
+          (now_ns() - started));
+   if ((bad = check(addresses, workers, filled)))
+      printf(", %d inconsistent addresses", bad);
+   if (failed)
+      printf(", %d workers had lookups fail", failed);
+   printf("\n");
+   munmap(addresses, sizeof(*addresses) * SHARED_NEW * SHARED_WORKERS);
+
+   return((bad || failed) ? 1 : 0);
+}
+
+int main(int argc, char **argv) {
+   static const int workers[] = { 1, 8, SHARED_WORKERS };
+   unsigned int filled[SHARED_FILLED];
+   struct stand_in server;
+   struct hostent *he;
+   char *child_argv[4], conf[512], name[64];
+   long lookups;
+   int i, rc = 0;
+
+   lookups = (argc > 1) ? atol(argv[1]) : 100000;
+   if (lookups <= 0) {
+      fprintf(stderr, "Usage: %s [lookups per worker]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      /* Never asked, .onion names are only given dead addresses */
+      memset(&server, 0, sizeof(server));
+      if (stand_in_start(&server))
+         return(2);
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n"
+               "tordns_cache_size = 4096\n"
+               "tordns_deadpool_range = 10.128.0.0/255.254.0.0\n",
+               server.port);
+      printf("%ld lookups per worker, after %d new names\n", lookups,
+             SHARED_NEW);
+      /* A fresh pool each time, so the new names are new to it */
+      for (i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+         snprintf(name, sizeof(name), "%d", workers[i]);
+         child_argv[0] = argv[0];
+         child_argv[1] = argv[1] ? argv[1] : "100000";
+         child_argv[2] = name;
+         child_argv[3] = NULL;
+         if (harness_run(conf, child_argv))
+            rc = 1;
+      }
+      return(rc);
+   }
+
+   if (!harness_stats()) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+   for (i = 0; i < SHARED_FILLED; i++) {
+      onion_name(name, "filled", i);
+      if (!(he = gethostbyname(name))) {
+         fprintf(stderr, "Can't look up %s\n", name);
+         return(1);
+      }
+      memcpy(&filled[i], he->h_addr_list[0], sizeof(filled[i]));
+   }
+
+   return(run(atoi(argv[2]), lookups, filled));
+}
@@ -0,0 +1,123 @@
+/*
+
+    bench_startup.c - Starting up with a cold and a warm pool file
+
+    Runs a program that looks up a few names, one after the other, as
+    it starts, against a stand-in SOCKS server that takes a while to
+    answer each RESOLVE. With tordns_pool_file the first run starts
+    cold and fills the file, the runs after it should find the names
+    there without asking the server. Without it every run starts cold.
+    How long each run took, from starting it until it exited, is given,
+    and how many RESOLVE requests the server got.
+
+    Usage: bench_startup [delay ms] [names]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "harness.h"
+
+static int lookup(const char *name) {
+   struct addrinfo hints, *result;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(name, "443", &hints, &result))
+      return(-1);
+   freeaddrinfo(result);
+
+   return(0);
+}
+
+/* Run the child, print how long it took and the RESOLVEs it cost */
+static int timed_run(const char *label, const char *conf, char **argv,
+                     struct stand_in *server) {
+   unsigned long resolves = server->resolves;
+   long long started = now_ns();
+   int rc;
+
+   rc = harness_run(conf, argv);
+   printf("    %-5s %8.1f ms, %lu RESOLVE requests\n", label,
+          (now_ns() - started) / 1e6, server->resolves - resolves);
+
+   return(rc);
+}
+
+int main(int argc, char **argv) {
+   char directory[] = "/tmp/bench_startup.XXXXXX";
+   char conf[1024], path[sizeof(directory) + 16], name[64];
+   struct stand_in server;
+   int delay, names, i, rc = 0;
+
+   delay = (argc > 1) ? atoi(argv[1]) : 50;
+   names = (argc > 2) ? atoi(argv[2]) : 20;
+   if ((delay < 0) || (names <= 0)) {
+      fprintf(stderr, "Usage: %s [delay ms] [names]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      memset(&server, 0, sizeof(server));
+      server.delay_ms = delay;
+      server.resolve = 1;
+      if (stand_in_start(&server))
+         return(2);
+      if (!mkdtemp(directory)) {
+         perror("mkdtemp");
+         return(2);
+      }
+      snprintf(path, sizeof(path), "%s/pool", directory);
+
+      printf("%d names at startup, %d ms per RESOLVE\n", names, delay);
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n",
+               server.port);
+      printf("  without tordns_pool_file\n");
+      for (i = 0; i < 2; i++) {
+         if (timed_run(i ? "again" : "first", conf, argv, &server))
+            rc = 1;
+      }
+
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n"
+               "tordns_pool_file = %s\n",
+               server.port, path);
+      printf("  tordns_pool_file\n");
+      for (i = 0; i < 3; i++) {
+         if (timed_run(i ? "warm" : "cold", conf, argv, &server))
+            rc = 1;
+      }
+
+      unlink(path);
+      rmdir(directory);
+      return(rc);
+   }
+
+   if (!harness_stats()) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+   for (i = 0; i < names; i++) {
+      snprintf(name, sizeof(name), "service%d.example", i);
+      if (lookup(name)) {
+         fprintf(stderr, "Can't look up %s\n", name);
+         return(1);
+      }
+   }
+
+   return(0);
+}
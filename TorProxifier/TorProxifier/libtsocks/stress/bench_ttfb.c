@@ -0,0 +1,140 @@
+/*
+
+    bench_ttfb.c - Time to first byte with and without optimistic data
+
+    A client that speaks first connects a non blocking socket, waits
+    until it is writable, writes its request and reads the first byte
+    of the answer, through a stand-in SOCKS server that holds each of
+    its replies, and the echo that answers the request, back by the
+    same delay. That is done with optimistic_data and socks5_pipeline
+    off and on, and the time from connect() to the first byte averaged.
+
+    Usage: bench_ttfb [delay ms] [connects]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+#define TTFB_DESTINATION  "10.77.0.1"
+#define TTFB_PORT         80
+
+static const char request[] = "GET / HTTP/1.0\r\n\r\n";
+
+static int wait_for(int fd, short events) {
+   struct pollfd pfd;
+   int rc;
+
+   pfd.fd = fd;
+   pfd.events = events;
+   do {
+      rc = poll(&pfd, 1, 10000);
+   } while ((rc == -1) && (errno == EINTR));
+
+   return((rc == 1) ? 0 : -1);
+}
+
+/* Nanoseconds from connect() to the first byte, -1 if it failed */
+static long long time_once(const struct sockaddr_in *destination) {
+   long long started;
+   socklen_t len = sizeof(int);
+   char first;
+   int fd, err = 0;
+
+   if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      return(-1);
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+   started = now_ns();
+   if (connect(fd, (const struct sockaddr *) destination,
+               sizeof(*destination)) && (errno != EINPROGRESS))
+      goto fail;
+   if (wait_for(fd, POLLOUT) ||
+       getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err ||
+       (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1) ||
+       wait_for(fd, POLLIN) || (read(fd, &first, 1) != 1))
+      goto fail;
+   close(fd);
+
+   return(now_ns() - started);
+
+fail:
+   close(fd);
+   return(-1);
+}
+
+int main(int argc, char **argv) {
+   static const char *flags[2] = { "false", "true" };
+   struct sockaddr_in destination;
+   struct stand_in server;
+   long long took, total = 0;
+   char conf[512];
+   int delay, count, i, pipeline, optimistic, done = 0, failed = 0;
+
+   delay = (argc > 1) ? atoi(argv[1]) : 50;
+   count = (argc > 2) ? atoi(argv[2]) : 20;
+   if ((delay < 0) || (count <= 0)) {
+      fprintf(stderr, "Usage: %s [delay ms] [connects]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      memset(&server, 0, sizeof(server));
+      server.delay_ms = delay;
+      if (stand_in_start(&server))
+         return(2);
+      printf("%d connects, %d ms per reply\n", count, delay);
+      for (pipeline = 0; pipeline < 2; pipeline++) {
+         for (optimistic = 0; optimistic < 2; optimistic++) {
+            snprintf(conf, sizeof(conf),
+                     "server = 127.0.0.1\n"
+                     "server_port = %d\n"
+                     "server_type = 5\n"
+                     "local = 127.0.0.0/255.0.0.0\n"
+                     "tordns_enable = false\n"
+                     "optimistic_data = %s\n"
+                     "socks5_pipeline = %s\n",
+                     server.port, flags[optimistic], flags[pipeline]);
+            printf("  optimistic_data %s, socks5_pipeline %s\n",
+                   flags[optimistic], flags[pipeline]);
+            if (harness_run(conf, argv))
+               failed = 1;
+         }
+      }
+      return(failed);
+   }
+
+   memset(&destination, 0, sizeof(destination));
+   destination.sin_family = AF_INET;
+   destination.sin_port = htons(TTFB_PORT);
+   inet_aton(TTFB_DESTINATION, &destination.sin_addr);
+
+   /* The first handshake with a server is never pipelined */
+   if (time_once(&destination) == -1)
+      failed++;
+   for (i = 0; i < count; i++) {
+      if ((took = time_once(&destination)) == -1)
+         failed++;
+      else {
+         total += took;
+         done++;
+      }
+   }
+   if (done)
+      printf("    %.1f ms to the first byte\n", (double) total / done / 1e6);
+   if (failed)
+      printf("    %d connects failed\n", failed);
+
+   return(failed ? 1 : 0);
+}
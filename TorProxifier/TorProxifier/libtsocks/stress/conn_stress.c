@@ -0,0 +1,228 @@
+/*
+
+    conn_stress.c - Hammers the connection table from many threads
+
+    Every thread opens sockets and connects them through a SOCKS V5
+    responder of our own, blocking or not, driven by poll() or select(),
+    and sometimes closes them in the middle of the negotiation. Each
+    stream echoes a few bytes back, so a request given the wrong socket
+    or lost on the way shows up as a failure. Once the threads are done
+    no request may be left in the connection table.
+
+    Usage: conn_stress [threads] [seconds] [reactor]
+
+    The responder runs in this process, the threads in a child started
+    with libtsocks.so, from the directory it is in, preloaded and
+    configured for it.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+/* Sent through the responder, which only pretends to connect */
+#define STRESS_DESTINATION  "10.77.0.1"
+#define STRESS_PORT         80
+
+enum stress_mode {
+   MODE_BLOCKING,
+   MODE_POLL,
+   MODE_SELECT,
+   MODE_ABANDON,       /* closed while the negotiation is going on */
+   MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+   "blocking", "poll", "select", "abandon"
+};
+
+static long long deadline;
+static unsigned long done[MODE_COUNT];
+static unsigned long failed[MODE_COUNT];
+
+static long long now_ms(void) {
+   return(now_ns() / 1000000);
+}
+
+/* Wait for a non blocking connect() to finish, 0 if it succeeded */
+static int wait_connected(int fd, enum stress_mode mode) {
+   struct pollfd pfd;
+   struct timeval tv;
+   fd_set writefds;
+   socklen_t len = sizeof(int);
+   int rc, err = 0;
+
+   if ((mode == MODE_SELECT) && (fd < FD_SETSIZE)) {
+      FD_ZERO(&writefds);
+      FD_SET(fd, &writefds);
+      tv.tv_sec = 10;
+      tv.tv_usec = 0;
+      rc = select(fd + 1, NULL, &writefds, NULL, &tv);
+   } else {
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      rc = poll(&pfd, 1, 10000);
+   }
+   if (rc != 1)
+      return(-1);
+   if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+      return(-1);
+
+   return(0);
+}
+
+/* Connect one socket the way mode says, 0 if it echoed what was sent */
+static int run_once(const struct sockaddr_in *destination,
+                    enum stress_mode mode, unsigned int *seed) {
+   char message[16], answer[16];
+   int fd, rc;
+
+   if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      return(-1);
+   if (mode != MODE_BLOCKING)
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+   rc = connect(fd, (const struct sockaddr *) destination,
+                sizeof(*destination));
+   if ((rc == -1) && (errno != EINPROGRESS)) {
+      close(fd);
+      return(-1);
+   }
+   if (mode == MODE_ABANDON) {
+      /* Sometimes right away, sometimes while the reply is coming */
+      if (rand_r(seed) & 1)
+         usleep(rand_r(seed) % 200);
+      close(fd);
+      return(0);
+   }
+   if (rc == -1) {
+      if (wait_connected(fd, mode)) {
+         close(fd);
+         return(-1);
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+   }
+
+   snprintf(message, sizeof(message), "%d:%u", fd, rand_r(seed));
+   rc = (write_all(fd, message, sizeof(message)) ||
+         read_all(fd, answer, sizeof(answer)) ||
+         memcmp(message, answer, sizeof(message))) ? -1 : 0;
+   close(fd);
+
+   return(rc);
+}
+
+static void *worker(void *arg) {
+   struct sockaddr_in destination;
+   unsigned long mine_done[MODE_COUNT] = { 0 };
+   unsigned long mine_failed[MODE_COUNT] = { 0 };
+   unsigned int seed = (unsigned int) (intptr_t) arg;
+   enum stress_mode mode;
+   int i;
+
+   memset(&destination, 0, sizeof(destination));
+   destination.sin_family = AF_INET;
+   destination.sin_port = htons(STRESS_PORT);
+   inet_aton(STRESS_DESTINATION, &destination.sin_addr);
+
+   while (now_ms() < deadline) {
+      mode = rand_r(&seed) % MODE_COUNT;
+      if (run_once(&destination, mode, &seed))
+         mine_failed[mode]++;
+      mine_done[mode]++;
+   }
+
+   for (i = 0; i < MODE_COUNT; i++) {
+      __atomic_add_fetch(&done[i], mine_done[i], __ATOMIC_RELAXED);
+      __atomic_add_fetch(&failed[i], mine_failed[i], __ATOMIC_RELAXED);
+   }
+
+   return(NULL);
+}
+
+int main(int argc, char **argv) {
+   void (*get_stats)(struct tsocks_stats *);
+   struct tsocks_stats stats;
+   struct stand_in responder;
+   pthread_t *threads;
+   unsigned long total = 0, total_failed = 0;
+   int threads_count, seconds, i;
+   char conf[512];
+
+   threads_count = (argc > 1) ? atoi(argv[1]) : 16;
+   seconds = (argc > 2) ? atoi(argv[2]) : 5;
+   if ((threads_count <= 0) || (seconds <= 0)) {
+      fprintf(stderr, "Usage: %s [threads] [seconds] [reactor]\n", argv[0]);
+      return(2);
+   }
+
+   if (!harness_is_child()) {
+      memset(&responder, 0, sizeof(responder));
+      if (stand_in_start(&responder))
+         return(2);
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n"
+               "tordns_enable = false\n"
+               "handshake_reactor = %s\n",
+               responder.port,
+               ((argc > 3) && atoi(argv[3])) ? "true" : "false");
+      return(harness_run(conf, argv));
+   }
+   /* Abandoned streams are written to after they are closed */
+   signal(SIGPIPE, SIG_IGN);
+
+   if (!(get_stats = harness_stats())) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+
+   if (!(threads = calloc(threads_count, sizeof(*threads))))
+      return(2);
+   deadline = now_ms() + (seconds * 1000LL);
+   for (i = 0; i < threads_count; i++) {
+      if (pthread_create(&threads[i], NULL, worker,
+                         (void *) (intptr_t) (i + 1))) {
+         perror("pthread_create");
+         return(2);
+      }
+   }
+   for (i = 0; i < threads_count; i++)
+      pthread_join(threads[i], NULL);
+
+   printf("%d threads for %d seconds, %s\n", threads_count, seconds,
+          ((argc > 3) && atoi(argv[3])) ? "with the reactor" :
+                                          "without the reactor");
+   for (i = 0; i < MODE_COUNT; i++) {
+      printf("  %-9s %10lu connects %6lu failed\n", mode_names[i], done[i],
+             failed[i]);
+      total += done[i];
+      total_failed += failed[i];
+   }
+
+   /* Abandoned requests are only reclaimed when their fd is seen again */
+   /* or closed, all of them were closed                                */
+   get_stats(&stats);
+   printf("  %lu connects, %lu failed, %lu requests left (%lu at most)\n",
+          total, total_failed, stats.conn_pool_in_use,
+          stats.conn_pool_high_water);
+
+   return((total_failed || stats.conn_pool_in_use) ? 1 : 0);
+}
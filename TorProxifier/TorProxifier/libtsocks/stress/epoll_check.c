@@ -0,0 +1,164 @@
+/*
+
+    epoll_check.c - Checks the epoll registrations of negotiating sockets
+
+    A non blocking socket is connected through a stand-in SOCKS server
+    that takes a while to answer. While it negotiates it is registered
+    with epoll, removed with a NULL event, the way most callers do it,
+    and added again, to the same epoll instance or to another one. The
+    caller must then be told it is writable only once the negotiation
+    is over, with their own data, and the stream must echo what is
+    written to it.
+
+    Usage: epoll_check
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+#define CHECK_DESTINATION  "10.77.0.1"
+#define CHECK_PORT         80
+#define CHECK_DELAY_MS     100
+#define CHECK_DATA         0x0123456789abcdefULL
+
+/* Register, remove and register fd again, in epfd then in other_epfd. */
+/* 0 if the caller only hears of it once it is connected               */
+static int check_once(const struct sockaddr_in *destination, int other) {
+   struct epoll_event event;
+   char message[16], answer[16];
+   long long started, took;
+   int fd, epfd, other_epfd, n;
+
+   if (((epfd = epoll_create1(0)) == -1) ||
+       ((other_epfd = epoll_create1(0)) == -1) ||
+       ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)) {
+      perror("socket");
+      return(-1);
+   }
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+   started = now_ns();
+   if (!connect(fd, (const struct sockaddr *) destination,
+                sizeof(*destination)) || (errno != EINPROGRESS)) {
+      fprintf(stderr, "connect didn't start a negotiation\n");
+      return(-1);
+   }
+
+   event.events = EPOLLIN | EPOLLOUT;
+   event.data.u64 = CHECK_DATA;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) ||
+       epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL)) {
+      perror("epoll_ctl");
+      return(-1);
+   }
+   if (other) {
+      close(epfd);
+      epfd = other_epfd;
+   }
+   event.events = EPOLLOUT;
+   event.data.u64 = CHECK_DATA;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event)) {
+      perror("epoll_ctl");
+      return(-1);
+   }
+
+   do {
+      n = epoll_wait(epfd, &event, 1, 10000);
+   } while ((n == -1) && (errno == EINTR));
+   took = (now_ns() - started) / 1000000;
+   if (n != 1) {
+      fprintf(stderr, "  no event after %lld ms\n", took);
+      return(-1);
+   }
+   if (event.data.u64 != CHECK_DATA) {
+      fprintf(stderr, "  event with data %llx\n",
+              (unsigned long long) event.data.u64);
+      return(-1);
+   }
+   /* The method and the connect request are answered in turn */
+   if (took < 2 * CHECK_DELAY_MS) {
+      fprintf(stderr, "  writable after %lld ms, before the negotiation "
+                      "was over\n", took);
+      return(-1);
+   }
+
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+   snprintf(message, sizeof(message), "%d:%lld", fd, took);
+   if (write_all(fd, message, sizeof(message)) ||
+       read_all(fd, answer, sizeof(answer)) ||
+       memcmp(message, answer, sizeof(message))) {
+      fprintf(stderr, "  the stream didn't echo\n");
+      return(-1);
+   }
+   printf("  %s epoll instance: writable after %lld ms, echoed\n",
+          other ? "another" : "the same", took);
+
+   close(fd);
+   close(epfd);
+   if (!other)
+      close(other_epfd);
+
+   return(0);
+}
+
+int main(int argc, char **argv) {
+   void (*get_stats)(struct tsocks_stats *);
+   struct tsocks_stats stats;
+   struct sockaddr_in destination;
+   struct stand_in server;
+   char conf[512];
+   int failed;
+
+   if (!harness_is_child()) {
+      memset(&server, 0, sizeof(server));
+      server.delay_ms = CHECK_DELAY_MS;
+      if (stand_in_start(&server))
+         return(2);
+      snprintf(conf, sizeof(conf),
+               "server = 127.0.0.1\n"
+               "server_port = %d\n"
+               "server_type = 5\n"
+               "local = 127.0.0.0/255.0.0.0\n"
+               "tordns_enable = false\n"
+               "socks5_pipeline = false\n"
+               "handshake_reactor = false\n",
+               server.port);
+      return(harness_run(conf, argv));
+   }
+
+   if (!(get_stats = harness_stats())) {
+      fprintf(stderr, "libtsocks.so isn't loaded\n");
+      return(2);
+   }
+
+   memset(&destination, 0, sizeof(destination));
+   destination.sin_family = AF_INET;
+   destination.sin_port = htons(CHECK_PORT);
+   inet_aton(CHECK_DESTINATION, &destination.sin_addr);
+
+   printf("Registered, removed with a NULL event and added again to\n");
+   failed = (check_once(&destination, 0) != 0);
+   failed |= (check_once(&destination, 1) != 0);
+
+   get_stats(&stats);
+   if (stats.conn_pool_in_use) {
+      fprintf(stderr, "  %lu requests left\n", stats.conn_pool_in_use);
+      failed = 1;
+   }
+   printf("%s\n", failed ? "FAILED" : "passed");
+
+   return(failed);
+}
@@ -0,0 +1,440 @@
+/*
+
+    harness.c - What the stress and benchmark programs share
+
+    The stand-in SOCKS server takes V5 CONNECT requests, with or without
+    username/password authentication, and Tor's SOCKS 4A RESOLVE. A
+    connected stream echoes what it is sent, unless it went to port 53:
+    then it answers DNS queries over TCP the way a nameserver would, with
+    an address made up from the name. Each reply, echoes included, can
+    be held back to stand in for the latency of a Tor circuit.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "harness.h"
+
+struct client {
+   struct stand_in *server;
+   int fd;
+};
+
+long long now_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+int read_all(int fd, void *buffer, size_t len) {
+   size_t got = 0;
+   ssize_t rc;
+
+   while (got < len) {
+      rc = read(fd, (char *) buffer + got, len - got);
+      if ((rc == -1) && (errno == EINTR))
+         continue;
+      if (rc <= 0)
+         return(-1);
+      got += rc;
+   }
+
+   return(0);
+}
+
+int write_all(int fd, const void *buffer, size_t len) {
+   size_t sent = 0;
+   ssize_t rc;
+
+   while (sent < len) {
+      rc = write(fd, (const char *) buffer + sent, len - sent);
+      if ((rc == -1) && (errno == EINTR))
+         continue;
+      if (rc <= 0)
+         return(-1);
+      sent += rc;
+   }
+
+   return(0);
+}
+
+/* 10.x.y.z from an FNV-1a hash of name */
+unsigned int stand_in_address(const char *name) {
+   uint32_t hash = 2166136261u;
+
+   for (; *name; name++)
+      hash = (hash ^ (unsigned char) *name) * 16777619u;
+
+   return(htonl(0x0a000000u | (hash & 0x00ffffffu)));
+}
+
+/* Send a reply delay_ms after *since, when the message it answers came */
+/* in. A message already waiting by then was sent before the reply     */
+/* could be seen, in the same flight as the one answered, so it keeps  */
+/* *since. Otherwise *since becomes 0, for the next read to set        */
+static int send_reply(struct stand_in *server, int fd, const void *reply,
+                      size_t len, long long *since) {
+   struct pollfd pfd;
+   struct timespec ts;
+   long long left;
+
+   if (server->delay_ms <= 0)
+      return(write_all(fd, reply, len));
+
+   left = *since + (server->delay_ms * 1000000LL) - now_ns();
+   if (left > 0) {
+      ts.tv_sec = left / 1000000000LL;
+      ts.tv_nsec = left % 1000000000LL;
+      while (nanosleep(&ts, &ts) && (errno == EINTR))
+         ;
+   }
+
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   if (poll(&pfd, 1, 0) != 1)
+      *since = 0;
+
+   return(write_all(fd, reply, len));
+}
+
+static int read_string(int fd, char *buffer, size_t size) {
+   size_t len = 0;
+
+   for (;;) {
+      if ((len == size) || read_all(fd, &buffer[len], 1))
+         return(-1);
+      if (buffer[len++] == '\0')
+         return(0);
+   }
+}
+
+/* The echo is held back too, as if it came from the destination */
+static void echo(struct stand_in *server, int fd, long long since) {
+   char buffer[4096];
+   ssize_t rc;
+
+   while ((rc = read(fd, buffer, sizeof(buffer))) > 0) {
+      if (!since)
+         since = now_ns();
+      if (send_reply(server, fd, buffer, rc, &since))
+         break;
+   }
+}
+
+/* Answer every A query with one record, anything else with no records */
+static void serve_dns(struct stand_in *server, int fd, long long since) {
+   unsigned char message[2 + 512 + 16], name[256];
+   unsigned int length, pos, namelen, type, address;
+
+   for (;;) {
+      if (read_all(fd, message, 2))
+         return;
+      if (!since)
+         since = now_ns();
+      length = (message[0] << 8) | message[1];
+      if ((length < 12) || (length > 512) ||
+          read_all(fd, &message[2], length))
+         return;
+      __atomic_add_fetch(&server->queries, 1, __ATOMIC_RELAXED);
+
+      /* The question's name, as dotted text, then its type */
+      namelen = 0;
+      for (pos = 2 + 12; (pos < 2 + length) && message[pos];
+           pos += message[pos] + 1) {
+         if ((message[pos] > 63) || (namelen + message[pos] + 1 >= sizeof(name)))
+            return;
+         if (namelen)
+            name[namelen++] = '.';
+         memcpy(&name[namelen], &message[pos + 1], message[pos]);
+         namelen += message[pos];
+      }
+      name[namelen] = '\0';
+      if (pos + 5 > 2 + length)
+         return;
+      type = (message[pos + 1] << 8) | message[pos + 2];
+      length = pos + 5 - 2;
+
+      message[2 + 2] |= 0x80;               /* A response              */
+      message[2 + 3] = 0x80;                /* Recursion available     */
+      memset(&message[2 + 6], 0, 6);        /* Only the answers follow */
+      if (type == 1) {
+         static const unsigned char record[] = {
+            0xc0, 0x0c,                     /* The question's name     */
+            0, 1, 0, 1,                     /* A, IN                   */
+            0, 0, 0, 60,                    /* TTL                     */
+            0, 4 };
+         message[2 + 7] = 1;
+         memcpy(&message[2 + length], record, sizeof(record));
+         length += sizeof(record);
+         address = stand_in_address((char *) name);
+         memcpy(&message[2 + length], &address, 4);
+         length += 4;
+      }
+      message[0] = length >> 8;
+      message[1] = length & 0xff;
+
+      if (send_reply(server, fd, message, 2 + length, &since))
+         return;
+   }
+}
+
+/* A SOCKS 4A request, the version has been read */
+static void serve_socks4(struct stand_in *server, int fd, long long since) {
+   unsigned char request[7], reply[8] = { 0, 90 };
+   char user[256], name[256];
+   unsigned int address;
+
+   if (read_all(fd, request, sizeof(request)) ||
+       read_string(fd, user, sizeof(user)))
+      return;
+   /* 0.0.0.x means a name follows */
+   if (!request[3] && !request[4] && !request[5] && request[6]) {
+      if (read_string(fd, name, sizeof(name)))
+         return;
+   } else
+      name[0] = '\0';
+
+   if (request[0] == 0xf0) {
+      __atomic_add_fetch(&server->resolves, 1, __ATOMIC_RELAXED);
+      if (!server->resolve || !strncmp(name, "fail", 4))
+         reply[1] = 91;
+      else {
+         address = stand_in_address(name);
+         memcpy(&reply[4], &address, 4);
+      }
+      send_reply(server, fd, reply, sizeof(reply), &since);
+      return;
+   }
+
+   if (request[0] != 1)
+      return;
+   __atomic_add_fetch(&server->connects, 1, __ATOMIC_RELAXED);
+   if (send_reply(server, fd, reply, sizeof(reply), &since))
+      return;
+   if (((request[1] << 8) | request[2]) == STAND_IN_DNS_PORT)
+      serve_dns(server, fd, since);
+   else
+      echo(server, fd, since);
+}
+
+/* A SOCKS V5 handshake, the version has been read */
+static void serve_socks5(struct stand_in *server, int fd, long long since) {
+   unsigned char buffer[512], reply[10] = { 5, 0, 0, 1 };
+   unsigned int i, off, len, port, method = 0xff;
+
+   if (read_all(fd, buffer, 1) || read_all(fd, &buffer[1], buffer[0]))
+      return;
+   for (i = 1; i <= buffer[0]; i++) {
+      if (buffer[i] == server->method)
+         method = server->method;
+   }
+   buffer[0] = 5;
+   buffer[1] = method;
+   if (send_reply(server, fd, buffer, 2, &since) || (method == 0xff))
+      return;
+
+   if (method == 2) {
+      /* Version, then the username and the password with their lengths */
+      if (read_all(fd, buffer, 2))
+         return;
+      if (!since)
+         since = now_ns();
+      if (read_all(fd, &buffer[2], buffer[1] + 1) ||
+          read_all(fd, &buffer[3 + buffer[1]], buffer[2 + buffer[1]]))
+         return;
+      buffer[0] = 1;
+      buffer[1] = 0;
+      if (send_reply(server, fd, buffer, 2, &since))
+         return;
+   }
+
+   if (read_all(fd, buffer, 4))
+      return;
+   if (!since)
+      since = now_ns();
+   /* The address, then the port */
+   off = 4;
+   switch (buffer[3]) {
+      case 1:
+         len = 4;
+         break;
+      case 3:
+         if (read_all(fd, &buffer[off++], 1))
+            return;
+         len = buffer[4];
+         break;
+      case 4:
+         len = 16;
+         break;
+      default:
+         return;
+   }
+   if (read_all(fd, &buffer[off], len + 2))
+      return;
+   port = (buffer[off + len] << 8) | buffer[off + len + 1];
+   if (buffer[1] != 1) {
+      reply[1] = 7;                        /* Command not supported */
+      write_all(fd, reply, sizeof(reply));
+      return;
+   }
+
+   __atomic_add_fetch(&server->connects, 1, __ATOMIC_RELAXED);
+   if (send_reply(server, fd, reply, sizeof(reply), &since))
+      return;
+   if (port == STAND_IN_DNS_PORT)
+      serve_dns(server, fd, since);
+   else
+      echo(server, fd, since);
+}
+
+static void *serve_client(void *arg) {
+   struct client *client = (struct client *) arg;
+   unsigned char version;
+   long long since;
+
+   if (!read_all(client->fd, &version, 1)) {
+      since = now_ns();
+      if (version == 4)
+         serve_socks4(client->server, client->fd, since);
+      else if (version == 5)
+         serve_socks5(client->server, client->fd, since);
+   }
+   close(client->fd);
+   free(client);
+
+   return(NULL);
+}
+
+static void *stand_in_accept(void *arg) {
+   struct stand_in *server = (struct stand_in *) arg;
+   struct client *client;
+   pthread_attr_t attr;
+   pthread_t thread;
+   int fd, one = 1;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_attr_setstacksize(&attr, 64 * 1024);
+   for (;;) {
+      if ((fd = accept(server->listener, NULL, NULL)) == -1) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         if (errno == EMFILE || errno == ENFILE) {
+            usleep(1000);
+            continue;
+         }
+         perror("accept");
+         exit(2);
+      }
+      if (!(client = malloc(sizeof(*client)))) {
+         close(fd);
+         continue;
+      }
+      /* A reply and the echo behind it mustn't wait for an ACK */
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      client->server = server;
+      client->fd = fd;
+      if (pthread_create(&thread, &attr, serve_client, client)) {
+         close(fd);
+         free(client);
+      }
+   }
+
+   return(NULL);
+}
+
+int stand_in_start(struct stand_in *server) {
+   struct sockaddr_in address;
+   socklen_t len = sizeof(address);
+   pthread_t thread;
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (((server->listener = socket(AF_INET, SOCK_STREAM, 0)) == -1) ||
+       bind(server->listener, (struct sockaddr *) &address, sizeof(address)) ||
+       listen(server->listener, 1024) ||
+       getsockname(server->listener, (struct sockaddr *) &address, &len)) {
+      perror("stand_in_start");
+      return(-1);
+   }
+   server->port = ntohs(address.sin_port);
+
+   if (pthread_create(&thread, NULL, stand_in_accept, server)) {
+      perror("pthread_create");
+      return(-1);
+   }
+   pthread_detach(thread);
+
+   return(0);
+}
+
+int harness_run(const char *conf, char *const argv[]) {
+   char self[PATH_MAX], preload[PATH_MAX + 16];
+   char *slash;
+   ssize_t n;
+   pid_t pid;
+   int status;
+
+   if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) == -1) {
+      perror("readlink");
+      return(-1);
+   }
+   self[n] = '\0';
+   strcpy(preload, self);
+   if ((slash = strrchr(preload, '/')))
+      slash[1] = '\0';
+   strcat(preload, "libtsocks.so");
+
+   fflush(NULL);
+   if ((pid = fork()) == -1) {
+      perror("fork");
+      return(-1);
+   }
+   if (pid == 0) {
+      setenv(HARNESS_CHILD_ENV, "1", 1);
+      if (conf) {
+         setenv("TSOCKS_CONF_DATA", conf, 1);
+         setenv("LD_PRELOAD", preload, 1);
+      } else {
+         unsetenv("TSOCKS_CONF_DATA");
+         unsetenv("LD_PRELOAD");
+      }
+      execv(self, argv);
+      perror("execv");
+      _exit(127);
+   }
+
+   while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR)
+         return(-1);
+   }
+
+   return(WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+int harness_is_child(void) {
+   return(getenv(HARNESS_CHILD_ENV) != NULL);
+}
+
+void (*harness_stats(void))(struct tsocks_stats *) {
+   return((void (*)(struct tsocks_stats *))
+          dlsym(RTLD_DEFAULT, "tsocks_get_stats"));
+}
@@ -0,0 +1,59 @@
+/*
+
+    harness.h - What the stress and benchmark programs share
+
+    A SOCKS V5 server of our own, running as threads of a process that
+    doesn't have the library loaded, and a way to run the program again
+    as a child with libtsocks.so preloaded and configured for it.
+
+*/
+
+#ifndef _HARNESS_H
+
+#define _HARNESS_H	1
+
+#include <stddef.h>
+
+#include "tsocks.h"
+
+/* Set in the children harness_run() starts */
+#define HARNESS_CHILD_ENV "TSOCKS_HARNESS_CHILD"
+
+/* The stand-in SOCKS V5 server. Every field but the counters is set   */
+/* before stand_in_start() and left alone afterwards                   */
+struct stand_in {
+   int port;                  /* Filled in by stand_in_start()          */
+   int delay_ms;              /* Before each reply, from when the       */
+                              /* message it answers came in             */
+   int method;                /* The one method taken, 0 or 2 (any      */
+                              /* username and password will do)         */
+   int resolve;               /* Answer Tor's RESOLVE (0xF0) command,   */
+                              /* names starting with "fail" fail        */
+   unsigned long connects;    /* CONNECT requests seen                  */
+   unsigned long resolves;    /* RESOLVE requests seen                  */
+   unsigned long queries;     /* DNS queries over TCP seen              */
+   int listener;
+};
+
+/* A CONNECT to this port is answered as a DNS server over TCP, any */
+/* other CONNECT gets an echo                                        */
+#define STAND_IN_DNS_PORT 53
+
+int stand_in_start(struct stand_in *server);
+/* The address RESOLVE and DNS queries give name, in network order */
+unsigned int stand_in_address(const char *name);
+
+/* Run this program again with argv, with libtsocks.so from the same    */
+/* directory preloaded and conf as its configuration, or without the    */
+/* library if conf is NULL. Returns its exit status, -1 if it couldn't  */
+/* be run or was killed                                                  */
+int harness_run(const char *conf, char *const argv[]);
+int harness_is_child(void);
+/* tsocks_get_stats() from the preloaded library, NULL if it isn't */
+void (*harness_stats(void))(struct tsocks_stats *);
+
+long long now_ns(void);
+int read_all(int fd, void *buffer, size_t len);
+int write_all(int fd, const void *buffer, size_t len);
+
+#endif
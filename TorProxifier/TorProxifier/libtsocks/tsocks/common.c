@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <netdb.h>
 #include "common.h"
+#include "interpose.h"
 #include <stdarg.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -35,7 +36,7 @@ unsigned int resolve_ip(char *host, int showmsg, int allownames) {
 		/* try it as a dns name                        */
 		if (allownames) {
 			#ifdef HAVE_GETHOSTBYNAME
-			if ((new = gethostbyname(host)) == (struct hostent *) 0) {
+			if ((new = realgethostbyname(host)) == (struct hostent *) 0) {
 			#endif
 				return(-1);
 			#ifdef HAVE_GETHOSTBYNAME
@@ -106,8 +107,8 @@ void show_msg(int level, char *fmt, ...) {
    char timestring[20];
    time_t timestamp;
 
-	// if ((loglevel == MSGNONE) || (level > loglevel))
-	//  return;
+	if (!MSG_ENABLED(level))
+		return;
 
    if (!logfile) {
       if (logfilename[0]) {
@@ -10,3 +10,7 @@ unsigned int resolve_ip(char *, int, int);
 #define MSGWARN   1
 #define MSGNOTICE 2
 #define MSGDEBUG  2
+
+/* Lets callers skip building arguments for messages nobody will see */
+extern int loglevel;
+#define MSG_ENABLED(level) ((loglevel != MSGNONE) && ((level) <= loglevel))
@@ -12,6 +12,12 @@ page for details */
 location */
 //#define ALLOW_ENV_CONFIG 1
 
+/* Outside of OS X there is no TorProxifier to hand us the configuration,
+so the environment and CONF_FILE are the only way to provide it */
+#if !defined(__APPLE__)
+#define ALLOW_ENV_CONFIG 1
+#endif
+
 /* Use _GNU_SOURCE to define RTLD_NEXT, mostly for RH7 systems */
 /* #undef USE_GNU_SOURCE */
 
@@ -0,0 +1,334 @@
+/*
+
+    conn_table.c    - fd indexed table of the sockets tsocks is proxying
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "parser.h"
+#include "tsocks.h"
+#include "conn_table.h"
+
+/* Structure holding the requests for CONN_TABLE_CHUNK_SIZE fds */
+struct conn_chunk {
+   struct connreq *slots[CONN_TABLE_CHUNK_SIZE];
+   uint8_t locks[CONN_TABLE_CHUNK_SIZE];
+   uint8_t info[CONN_TABLE_CHUNK_SIZE];
+   int epfds[CONN_TABLE_CHUNK_SIZE];       /* Plus one, 0 for none */
+   uint8_t polled[CONN_TABLE_CHUNK_SIZE];
+};
+
+/* A connreq in the pool, the link is only used while it is free */
+union conn_slot {
+   struct connreq conn;
+   union conn_slot *next;
+};
+
+/* Globals */
+uint64_t conn_table_proxied[CONN_TABLE_MAX_FDS / 64];
+uint64_t conn_table_known[CONN_TABLE_MAX_FDS / 64];
+int conn_table_count = 0;
+
+/* Chunks are never freed once published, so a chunk pointer read by */
+/* any thread stays valid for the life of the process                */
+static struct conn_chunk *conn_chunks[CONN_TABLE_MAX_CHUNKS];
+
+static pthread_mutex_t conn_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static union conn_slot *conn_pool_free_list = NULL;
+static unsigned long conn_pool_in_use = 0;
+static unsigned long conn_pool_high_water = 0;
+static unsigned long conn_pool_capacity = 0;
+
+struct connreq *conn_pool_alloc(void) {
+   union conn_slot *slot;
+   int i;
+
+   pthread_mutex_lock(&conn_pool_mutex);
+
+   if (conn_pool_free_list == NULL) {
+      /* Carve a new slab into the free list */
+      if ((slot = malloc(CONN_POOL_SLAB_SIZE * sizeof(*slot))) == NULL) {
+         pthread_mutex_unlock(&conn_pool_mutex);
+         return(NULL);
+      }
+      for (i = 0; i < CONN_POOL_SLAB_SIZE; i++) {
+         slot[i].next = conn_pool_free_list;
+         conn_pool_free_list = &slot[i];
+      }
+      conn_pool_capacity += CONN_POOL_SLAB_SIZE;
+   }
+
+   slot = conn_pool_free_list;
+   conn_pool_free_list = slot->next;
+   if (++conn_pool_in_use > conn_pool_high_water)
+      conn_pool_high_water = conn_pool_in_use;
+
+   pthread_mutex_unlock(&conn_pool_mutex);
+
+   return(&slot->conn);
+}
+
+void conn_pool_free(struct connreq *conn) {
+   union conn_slot *slot = (union conn_slot *) conn;
+
+   pthread_mutex_lock(&conn_pool_mutex);
+   slot->next = conn_pool_free_list;
+   conn_pool_free_list = slot;
+   conn_pool_in_use--;
+   pthread_mutex_unlock(&conn_pool_mutex);
+}
+
+void conn_pool_stats(unsigned long *in_use, unsigned long *high_water,
+                     unsigned long *capacity) {
+   pthread_mutex_lock(&conn_pool_mutex);
+   *in_use = conn_pool_in_use;
+   *high_water = conn_pool_high_water;
+   *capacity = conn_pool_capacity;
+   pthread_mutex_unlock(&conn_pool_mutex);
+}
+
+static struct conn_chunk *get_chunk(int fd, int create) {
+   struct conn_chunk *chunk, *expected = NULL;
+
+   chunk = __atomic_load_n(&conn_chunks[fd >> CONN_TABLE_CHUNK_BITS],
+                           __ATOMIC_ACQUIRE);
+   if (chunk || !create)
+      return(chunk);
+
+   if ((chunk = calloc(1, sizeof(*chunk))) == NULL) {
+      show_msg(MSGERR, "Could not allocate memory for connection "
+                       "table\n");
+      return(NULL);
+   }
+
+   /* Someone else may be publishing the same chunk right now, if they */
+   /* won we use theirs                                                */
+   if (!__atomic_compare_exchange_n(&conn_chunks[fd >> CONN_TABLE_CHUNK_BITS],
+                                    &expected, chunk, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      free(chunk);
+      chunk = expected;
+   }
+
+   return(chunk);
+}
+
+int conn_table_lock(int fd) {
+   struct conn_chunk *chunk;
+   uint8_t *lock;
+   struct timespec pause = { 0, 1000000 };
+   int spins = 0;
+
+   if ((unsigned int) fd >= CONN_TABLE_MAX_FDS) {
+      show_msg(MSGERR, "Socket %d is beyond the %d sockets tsocks can "
+                       "track\n", fd, CONN_TABLE_MAX_FDS);
+      return(-1);
+   }
+
+   if ((chunk = get_chunk(fd, 1)) == NULL)
+      return(-1);
+
+   /* The lock is only ever contended by threads using the same socket, */
+   /* which is rare, but the holder may be blocked in a handshake for   */
+   /* a while so we back off from spinning to yielding to sleeping      */
+   lock = &chunk->locks[fd & CONN_TABLE_CHUNK_MASK];
+   while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+      if (spins < 64)
+         spins++;
+      else if (spins < 128) {
+         spins++;
+         sched_yield();
+      } else
+         nanosleep(&pause, NULL);
+   }
+
+   return(0);
+}
+
+void conn_table_unlock(int fd) {
+   struct conn_chunk *chunk = get_chunk(fd, 0);
+
+   __atomic_clear(&chunk->locks[fd & CONN_TABLE_CHUNK_MASK], __ATOMIC_RELEASE);
+}
+
+struct connreq *conn_table_acquire(int fd) {
+   struct connreq *conn;
+
+   if (!conn_table_is_proxied(fd))
+      return(NULL);
+
+   if (conn_table_lock(fd))
+      return(NULL);
+
+   if ((conn = conn_table_get(fd)) == NULL)
+      conn_table_unlock(fd);
+
+   return(conn);
+}
+
+/* The lock for conn->sockid must be held */
+int conn_table_add(struct connreq *conn) {
+   int fd = conn->sockid;
+   struct conn_chunk *chunk = get_chunk(fd, 0);
+
+   if (!chunk->slots[fd & CONN_TABLE_CHUNK_MASK])
+      __atomic_fetch_add(&conn_table_count, 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&chunk->slots[fd & CONN_TABLE_CHUNK_MASK], conn,
+                    __ATOMIC_RELEASE);
+   __atomic_fetch_or(&conn_table_proxied[fd >> 6], (uint64_t) 1 << (fd & 63),
+                     __ATOMIC_RELEASE);
+
+   return(0);
+}
+
+/* The lock for conn->sockid must be held */
+void conn_table_remove(struct connreq *conn) {
+   int fd = conn->sockid;
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 0)) ||
+       (chunk->slots[fd & CONN_TABLE_CHUNK_MASK] != conn))
+      return;
+
+   __atomic_fetch_and(&conn_table_proxied[fd >> 6],
+                      ~((uint64_t) 1 << (fd & 63)), __ATOMIC_RELEASE);
+   __atomic_store_n(&chunk->slots[fd & CONN_TABLE_CHUNK_MASK], NULL,
+                    __ATOMIC_RELEASE);
+   __atomic_fetch_sub(&conn_table_count, 1, __ATOMIC_RELAXED);
+}
+
+/* The lock for fd must be held */
+struct connreq *conn_table_get(int fd) {
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 0)))
+      return(NULL);
+
+   return(__atomic_load_n(&chunk->slots[fd & CONN_TABLE_CHUNK_MASK],
+                          __ATOMIC_ACQUIRE));
+}
+
+int conn_table_info(int fd) {
+   if (!conn_table_has_info(fd))
+      return(0);
+
+   return(__atomic_load_n(&get_chunk(fd, 0)->info[fd & CONN_TABLE_CHUNK_MASK],
+                          __ATOMIC_RELAXED));
+}
+
+void conn_table_set_info(int fd, int info) {
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 1)))
+      return;
+
+   __atomic_store_n(&chunk->info[fd & CONN_TABLE_CHUNK_MASK],
+                    (uint8_t) (info | FDINFO_KNOWN), __ATOMIC_RELAXED);
+   __atomic_fetch_or(&conn_table_known[fd >> 6], (uint64_t) 1 << (fd & 63),
+                     __ATOMIC_RELEASE);
+}
+
+void conn_table_forget(int fd) {
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 0)))
+      return;
+
+   if (chunk->epfds[fd & CONN_TABLE_CHUNK_MASK])
+      __atomic_store_n(&chunk->epfds[fd & CONN_TABLE_CHUNK_MASK], 0,
+                       __ATOMIC_RELAXED);
+   if (chunk->polled[fd & CONN_TABLE_CHUNK_MASK])
+      __atomic_store_n(&chunk->polled[fd & CONN_TABLE_CHUNK_MASK], 0,
+                       __ATOMIC_RELAXED);
+   if (!conn_table_has_info(fd))
+      return;
+
+   __atomic_fetch_and(&conn_table_known[fd >> 6],
+                      ~((uint64_t) 1 << (fd & 63)), __ATOMIC_RELEASE);
+}
+
+int conn_table_epoll(int fd) {
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 0)))
+      return(-1);
+
+   return(__atomic_load_n(&chunk->epfds[fd & CONN_TABLE_CHUNK_MASK],
+                          __ATOMIC_RELAXED) - 1);
+}
+
+void conn_table_set_epoll(int fd, int epfd) {
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 1)))
+      return;
+
+   __atomic_store_n(&chunk->epfds[fd & CONN_TABLE_CHUNK_MASK], epfd + 1,
+                    __ATOMIC_RELAXED);
+}
+
+int conn_table_polled(int fd) {
+   struct conn_chunk *chunk;
+
+   /* Not knowing is taken for yes */
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS))
+      return(1);
+   if (!(chunk = get_chunk(fd, 0)))
+      return(0);
+
+   return(__atomic_load_n(&chunk->polled[fd & CONN_TABLE_CHUNK_MASK],
+                          __ATOMIC_RELAXED));
+}
+
+void conn_table_set_polled(int fd) {
+   struct conn_chunk *chunk;
+
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       !(chunk = get_chunk(fd, 1)))
+      return;
+
+   if (!chunk->polled[fd & CONN_TABLE_CHUNK_MASK])
+      __atomic_store_n(&chunk->polled[fd & CONN_TABLE_CHUNK_MASK], 1,
+                       __ATOMIC_RELAXED);
+}
+
+/* Return the first proxied fd in the range [fd, limit), or -1 if there */
+/* isn't one. Whole bitmap words are skipped at a time                  */
+int conn_table_next(int fd, int limit) {
+   uint64_t word;
+   int base;
+
+   if (fd < 0)
+      fd = 0;
+   if (limit > CONN_TABLE_MAX_FDS)
+      limit = CONN_TABLE_MAX_FDS;
+
+   while (fd < limit) {
+      base = fd & ~63;
+      word = __atomic_load_n(&conn_table_proxied[fd >> 6], __ATOMIC_ACQUIRE) &
+             (~(uint64_t) 0 << (fd & 63));
+      if (word) {
+         fd = base + __builtin_ctzll(word);
+         return((fd < limit) ? fd : -1);
+      }
+      fd = base + 64;
+   }
+
+   return(-1);
+}
@@ -0,0 +1,89 @@
+/* conn_table.h - fd indexed table of the sockets tsocks is proxying */
+
+#ifndef _CONN_TABLE_H
+
+#define _CONN_TABLE_H	1
+
+#include <stdint.h>
+
+struct connreq;
+
+/* The table covers every fd below CONN_TABLE_MAX_FDS. Slots are kept  */
+/* in chunks which are only allocated once an fd in their range gets   */
+/* proxied, the "proxied" bitmap itself is a flat array so that        */
+/* checking an untracked fd is a single bit test                       */
+#define CONN_TABLE_CHUNK_BITS   8
+#define CONN_TABLE_CHUNK_SIZE   (1 << CONN_TABLE_CHUNK_BITS)
+#define CONN_TABLE_CHUNK_MASK   (CONN_TABLE_CHUNK_SIZE - 1)
+#define CONN_TABLE_MAX_FDS      (1 << 20)
+#define CONN_TABLE_MAX_CHUNKS   (CONN_TABLE_MAX_FDS / CONN_TABLE_CHUNK_SIZE)
+
+/* What we learnt about a socket from the intercepted call which */
+/* created it, fds we have no info for have to be asked for it    */
+#define FDINFO_KNOWN            (1 << 0)
+#define FDINFO_STREAM           (1 << 1)
+#define FDINFO_CONNECTED        (1 << 2)
+
+extern uint64_t conn_table_proxied[CONN_TABLE_MAX_FDS / 64];
+extern uint64_t conn_table_known[CONN_TABLE_MAX_FDS / 64];
+extern int conn_table_count;
+
+/* This is a hint only, the state of the fd can change as soon as it  */
+/* has been read. It is exact again once the fd has been locked       */
+static inline int conn_table_is_proxied(int fd) {
+   return ((unsigned int) fd < CONN_TABLE_MAX_FDS) &&
+          ((__atomic_load_n(&conn_table_proxied[fd >> 6], __ATOMIC_ACQUIRE) >>
+            (fd & 63)) & 1);
+}
+
+static inline int conn_table_has_info(int fd) {
+   return ((unsigned int) fd < CONN_TABLE_MAX_FDS) &&
+          ((__atomic_load_n(&conn_table_known[fd >> 6], __ATOMIC_ACQUIRE) >>
+            (fd & 63)) & 1);
+}
+
+static inline int conn_table_empty(void) {
+   return(__atomic_load_n(&conn_table_count, __ATOMIC_RELAXED) == 0);
+}
+
+/* Every fd has its own lock so threads working on different sockets  */
+/* never wait on each other. A connreq may only be read or modified,   */
+/* added or removed while the lock for its fd is held                  */
+int conn_table_lock(int fd);
+void conn_table_unlock(int fd);
+
+/* Returns the locked request for fd or NULL (and nothing locked) */
+struct connreq *conn_table_acquire(int fd);
+
+int conn_table_info(int fd);
+void conn_table_set_info(int fd, int info);
+void conn_table_forget(int fd);
+
+/* The epoll instance on which we replaced the caller's registration   */
+/* of fd, -1 if none. It is kept once the registration is given back,  */
+/* for events another thread already took from the kernel, until fd is */
+/* closed                                                              */
+int conn_table_epoll(int fd);
+void conn_table_set_epoll(int fd, int epfd);
+
+/* Whether the caller added fd to an epoll instance since it was last  */
+/* closed through us. An fd libc closed behind our back may keep it    */
+/* set, which only errs on the side of leaving the fd alone            */
+int conn_table_polled(int fd);
+void conn_table_set_polled(int fd);
+
+/* connreqs are carved out of slabs of CONN_POOL_SLAB_SIZE and recycled */
+/* through a free list, they are never handed back to malloc            */
+#define CONN_POOL_SLAB_SIZE     64
+
+struct connreq *conn_pool_alloc(void);
+void conn_pool_free(struct connreq *conn);
+void conn_pool_stats(unsigned long *in_use, unsigned long *high_water,
+                     unsigned long *capacity);
+
+int conn_table_add(struct connreq *conn);
+void conn_table_remove(struct connreq *conn);
+struct connreq *conn_table_get(int fd);
+int conn_table_next(int fd, int limit);
+
+#endif
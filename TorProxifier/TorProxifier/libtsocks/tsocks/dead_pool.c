@@ -5,15 +5,380 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
 #include "common.h"
 #include "dead_pool.h"
+#include "interpose.h"
+#include "resolver.h"
+
+/* Reserved memory is only backed once touched */
+#ifdef MAP_NORESERVE
+# define POOL_MAP_NORESERVE MAP_NORESERVE
+#else
+# define POOL_MAP_NORESERVE 0
+#endif
 
-int store_pool_entry(dead_pool *pool, char *hostname, struct in_addr *addr);
+int store_pool_entry(dead_pool *pool, char *name, struct in_addr *addr);
 void get_next_dead_address(dead_pool *pool, uint32_t *result);
 
-static int do_resolve(const char *hostname, uint32_t sockshost, uint16_t socksport, uint32_t *result_addr);
+/* The pool's arrays, at their offsets in this process's mapping of it */
+#define POOL_AT(pool, off)     ((void *) ((char *) (pool) + (off)))
+#define ENTRY_IPS(pool)        ((uint32_t *) POOL_AT(pool, (pool)->ips_off))
+#define ENTRY_NAMES(pool)      ((uint32_t *) POOL_AT(pool, (pool)->names_off))
+#define ENTRY_EXPIRY(pool)     ((uint32_t *) POOL_AT(pool, (pool)->expiry_off))
+#define ENTRY_PINS(pool)       ((uint32_t *) POOL_AT(pool, (pool)->pins_off))
+#define ENTRY_REFS(pool)       ((uint8_t *) POOL_AT(pool, (pool)->refs_off))
+#define DEAD_SLOTS(pool)       ((uint32_t *) POOL_AT(pool, (pool)->dead_off))
+#define ARENA(pool)            ((char *) POOL_AT(pool, (pool)->arena_off))
+#define INDEX_CTRL(pool, index)  ((uint8_t *) POOL_AT(pool, (index)->ctrl_off))
+#define INDEX_SLOTS(pool, index) ((int32_t *) POOL_AT(pool, (index)->slots_off))
+
+/* Yields before a lock or change which doesn't end is checked for a */
+/* process which died in the middle of it                            */
+#define POOL_LOCK_SPINS   1024
+
+/* Bit i set for each of the POOL_GROUP_SIZE control bytes at ctrl equal  */
+/* to tag, or for free ones (the top bit set, POOL_CTRL_EMPTY or _DELETED) */
+/* when tag is 0                                                           */
+static unsigned int group_match(const uint8_t *ctrl, uint8_t tag)
+{
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+
+    if(tag)
+        group = _mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag));
+    return (unsigned int) _mm_movemask_epi8(group);
+#elif defined(__aarch64__)
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                         1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t group = vld1q_u8(ctrl), hits;
+
+    if(tag)
+        hits = vceqq_u8(group, vdupq_n_u8(tag));
+    else
+        hits = vcltq_s8(vreinterpretq_s8_u8(group), vdupq_n_s8(0));
+    hits = vandq_u8(hits, vld1q_u8(weights));
+    return vaddv_u8(vget_low_u8(hits)) | 
+           ((unsigned int) vaddv_u8(vget_high_u8(hits)) << 8);
+#else
+    unsigned int i, bits = 0;
+
+    for(i = 0; i < POOL_GROUP_SIZE; i++) {
+        if(tag ? (ctrl[i] == tag) : (ctrl[i] & 0x80))
+            bits |= (1u << i);
+    }
+    return bits;
+#endif
+}
+
+/* The low 7 bits are the control byte, the others pick the bucket */
+static uint64_t mix_hash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t hash_name(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;   /* FNV-1a */
+
+    while(*name) {
+        hash = (hash ^ (unsigned char) *name++) * 1099511628211ULL;
+    }
+    return mix_hash(hash);
+}
+
+static uint64_t hash_ip(uint32_t ip)
+{
+    return mix_hash(ip * 0x9E3779B97F4A7C15ULL);
+}
+
+/* Control byte of an entry, never 0 which group_match() takes for free ones */
+static uint8_t hash_tag(uint64_t hash)
+{
+    uint8_t tag = (uint8_t) (hash & 0x7F);
+
+    return tag ? tag : 1;
+}
+
+typedef int (*index_match_t)(dead_pool *pool, int32_t slot, const void *key);
+
+/* Lookups may see an entry being changed, everything read is checked */
+/* to stay within the pool before it is used                          */
+static char *entry_name(dead_pool *pool, int32_t slot)
+{
+    uint32_t offset = ENTRY_NAMES(pool)[slot];
+
+    if(offset == 0 || offset - 1 > pool->arena_size - POOL_NAME_MAX) {
+        return NULL;
+    }
+    return ARENA(pool) + offset - 1;
+}
+
+static int match_name(dead_pool *pool, int32_t slot, const void *key)
+{
+    char *name = entry_name(pool, slot);
+
+    return name && (strncmp(name, key, POOL_NAME_MAX) == 0);
+}
+
+static int match_ip(dead_pool *pool, int32_t slot, const void *key)
+{
+    return (ENTRY_IPS(pool)[slot] == *((const uint32_t *) key));
+}
+
+static int match_slot(dead_pool *pool, int32_t slot, const void *key)
+{
+    return (slot == *((const int32_t *) key));
+}
+
+/* The bucket holding an entry match() accepts, with the entry in *slot, */
+/* -1 if there is none                                                   */
+static long index_find(dead_pool *pool, pool_index *index, uint64_t hash, 
+                       index_match_t match, const void *key, int32_t *slot)
+{
+    uint8_t tag = hash_tag(hash);
+    unsigned int mask = __atomic_load_n(&(index->mask), __ATOMIC_RELAXED);
+    unsigned int pos = (unsigned int) (hash >> 7) & mask;
+    unsigned int step = 0, bits, bucket;
+    int32_t found;
+
+    /* The buckets of a group are probed together, the groups after */
+    /* one another until one has an empty bucket. A lookup racing a  */
+    /* store may find none, it stops once it went round              */
+    while(step <= mask) {
+        bits = group_match(&INDEX_CTRL(pool, index)[pos], tag);
+        while(bits) {
+            bucket = (pos + __builtin_ctz(bits)) & mask;
+            found = INDEX_SLOTS(pool, index)[bucket];
+            if((uint32_t) found < (uint32_t) pool->n_entries &&
+               match(pool, found, key)) {
+                *slot = found;
+                return bucket;
+            }
+            bits &= bits - 1;
+        }
+        if(group_match(&INDEX_CTRL(pool, index)[pos], POOL_CTRL_EMPTY)) {
+            break;
+        }
+        step += POOL_GROUP_SIZE;
+        pos = (pos + step) & mask;
+    }
+    return -1;
+}
+
+static void index_set_ctrl(dead_pool *pool, pool_index *index, 
+                           unsigned int bucket, uint8_t ctrl)
+{
+    INDEX_CTRL(pool, index)[bucket] = ctrl;
+    /* Groups starting near the end read the first bytes again after it */
+    if(bucket < POOL_GROUP_SIZE) {
+        INDEX_CTRL(pool, index)[index->mask + 1 + bucket] = ctrl;
+    }
+}
+
+static void index_add(dead_pool *pool, pool_index *index, uint64_t hash, 
+                      int32_t slot)
+{
+    unsigned int pos = (unsigned int) (hash >> 7) & index->mask;
+    unsigned int step = 0, bits, bucket;
+
+    while((bits = group_match(&INDEX_CTRL(pool, index)[pos], 0)) == 0) {
+        step += POOL_GROUP_SIZE;
+        pos = (pos + step) & index->mask;
+    }
+    bucket = (pos + __builtin_ctz(bits)) & index->mask;
+    if(INDEX_CTRL(pool, index)[bucket] == POOL_CTRL_EMPTY) {
+        index->used++;
+    }
+    index->live++;
+    index_set_ctrl(pool, index, bucket, hash_tag(hash));
+    INDEX_SLOTS(pool, index)[bucket] = slot;
+}
+
+static void index_remove(dead_pool *pool, pool_index *index, uint64_t hash, int32_t slot)
+{
+    int32_t found;
+    long bucket = index_find(pool, index, hash, match_slot, &slot, &found);
+
+    if(bucket != -1) {
+        index_set_ctrl(pool, index, (unsigned int) bucket, POOL_CTRL_DELETED);
+        index->live--;
+    }
+}
+
+static void index_clear(dead_pool *pool, pool_index *index)
+{
+    memset(INDEX_CTRL(pool, index), POOL_CTRL_EMPTY, 
+           index->mask + 1 + POOL_GROUP_SIZE);
+    index->used = 0;
+    index->live = 0;
+}
+
+static int indexed_by_ip(dead_pool *pool, int32_t slot)
+{
+    return ENTRY_NAMES(pool)[slot] && 
+           !is_dead_address(pool, ENTRY_IPS(pool)[slot]);
+}
+
+static void index_rebuild(dead_pool *pool, pool_index *index)
+{
+    int32_t i;
+
+    index_clear(pool, index);
+    /* Entries past used_entries were never touched, reading them */
+    /* would back their pages                                     */
+    for(i = 0; i < (int32_t) pool->used_entries; i++) {
+        if(index == &(pool->name_index) && ENTRY_NAMES(pool)[i]) {
+            index_add(pool, index, hash_name(entry_name(pool, i)), i);
+        } else if(index == &(pool->ip_index) && indexed_by_ip(pool, i)) {
+            index_add(pool, index, hash_ip(ENTRY_IPS(pool)[i]), i);
+        }
+    }
+}
+
+/* Make room for one more entry. Indexes start small and double while */
+/* they are more than half full, so that only the pages they need are */
+/* touched. Deleted buckets only go away when the index is built      */
+/* again, which is done once they fill 7/8 of it                      */
+static void index_reserve(dead_pool *pool, pool_index *index)
+{
+    if(((index->live + 1) * 2 > index->mask + 1) && 
+       (index->mask < index->max_mask)) {
+        index->mask = (index->mask << 1) | 1;
+        index_rebuild(pool, index);
+    } else if(index->used >= (((index->mask + 1) / 8) * 7)) {
+        index_rebuild(pool, index);
+    }
+}
+
+/* Chunk size class for a name of len bytes, its NUL included */
+static int name_class(size_t len)
+{
+    int class = 0;
+
+    while((POOL_NAME_MIN << class) < len) {
+        class++;
+    }
+    return class;
+}
+
+/* Offset of a chunk for len bytes, the arena is reserved so that */
+/* there is always room for one                                   */
+static uint32_t arena_alloc(dead_pool *pool, size_t len)
+{
+    int class = name_class(len);
+    uint32_t offset;
+
+    if(pool->arena_free[class]) {
+        offset = pool->arena_free[class] - 1;
+        memcpy(&(pool->arena_free[class]), ARENA(pool) + offset, sizeof(uint32_t));
+    } else {
+        offset = pool->arena_used;
+        pool->arena_used += (POOL_NAME_MIN << class);
+    }
+    return offset;
+}
+
+static void arena_release(dead_pool *pool, uint32_t offset)
+{
+    int class = name_class(strlen(ARENA(pool) + offset) + 1);
+
+    /* Free chunks are linked through their first bytes */
+    memcpy(ARENA(pool) + offset, &(pool->arena_free[class]), sizeof(uint32_t));
+    pool->arena_free[class] = offset + 1;
+}
+
+/* Drop entry slot from the indexes and the arena, before it is replaced */
+static void release_entry(dead_pool *pool, int32_t slot)
+{
+    char *name = entry_name(pool, slot);
+    uint32_t ip = ENTRY_IPS(pool)[slot];
+    uint32_t offset;
+
+    if(name == NULL) {
+        return;
+    }
+    index_remove(pool, &(pool->name_index), hash_name(name), slot);
+    if(is_dead_address(pool, ip)) {
+        offset = ntohl(ip) - pool->deadrange_base;
+        if(DEAD_SLOTS(pool)[offset] == (uint32_t) slot + 1) {
+            DEAD_SLOTS(pool)[offset] = 0;
+        }
+    } else {
+        index_remove(pool, &(pool->ip_index), hash_ip(ip), slot);
+    }
+    arena_release(pool, ENTRY_NAMES(pool)[slot] - 1);
+    ENTRY_NAMES(pool)[slot] = 0;
+}
+
+static void store_entry(dead_pool *pool, int32_t slot, const char *name, 
+                        uint32_t ip, uint32_t expiry)
+{
+    size_t len = strlen(name) + 1;
+    uint32_t offset;
+    int dead = is_dead_address(pool, ip);
+
+    /* Before the entry is filled in, rebuilding would index it already */
+    index_reserve(pool, &(pool->name_index));
+    if(!dead) {
+        index_reserve(pool, &(pool->ip_index));
+    }
+
+    offset = arena_alloc(pool, len);
+    memcpy(ARENA(pool) + offset, name, len);
+    ENTRY_NAMES(pool)[slot] = offset + 1;
+    ENTRY_IPS(pool)[slot] = ip;
+    ENTRY_EXPIRY(pool)[slot] = expiry;
+    ENTRY_REFS(pool)[slot] = 0;
+    if((unsigned int) slot >= pool->used_entries) {
+        pool->used_entries = slot + 1;
+    }
+
+    index_add(pool, &(pool->name_index), hash_name(name), slot);
+    if(dead) {
+        DEAD_SLOTS(pool)[ntohl(ip) - pool->deadrange_base] = slot + 1;
+    } else {
+        index_add(pool, &(pool->ip_index), hash_ip(ip), slot);
+    }
+}
+
+/* Buckets an index starts with, at most half of them used */
+#define POOL_INDEX_START  1024
+
+static unsigned int index_buckets(int n)
+{
+    unsigned int buckets = POOL_GROUP_SIZE;
+
+    while(buckets < 2 * (unsigned int) n) {
+        buckets *= 2;
+    }
+    return buckets;
+}
+
+static size_t align_size(size_t size)
+{
+    return (size + 7) & ~((size_t) 7);
+}
 
 /* Compares the last strlen(s2) characters of s1 with s2.  Returns as for
    strcasecmp. */
@@ -26,11 +391,188 @@ static int strcasecmpend(const char *s1, const char *s2)
        return strncasecmp(s1+(n1-n2), s2, n2);
 }
 
-dead_pool * init_pool(int pool_size, struct in_addr deadrange_base, struct in_addr deadrange_mask, char *sockshost, uint16_t socksport)
+static void index_start(dead_pool *pool, pool_index *index)
+{
+    unsigned int buckets = index->max_mask + 1;
+
+    index->mask = ((buckets < POOL_INDEX_START) ? buckets : POOL_INDEX_START) - 1;
+    index_clear(pool, index);
+}
+
+/* Only with the pool lock held and seq odd: a process died changing  */
+/* the entries, which can't be trusted anymore. They are all dropped, */
+/* the pins of the connections still open are kept                    */
+static void pool_reset(dead_pool *pool)
+{
+    int32_t slot;
+    uint32_t ip;
+
+    if(pool->used_entries > (unsigned int) pool->n_entries) {
+        pool->used_entries = pool->n_entries;
+    }
+    for(slot = 0; slot < (int32_t) pool->used_entries; slot++) {
+        ip = ENTRY_IPS(pool)[slot];
+        if(is_dead_address(pool, ip)) {
+            DEAD_SLOTS(pool)[ntohl(ip) - pool->deadrange_base] = 0;
+        }
+        ENTRY_NAMES(pool)[slot] = 0;
+        ENTRY_EXPIRY(pool)[slot] = 0;
+        ENTRY_REFS(pool)[slot] = 0;
+    }
+    pool->write_pos = 0;
+    pool->dead_pos = 0;
+    pool->arena_used = 0;
+    memset(pool->arena_free, 0, sizeof(pool->arena_free));
+    index_start(pool, &(pool->name_index));
+    index_start(pool, &(pool->ip_index));
+}
+
+/* Set up a pool from header, in a mapping never written to yet or */
+/* whose size was just given again. magic is written last, a pool   */
+/* file left without it is set up again by the next process         */
+static void format_pool(dead_pool *pool, const dead_pool *header)
+{
+    memcpy(pool, header, sizeof(dead_pool));
+    pool->magic = 0;
+    index_start(pool, &(pool->name_index));
+    index_start(pool, &(pool->ip_index));
+    __atomic_store_n(&(pool->magic), POOL_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Whether a pool file was set up like header, by this version of the */
+/* layout and with the same configuration                             */
+static int same_setup(const dead_pool *pool, const dead_pool *header)
+{
+    return pool->magic == header->magic &&
+           pool->version == header->version &&
+           pool->header_size == header->header_size &&
+           pool->map_size == header->map_size &&
+           pool->n_entries == header->n_entries &&
+           pool->deadrange_base == header->deadrange_base &&
+           pool->deadrange_mask == header->deadrange_mask &&
+           pool->ttl == header->ttl &&
+           pool->negative_ttl == header->negative_ttl &&
+           pool->remote_resolve == header->remote_resolve &&
+           pool->deterministic == header->deterministic &&
+           pool->address_key[0] == header->address_key[0] &&
+           pool->address_key[1] == header->address_key[1] &&
+           pool->sockshost == header->sockshost &&
+           pool->socksport == header->socksport;
+}
+
+/* path with a leading ~/ for $HOME */
+static int expand_path(const char *path, char expanded[PATH_MAX])
+{
+    const char *home = getenv("HOME");
+    int len;
+
+    if(strncmp(path, "~/", 2) == 0) {
+        if(home == NULL) {
+            return -1;
+        }
+        len = snprintf(expanded, PATH_MAX, "%s%s", home, path + 1);
+    } else {
+        len = snprintf(expanded, PATH_MAX, "%s", path);
+    }
+    return (len < 0 || len >= PATH_MAX) ? -1 : 0;
+}
+
+/* The pool in the file at path. Every process using it holds a shared */
+/* lock on it for as long as it runs, the one which gets it exclusive  */
+/* is alone: it sets the file up again if it was made by another       */
+/* version or configuration, and clears what the processes which used  */
+/* it last left behind, the others wait for it. NULL if it can't be    */
+/* used, the caller then keeps its pool to itself                      */
+static dead_pool *map_pool_file(const char *path, const dead_pool *header)
+{
+    char expanded[PATH_MAX];
+    struct stat st;
+    dead_pool existing;
+    dead_pool *pool;
+    int fd, alone, fresh;
+
+    if(expand_path(path, expanded) == -1) {
+        show_msg(MSGERR, "map_pool_file: invalid pool file path %s\n", path);
+        return NULL;
+    }
+    fd = open(expanded, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd == -1) {
+        show_msg(MSGERR, "map_pool_file: can't open %s (%s)\n", expanded, 
+                 strerror(errno));
+        return NULL;
+    }
+    /* Addresses are taken from it as they are, it must be ours only */
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || 
+       st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        show_msg(MSGERR, "map_pool_file: %s must be a file only its owner "
+                 "may write\n", expanded);
+        close(fd);
+        return NULL;
+    }
+    alone = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+    if(!alone && flock(fd, LOCK_SH) == -1) {
+        show_msg(MSGERR, "map_pool_file: can't lock %s (%s)\n", expanded, 
+                 strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    fresh = fstat(fd, &st) == -1 || 
+            (size_t) st.st_size != header->map_size ||
+            pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+            !same_setup(&existing, header);
+    if(fresh && !alone) {
+        show_msg(MSGERR, "map_pool_file: %s is used with another "
+                 "configuration\n", expanded);
+        close(fd);
+        return NULL;
+    }
+    if(fresh) {
+        show_msg(MSGNOTICE, "map_pool_file: setting %s up\n", expanded);
+        if(ftruncate(fd, 0) == -1 || 
+           ftruncate(fd, (off_t) header->map_size) == -1) {
+            show_msg(MSGERR, "map_pool_file: can't size %s (%s)\n", 
+                     expanded, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    }
+
+    pool = (dead_pool *) mmap(0, header->map_size, PROT_READ | PROT_WRITE, 
+                              MAP_SHARED | POOL_MAP_NORESERVE, fd, 0);
+    if(pool == MAP_FAILED) {
+        show_msg(MSGERR, "map_pool_file: unable to mmap %s (%s)\n", 
+                 expanded, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if(fresh) {
+        format_pool(pool, header);
+    } else if(alone) {
+        pool->lock = 0;
+        memset(ENTRY_PINS(pool), 0, pool->n_entries * sizeof(uint32_t));
+        if(pool->seq & 1) {
+            pool_reset(pool);
+            pool->seq++;
+        }
+    }
+    if(alone) {
+        flock(fd, LOCK_SH);
+    }
+    /* fd stays open, holding the lock, and is closed by exec() */
+    return pool;
+}
+
+dead_pool * init_pool(int pool_size, struct in_addr deadrange_base, struct in_addr deadrange_mask, char *sockshost, uint16_t socksport, int ttl, int negative_ttl, int remote_resolve, const unsigned char *address_key, const char *path)
 {
     int i, deadrange_bits, deadrange_width, deadrange_size;
     struct in_addr socks_server;
+    dead_pool header;
     dead_pool *newpool = NULL;
+    unsigned int buckets;
+    size_t arena_size;
+    size_t ips_off, names_off, expiry_off, pins_off, refs_off, ctrl_off;
+    size_t slots_off, dead_off, arena_off, map_size;
 
     /* Count bits in netmask and determine deadrange width. */
     deadrange_bits = count_netmask_bits(deadrange_mask.s_addr);
@@ -38,6 +580,10 @@ dead_pool * init_pool(int pool_size, struct in_addr deadrange_base, struct in_ad
         show_msg(MSGERR, "init_pool: invalid netmask for deadrange\n");
         return NULL;
     } 
+    if(deadrange_bits < 8) {
+        show_msg(MSGERR, "init_pool: deadrange can't be larger than a /8\n");
+        return NULL;
+    }
     deadrange_width = 32 - deadrange_bits;
 
     show_msg(MSGDEBUG, "deadrange width is %d bits\n", deadrange_width);
@@ -61,48 +607,86 @@ dead_pool * init_pool(int pool_size, struct in_addr deadrange_base, struct in_ad
         return NULL;
     }
 
-    /* Allocate space for the dead_pool structure */
-    newpool = (dead_pool *) mmap(0, sizeof(dead_pool), 
-                   PROT_READ | PROT_WRITE, 
-                   MAP_SHARED | MAP_ANONYMOUS, -1, 0); 
-    if(!newpool) {
-        show_msg(MSGERR, "init_pool: unable to mmap deadpool "
-                 "(tried to map %d bytes)\n", sizeof(dead_pool));
-        return NULL;
-    }
+    /* The pool, its entries and their indexes share one mapping, so */
+    /* that forked children keep seeing them. It is reserved for the  */
+    /* worst case (every name in every chunk size) but pages are only */
+    /* backed once touched, zero meaning free throughout              */
+    buckets = index_buckets(pool_size);
+    ips_off = align_size(sizeof(dead_pool));
+    names_off = ips_off + align_size(pool_size * sizeof(uint32_t));
+    expiry_off = names_off + align_size(pool_size * sizeof(uint32_t));
+    pins_off = expiry_off + align_size(pool_size * sizeof(uint32_t));
+    refs_off = pins_off + align_size(pool_size * sizeof(uint32_t));
+    ctrl_off = refs_off + align_size(pool_size);
+    slots_off = ctrl_off + 2 * align_size(buckets + POOL_GROUP_SIZE);
+    dead_off = slots_off + 2 * align_size(buckets * sizeof(int32_t));
+    arena_off = dead_off + align_size(deadrange_size * sizeof(uint32_t));
+    arena_size = (size_t) pool_size * 
+                 (POOL_NAME_MIN << POOL_NAME_CLASSES);
+    map_size = arena_off + arena_size;
 
     /* Initialize the dead_pool structure */
+    memset(&header, 0, sizeof(header));
+    header.magic = POOL_MAGIC;
+    header.version = POOL_VERSION;
+    header.header_size = sizeof(dead_pool);
+    header.persistent = (path != NULL);
+    header.map_size = map_size;
 #ifdef HAVE_INET_ATON
     inet_aton(sockshost, &socks_server);
 #elif defined(HAVE_INET_ADDR)
     socks_server.s_addr = inet_addr(sockshost);
 #endif
-    newpool->sockshost = ntohl(socks_server.s_addr);
-    newpool->socksport = socksport;
-    newpool->deadrange_base = ntohl(deadrange_base.s_addr);
-    newpool->deadrange_mask = ntohl(deadrange_mask.s_addr);
-    newpool->deadrange_size = deadrange_size;
-    newpool->write_pos = 0;
-    newpool->dead_pos = 0;
-    newpool->n_entries = pool_size;
-
-    /* Allocate space for the entries */
-    newpool->entries = (pool_ent *) mmap(0, newpool->n_entries * sizeof(pool_ent), 
-                            PROT_READ | PROT_WRITE, 
-                            MAP_SHARED | MAP_ANONYMOUS, -1, 0); 
-    if(!newpool->entries) {
-        munmap((void *)newpool, sizeof(dead_pool));
-        show_msg(MSGERR, "init_pool: unable to mmap deadpool entries "
-                 "(tried to map %d bytes)\n", 
-                 newpool->n_entries * sizeof(pool_ent)); 
-        return NULL;
+    header.sockshost = ntohl(socks_server.s_addr);
+    header.socksport = socksport;
+    header.ttl = (uint32_t) ttl;
+    header.negative_ttl = (uint32_t) negative_ttl;
+    header.remote_resolve = (uint32_t) remote_resolve;
+    header.deterministic = (address_key != NULL);
+    if(address_key) {
+        for(i = 0; i < 16; i++) {
+            header.address_key[i / 8] |= 
+                (uint64_t) address_key[i] << (8 * (i % 8));
+        }
+    }
+    header.deadrange_base = ntohl(deadrange_base.s_addr);
+    header.deadrange_mask = ntohl(deadrange_mask.s_addr);
+    header.deadrange_size = deadrange_size;
+    header.n_entries = pool_size;
+
+    header.ips_off = ips_off;
+    header.names_off = names_off;
+    header.expiry_off = expiry_off;
+    header.pins_off = pins_off;
+    header.refs_off = refs_off;
+    header.name_index.ctrl_off = ctrl_off;
+    header.ip_index.ctrl_off = ctrl_off + align_size(buckets + POOL_GROUP_SIZE);
+    header.name_index.slots_off = slots_off;
+    header.ip_index.slots_off = slots_off + buckets * sizeof(int32_t);
+    header.name_index.max_mask = header.ip_index.max_mask = buckets - 1;
+    header.dead_off = dead_off;
+    header.arena_off = arena_off;
+    header.arena_size = (uint32_t) arena_size;
+
+    if(path) {
+        newpool = map_pool_file(path, &header);
+        if(newpool) {
+            return newpool;
+        }
+        show_msg(MSGWARN, "init_pool: not using pool file %s, names will "
+                 "only be kept while this process runs\n", path);
+        header.persistent = 0;
     }
 
-    /* Initialize the entries */
-    for(i=0; i < newpool->n_entries; i++) {
-        newpool->entries[i].ip = -1;
-        newpool->entries[i].name[0] = '\0';
+    newpool = (dead_pool *) mmap(0, map_size, 
+                   PROT_READ | PROT_WRITE, 
+                   MAP_SHARED | MAP_ANONYMOUS | POOL_MAP_NORESERVE, -1, 0); 
+    if(newpool == MAP_FAILED) {
+        show_msg(MSGERR, "init_pool: unable to mmap deadpool "
+                 "(tried to map %lu bytes)\n", (unsigned long) map_size);
+        return NULL;
     }
+    format_pool(newpool, &header);
 
     return newpool;
 }
@@ -116,332 +700,1051 @@ int is_dead_address(dead_pool *pool, uint32_t addr)
     return (pool->deadrange_base == (haddr & pool->deadrange_mask));
 }
 
+/* Whether the process holding the lock is gone, without its unlock */
+static int owner_gone(uint32_t owner)
+{
+    int saved_errno = errno;
+    int gone = owner && (kill((pid_t) owner, 0) == -1) && (errno == ESRCH);
+
+    errno = saved_errno;
+    return gone;
+}
+
+/* Only with the pool lock held */
+static void write_begin(dead_pool *pool)
+{
+    __atomic_store_n(&(pool->seq), pool->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(dead_pool *pool)
+{
+    __atomic_store_n(&(pool->seq), pool->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Stores are short and never wait on the network with the lock held. */
+/* A process killed with it is noticed, its lock taken over and the   */
+/* pool cleared if it was changing it                                 */
+static void pool_lock(dead_pool *pool)
+{
+    uint32_t owner = (uint32_t) getpid();
+    uint32_t expected;
+    unsigned int spins = 0;
+
+    for(;;) {
+        expected = 0;
+        if(__atomic_compare_exchange_n(&(pool->lock), &expected, owner, 0, 
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if((++spins % POOL_LOCK_SPINS) == 0 && owner_gone(expected) &&
+           __atomic_compare_exchange_n(&(pool->lock), &expected, owner, 0, 
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            show_msg(MSGWARN, "pool_lock: process %u died holding the "
+                     "pool lock, taking it over\n", expected);
+            if(pool->seq & 1) {
+                pool_reset(pool);
+                write_end(pool);
+            }
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static void pool_unlock(dead_pool *pool)
+{
+    __atomic_store_n(&(pool->lock), 0, __ATOMIC_RELEASE);
+}
+
+static uint32_t read_begin(dead_pool *pool)
+{
+    uint32_t seq;
+    unsigned int spins = 0;
+
+    while((seq = __atomic_load_n(&(pool->seq), __ATOMIC_ACQUIRE)) & 1) {
+        /* The writer may have died, pool_lock() then takes over */
+        if((++spins % POOL_LOCK_SPINS) == 0 && 
+           owner_gone(__atomic_load_n(&(pool->lock), __ATOMIC_RELAXED))) {
+            pool_lock(pool);
+            pool_unlock(pool);
+        }
+        sched_yield();
+    }
+    return seq;
+}
+
+/* Whether what was read since read_begin() may be torn */
+static int read_again(dead_pool *pool, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&(pool->seq), __ATOMIC_RELAXED) != seq);
+}
+
+/* Seconds on a clock which every process of the machine shares, */
+/* the wall clock for a pool file, which outlives reboots         */
+static uint32_t pool_now(dead_pool *pool)
+{
+    struct timespec now;
+
+    clock_gettime(pool->persistent ? CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+    return (uint32_t) now.tv_sec;
+}
+
+static int is_stale(uint32_t expiry, uint32_t now)
+{
+    return expiry && ((int32_t) (now - expiry) >= 0);
+}
+
+static void pool_count(unsigned long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Give the entry a second chance when the clock hand comes round. The */
+/* byte is only written when clear, not to bounce the line about       */
+static void entry_used(dead_pool *pool, int32_t slot)
+{
+    if(!__atomic_load_n(&(ENTRY_REFS(pool)[slot]), __ATOMIC_RELAXED)) {
+        __atomic_store_n(&(ENTRY_REFS(pool)[slot]), 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Only with the pool lock held. Addresses still held by an entry are */
+/* skipped, there is always a free one since the pool is no larger    */
+/* than the deadrange and the entry being replaced was released first */
 void get_next_dead_address(dead_pool *pool, uint32_t *result)
 {
-    *result = htonl(pool->deadrange_base + pool->dead_pos++);
-    if(pool->dead_pos >= pool->deadrange_size) {
-        pool->dead_pos = 0;
+    uint32_t offset;
+
+    do {
+        offset = pool->dead_pos++;
+        if(pool->dead_pos >= pool->deadrange_size) {
+            pool->dead_pos = 0;
+        }
+    } while(DEAD_SLOTS(pool)[offset]);
+    *result = htonl(pool->deadrange_base + offset);
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+} while(0)
+
+/* SipHash-2-4 of the len bytes at data, with the pool's address key */
+static uint64_t keyed_hash(dead_pool *pool, const char *data, size_t len)
+{
+    const unsigned char *in = (const unsigned char *) data;
+    uint64_t v0 = pool->address_key[0] ^ 0x736F6D6570736575ULL;
+    uint64_t v1 = pool->address_key[1] ^ 0x646F72616E646F6DULL;
+    uint64_t v2 = pool->address_key[0] ^ 0x6C7967656E657261ULL;
+    uint64_t v3 = pool->address_key[1] ^ 0x7465646279746573ULL;
+    uint64_t m, last = (uint64_t) len << 56;
+    size_t i, tail = len & 7;
+
+    for(; len >= 8; len -= 8, in += 8) {
+        for(i = 0, m = 0; i < 8; i++) {
+            m |= (uint64_t) in[i] << (8 * i);
+        }
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for(i = 0; i < tail; i++) {
+        last |= (uint64_t) in[i] << (8 * i);
+    }
+    v3 ^= last;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xFF;
+    for(i = 0; i < 4; i++) {
+        SIP_ROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Only with the pool lock held. The dead address of name in the       */
+/* deterministic mode: its offset in the deadrange is taken from a      */
+/* keyed hash of the name, and if that one is held by another name the  */
+/* next ones are tried with a stride also taken from the hash, odd so   */
+/* that it visits the whole power of two sized deadrange. Processes     */
+/* with the same key and range then agree on the address of a name      */
+/* without sharing anything, as long as its first choice was free       */
+static void get_hashed_dead_address(dead_pool *pool, const char *name, 
+                                    uint32_t *result)
+{
+    uint64_t hash = keyed_hash(pool, name, strlen(name));
+    uint32_t mask = pool->deadrange_size - 1;
+    uint32_t offset = (uint32_t) hash & mask;
+    uint32_t step = ((uint32_t) (hash >> 32) & mask) | 1;
+
+    while(DEAD_SLOTS(pool)[offset]) {
+        offset = (offset + step) & mask;
     }
+    *result = htonl(pool->deadrange_base + offset);
 }
 
-int store_pool_entry(dead_pool *pool, char *hostname, struct in_addr *addr)
+/* The name as the deterministic mode stores and hashes it: lowercase, */
+/* without a trailing dot, so that every spelling gets one address      */
+static const char *normalize_name(dead_pool *pool, const char *name, 
+                                  char buf[POOL_NAME_MAX])
 {
-  int position = pool->write_pos;
-  int oldpos;
+    size_t i, len;
+
+    if(!pool->deterministic) {
+        return name;
+    }
+    len = strlen(name);
+    if(len >= POOL_NAME_MAX) {
+        return name;
+    }
+    if(len > 1 && name[len - 1] == '.') {
+        len--;
+    }
+    for(i = 0; i < len; i++) {
+        buf[i] = (char) tolower((unsigned char) name[i]);
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/* Only with the pool lock held. The entry to replace: free or stale */
+/* ones first, then those not looked up since the clock hand last    */
+/* passed. Entries pinned by a connection are never taken, -1 when   */
+/* they all are                                                      */
+static int32_t next_victim(dead_pool *pool, uint32_t now)
+{
+    unsigned int turns;
+    int32_t slot;
+
+    for(turns = 0; turns < 2 * (unsigned int) pool->n_entries; turns++) {
+        slot = (int32_t) pool->write_pos++;
+        if(pool->write_pos >= (unsigned int) pool->n_entries) {
+            pool->write_pos = 0;
+        }
+        if(ENTRY_NAMES(pool)[slot] == 0 || 
+           is_stale(ENTRY_EXPIRY(pool)[slot], now)) {
+            return slot;
+        }
+        if(ENTRY_PINS(pool)[slot]) {
+            continue;
+        }
+        if(ENTRY_REFS(pool)[slot]) {
+            ENTRY_REFS(pool)[slot] = 0;
+            continue;
+        }
+        pool_count(&(pool->evictions));
+        return slot;
+    }
+    return -1;
+}
+
+static unsigned int negative_bucket(uint64_t hash)
+{
+    return (unsigned int) (hash >> 7) & (POOL_NEGATIVE_SIZE - 1);
+}
+
+/* Whether resolving name failed less than negative_ttl seconds ago */
+static int negative_lookup(dead_pool *pool, uint64_t hash, uint32_t now)
+{
+    unsigned int bucket = negative_bucket(hash);
+    uint32_t seq;
+    int found;
+
+    if(pool->negative_ttl == 0) {
+        return 0;
+    }
+    do {
+        seq = read_begin(pool);
+        found = (pool->negative_hashes[bucket] == hash) && 
+                !is_stale(pool->negative_expiry[bucket], now);
+    } while(read_again(pool, seq));
+
+    return found;
+}
+
+static void negative_store(dead_pool *pool, uint64_t hash, uint32_t now)
+{
+    unsigned int bucket = negative_bucket(hash);
+
+    if(pool->negative_ttl == 0) {
+        return;
+    }
+    pool_lock(pool);
+    write_begin(pool);
+    pool->negative_hashes[bucket] = hash;
+    pool->negative_expiry[bucket] = now + pool->negative_ttl;
+    write_end(pool);
+    pool_unlock(pool);
+}
+
+/* The entry for name, stale or not, with its address and expiry */
+static int32_t find_name(dead_pool *pool, const char *name, uint64_t hash, 
+                         uint32_t *ip, uint32_t *expiry)
+{
+  uint32_t seq;
+  int32_t slot;
+
+  do {
+      seq = read_begin(pool);
+      slot = -1;
+      if(index_find(pool, &(pool->name_index), hash, match_name, name, &slot) != -1) {
+          *ip = ENTRY_IPS(pool)[slot];
+          *expiry = ENTRY_EXPIRY(pool)[slot];
+      }
+  } while(read_again(pool, seq));
+
+  return slot;
+}
+
+/* Whether name is an address written out rather than a host name */
+static int is_address(const char *name)
+{
+#ifdef HAVE_INET_ATON
+    struct in_addr addr;
+
+    return (inet_aton(name, &addr) != 0);
+#elif defined(HAVE_INET_ADDR)
+    return (inet_addr(name) != (in_addr_t) -1);
+#endif
+}
+
+int store_pool_entry(dead_pool *pool, char *name, struct in_addr *addr)
+{
+  char normal[POOL_NAME_MAX];
+  const char *hostname = normalize_name(pool, name, normal);
+  int32_t position;
+  int32_t oldpos;
   int rc;
+  int fake;
   uint32_t intaddr;
+  uint32_t oldaddr;
+  uint32_t expiry;
+  uint32_t now = pool_now(pool);
+  uint64_t hash;
+  char addrbuf[INET_ADDRSTRLEN];
 
   show_msg(MSGDEBUG, "store_pool_entry: storing '%s'\n", hostname);
-  show_msg(MSGDEBUG, "store_pool_entry: write pos is: %d\n", pool->write_pos);
+  if(strlen(hostname) >= POOL_NAME_MAX) {
+      show_msg(MSGWARN, "store_pool_entry: name too long: %s\n", hostname);
+      return -1;
+  }
+  hash = hash_name(hostname);
 
   /* Check to see if name already exists in pool */
-  oldpos = search_pool_for_name(pool, hostname);
-  if(oldpos != -1){
+  oldpos = find_name(pool, hostname, hash, &oldaddr, &expiry);
+  if(oldpos != -1 && !is_stale(expiry, now)){
       show_msg(MSGDEBUG, "store_pool_entry: not storing (entry exists)\n");
-      addr->s_addr = pool->entries[oldpos].ip;
+      entry_used(pool, oldpos);
+      pool_count(&(pool->hits));
+      addr->s_addr = oldaddr;
       return oldpos;
   }
 
   /* If this is a .onion host, then we return a bogus ip from our deadpool, 
-     otherwise we try to resolve it and store the 'real' IP */
-  if(strcasecmpend(hostname, ".onion") == 0) {
-      get_next_dead_address(pool, &pool->entries[position].ip);
-  } else {
-      rc = do_resolve(hostname, pool->sockshost, pool->socksport, &intaddr);
+     otherwise we try to resolve it and store the 'real' IP. With remote 
+     resolution every name but addresses written out gets a bogus ip, the
+     name is then sent to the socks server with the connect request */
+  fake = (strcasecmpend(hostname, ".onion") == 0) || 
+          (pool->remote_resolve && !is_address(hostname));
+  if(!fake) {
+      if(negative_lookup(pool, hash, now)) {
+          show_msg(MSGDEBUG, "store_pool_entry: '%s' failed to resolve "
+                   "recently, not trying again yet\n", hostname);
+          pool_count(&(pool->negative_hits));
+          return -1;
+      }
+      pool_count(&(pool->misses));
+      rc = resolve_remote(hostname, pool->sockshost, pool->socksport, &intaddr);
       if(rc != 0) {
           show_msg(MSGWARN, "failed to resolve: %s\n", hostname);
+          negative_store(pool, hash, now);
           return -1;
       } 
       if(is_dead_address(pool, intaddr)) {
-          show_msg(MSGERR, "resolved %s -> %d (deadpool address) IGNORED\n");
+          show_msg(MSGERR, "resolved %s -> %s (deadpool address) IGNORED\n",
+                   hostname, inet_ntop(AF_INET, &intaddr, addrbuf, sizeof(addrbuf)));
           return -1;
       }
-      pool->entries[position].ip = intaddr;
+  } else {
+      pool_count(&(pool->misses));
   }
 
-  strncpy(pool->entries[position].name, hostname, 255);
-  pool->entries[position].name[255] = '\0';
-  pool->write_pos++;
-  if(pool->write_pos >= pool->n_entries) {
-      pool->write_pos = 0;
+  pool_lock(pool);
+
+  /* Another thread or process may have stored it meanwhile, the slot */
+  /* and dead address are only taken once we know it has to be. A     */
+  /* stale entry for the name is replaced in place                    */
+  oldpos = find_name(pool, hostname, hash, &oldaddr, &expiry);
+  if(oldpos != -1 && !is_stale(expiry, now)){
+      pool_unlock(pool);
+      addr->s_addr = oldaddr;
+      return oldpos;
+  }
+  if(oldpos != -1) {
+      position = oldpos;
+      pool_count(&(pool->expirations));
+  } else if((position = next_victim(pool, now)) == -1) {
+      pool_unlock(pool);
+      show_msg(MSGWARN, "store_pool_entry: every entry is in use by a "
+               "connection, not storing '%s'\n", hostname);
+      return -1;
   }
-  addr->s_addr = pool->entries[position].ip;
+  show_msg(MSGDEBUG, "store_pool_entry: write pos is: %d\n", position);
+
+  write_begin(pool);
+  release_entry(pool, position);
+  if(fake && pool->deterministic) {
+      get_hashed_dead_address(pool, hostname, &intaddr);
+  } else if(fake) {
+      get_next_dead_address(pool, &intaddr);
+  }
+  store_entry(pool, position, hostname, intaddr, 
+              (fake || pool->ttl == 0) ? 0 : now + pool->ttl);
+  write_end(pool);
+
+  pool_unlock(pool);
+  addr->s_addr = intaddr;
 
   show_msg(MSGDEBUG, "store_pool_entry: stored entry in slot '%d'\n", position);
 
   return position;
 }
 
-int search_pool_for_name(dead_pool *pool, const char *name)
+int search_pool_for_name(dead_pool *pool, const char *name, uint32_t *ip)
 {
-  int i;
-  for(i=0; i < pool->n_entries; i++){
-    if(strcmp(name, pool->entries[i].name) == 0){
-      return i;
-    }
+  char normal[POOL_NAME_MAX];
+  uint32_t expiry;
+  int32_t slot;
+
+  name = normalize_name(pool, name, normal);
+  slot = find_name(pool, name, hash_name(name), ip, &expiry);
+
+  if(slot == -1 || is_stale(expiry, pool_now(pool))) {
+      return -1;
   }
-  return -1;
+  entry_used(pool, slot);
+
+  return slot;
 }
 
-char * get_pool_entry(dead_pool *pool, struct in_addr *addr)
+char * get_pool_entry(dead_pool *pool, struct in_addr *addr, char name[POOL_NAME_MAX])
 {
-  int i;
   uint32_t intaddr = addr->s_addr;
+  uint32_t seq;
+  int32_t slot;
+  char *found;
+  char addrbuf[INET_ADDRSTRLEN];
+  int i;
 
   if(pool == NULL) {
       return NULL;
   }
 
-  show_msg(MSGDEBUG, "get_pool_entry: searching for: %s\n", inet_ntoa(*addr));
-  for(i=0; i<pool->n_entries; i++) {
-    if(intaddr == pool->entries[i].ip) {
-        show_msg(MSGDEBUG, "get_pool_entry: found: %s\n", pool->entries[i].name);
-        return pool->entries[i].name;
-    }
+  if (MSG_ENABLED(MSGDEBUG))
+      show_msg(MSGDEBUG, "get_pool_entry: searching for: %s\n", 
+               inet_ntop(AF_INET, addr, addrbuf, sizeof(addrbuf)));
+  do {
+      seq = read_begin(pool);
+      slot = -1;
+      found = NULL;
+      if(is_dead_address(pool, intaddr)) {
+          slot = (int32_t) DEAD_SLOTS(pool)[ntohl(intaddr) - pool->deadrange_base] - 1;
+          if(slot >= pool->n_entries) {
+              slot = -1;
+          }
+      } else {
+          index_find(pool, &(pool->ip_index), hash_ip(intaddr), match_ip, &intaddr, &slot);
+      }
+      /* The name is copied, its chunk may be reused once we are done */
+      if(slot != -1 && ENTRY_IPS(pool)[slot] == intaddr && 
+         (found = entry_name(pool, slot)) != NULL) {
+          for(i = 0; i < POOL_NAME_MAX - 1 && found[i]; i++) {
+              name[i] = found[i];
+          }
+          name[i] = '\0';
+      }
+  } while(read_again(pool, seq));
+
+  if(found) {
+      entry_used(pool, slot);
+      show_msg(MSGDEBUG, "get_pool_entry: found: %s\n", name);
+      return name;
   }
   show_msg(MSGDEBUG, "get_pool_entry: address not found\n");
 
   return NULL;
 }
 
-static int build_socks4a_resolve_request(char **out, const char *username, const char *hostname)
+/* Keep the entry of a dead address from being replaced while a  */
+/* connection goes through it. Returns what to give to            */
+/* unpin_pool_entry() once it is closed, 0 if there is no entry   */
+int pin_pool_entry(dead_pool *pool, struct in_addr *addr)
 {
-  size_t len;
-  uint16_t port = htons(0);  /* port: 0. */
-  uint32_t addr = htonl(0x00000001u); /* addr: 0.0.0.1 */
+  int32_t slot;
 
-  len = 8 + strlen(username) + 1 + strlen(hostname) + 1;
-  *out = malloc(len);
-  (*out)[0] = 4;      /* SOCKS version 4 */
-  (*out)[1] = '\xF0'; /* Command: resolve. */
+  if(pool == NULL || !is_dead_address(pool, addr->s_addr)) {
+      return 0;
+  }
 
-  memcpy((*out)+2, &port, sizeof(port));
-  memcpy((*out)+4, &addr, sizeof(addr));
-  strcpy((*out)+8, username);
-  strcpy((*out)+8+strlen(username)+1, hostname);
+  pool_lock(pool);
+  slot = (int32_t) DEAD_SLOTS(pool)[ntohl(addr->s_addr) - pool->deadrange_base] - 1;
+  if(slot != -1) {
+      ENTRY_PINS(pool)[slot]++;
+  }
+  pool_unlock(pool);
 
-  return (int)len;
+  return slot + 1;
 }
 
-#define RESPONSE_LEN 8
-
-static int parse_socks4a_resolve_response(const char *response, size_t len, uint32_t *addr_out)
+void unpin_pool_entry(dead_pool *pool, int pin)
 {
-  uint8_t status;
-  uint16_t port;
+  if(pool == NULL || pin == 0) {
+      return;
+  }
 
-  if (len < RESPONSE_LEN) {
-    show_msg(MSGWARN,"Truncated socks response.\n"); 
-    return -1;
+  pool_lock(pool);
+  /* A forked child closes the connections it was handed down too */
+  if(ENTRY_PINS(pool)[pin - 1]) {
+      ENTRY_PINS(pool)[pin - 1]--;
   }
-  if (((uint8_t)response[0])!=0) { /* version: 0 */
-    show_msg(MSGWARN,"Nonzero version in socks response: bad format.\n");
-    return -1;
+  pool_unlock(pool);
+}
+
+void get_pool_stats(dead_pool *pool, unsigned long *hits, unsigned long *misses,
+                    unsigned long *evictions, unsigned long *expirations,
+                    unsigned long *negative_hits)
+{
+  *hits = __atomic_load_n(&(pool->hits), __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&(pool->misses), __ATOMIC_RELAXED);
+  *evictions = __atomic_load_n(&(pool->evictions), __ATOMIC_RELAXED);
+  *expirations = __atomic_load_n(&(pool->expirations), __ATOMIC_RELAXED);
+  *negative_hits = __atomic_load_n(&(pool->negative_hits), __ATOMIC_RELAXED);
+}
+
+/* Room for a hostent's lists, address and name */
+#define POOL_HOSTENT_BUF  (3 * sizeof(char *) + 16 + POOL_NAME_MAX)
+
+/* Lay the lists, address (4 or 16 bytes, by af) and name of a hostent */
+/* out in buf. ERANGE if buf is too short                              */
+static int fill_hostent(struct hostent *he, const char *name, int af, 
+                        const void *addr, char *buf, size_t buflen)
+{
+    size_t len = strlen(name) + 1;
+    size_t addrlen = (af == AF_INET6) ? 16 : 4;
+    size_t align = (sizeof(char *) - ((uintptr_t) buf % sizeof(char *))) % 
+                   sizeof(char *);
+    char **lists;
+    char *data;
+
+    if(buflen < align + 3 * sizeof(char *) + addrlen + len) {
+        return ERANGE;
+    }
+    lists = (char **) (buf + align);
+    data = (char *) (lists + 3);
+    memcpy(data, addr, addrlen);
+    memcpy(data + addrlen, name, len);
+
+    lists[0] = NULL;            /* No aliases */
+    lists[1] = data;
+    lists[2] = NULL;
+    he->h_name = data + addrlen;
+    he->h_aliases = &lists[0];
+    he->h_addrtype = af;
+    he->h_length = (int) addrlen;
+    he->h_addr_list = &lists[1];
+
+    return 0;
+}
+
+/* Reentrant, as glibc's gethostbyname2_r(): 0 with *result NULL and */
+/* *h_errnop set when there is no address, an error number otherwise */
+int our_gethostbyname2_r(dead_pool *pool, const char *name, int af, 
+                         struct hostent *ret, char *buf, size_t buflen, 
+                         struct hostent **result, int *h_errnop)
+{
+  struct in_addr addr;
+  char addrbuf[INET_ADDRSTRLEN];
+  int rc;
+
+  show_msg(MSGDEBUG, "our_gethostbyname2_r: '%s' requested\n", name);
+  *result = NULL;
+
+  /* The pool only has IPv4 addresses. Not asking the system keeps */
+  /* the name from leaking                                          */
+  if(af == AF_INET6) {
+      *h_errnop = NO_DATA;
+      return 0;
+  } else if(af != AF_INET) {
+      *h_errnop = NO_DATA;
+      errno = EAFNOSUPPORT;
+      return EAFNOSUPPORT;
   }
-  status = (uint8_t)response[1];
 
-  memcpy(&port, response+2, sizeof(port));
-  if (port!=0) { /* port: 0 */
-    show_msg(MSGWARN,"Nonzero port in socks response: bad format.\n"); 
-    return -1;
+  if(store_pool_entry(pool, (char *) name, &addr) == -1) {
+      *h_errnop = HOST_NOT_FOUND;
+      return 0;
   }
-  if (status != 90) {
-    show_msg(MSGWARN,"Bad status: socks request failed.\n"); 
-    return -1;
+  if((rc = fill_hostent(ret, name, AF_INET, &addr, buf, buflen))) {
+      *h_errnop = NETDB_INTERNAL;
+      errno = rc;
+      return rc;
   }
+  *result = ret;
 
-  memcpy(addr_out, response+4, sizeof(*addr_out));
+  if (MSG_ENABLED(MSGDEBUG))
+      show_msg(MSGDEBUG, "our_gethostbyname2_r: resolved '%s' to: '%s'\n", 
+               name, inet_ntop(AF_INET, &addr, addrbuf, sizeof(addrbuf)));
 
   return 0;
 }
 
-static int do_resolve(const char *hostname, uint32_t sockshost, uint16_t socksport, uint32_t *result_addr)
+int our_gethostbyname_r(dead_pool *pool, const char *name, 
+                        struct hostent *ret, char *buf, size_t buflen, 
+                        struct hostent **result, int *h_errnop)
 {
-  int s;
-  struct sockaddr_in socksaddr;
-  char *req, *cp;
-  int r, len;
-  char response_buf[RESPONSE_LEN];
-
-  show_msg(MSGDEBUG, "do_resolve: resolving %s\n", hostname);
+  return our_gethostbyname2_r(pool, name, AF_INET, ret, buf, buflen, 
+                              result, h_errnop);
+}
 
-  s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (s<0) {
-    show_msg(MSGWARN, "do_resolve: problem creating socket\n"); 
-    return -1;
+/* Each thread gets a result of its own */
+struct hostent * our_gethostbyname2(dead_pool *pool, const char *name, int af)
+{
+  static __thread struct hostent he;
+  static __thread char *buf[(POOL_HOSTENT_BUF + sizeof(char *) - 1) / sizeof(char *)];
+  struct hostent *result;
+  int error;
+
+  our_gethostbyname2_r(pool, name, af, &he, (char *) buf, sizeof(buf), 
+                       &result, &error);
+  if(result == NULL) {
+      h_errno = error;
   }
 
-  memset(&socksaddr, 0, sizeof(socksaddr));
-  socksaddr.sin_family = AF_INET;
-  socksaddr.sin_port = htons(socksport);
-  socksaddr.sin_addr.s_addr = htonl(sockshost);
-  if (connect(s, (struct sockaddr*)&socksaddr, sizeof(socksaddr))) {
-    show_msg(MSGWARN, "do_resolve: error connecting to SOCKS server\n");
-    return -1;
-  }
+  return result;
+}
 
-  if ((len = build_socks4a_resolve_request(&req, "", hostname))<0) {
-    show_msg(MSGWARN, "do_resolve: error generating SOCKS request\n"); 
-    return -1;
-  }
+struct hostent * our_gethostbyname(dead_pool *pool, const char *name)
+{
+  return our_gethostbyname2(pool, name, AF_INET);
+}
 
-  cp = req;
-  while (len) {
-    r = (int)send(s, cp, len, 0);
-    if (r<0) {
-      show_msg(MSGWARN, "do_resolve: error sending SOCKS request\n"); 
-      free(req);
-      return -1;
+/* The IPv4 address in addr (len bytes of family af), IPv4 mapped in */
+/* IPv6 included. 0 if it has none                                   */
+static int host_ipv4(int af, const void *addr, socklen_t len, struct in_addr *ipv4)
+{
+    const struct in6_addr *in6 = addr;
+
+    if(af == AF_INET && len >= 4) {
+        memcpy(&(ipv4->s_addr), addr, 4);
+        return 1;
     }
-    len -= r;
-    cp += r;
-  }
-  free(req);
+    if(af == AF_INET6 && len >= 16 && IN6_IS_ADDR_V4MAPPED(in6)) {
+        memcpy(&(ipv4->s_addr), &(in6->s6_addr[12]), 4);
+        return 1;
+    }
+    return 0;
+}
 
-  len = 0;
-  while (len < RESPONSE_LEN) {
-    r = (int)recv(s, response_buf+len, RESPONSE_LEN-len, 0);
-    if (r==0) {
-      show_msg(MSGWARN, "do_resolve: EOF while reading SOCKS response\n"); 
-      return -1;
+/* The IPv4 address of sa, IPv4 mapped in IPv6 included. 0 if it has none */
+static int sockaddr_ipv4(const struct sockaddr *sa, socklen_t salen, 
+                         struct in_addr *addr)
+{
+    if(sa->sa_family == AF_INET && salen >= sizeof(struct sockaddr_in)) {
+        return host_ipv4(AF_INET, &(((const struct sockaddr_in *) sa)->sin_addr), 
+                         4, addr);
     }
-    if (r<0) {
-      show_msg(MSGWARN, "do_resolve: error reading SOCKS response\n"); 
-      return -1;
+    if(sa->sa_family == AF_INET6 && salen >= sizeof(struct sockaddr_in6)) {
+        return host_ipv4(AF_INET6, &(((const struct sockaddr_in6 *) sa)->sin6_addr), 
+                         16, addr);
     }
-    len += r;
-  }
+    return 0;
+}
 
-  close(s);
+/* Reverse lookups: 1 with the name of addr copied from the pool, 0 when */
+/* the system should be asked. Dead addresses the pool doesn't know give */
+/* -1, nobody else could name them and asking would only wait for a     */
+/* PTR query to time out                                                 */
+static int reverse_lookup(dead_pool *pool, struct in_addr *addr, 
+                          char name[POOL_NAME_MAX])
+{
+    if(get_pool_entry(pool, addr, name) != NULL) {
+        return 1;
+    }
+    return is_dead_address(pool, addr->s_addr) ? -1 : 0;
+}
 
-  if (parse_socks4a_resolve_response(response_buf, RESPONSE_LEN, result_addr) < 0){
-    show_msg(MSGWARN, "do_resolve: error parsing SOCKS response\n");
-    return -1;
+/* Answer gethostbyaddr() from the pool, as glibc's gethostbyaddr_r() */
+/* would. -1 when the system should be asked                          */
+static int reverse_hostent(dead_pool *pool, const void *addr, socklen_t len, 
+                           int af, struct hostent *ret, char *buf, 
+                           size_t buflen, struct hostent **result, 
+                           int *h_errnop)
+{
+  char name[POOL_NAME_MAX];
+  struct in_addr ipv4;
+  int rc;
+
+  *result = NULL;
+  if(addr == NULL || !host_ipv4(af, addr, len, &ipv4)) {
+      return -1;
+  }
+  if((rc = reverse_lookup(pool, &ipv4, name)) == 0) {
+      return -1;
+  }
+  if(rc == -1) {
+      show_msg(MSGDEBUG, "our_gethostbyaddr: dead address not in the pool\n");
+      *h_errnop = HOST_NOT_FOUND;
+      return 0;
   }
 
-  show_msg(MSGDEBUG, "do_resolve: success\n");
+  show_msg(MSGDEBUG, "our_gethostbyaddr: answered '%s' from the pool\n", name);
+  if((rc = fill_hostent(ret, name, af, addr, buf, buflen))) {
+      *h_errnop = NETDB_INTERNAL;
+      errno = rc;
+      return rc;
+  }
+  *result = ret;
 
   return 0;
 }
 
-struct hostent * our_gethostbyname(dead_pool *pool, const char *name)
+#if defined(__GLIBC__)
+int our_gethostbyaddr_r(dead_pool *pool, const void *addr, socklen_t len, 
+                        int af, struct hostent *ret, char *buf, size_t buflen, 
+                        struct hostent **result, int *h_errnop)
 {
-  int pos;
-  static struct in_addr addr;
-  static struct hostent he;
-  static char *addrs[2];
+  int rc = reverse_hostent(pool, addr, len, af, ret, buf, buflen, result, 
+                           h_errnop);
 
-  show_msg(MSGDEBUG, "our_gethostbyname: '%s' requested\n", name);
+  if(rc == -1) {
+      return realgethostbyaddr_r(addr, len, af, ret, buf, buflen, result, 
+                                 h_errnop);
+  }
+  return rc;
+}
+#endif
 
-  pos = store_pool_entry(pool,(char *) name, &addr);
-  if(pos == -1) {
-      h_errno = HOST_NOT_FOUND;
-      return NULL;
+/* Each thread gets a result of its own, as with our_gethostbyname2() */
+struct hostent * our_gethostbyaddr(dead_pool *pool, const void *addr, 
+                                   socklen_t len, int af)
+{
+  static __thread struct hostent he;
+  static __thread char *buf[(POOL_HOSTENT_BUF + sizeof(char *) - 1) / sizeof(char *)];
+  struct hostent *result;
+  int error;
+
+  if(reverse_hostent(pool, addr, len, af, &he, (char *) buf, sizeof(buf), 
+                     &result, &error) == -1) {
+      return realgethostbyaddr(addr, len, af);
+  }
+  if(result == NULL) {
+      h_errno = error;
   }
 
-  addrs[0] = (char *)&addr;
-  addrs[1] = NULL;
+  return result;
+}
 
-  he.h_name      = pool->entries[pos].name;
-  he.h_aliases   = NULL;
-  he.h_length    = 4;
-  he.h_addrtype  = AF_INET;
-  he.h_addr_list = addrs;
+/* Addresses with an entry in the pool are given its name, the others */
+/* and the service are left to the system                             */
+int our_getnameinfo(dead_pool *pool, const struct sockaddr *sa, socklen_t salen, 
+                    char *host, socklen_t hostlen, char *serv, 
+                    socklen_t servlen, int flags)
+{
+  char namebuf[POOL_NAME_MAX];
+  struct in_addr addr;
+  size_t len;
+  int found = 0;
+  int rc;
+
+  if(sa && host && hostlen && !(flags & NI_NUMERICHOST) && 
+     sockaddr_ipv4(sa, salen, &addr)) {
+      found = reverse_lookup(pool, &addr, namebuf);
+  }
+  if(found == 0) {
+      return realgetnameinfo(sa, salen, host, hostlen, serv, servlen, flags);
+  }
 
-  show_msg(MSGDEBUG, "our_gethostbyname: resolved '%s' to: '%s'\n", 
-           name, inet_ntoa(*((struct in_addr *)he.h_addr)));
+  if(found == 1) {
+      show_msg(MSGDEBUG, "our_getnameinfo: answered '%s' from the pool\n", 
+               namebuf);
+  } else if(flags & NI_NAMEREQD) {
+      show_msg(MSGDEBUG, "our_getnameinfo: dead address not in the pool\n");
+      return EAI_NONAME;
+  } else {
+      /* Without a name the address is given written out */
+      if(sa->sa_family == AF_INET6) {
+          inet_ntop(AF_INET6, &(((const struct sockaddr_in6 *) sa)->sin6_addr), 
+                    namebuf, sizeof(namebuf));
+      } else {
+          inet_ntop(AF_INET, &addr, namebuf, sizeof(namebuf));
+      }
+  }
+  if((len = strlen(namebuf) + 1) > hostlen) {
+      return EAI_OVERFLOW;
+  }
+  if(serv && servlen && 
+     (rc = realgetnameinfo(sa, salen, NULL, 0, serv, servlen, flags))) {
+      return rc;
+  }
+  memcpy(host, namebuf, len);
 
-  return &he;
+  return 0;
 }
 
-static struct hostent * alloc_hostent(int af)
+/* Results are built in a single allocation, which the caller hands back */
+/* to freeaddrinfo() or freehostent(). Ours are told from the system's   */
+/* by a marker just before the first address: it is inside the block     */
+/* either way, where the system's keep the node or list before it        */
+#define POOL_RESULT_MARK  0x6b636f7374524553ULL  /* Never a valid pointer */
+#define POOL_AI_MAX       3                      /* Stream, datagram, raw */
+
+union pool_sockaddr {
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
+struct pool_addrinfo {
+    struct addrinfo nodes[POOL_AI_MAX];
+    uint64_t mark;
+    union pool_sockaddr addrs[POOL_AI_MAX];
+    char name[];
+};
+
+struct pool_hostent {
+    struct hostent he;
+    char *aliases[1];
+    char *addr_list[2];
+    uint64_t mark;
+    struct in6_addr addr;
+    char name[];
+};
+
+/* The marks must come right before the addresses */
+typedef char pool_addrinfo_layout[(offsetof(struct pool_addrinfo, addrs) == 
+    offsetof(struct pool_addrinfo, mark) + sizeof(uint64_t)) ? 1 : -1];
+typedef char pool_hostent_layout[(offsetof(struct pool_hostent, addr) == 
+    offsetof(struct pool_hostent, mark) + sizeof(uint64_t)) ? 1 : -1];
+
+static int is_ours(const void *first_addr)
 {
-    struct hostent *he = NULL;
-    char **addr_list = NULL;
-    void *addr = NULL;
-    char **aliases = NULL;
+    uint64_t mark;
+
+    if(first_addr == NULL) {
+        return 0;
+    }
+    memcpy(&mark, (const char *) first_addr - sizeof(mark), sizeof(mark));
+    return (mark == POOL_RESULT_MARK);
+}
+
+/* A hostent for name and addr (4 or 16 bytes, by af), NULL if out of memory */
+static struct hostent * alloc_hostent(int af, const char *name, const void *addr)
+{
+    size_t len = strlen(name) + 1;
+    struct pool_hostent *result;
 
     if(af != AF_INET && af != AF_INET6) {
         return NULL;
     }
+    if((result = calloc(1, sizeof(*result) + len)) == NULL) {
+        return NULL;
+    }
 
-    /* Since the memory we allocate here will be free'd by freehostent and
-       that function is opaque to us, it's likely that we'll leak a little 
-       bit of memory here. */
+    result->mark = POOL_RESULT_MARK;
+    memcpy(result->name, name, len);
+    memcpy(&(result->addr), addr, (af == AF_INET) ? 4 : 16);
+    result->addr_list[0] = (char *) &(result->addr);
+    result->he.h_name = result->name;
+    result->he.h_aliases = result->aliases;
+    result->he.h_addr_list = result->addr_list;
+    result->he.h_length = (af == AF_INET) ? 4 : 16;
+    result->he.h_addrtype = af;
+
+    return &(result->he);
+}
 
-    he = malloc(sizeof(struct hostent));
-    addr_list = malloc(2 * sizeof(char *));
-    if(af == AF_INET6) {
-        addr = malloc(sizeof(struct in6_addr));
-    } else {
-        addr = malloc(sizeof(struct in_addr));
-    }
-    aliases = malloc(sizeof(char *));
-
-    if(he == NULL || addr_list == NULL || addr == NULL || aliases == NULL) {
-        if(he)
-            free(he);
-        if(addr_list)
-            free(addr_list);
-        if(addr)
-            free(addr);
-        if(aliases)
-            free(aliases);
-    }
-
-    he->h_name = NULL;
-    he->h_addr_list = addr_list;
-    he->h_addr_list[0] = addr;
-    he->h_addr_list[1] = NULL;
-    he->h_aliases = aliases;
-    he->h_aliases[0] = NULL;
-    he->h_length = af == AF_INET ? 4 : 16;
-    he->h_addrtype = af;
+/* Whether he came from us, it is then freed */
+int our_freehostent(struct hostent *he)
+{
+    if(he == NULL || he->h_addr_list == NULL || !is_ours(he->h_addr_list[0])) {
+        return 0;
+    }
+    free(he);
+    return 1;
+}
 
-    return he;
+/* Whether ai came from us, it is then freed */
+int our_freeaddrinfo(struct addrinfo *ai)
+{
+    if(ai == NULL || !is_ours(ai->ai_addr)) {
+        return 0;
+    }
+    free(ai);
+    return 1;
+}
+
+/* Port of service for socktype, in network byte order. -1 if it isn't */
+/* known, raw sockets only take numbers                                */
+static int service_port(const char *service, int socktype)
+{
+    const char *proto = (socktype == SOCK_DGRAM) ? "udp" : "tcp";
+    struct servent *se;
+    char *endptr;
+    long port;
+#if defined(__GLIBC__)
+    struct servent se_buf;
+    char buf[1024];
+#endif
+
+    if(service == NULL) {
+        return 0;
+    }
+    port = strtol(service, &endptr, 10);
+    if(*service != '\0' && *endptr == '\0') {
+        return (port >= 0 && port <= 65535) ? htons((uint16_t) port) : -1;
+    }
+    if(socktype == SOCK_RAW) {
+        return -1;
+    }
+#if defined(__GLIBC__)
+    if(getservbyname_r(service, proto, &se_buf, buf, sizeof(buf), &se) != 0) {
+        se = NULL;
+    }
+#else
+    /* Thread safe on Darwin, its results are per thread */
+    se = getservbyname(service, proto);
+#endif
+    return se ? se->s_port : -1;
 }
 
-/* On Linux, there's no freehostent() anymore; we might as well implement
-   this ourselves. */
+/* What getaddrinfo() would refuse hints and service with whatever the */
+/* name, checked before the name takes a pool entry                    */
+static int check_addrinfo_hints(const char *service, const struct addrinfo *hints)
+{
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int flags = hints ? hints->ai_flags : 0;
+    int socktype = hints ? hints->ai_socktype : 0;
+
+    if(family != AF_UNSPEC && family != AF_INET && family != AF_INET6) {
+        return EAI_FAMILY;
+    }
+    /* The pool only has IPv4 addresses */
+    if(family == AF_INET6 && !(flags & AI_V4MAPPED)) {
+        return EAI_NONAME;
+    }
+    if(socktype != 0 && socktype != SOCK_STREAM && socktype != SOCK_DGRAM && 
+       socktype != SOCK_RAW) {
+        return EAI_SOCKTYPE;
+    }
+    if((flags & AI_NUMERICSERV) && service && 
+       strspn(service, "0123456789") != strlen(service)) {
+        return EAI_NONAME;
+    }
+
+    return 0;
+}
 
-static void free_hostent(struct hostent *he)
+/* Build the result for addr (network byte order) out of the pool, the */
+/* way getaddrinfo() would for a name having that single address, once */
+/* check_addrinfo_hints() has passed the hints and service             */
+static int make_addrinfo(const char *node, uint32_t addr, const char *service, 
+                         const struct addrinfo *hints, struct addrinfo **res)
 {
-    int i;
-    if(he->h_name) {
-        free(he->h_name);
+    static const int socktypes[POOL_AI_MAX] = { SOCK_STREAM, SOCK_DGRAM, SOCK_RAW };
+    static const int protocols[POOL_AI_MAX] = { IPPROTO_TCP, IPPROTO_UDP, 0 };
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int flags = hints ? hints->ai_flags : 0;
+    int socktype = hints ? hints->ai_socktype : 0;
+    int protocol = hints ? hints->ai_protocol : 0;
+    size_t len = (flags & AI_CANONNAME) ? strlen(node) + 1 : 0;
+    struct pool_addrinfo *result;
+    struct addrinfo *ai;
+    int i, n = 0, port;
+
+    if((result = calloc(1, sizeof(*result) + len)) == NULL) {
+        return EAI_MEMORY;
     }
-    if(he->h_aliases) {
-        for(i=0; he->h_aliases[i] != NULL; i++) {
-            free(he->h_aliases[i]);
+    result->mark = POOL_RESULT_MARK;
+
+    for(i = 0; i < POOL_AI_MAX; i++) {
+        if((socktype != 0 && socktype != socktypes[i]) || 
+           (socktype == 0 && protocol != 0 && protocols[i] != protocol)) {
+            continue;
+        }
+        if((port = service_port(service, socktypes[i])) == -1) {
+            continue;
         }
-        free(he->h_aliases);
+
+        ai = &(result->nodes[n]);
+        ai->ai_flags = flags;
+        ai->ai_socktype = socktypes[i];
+        ai->ai_protocol = protocol ? protocol : protocols[i];
+        ai->ai_addr = (struct sockaddr *) &(result->addrs[n]);
+        if(family == AF_INET6) {
+            struct sockaddr_in6 *sin6 = &(result->addrs[n].in6);
+
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = (uint16_t) port;
+            sin6->sin6_addr.s6_addr[10] = 0xFF;
+            sin6->sin6_addr.s6_addr[11] = 0xFF;
+            memcpy(&(sin6->sin6_addr.s6_addr[12]), &addr, 4);
+#if defined(__APPLE__)
+            sin6->sin6_len = sizeof(*sin6);
+#endif
+            ai->ai_family = AF_INET6;
+            ai->ai_addrlen = sizeof(*sin6);
+        } else {
+            struct sockaddr_in *sin = &(result->addrs[n].in);
+
+            sin->sin_family = AF_INET;
+            sin->sin_port = (uint16_t) port;
+            sin->sin_addr.s_addr = addr;
+#if defined(__APPLE__)
+            sin->sin_len = sizeof(*sin);
+#endif
+            ai->ai_family = AF_INET;
+            ai->ai_addrlen = sizeof(*sin);
+        }
+        if(n > 0) {
+            result->nodes[n - 1].ai_next = ai;
+        }
+        n++;
     }
-    if(he->h_addr_list) {
-        free(he->h_addr_list);
+
+    if(n == 0) {
+        free(result);
+        return EAI_SERVICE;
     }
-    free(he);
+    if(len) {
+        memcpy(result->name, node, len);
+        result->nodes[0].ai_canonname = result->name;
+    }
+    *res = &(result->nodes[0]);
+
+    return 0;
 }
 
 int our_getaddrinfo(dead_pool *pool, const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res)
 {
 	show_msg(MSGDEBUG, "our_getaddrinfo: ('%s' '%s') requested\n", node, service);
 
-    int pos;
+    int pos, rc;
     struct in_addr addr;
-    char *ipstr;
-    int ret;
 
 	if (node == NULL)
-		return getaddrinfo(NULL, service, hints, res);
+		return realgetaddrinfo(NULL, service, hints, res);
 
-	if (hints->ai_flags & AI_NUMERICHOST)
-		return getaddrinfo(node, service, hints, res);
+	if (hints && (hints->ai_flags & AI_NUMERICHOST))
+		return realgetaddrinfo(node, service, hints, res);
 
 	/* If "node" looks like a dotted-decimal ip address, then just call
        the real getaddrinfo; otherwise we'll need to get an address from
-       our pool. */
-	
-    /* TODO: work out what to do with AF_INET6 requests */
+       our pool, the result is then built from it right away. */
 	
 #ifdef HAVE_INET_ATON
     if(inet_aton(node, &addr) == 0) {
@@ -453,19 +1756,17 @@ int our_getaddrinfo(dead_pool *pool, const char *node, const char *service, cons
     is_valid = inet_addr(node);
     if(is_valid == -1) {
 #endif
+        if((rc = check_addrinfo_hints(service, hints)) != 0) {
+            return rc;
+        }
         pos = store_pool_entry(pool, (char *) node, &addr);
         if(pos == -1) {
             return EAI_NONAME;
-        } else {
-            ipstr = strdup(inet_ntoa(addr));
-            ret = getaddrinfo(ipstr, service, hints, res);
-            free(ipstr);
         }
-    } else {
-        ret = getaddrinfo(node, service, hints, res);
+        return make_addrinfo(node, addr.s_addr, service, hints, res);
     }
 
-    return ret;
+    return realgetaddrinfo(node, service, hints, res);
 }
 
 struct hostent * our_getipnodebyname(dead_pool *pool, const char *name, int af, int flags, int *error_num)
@@ -474,9 +1775,8 @@ struct hostent * our_getipnodebyname(dead_pool *pool, const char *name, int af,
 
     int pos;
     struct hostent *he = NULL;
-    int want_4in6 = 0;
-    char addr_convert_buf[80];
     struct in_addr pool_addr;
+    struct in6_addr mapped;
 
     if(af == AF_INET6) {
         /* Caller has requested an AF_INET6 address, and is not prepared to
@@ -487,8 +1787,6 @@ struct hostent * our_getipnodebyname(dead_pool *pool, const char *name, int af,
                      "but tsocks can't handle that\n");
             *error_num = NO_RECOVERY;
             return NULL;
-        } else {
-            want_4in6 = 1;
         }
     }
 
@@ -498,31 +1796,21 @@ struct hostent * our_getipnodebyname(dead_pool *pool, const char *name, int af,
         return NULL;
     }
 
-    he = alloc_hostent(af);
+    if(af == AF_INET6) {
+        /* The IPv4 address mapped in IPv6, ::FFFF:a.b.c.d */
+        memset(&mapped, 0x0, sizeof(mapped));
+        mapped.s6_addr[10] = 0xFF;
+        mapped.s6_addr[11] = 0xFF;
+        memcpy(&(mapped.s6_addr[12]), &(pool_addr.s_addr), 4);
+        he = alloc_hostent(af, name, &mapped);
+    } else {
+        he = alloc_hostent(af, name, &(pool_addr.s_addr));
+    }
     if(he == NULL) {
         show_msg(MSGERR, "getipnodebyname: failed to allocate hostent\n");
         *error_num = NO_RECOVERY;
         return NULL;
     }
 
-    if(want_4in6) {
-        /* Convert the ipv4 address in *addr to an IPv4 in IPv6 mapped 
-           address. TODO: inet_ntoa() is thread-safe on Solaris but might
-           not be on other platforms. */
-        strcpy(addr_convert_buf, "::FFFF:");
-        strcpy(addr_convert_buf+7, inet_ntoa(pool_addr));
-        if(inet_pton(AF_INET6, addr_convert_buf, he->h_addr_list[0]) != 1) {
-            show_msg(MSGERR, "getipnodebyname: inet_pton() failed!\n");
-            free_hostent(he);
-            *error_num = NO_RECOVERY;
-            return NULL;
-        }
-    } else {
-        ((struct in_addr *) he->h_addr_list[0])->s_addr = pool_addr.s_addr;
-    }
-    he->h_name = strdup(name);
-
     return he;
 }
-
-
@@ -7,35 +7,126 @@
 //extern int (*realclose)(CLOSE_SIGNATURE);
 //extern int (*realgetaddrinfo)(GETADDRINFO_SIGNATURE);
 
-struct struct_pool_ent {
-  unsigned int ip;
-  char name[256];
+#define POOL_CTRL_EMPTY   0x80
+#define POOL_CTRL_DELETED 0xFE
+/* Buckets whose control bytes are compared at once */
+#define POOL_GROUP_SIZE   16
+/* Names are stored in chunks of 16, 32, 64, 128 or 256 bytes */
+#define POOL_NAME_CLASSES 5
+#define POOL_NAME_MIN     16
+#define POOL_NAME_MAX     256   /* The NUL included */
+/* Names which could not be resolved are remembered in a table of this */
+/* many buckets, a newer failure replacing an older one in its bucket  */
+#define POOL_NEGATIVE_SIZE 256
+/* First bytes of a pool file, and the version of its layout: bumped */
+/* whenever struct_dead_pool or what follows it changes              */
+#define POOL_MAGIC        0x50445354    /* "TSDP" */
+#define POOL_VERSION      1
+
+struct struct_pool_index {
+  size_t ctrl_off;              /* mask + 1 + POOL_GROUP_SIZE control bytes, */
+                                /* the last ones mirror the first ones       */
+  size_t slots_off;             /* Entry number in each bucket */
+  unsigned int mask;            /* Number of buckets - 1 */
+  unsigned int max_mask;        /* The most buckets there is room for - 1 */
+  unsigned int used;            /* Buckets not empty, deleted included */
+  unsigned int live;            /* Buckets holding an entry */
 };
 
-typedef struct struct_pool_ent pool_ent;
+typedef struct struct_pool_index pool_index;
 
+/* The pool lives in a single shared mapping, reserved for the largest */
+/* the entries could take but only touched as they are stored. Every   */
+/* process sharing it may store names, one at a time under lock, while */
+/* lookups take no lock: a store makes seq odd while it changes the    */
+/* entries and indexes, lookups which saw it change start again. The   */
+/* mapping is anonymous, or the pool file (see tordns_pool_file) which */
+/* every process of the user maps wherever it likes: the arrays are    */
+/* only known by their offset from the start of the pool               */
 struct struct_dead_pool {
-  pool_ent *entries;            /* Points to array of pool entries */
+  uint32_t magic;               /* POOL_MAGIC */
+  uint32_t version;             /* POOL_VERSION */
+  uint32_t header_size;         /* sizeof(dead_pool), which the word size */
+                                /* of the process changes                 */
+  uint32_t persistent;          /* In a pool file, expiries are then on */
+                                /* the wall clock                       */
+  size_t ips_off;               /* Address of each entry */
+  size_t names_off;             /* Offset in the arena of each entry's */
+                                /* name plus one, 0 for free entries   */
+  size_t expiry_off;            /* When a resolved address goes stale, on */
+                                /* pool_now()'s clock, 0 for never         */
+  size_t pins_off;              /* Connections through each dead address */
+  size_t refs_off;              /* Set when an entry is looked up, cleared */
+                                /* as the clock hand passes it             */
   int n_entries;                /* Number of entries in the deadpool */
   unsigned int deadrange_base;  /* Deadrange start IP in host byte order */
   unsigned int deadrange_mask;  /* Deadrange netmask in host byte order */
   unsigned int deadrange_size;  /* Number of IPs in the deadrange */
-  unsigned int write_pos;       /* Next position to use in the pool array */
+  unsigned int write_pos;       /* Clock hand, next entry to consider */
+  unsigned int used_entries;    /* Entries written so far, never more than */
+                                /* write_pos before it wraps around        */
   unsigned int dead_pos;        /* Next 'unused' deadpool IP */
+  uint32_t ttl;                 /* Seconds resolved addresses are kept */
+  uint32_t negative_ttl;        /* Seconds failures are remembered */
+  uint32_t remote_resolve;      /* Every name gets a dead address, not */
+                                /* only .onion ones                    */
+  uint32_t deterministic;       /* Dead addresses are derived from a */
+                                /* keyed hash of the name             */
+  uint64_t address_key[2];      /* SipHash key of the deterministic mode */
   uint32_t sockshost;     
   uint16_t socksport;
   char pad[2];
+  /* Indexes of the entries, in the same shared mapping. The name and IP */
+  /* indexes are open addressed tables of entry numbers, with a control  */
+  /* byte per bucket: POOL_CTRL_EMPTY, POOL_CTRL_DELETED or 7 bits of the */
+  /* hash. Dead addresses are looked up directly by their offset in the  */
+  /* deadrange, dead_slots holding the entry number plus one             */
+  pool_index name_index;
+  pool_index ip_index;
+  size_t dead_off;
+  /* The names, chunks of names replaced are reused for the same size */
+  size_t arena_off;
+  uint32_t arena_size;          /* Bytes reserved */
+  uint32_t arena_used;          /* Bytes handed out, never touched past it */
+  uint32_t arena_free[POOL_NAME_CLASSES]; /* First free chunk plus one */
+  size_t map_size;
+  uint32_t lock;                /* pid of the process storing, 0 for none */
+  uint32_t seq;
+  /* Failed names, by hash, with when they may be tried again */
+  uint64_t negative_hashes[POOL_NEGATIVE_SIZE];
+  uint32_t negative_expiry[POOL_NEGATIVE_SIZE];
+  /* Counters for every process using the pool */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;      /* Live entries replaced */
+  unsigned long expirations;    /* Stale entries resolved again */
+  unsigned long negative_hits;  /* Lookups failed from the negative cache */
 };
 
 typedef struct struct_dead_pool dead_pool;
 
-dead_pool *init_pool(int deadpool_size, struct in_addr deadrange_base, struct in_addr deadrange_mask, char *sockshost, uint16_t socksport);
+dead_pool *init_pool(int deadpool_size, struct in_addr deadrange_base, struct in_addr deadrange_mask, char *sockshost, uint16_t socksport, int ttl, int negative_ttl, int remote_resolve, const unsigned char *address_key, const char *path);
 int is_dead_address(dead_pool *pool, uint32_t addr);
-char *get_pool_entry(dead_pool *pool, struct in_addr *addr);
-int search_pool_for_name(dead_pool *pool, const char *name);
+char *get_pool_entry(dead_pool *pool, struct in_addr *addr, char name[POOL_NAME_MAX]);
+int search_pool_for_name(dead_pool *pool, const char *name, uint32_t *ip);
+int pin_pool_entry(dead_pool *pool, struct in_addr *addr);
+void unpin_pool_entry(dead_pool *pool, int pin);
+void get_pool_stats(dead_pool *pool, unsigned long *hits, unsigned long *misses,
+                    unsigned long *evictions, unsigned long *expirations,
+                    unsigned long *negative_hits);
 struct hostent *our_gethostbyname(dead_pool *pool, const char *name);
+struct hostent *our_gethostbyname2(dead_pool *pool, const char *name, int af);
+int our_gethostbyname_r(dead_pool *pool, const char *name, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop);
+int our_gethostbyname2_r(dead_pool *pool, const char *name, int af, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop);
+struct hostent *our_gethostbyaddr(dead_pool *pool, const void *addr, socklen_t len, int af);
+#if defined(__GLIBC__)
+int our_gethostbyaddr_r(dead_pool *pool, const void *addr, socklen_t len, int af, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop);
+#endif
+int our_getnameinfo(dead_pool *pool, const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen, char *serv, socklen_t servlen, int flags);
 int our_getaddrinfo(dead_pool *pool, const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
 struct hostent *our_getipnodebyname(dead_pool *pool, const char *name, int af, int flags, int *error_num);
+int our_freeaddrinfo(struct addrinfo *ai);
+int our_freehostent(struct hostent *he);
 
 #endif /* _DEAD_POOL_H */
 
@@ -0,0 +1,699 @@
+/*
+
+    dns_mux.c    - Pipelines the resolver's queries over a few long-lived
+                   TCP connections to the nameservers
+
+*/
+
+#include "config.h"
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "common.h"
+#include "interpose.h"
+#include "dns_mux.h"
+
+#ifdef USE_SOCKS_DNS
+
+/* Every TCP connection to the nameserver is a stream of its own through */
+/* the SOCKS server, which takes a while to set up. Instead of one per    */
+/* query as libc does with RES_USEVC, the queries are sent over a few     */
+/* connections kept open, without waiting for the replies in between.    */
+/* The replies may come back in any order (RFC 7766), they are matched to */
+/* their query by the ID we gave it on the wire. There is no thread, the  */
+/* callers waiting take turns reading the replies for all of them         */
+
+#define MUX_CONNECTIONS_MAX     8
+
+/* Queries in flight on a connection. The low byte of their ID on the */
+/* wire is their slot                                                 */
+#define MUX_SLOTS               256
+
+/* Another connection is opened once the open ones each have this many */
+/* queries in flight                                                    */
+#define MUX_DEPTH               32
+
+/* Room for the largest reply and the start of the next one */
+#define MUX_BUFFER              (2 + 65535 + 4096)
+
+/* A query of ours, its name and question */
+#define MUX_QUERY_LEN           (NS_HFIXEDSZ + NS_MAXCDNAME + NS_QFIXEDSZ)
+
+#define NO_DEADLINE             (-1LL)
+
+#ifdef MSG_NOSIGNAL
+# define MUX_SEND_FLAGS         MSG_NOSIGNAL
+#else
+# define MUX_SEND_FLAGS         0
+#endif
+
+/* A query waiting for its reply, on the stack of its caller */
+struct mux_query {
+   uint16_t id;            /* On the wire */
+   uint16_t callerid;      /* Put back in the reply */
+   int done;
+   int len;                /* Of the reply, -2 if the connection was lost */
+   unsigned char *answer;
+   int anslen;
+};
+
+struct mux_conn {
+   int fd;                 /* -1 while closed */
+   int opening;            /* Being connected, outside the mutex */
+   int reading;            /* A caller is reading the replies */
+   int busy;               /* Callers using fd outside the mutex */
+   int broken;             /* Closed once nobody uses fd anymore */
+   struct sockaddr_in server;
+   pthread_mutex_t send_mutex;
+   unsigned int sent;      /* Gives the high byte of the IDs */
+   int inflight;
+   struct mux_query *slots[MUX_SLOTS];
+   unsigned char *buffer;  /* Replies read, MUX_BUFFER bytes */
+   int have;
+};
+
+static pthread_mutex_t mux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_cond = PTHREAD_COND_INITIALIZER;
+static struct mux_conn conns[MUX_CONNECTIONS_MAX];
+static int mux_connections = 0;
+static uint16_t mux_ids = 0;
+
+static long long mux_now(void) {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return(((long long) now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+/* Milliseconds left before deadline, -1 for none */
+static int mux_left(long long deadline) {
+   long long left;
+
+   if (deadline == NO_DEADLINE)
+      return(-1);
+   left = deadline - mux_now();
+   if (left <= 0)
+      return(0);
+   return((left > INT32_MAX) ? INT32_MAX : (int) left);
+}
+
+/* Wait on the mux condition with the mux mutex held. Returns ETIMEDOUT */
+/* once the deadline passed                                             */
+static int mux_wait(long long deadline) {
+   struct timeval now;
+   struct timespec until;
+   int left;
+
+   if ((left = mux_left(deadline)) == -1)
+      return(pthread_cond_wait(&mux_cond, &mux_mutex));
+   if (left == 0)
+      return(ETIMEDOUT);
+
+   /* Condition variables wait on the wall clock */
+   gettimeofday(&now, NULL);
+   until.tv_sec = now.tv_sec + (left / 1000);
+   until.tv_nsec = (now.tv_usec * 1000L) + ((left % 1000) * 1000000L);
+   if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+   }
+   return(pthread_cond_timedwait(&mux_cond, &mux_mutex, &until));
+}
+
+static void mux_prepare(void) {
+   pthread_mutex_lock(&mux_mutex);
+}
+
+static void mux_parent(void) {
+   pthread_mutex_unlock(&mux_mutex);
+}
+
+/* The child would mix its queries with the parent's on the same */
+/* connections, it opens its own. The callers waiting are gone   */
+static void mux_child(void) {
+   struct mux_conn *conn;
+   int i;
+
+   for (i = 0; i < mux_connections; i++) {
+      conn = &conns[i];
+      if (conn->fd != -1)
+         realclose(conn->fd);
+      conn->fd = -1;
+      conn->opening = conn->reading = conn->busy = conn->broken = 0;
+      conn->inflight = conn->have = 0;
+      memset(conn->slots, 0x0, sizeof(conn->slots));
+      pthread_mutex_init(&(conn->send_mutex), NULL);
+   }
+   pthread_mutex_unlock(&mux_mutex);
+}
+
+void dns_mux_setup(int connections) {
+   static int done = 0;
+   int i;
+
+   pthread_mutex_lock(&mux_mutex);
+   if (!done) {
+      for (i = 0; i < MUX_CONNECTIONS_MAX; i++) {
+         conns[i].fd = -1;
+         pthread_mutex_init(&(conns[i].send_mutex), NULL);
+      }
+      pthread_atfork(mux_prepare, mux_parent, mux_child);
+      done = 1;
+   }
+   if (connections > MUX_CONNECTIONS_MAX)
+      connections = MUX_CONNECTIONS_MAX;
+   /* Connections can be added but not taken away from under callers */
+   if (connections > mux_connections)
+      mux_connections = connections;
+   pthread_mutex_unlock(&mux_mutex);
+}
+
+/* The mux mutex must be held for the conn functions */
+
+/* Close conn once nobody uses its socket anymore */
+static void conn_release(struct mux_conn *conn) {
+   if (!conn->broken || conn->busy)
+      return;
+   realclose(conn->fd);
+   conn->fd = -1;
+   conn->broken = 0;
+   conn->have = 0;
+}
+
+/* The queries in flight on conn fail, the connection is closed */
+static void conn_fail(struct mux_conn *conn) {
+   int i;
+
+   for (i = 0; i < MUX_SLOTS; i++) {
+      if (conn->slots[i]) {
+         conn->slots[i]->done = 1;
+         conn->slots[i]->len = -2;
+         conn->slots[i] = NULL;
+      }
+   }
+   conn->inflight = 0;
+   conn->broken = 1;
+   conn_release(conn);
+   pthread_cond_broadcast(&mux_cond);
+}
+
+/* Connect conn to server, through the SOCKS server unless it is local. */
+/* The mutex is released meanwhile                                      */
+static int conn_open(struct mux_conn *conn, const struct sockaddr_in *server) {
+   int fd;
+#ifdef SO_NOSIGPIPE
+   int one = 1;
+#endif
+
+   if (!conn->buffer && ((conn->buffer = malloc(MUX_BUFFER)) == NULL)) {
+      show_msg(MSGERR, "dns_mux: could not allocate memory\n");
+      return(-1);
+   }
+   conn->opening = 1;
+   conn->server = *server;
+   pthread_mutex_unlock(&mux_mutex);
+
+   if ((fd = realsocket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) != -1) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      if (p_connect(fd, (const struct sockaddr *) server, sizeof(*server))) {
+         show_msg(MSGWARN, "dns_mux: could not connect to nameserver %s "
+                  "(%s)\n", inet_ntoa(server->sin_addr), strerror(errno));
+         realclose(fd);
+         fd = -1;
+      } else {
+         /* Nothing waits on it for ever from here on */
+         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+         setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+         show_msg(MSGDEBUG, "dns_mux: connected to nameserver %s\n",
+                  inet_ntoa(server->sin_addr));
+      }
+   }
+
+   pthread_mutex_lock(&mux_mutex);
+   conn->opening = 0;
+   conn->fd = fd;
+   conn->have = 0;
+   pthread_cond_broadcast(&mux_cond);
+   return((fd == -1) ? -1 : 0);
+}
+
+static int same_server(const struct mux_conn *conn,
+                       const struct sockaddr_in *server) {
+   return((conn->server.sin_addr.s_addr == server->sin_addr.s_addr) &&
+          (conn->server.sin_port == server->sin_port));
+}
+
+/* The least busy connection to server. Another one is opened when they */
+/* all have MUX_DEPTH queries in flight. NULL if none could be had in   */
+/* time                                                                 */
+static struct mux_conn *conn_pick(const struct sockaddr_in *server,
+                                  long long deadline) {
+   struct mux_conn *conn, *best, *spare;
+   int i, opening;
+
+   for (;;) {
+      best = spare = NULL;
+      opening = 0;
+      for (i = 0; i < mux_connections; i++) {
+         conn = &conns[i];
+         if (conn->opening) {
+            opening |= same_server(conn, server);
+         } else if (conn->fd == -1) {
+            if (!spare)
+               spare = conn;
+         } else if (conn->broken) {
+            continue;
+         } else if (!same_server(conn, server)) {
+            /* Left over from another nameserver */
+            if (!spare && !conn->inflight && !conn->busy)
+               spare = conn;
+         } else if ((conn->inflight < MUX_SLOTS) &&
+                    (!best || (conn->inflight < best->inflight))) {
+            best = conn;
+         }
+      }
+
+      if (best && (best->inflight < MUX_DEPTH))
+         return(best);
+      /* Rather than opening yet another, use the one coming */
+      if (!opening && spare) {
+         if (spare->fd != -1) {
+            spare->broken = 1;
+            conn_release(spare);
+         }
+         return(conn_open(spare, server) ? NULL : spare);
+      }
+      if (best)
+         return(best);
+      if (mux_wait(deadline) == ETIMEDOUT)
+         return(NULL);
+   }
+}
+
+/* Hands the replies read on conn to their queries */
+static void conn_dispatch(struct mux_conn *conn) {
+   struct mux_query *query;
+   unsigned char *reply;
+   int used = 0, len, copy;
+
+   while ((conn->have - used) >= 2) {
+      len = (conn->buffer[used] << 8) | conn->buffer[used + 1];
+      if ((conn->have - used) < (2 + len))
+         break;
+      reply = conn->buffer + used + 2;
+      used += 2 + len;
+
+      /* Replies to queries which timed out meanwhile are dropped */
+      if ((len < NS_HFIXEDSZ) || !(query = conn->slots[reply[1]]) ||
+          (query->id != ((reply[0] << 8) | reply[1])))
+         continue;
+
+      copy = (len < query->anslen) ? len : query->anslen;
+      memcpy(query->answer, reply, copy);
+      query->answer[0] = query->callerid >> 8;
+      query->answer[1] = query->callerid & 0xff;
+      /* As libc does, the reply is cut and flagged as truncated but */
+      /* its whole length is returned                                */
+      if (copy < len)
+         query->answer[2] |= 0x02;
+      query->len = len;
+      query->done = 1;
+      conn->slots[reply[1]] = NULL;
+      conn->inflight--;
+   }
+
+   if (used) {
+      memmove(conn->buffer, conn->buffer + used, conn->have - used);
+      conn->have -= used;
+   }
+}
+
+/* Without the mutex, only by the caller whose turn it is to read. Reads */
+/* until conn holds a whole reply. Returns 1 once it does, 0 on timeout  */
+/* and -1 if the connection is lost                                      */
+static int conn_read(struct mux_conn *conn, long long deadline) {
+   struct pollfd pfd;
+   ssize_t r;
+
+   for (;;) {
+      if ((conn->have >= 2) &&
+          (conn->have >= 2 + ((conn->buffer[0] << 8) | conn->buffer[1])))
+         return(1);
+      r = recv(conn->fd, conn->buffer + conn->have, MUX_BUFFER - conn->have,
+               0);
+      if (r > 0) {
+         conn->have += r;
+         continue;
+      }
+      if (r == 0) {
+         show_msg(MSGDEBUG, "dns_mux: nameserver closed the connection\n");
+         return(-1);
+      }
+      if (errno == EINTR)
+         continue;
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+         show_msg(MSGWARN, "dns_mux: error reading replies (%s)\n",
+                  strerror(errno));
+         return(-1);
+      }
+
+      pfd.fd = conn->fd;
+      pfd.events = POLLIN;
+      r = realpoll(&pfd, 1, mux_left(deadline));
+      if (r == 0)
+         return(0);
+      if ((r == -1) && (errno != EINTR))
+         return(-1);
+   }
+}
+
+/* Without the mutex but with the connection's send mutex */
+static int conn_write(struct mux_conn *conn, const unsigned char *frame,
+                      int len, long long deadline) {
+   struct pollfd pfd;
+   ssize_t r;
+
+   while (len) {
+      r = realsend(conn->fd, frame, len, MUX_SEND_FLAGS);
+      if (r > 0) {
+         frame += r;
+         len -= r;
+         continue;
+      }
+      if ((r == -1) && (errno == EINTR))
+         continue;
+      if ((r == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+         pfd.fd = conn->fd;
+         pfd.events = POLLOUT;
+         if (realpoll(&pfd, 1, mux_left(deadline)) > 0)
+            continue;
+      }
+      show_msg(MSGWARN, "dns_mux: error sending query\n");
+      return(-1);
+   }
+   return(0);
+}
+
+/* Send msg to server and wait for the reply. Returns its length, -1 on */
+/* timeout and -2 if the connection was lost                            */
+static int mux_exchange(const struct sockaddr_in *server,
+                        const unsigned char *msg, int msglen,
+                        unsigned char *answer, int anslen,
+                        long long deadline) {
+   struct mux_query query;
+   struct mux_conn *conn;
+   unsigned char small[2 + MUX_QUERY_LEN], *frame = small;
+   int slot, rc;
+
+   if ((2 + msglen > sizeof(small)) &&
+       ((frame = malloc(2 + msglen)) == NULL)) {
+      show_msg(MSGERR, "dns_mux: could not allocate memory\n");
+      return(-1);
+   }
+
+   pthread_mutex_lock(&mux_mutex);
+   if (!(conn = conn_pick(server, deadline))) {
+      pthread_mutex_unlock(&mux_mutex);
+      if (frame != small)
+         free(frame);
+      return(-1);
+   }
+
+   /* conn_pick() made sure there is a free slot */
+   for (slot = conn->sent % MUX_SLOTS; conn->slots[slot];
+        slot = (slot + 1) % MUX_SLOTS)
+      ;
+   query.id = (uint16_t) (((conn->sent++ & 0xff) << 8) | slot);
+   query.callerid = (uint16_t) ((msg[0] << 8) | msg[1]);
+   query.done = 0;
+   query.len = -1;
+   query.answer = answer;
+   query.anslen = anslen;
+   conn->slots[slot] = &query;
+   conn->inflight++;
+   conn->busy++;
+   pthread_mutex_unlock(&mux_mutex);
+
+   /* The length, then the query under our ID */
+   frame[0] = msglen >> 8;
+   frame[1] = msglen & 0xff;
+   memcpy(frame + 2, msg, msglen);
+   frame[2] = query.id >> 8;
+   frame[3] = query.id & 0xff;
+
+   pthread_mutex_lock(&(conn->send_mutex));
+   rc = conn_write(conn, frame, 2 + msglen, deadline);
+   pthread_mutex_unlock(&(conn->send_mutex));
+   if (frame != small)
+      free(frame);
+
+   pthread_mutex_lock(&mux_mutex);
+   conn->busy--;
+   /* Part of the query may have gone out, the stream can't be trusted */
+   if (rc && !conn->broken)
+      conn_fail(conn);
+   conn_release(conn);
+
+   while (!query.done) {
+      if (!conn->reading) {
+         conn->reading = 1;
+         conn->busy++;
+         pthread_mutex_unlock(&mux_mutex);
+
+         rc = conn_read(conn, deadline);
+
+         pthread_mutex_lock(&mux_mutex);
+         conn->reading = 0;
+         conn->busy--;
+         if (rc == 1)
+            conn_dispatch(conn);
+         else if ((rc == -1) && !conn->broken)
+            conn_fail(conn);
+         conn_release(conn);
+         /* Others wait for their reply or for their turn to read */
+         pthread_cond_broadcast(&mux_cond);
+         if (rc == 0)
+            break;
+      } else if (mux_wait(deadline) == ETIMEDOUT) {
+         break;
+      }
+   }
+
+   if (!query.done) {
+      show_msg(MSGDEBUG, "dns_mux: query timed out\n");
+      conn->slots[slot] = NULL;
+      conn->inflight--;
+   }
+   pthread_mutex_unlock(&mux_mutex);
+
+   return(query.done ? query.len : -1);
+}
+
+int dns_mux_send(const unsigned char *msg, int msglen, unsigned char *answer,
+                 int anslen)
+{
+   struct sockaddr_in server;
+   long long deadline;
+   int i, rc = -1;
+
+   if ((msglen < NS_HFIXEDSZ) || (msglen > 65535) || (anslen < NS_HFIXEDSZ)) {
+      errno = EINVAL;
+      return(-1);
+   }
+   if (!(_res.options & RES_INIT) && (p_res_init() == -1))
+      return(-1);
+
+   /* The nameservers in turn, as libc does */
+   for (i = 0; i < _res.nscount; i++) {
+      server = _res.nsaddr_list[i];
+      if (server.sin_family != AF_INET)
+         continue;
+      deadline = mux_now() +
+                 ((long long) _res.retrans * 1000 *
+                  ((_res.retry > 0) ? _res.retry : 1));
+      /* Servers close the connections left idle (RFC 7766), a query */
+      /* lost with one is sent again on a new one                    */
+      if ((rc = mux_exchange(&server, msg, msglen, answer, anslen,
+                             deadline)) == -2)
+         rc = mux_exchange(&server, msg, msglen, answer, anslen, deadline);
+      if (rc >= 0)
+         return(rc);
+   }
+
+   errno = ETIMEDOUT;
+   return(-1);
+}
+
+/* Build the query for dname, res_mkquery() isn't in libc everywhere. */
+/* Returns its length or -1 if the name is malformed                  */
+static int make_query(const char *dname, int class, int type,
+                      unsigned char *buf, int buflen) {
+   unsigned char *p = buf + NS_HFIXEDSZ, *label;
+   uint16_t id;
+
+   if (buflen < MUX_QUERY_LEN)
+      return(-1);
+
+   memset(buf, 0x0, NS_HFIXEDSZ);
+   /* The caller doesn't see it, on the wire it is replaced anyway */
+   id = __atomic_add_fetch(&mux_ids, 1, __ATOMIC_RELAXED);
+   buf[0] = id >> 8;
+   buf[1] = id & 0xff;
+   if (_res.options & RES_RECURSE)
+      buf[2] = 0x01;
+   buf[5] = 1;             /* One question */
+
+   /* The labels, then the root. The root's name is "." or "" */
+   while (*dname) {
+      label = p++;
+      while (*dname && (*dname != '.')) {
+         if ((p - label > 63) || (p - (buf + NS_HFIXEDSZ) >= NS_MAXCDNAME - 1))
+            return(-1);
+         *p++ = (unsigned char) *dname++;
+      }
+      if ((*label = (unsigned char) (p - label - 1)) == 0) {
+         /* Only the root may be empty */
+         if (*dname && dname[1])
+            return(-1);
+         p--;
+         break;
+      }
+      if (*dname)
+         dname++;
+   }
+   *p++ = 0;
+
+   *p++ = (unsigned char) (type >> 8);
+   *p++ = (unsigned char) type;
+   *p++ = (unsigned char) (class >> 8);
+   *p++ = (unsigned char) class;
+   return((int) (p - buf));
+}
+
+int dns_mux_query(const char *dname, int class, int type,
+                  unsigned char *answer, int anslen)
+{
+   unsigned char query[MUX_QUERY_LEN];
+   int len, rc, rcode;
+
+   if (!(_res.options & RES_INIT) && (p_res_init() == -1)) {
+      h_errno = NETDB_INTERNAL;
+      return(-1);
+   }
+   if ((len = make_query(dname, class, type, query, sizeof(query))) == -1) {
+      errno = EMSGSIZE;
+      h_errno = NO_RECOVERY;
+      return(-1);
+   }
+   if ((rc = dns_mux_send(query, len, answer, anslen)) == -1) {
+      h_errno = TRY_AGAIN;
+      return(-1);
+   }
+
+   /* The same answers as libc's */
+   rcode = answer[3] & 0x0f;
+   if ((rcode != ns_r_noerror) || !((answer[6] << 8) | answer[7])) {
+      switch (rcode) {
+         case ns_r_nxdomain:
+            h_errno = HOST_NOT_FOUND;
+            break;
+         case ns_r_servfail:
+            h_errno = TRY_AGAIN;
+            break;
+         case ns_r_noerror:
+            h_errno = NO_DATA;
+            break;
+         default:
+            h_errno = NO_RECOVERY;
+            break;
+      }
+      return(-1);
+   }
+   return(rc);
+}
+
+/* dname in domain, or -1 if it doesn't fit */
+static int query_domain(const char *dname, const char *domain, int class,
+                        int type, unsigned char *answer, int anslen) {
+   char name[NS_MAXDNAME];
+
+   if (snprintf(name, sizeof(name), "%s.%s", dname, domain) >=
+       (int) sizeof(name)) {
+      h_errno = NO_RECOVERY;
+      return(-1);
+   }
+   return(dns_mux_query(name, class, type, answer, anslen));
+}
+
+int dns_mux_search(const char *dname, int class, int type,
+                   unsigned char *answer, int anslen)
+{
+   const char *cp;
+   char **domain;
+   int dots = 0, tried = 0, nodata = 0, rc;
+
+   if (!(_res.options & RES_INIT) && (p_res_init() == -1)) {
+      h_errno = NETDB_INTERNAL;
+      return(-1);
+   }
+
+   for (cp = dname; *cp; cp++)
+      dots += (*cp == '.');
+   /* Absolute names are only tried as they are */
+   if ((cp > dname) && (cp[-1] == '.'))
+      return(dns_mux_query(dname, class, type, answer, anslen));
+
+   if (dots >= _res.ndots) {
+      if ((rc = dns_mux_query(dname, class, type, answer, anslen)) >= 0)
+         return(rc);
+      nodata = (h_errno == NO_DATA);
+      tried = 1;
+   }
+
+   /* Then in the search domains, as long as the name isn't there */
+   if ((!dots && (_res.options & RES_DEFNAMES)) ||
+       (dots && (_res.options & RES_DNSRCH))) {
+      for (domain = _res.dnsrch; *domain; domain++) {
+         if ((rc = query_domain(dname, *domain, class, type, answer,
+                                anslen)) >= 0)
+            return(rc);
+         if (h_errno == NO_DATA)
+            nodata = 1;
+         else if (h_errno != HOST_NOT_FOUND)
+            break;
+      }
+   }
+
+   if (!tried &&
+       ((rc = dns_mux_query(dname, class, type, answer, anslen)) >= 0))
+      return(rc);
+
+   if (nodata)
+      h_errno = NO_DATA;
+   return(-1);
+}
+
+#endif
@@ -0,0 +1,21 @@
+/* dns_mux.h - The resolver's queries pipelined over a few long-lived */
+/*             TCP connections to the nameservers                      */
+
+#ifndef _DNS_MUX_H
+
+#define _DNS_MUX_H	1
+
+/* connections is the number of connections kept to a nameserver, */
+/* see socks_dns_connections in tsocks.conf                         */
+void dns_mux_setup(int connections);
+
+/* The res_send(), res_query() and res_search() of the channel, with */
+/* their return values and h_errno                                   */
+int dns_mux_send(const unsigned char *msg, int msglen, unsigned char *answer,
+                 int anslen);
+int dns_mux_query(const char *dname, int class, int type,
+                  unsigned char *answer, int anslen);
+int dns_mux_search(const char *dname, int class, int type,
+                   unsigned char *answer, int anslen);
+
+#endif
@@ -0,0 +1,503 @@
+/*
+
+    interpose.c    - Hooks the tsocks replacements into the process
+
+*/
+
+#include "config.h"
+
+#if !defined(__APPLE__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+
+#include "interpose.h"
+
+#if defined(__APPLE__)
+
+#ifdef USE_SOCKS_DNS
+int res_init(void);
+#endif
+
+// --JP/
+// From 'OS X Internal'
+typedef struct interpose_s {
+	void *new_func;
+	void *origin_func;
+} interpose_t;
+
+__attribute__((used)) static const interpose_t interposers[] __attribute__((section("__DATA,__interpose"))) = {
+
+#if defined(USE_SOCKS_DNS) && USE_SOCKS_DNS
+	{ (void *)p_res_init, (void *)res_init },
+	{ (void *)p_res_query, (void *)res_query },
+	{ (void *)p_res_search, (void *)res_search },
+	{ (void *)p_res_send, (void *)res_send },
+#endif
+
+#if defined(USE_TOR_DNS) && USE_TOR_DNS
+	{ (void *)p_gethostbyname, (void *)gethostbyname },
+	{ (void *)p_gethostbyname2, (void *)gethostbyname2 },
+	{ (void *)p_gethostbyaddr, (void *)gethostbyaddr },
+	{ (void *)p_getnameinfo, (void *)getnameinfo },
+	{ (void *)p_getaddrinfo, (void *)getaddrinfo },
+	{ (void *)p_freeaddrinfo, (void *)freeaddrinfo },
+	{ (void *)p_getipnodebyname, (void *)getipnodebyname },
+	{ (void *)p_freehostent, (void *)freehostent },
+#endif
+
+	{ (void *)p_connect, (void *)connect },
+	{ (void *)p_select, (void *)select },
+	{ (void *)p_poll, (void *)poll },
+	{ (void *)p_close, (void *)close },
+	{ (void *)p_getpeername, (void *)getpeername },
+	{ (void *)p_socket, (void *)socket },
+	{ (void *)p_socketpair, (void *)socketpair },
+	{ (void *)p_accept, (void *)accept },
+	{ (void *)p_dup, (void *)dup },
+	{ (void *)p_dup2, (void *)dup2 },
+	{ (void *)p_fcntl, (void *)fcntl },
+	{ (void *)p_send, (void *)send },
+	{ (void *)p_write, (void *)write },
+	{ (void *)p_writev, (void *)writev },
+	{ (void *)p_sendmsg, (void *)sendmsg },
+};
+// --JP!
+
+#else
+
+/* The resolver headers may rename res_init (glibc uses __res_init), */
+/* these give us the symbol name programs were actually linked with   */
+#define SYMBOL_NAME(name)	SYMBOL_STRING(name)
+#define SYMBOL_STRING(name)	#name
+
+#ifdef USE_SOCKS_DNS
+int (*realres_init)(void);
+int (*realres_query)(const char *, int, int, unsigned char *, int);
+int (*realres_search)(const char *, int, int, unsigned char *, int);
+int (*realres_send)(const unsigned char *, int, unsigned char *, int);
+#endif
+struct hostent *(*realgethostbyname)(const char *);
+struct hostent *(*realgethostbyname2)(const char *, int);
+struct hostent *(*realgethostbyaddr)(const void *, socklen_t, int);
+int (*realgetnameinfo)(const struct sockaddr *, socklen_t, char *, socklen_t, char *, socklen_t, int);
+int (*realgetaddrinfo)(const char *, const char *, const struct addrinfo *, struct addrinfo **);
+void (*realfreeaddrinfo)(struct addrinfo *);
+#if defined(__GLIBC__)
+int (*realgethostbyname_r)(const char *, struct hostent *, char *, size_t, struct hostent **, int *);
+int (*realgethostbyname2_r)(const char *, int, struct hostent *, char *, size_t, struct hostent **, int *);
+int (*realgethostbyaddr_r)(const void *, socklen_t, int, struct hostent *, char *, size_t, struct hostent **, int *);
+int (*realgetaddrinfo_a)(int, struct gaicb **, int, struct sigevent *);
+int (*realgai_suspend)(const struct gaicb *const *, int, const struct timespec *);
+int (*realgai_cancel)(struct gaicb *);
+#endif
+int (*realconnect)(int, const struct sockaddr *, socklen_t);
+int (*realselect)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+int (*realpoll)(struct pollfd *, nfds_t, int);
+int (*realpselect)(int, fd_set *, fd_set *, fd_set *, const struct timespec *, const sigset_t *);
+int (*realppoll)(struct pollfd *, nfds_t, const struct timespec *, const sigset_t *);
+int (*realclose)(int);
+int (*realgetpeername)(int, struct sockaddr *, socklen_t *);
+int (*realsocket)(int, int, int);
+int (*realsocketpair)(int, int, int, int *);
+int (*realaccept)(int, struct sockaddr *, socklen_t *);
+int (*realdup)(int);
+int (*realdup2)(int, int);
+int (*realfcntl)(int, int, ...);
+#if defined(__GLIBC__)
+int (*realfcntl64)(int, int, ...);
+#endif
+ssize_t (*realsend)(int, const void *, size_t, int);
+ssize_t (*realwrite)(int, const void *, size_t);
+ssize_t (*realwritev)(int, const struct iovec *, int);
+ssize_t (*realsendmsg)(int, const struct msghdr *, int);
+#if defined(__linux__)
+int (*realaccept4)(int, struct sockaddr *, socklen_t *, int);
+int (*realdup3)(int, int, int);
+int (*realepoll_ctl)(int, int, int, struct epoll_event *);
+int (*realepoll_wait)(int, struct epoll_event *, int, int);
+int (*realepoll_pwait)(int, struct epoll_event *, int, int, const sigset_t *);
+#endif
+
+static void *find_real(const char *name) {
+   void *func;
+
+   if ((func = dlsym(RTLD_NEXT, name)) == NULL) {
+      /* Nothing will work without it, there is no point going on */
+      fprintf(stderr, "libtsocks: Unable to find the real %s(): %s\n",
+              name, dlerror());
+      abort();
+   }
+
+   return(func);
+}
+
+#if defined(__GLIBC__)
+/* For the functions programs may well not be linked with */
+static void *find_optional(const char *name) {
+   return(dlsym(RTLD_NEXT, name));
+}
+#endif
+
+void interpose_init(void) {
+   static int done = 0;
+
+   if (__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+      return;
+
+   /* Racing threads all store the same values, so no lock is needed */
+#ifdef USE_SOCKS_DNS
+   realres_init = find_real(SYMBOL_NAME(res_init));
+#if defined(__GLIBC__)
+   realres_query = find_optional(SYMBOL_NAME(res_query));
+   realres_search = find_optional(SYMBOL_NAME(res_search));
+   realres_send = find_optional(SYMBOL_NAME(res_send));
+#else
+   realres_query = find_real(SYMBOL_NAME(res_query));
+   realres_search = find_real(SYMBOL_NAME(res_search));
+   realres_send = find_real(SYMBOL_NAME(res_send));
+#endif
+#endif
+   realgethostbyname = find_real("gethostbyname");
+   realgethostbyname2 = find_real("gethostbyname2");
+   realgethostbyaddr = find_real("gethostbyaddr");
+   realgetnameinfo = find_real("getnameinfo");
+   realgetaddrinfo = find_real("getaddrinfo");
+   realfreeaddrinfo = find_real("freeaddrinfo");
+#if defined(__GLIBC__)
+   realgethostbyname_r = find_real("gethostbyname_r");
+   realgethostbyname2_r = find_real("gethostbyname2_r");
+   realgethostbyaddr_r = find_real("gethostbyaddr_r");
+   realgetaddrinfo_a = find_optional("getaddrinfo_a");
+   realgai_suspend = find_optional("gai_suspend");
+   realgai_cancel = find_optional("gai_cancel");
+#endif
+   realconnect = find_real("connect");
+   realselect = find_real("select");
+   realpoll = find_real("poll");
+   realpselect = find_real("pselect");
+   realppoll = find_real("ppoll");
+   realclose = find_real("close");
+   realgetpeername = find_real("getpeername");
+   realsocket = find_real("socket");
+   realsocketpair = find_real("socketpair");
+   realaccept = find_real("accept");
+   realdup = find_real("dup");
+   realdup2 = find_real("dup2");
+   realfcntl = find_real("fcntl");
+#if defined(__GLIBC__)
+   realfcntl64 = find_optional("fcntl64");
+#endif
+   realsend = find_real("send");
+   realwrite = find_real("write");
+   realwritev = find_real("writev");
+   realsendmsg = find_real("sendmsg");
+#if defined(__linux__)
+   realaccept4 = find_real("accept4");
+   realdup3 = find_real("dup3");
+   realepoll_ctl = find_real("epoll_ctl");
+   realepoll_wait = find_real("epoll_wait");
+   realepoll_pwait = find_real("epoll_pwait");
+#endif
+
+   __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+}
+
+/* Run before any other constructor of ours, but other libraries may */
+/* still call in earlier, hence the checks in the entry points below */
+static void __attribute__((constructor(101))) interpose_constructor(void) {
+   interpose_init();
+}
+
+/* The exported entry points. They are declared under names of their  */
+/* own and given the libc symbol names through asm labels, so that the */
+/* system prototypes (which vary between libcs) never conflict         */
+#define ENTRY_POINT(ret, name, args) \
+   ret tsocks_entry_##name args __asm__(SYMBOL_NAME(name)) \
+      __attribute__((visibility("default"))); \
+   ret tsocks_entry_##name args
+
+#define CHECK_INIT(real) \
+   if (__builtin_expect((real) == NULL, 0)) \
+      interpose_init()
+
+#if defined(__GLIBC__)
+/* libresolv may only be loaded after the constructor looked for its */
+/* functions, they are looked for again until found                  */
+#define CHECK_OPTIONAL(real, name) \
+   if (__builtin_expect((real) == NULL, 0)) { \
+      interpose_init(); \
+      if ((real) == NULL) \
+         __atomic_store_n(&(real), find_optional(SYMBOL_NAME(name)), \
+                          __ATOMIC_RELEASE); \
+   }
+#else
+#define CHECK_OPTIONAL(real, name) CHECK_INIT(real)
+#endif
+
+#ifdef USE_SOCKS_DNS
+ENTRY_POINT(int, res_init, (void)) {
+   CHECK_INIT(realres_init);
+   return(p_res_init());
+}
+
+ENTRY_POINT(int, res_query, (const char *dname, int class, int type,
+                             unsigned char *answer, int anslen)) {
+   CHECK_OPTIONAL(realres_query, res_query);
+   return(p_res_query(dname, class, type, answer, anslen));
+}
+
+ENTRY_POINT(int, res_search, (const char *dname, int class, int type,
+                              unsigned char *answer, int anslen)) {
+   CHECK_OPTIONAL(realres_search, res_search);
+   return(p_res_search(dname, class, type, answer, anslen));
+}
+
+ENTRY_POINT(int, res_send, (const unsigned char *msg, int msglen,
+                            unsigned char *answer, int anslen)) {
+   CHECK_OPTIONAL(realres_send, res_send);
+   return(p_res_send(msg, msglen, answer, anslen));
+}
+#endif
+
+#if defined(USE_TOR_DNS) && USE_TOR_DNS
+ENTRY_POINT(struct hostent *, gethostbyname, (const char *name)) {
+   CHECK_INIT(realgethostbyname);
+   return(p_gethostbyname(name));
+}
+
+ENTRY_POINT(struct hostent *, gethostbyname2, (const char *name, int af)) {
+   CHECK_INIT(realgethostbyname2);
+   return(p_gethostbyname2(name, af));
+}
+
+ENTRY_POINT(struct hostent *, gethostbyaddr, (const void *addr, socklen_t len,
+                                              int type)) {
+   CHECK_INIT(realgethostbyaddr);
+   return(p_gethostbyaddr(addr, len, type));
+}
+
+#if defined(__GLIBC__)
+ENTRY_POINT(int, gethostbyname_r, (const char *name, struct hostent *ret,
+                                   char *buf, size_t buflen,
+                                   struct hostent **result, int *h_errnop)) {
+   CHECK_INIT(realgethostbyname_r);
+   return(p_gethostbyname_r(name, ret, buf, buflen, result, h_errnop));
+}
+
+ENTRY_POINT(int, gethostbyname2_r, (const char *name, int af,
+                                    struct hostent *ret, char *buf,
+                                    size_t buflen, struct hostent **result,
+                                    int *h_errnop)) {
+   CHECK_INIT(realgethostbyname2_r);
+   return(p_gethostbyname2_r(name, af, ret, buf, buflen, result, h_errnop));
+}
+
+ENTRY_POINT(int, gethostbyaddr_r, (const void *addr, socklen_t len, int type,
+                                   struct hostent *ret, char *buf,
+                                   size_t buflen, struct hostent **result,
+                                   int *h_errnop)) {
+   CHECK_INIT(realgethostbyaddr_r);
+   return(p_gethostbyaddr_r(addr, len, type, ret, buf, buflen, result,
+                            h_errnop));
+}
+#endif
+
+ENTRY_POINT(int, getnameinfo, (const struct sockaddr *sa, socklen_t salen,
+                               char *host, socklen_t hostlen, char *serv,
+                               socklen_t servlen, int flags)) {
+   CHECK_INIT(realgetnameinfo);
+   return(p_getnameinfo(sa, salen, host, hostlen, serv, servlen, flags));
+}
+
+ENTRY_POINT(int, getaddrinfo, (const char *hostname, const char *servname,
+                               const struct addrinfo *hints,
+                               struct addrinfo **res)) {
+   CHECK_INIT(realgetaddrinfo);
+   return(p_getaddrinfo(hostname, servname, hints, res));
+}
+
+ENTRY_POINT(void, freeaddrinfo, (struct addrinfo *ai)) {
+   CHECK_INIT(realfreeaddrinfo);
+   p_freeaddrinfo(ai);
+}
+
+#if defined(__GLIBC__)
+ENTRY_POINT(int, getaddrinfo_a, (int mode, struct gaicb *list[], int nitems,
+                                 struct sigevent *sevp)) {
+   CHECK_INIT(realgetaddrinfo);
+   return(p_getaddrinfo_a(mode, list, nitems, sevp));
+}
+
+ENTRY_POINT(int, gai_suspend, (const struct gaicb *const list[], int nitems,
+                               const struct timespec *timeout)) {
+   CHECK_INIT(realgetaddrinfo);
+   return(p_gai_suspend(list, nitems, timeout));
+}
+
+ENTRY_POINT(int, gai_cancel, (struct gaicb *req)) {
+   CHECK_INIT(realgetaddrinfo);
+   return(p_gai_cancel(req));
+}
+#endif
+#endif
+
+ENTRY_POINT(int, connect, (int fd, const struct sockaddr *address,
+                           socklen_t address_len)) {
+   CHECK_INIT(realconnect);
+   return(p_connect(fd, address, address_len));
+}
+
+ENTRY_POINT(int, select, (int nfds, fd_set *readfds, fd_set *writefds,
+                          fd_set *errorfds, struct timeval *timeout)) {
+   CHECK_INIT(realselect);
+   return(p_select(nfds, readfds, writefds, errorfds, timeout));
+}
+
+ENTRY_POINT(int, poll, (struct pollfd fds[], nfds_t nfds, int timeout)) {
+   CHECK_INIT(realpoll);
+   return(p_poll(fds, nfds, timeout));
+}
+
+ENTRY_POINT(int, pselect, (int nfds, fd_set *readfds, fd_set *writefds,
+                           fd_set *errorfds, const struct timespec *timeout,
+                           const sigset_t *sigmask)) {
+   CHECK_INIT(realpselect);
+   return(p_pselect(nfds, readfds, writefds, errorfds, timeout, sigmask));
+}
+
+ENTRY_POINT(int, ppoll, (struct pollfd fds[], nfds_t nfds,
+                         const struct timespec *timeout,
+                         const sigset_t *sigmask)) {
+   CHECK_INIT(realppoll);
+   return(p_ppoll(fds, nfds, timeout, sigmask));
+}
+
+ENTRY_POINT(int, close, (int fd)) {
+   CHECK_INIT(realclose);
+   return(p_close(fd));
+}
+
+ENTRY_POINT(int, getpeername, (int fd, struct sockaddr *address,
+                               socklen_t *address_len)) {
+   CHECK_INIT(realgetpeername);
+   return(p_getpeername(fd, address, address_len));
+}
+
+ENTRY_POINT(int, socket, (int domain, int type, int protocol)) {
+   CHECK_INIT(realsocket);
+   return(p_socket(domain, type, protocol));
+}
+
+ENTRY_POINT(int, socketpair, (int domain, int type, int protocol,
+                              int sv[2])) {
+   CHECK_INIT(realsocketpair);
+   return(p_socketpair(domain, type, protocol, sv));
+}
+
+ENTRY_POINT(int, accept, (int fd, struct sockaddr *address,
+                          socklen_t *address_len)) {
+   CHECK_INIT(realaccept);
+   return(p_accept(fd, address, address_len));
+}
+
+ENTRY_POINT(int, dup, (int fd)) {
+   CHECK_INIT(realdup);
+   return(p_dup(fd));
+}
+
+ENTRY_POINT(int, dup2, (int fd, int fd2)) {
+   CHECK_INIT(realdup2);
+   return(p_dup2(fd, fd2));
+}
+
+/* The argument is passed on as it came, see p_fcntl() */
+ENTRY_POINT(int, fcntl, (int fd, int cmd, ...)) {
+   va_list ap;
+   void *arg;
+
+   va_start(ap, cmd);
+   arg = va_arg(ap, void *);
+   va_end(ap);
+
+   CHECK_INIT(realfcntl);
+   return(p_fcntl(fd, cmd, arg));
+}
+
+#if defined(__GLIBC__)
+ENTRY_POINT(int, fcntl64, (int fd, int cmd, ...)) {
+   va_list ap;
+   void *arg;
+
+   va_start(ap, cmd);
+   arg = va_arg(ap, void *);
+   va_end(ap);
+
+   CHECK_OPTIONAL(realfcntl64, fcntl64);
+   return(p_fcntl64(fd, cmd, arg));
+}
+#endif
+
+#if defined(__linux__)
+ENTRY_POINT(int, accept4, (int fd, struct sockaddr *address,
+                           socklen_t *address_len, int flags)) {
+   CHECK_INIT(realaccept4);
+   return(p_accept4(fd, address, address_len, flags));
+}
+
+ENTRY_POINT(int, dup3, (int fd, int fd2, int flags)) {
+   CHECK_INIT(realdup3);
+   return(p_dup3(fd, fd2, flags));
+}
+#endif
+
+ENTRY_POINT(ssize_t, send, (int fd, const void *buffer, size_t length,
+                            int flags)) {
+   CHECK_INIT(realsend);
+   return(p_send(fd, buffer, length, flags));
+}
+
+ENTRY_POINT(ssize_t, write, (int fd, const void *buffer, size_t length)) {
+   CHECK_INIT(realwrite);
+   return(p_write(fd, buffer, length));
+}
+
+ENTRY_POINT(ssize_t, writev, (int fd, const struct iovec *iov, int iovcnt)) {
+   CHECK_INIT(realwritev);
+   return(p_writev(fd, iov, iovcnt));
+}
+
+ENTRY_POINT(ssize_t, sendmsg, (int fd, const struct msghdr *message,
+                               int flags)) {
+   CHECK_INIT(realsendmsg);
+   return(p_sendmsg(fd, message, flags));
+}
+
+#if defined(__linux__)
+ENTRY_POINT(int, epoll_ctl, (int epfd, int op, int fd,
+                             struct epoll_event *event)) {
+   CHECK_INIT(realepoll_ctl);
+   return(p_epoll_ctl(epfd, op, fd, event));
+}
+
+ENTRY_POINT(int, epoll_wait, (int epfd, struct epoll_event *events,
+                              int maxevents, int timeout)) {
+   CHECK_INIT(realepoll_wait);
+   return(p_epoll_wait(epfd, events, maxevents, timeout));
+}
+
+ENTRY_POINT(int, epoll_pwait, (int epfd, struct epoll_event *events,
+                               int maxevents, int timeout,
+                               const sigset_t *sigmask)) {
+   CHECK_INIT(realepoll_pwait);
+   return(p_epoll_pwait(epfd, events, maxevents, timeout, sigmask));
+}
+#endif
+
+#endif
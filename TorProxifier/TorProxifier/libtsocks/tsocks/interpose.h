@@ -0,0 +1,183 @@
+/* interpose.h - The functions tsocks replaces and the way to reach */
+/*               the real ones                                       */
+
+#ifndef _INTERPOSE_H
+
+#define _INTERPOSE_H	1
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#if defined(__linux__)
+# include <sys/epoll.h>
+#endif
+#ifdef USE_SOCKS_DNS
+# include <resolv.h>
+#endif
+
+/* Our replacements, see tsocks.c */
+#ifdef USE_SOCKS_DNS
+int p_res_init(void);
+int p_res_query(const char *dname, int class, int type, unsigned char *answer, int anslen);
+int p_res_search(const char *dname, int class, int type, unsigned char *answer, int anslen);
+int p_res_send(const unsigned char *msg, int msglen, unsigned char *answer, int anslen);
+#endif
+#if defined(USE_TOR_DNS) && USE_TOR_DNS
+struct hostent *	p_gethostbyname(const char *name);
+struct hostent *	p_gethostbyname2(const char *name, int af);
+struct hostent *	p_gethostbyaddr(const void *addr, socklen_t len, int type);
+int					p_getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen, char *serv, socklen_t servlen, int flags);
+int					p_getaddrinfo(const char *hostname, const char *servname, const struct addrinfo *hints, struct addrinfo **res);
+void				p_freeaddrinfo(struct addrinfo *ai);
+#if defined(__GLIBC__)
+int					p_gethostbyname_r(const char *name, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop);
+int					p_gethostbyname2_r(const char *name, int af, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop);
+int					p_gethostbyaddr_r(const void *addr, socklen_t len, int type, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop);
+struct gaicb;
+int					p_getaddrinfo_a(int mode, struct gaicb *list[], int nitems, struct sigevent *sevp);
+int					p_gai_suspend(const struct gaicb *const list[], int nitems, const struct timespec *timeout);
+int					p_gai_cancel(struct gaicb *req);
+#endif
+#if defined(__APPLE__)
+struct hostent *	p_getipnodebyname(const char *name, int af, int flags, int *error_num);
+void				p_freehostent(struct hostent *he);
+#endif
+#endif
+
+int p_connect(int fd, const struct sockaddr *address, socklen_t address_len);
+
+int p_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
+int p_poll(struct pollfd fds[], nfds_t nfds, int timeout);
+#if !defined(__APPLE__)
+int p_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, const struct timespec *timeout, const sigset_t *sigmask);
+int p_ppoll(struct pollfd fds[], nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask);
+#endif
+int p_close(int fd);
+int p_getpeername(int fd, struct sockaddr *address, socklen_t *address_len);
+int p_socket(int domain, int type, int protocol);
+int p_socketpair(int domain, int type, int protocol, int sv[2]);
+int p_accept(int fd, struct sockaddr *address, socklen_t *address_len);
+int p_dup(int fd);
+int p_dup2(int fd, int fd2);
+int p_fcntl(int fd, int cmd, ...);
+#if defined(__linux__)
+int p_accept4(int fd, struct sockaddr *address, socklen_t *address_len, int flags);
+int p_dup3(int fd, int fd2, int flags);
+#endif
+#if defined(__GLIBC__)
+int p_fcntl64(int fd, int cmd, ...);
+#endif
+ssize_t p_send(int fd, const void *buffer, size_t length, int flags);
+ssize_t p_write(int fd, const void *buffer, size_t length);
+ssize_t p_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t p_sendmsg(int fd, const struct msghdr *message, int flags);
+#if defined(__linux__)
+int p_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int p_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int p_epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask);
+#endif
+
+#if defined(__APPLE__)
+
+/* dyld only applies __DATA,__interpose to calls made from other images, */
+/* inside the library the usual names still are the real functions       */
+#define realres_init		res_init
+#define realres_query		res_query
+#define realres_search		res_search
+#define realres_send		res_send
+#define realgethostbyname	gethostbyname
+#define realgethostbyname2	gethostbyname2
+#define realgethostbyaddr	gethostbyaddr
+#define realgetnameinfo		getnameinfo
+#define realgetaddrinfo		getaddrinfo
+#define realfreeaddrinfo	freeaddrinfo
+#define realgetipnodebyname	getipnodebyname
+#define realfreehostent		freehostent
+#define realconnect			connect
+#define realselect			select
+#define realpoll			poll
+#define realclose			close
+#define realgetpeername		getpeername
+#define realsocket			socket
+#define realsocketpair		socketpair
+#define realaccept			accept
+#define realdup			dup
+#define realdup2			dup2
+#define realfcntl			fcntl
+#define realsend			send
+#define realwrite			write
+#define realwritev			writev
+#define realsendmsg			sendmsg
+
+#define interpose_init()
+
+#else
+
+/* With an ELF preload our definitions win for every caller, the library */
+/* itself included, so the real functions are looked up once when we    */
+/* are loaded and always called through these pointers                   */
+#ifdef USE_SOCKS_DNS
+extern int (*realres_init)(void);
+/* In libresolv before glibc 2.34, only there when the program uses it */
+extern int (*realres_query)(const char *, int, int, unsigned char *, int);
+extern int (*realres_search)(const char *, int, int, unsigned char *, int);
+extern int (*realres_send)(const unsigned char *, int, unsigned char *, int);
+#endif
+extern struct hostent *(*realgethostbyname)(const char *);
+extern struct hostent *(*realgethostbyname2)(const char *, int);
+extern struct hostent *(*realgethostbyaddr)(const void *, socklen_t, int);
+extern int (*realgetnameinfo)(const struct sockaddr *, socklen_t, char *, socklen_t, char *, socklen_t, int);
+extern int (*realgetaddrinfo)(const char *, const char *, const struct addrinfo *, struct addrinfo **);
+extern void (*realfreeaddrinfo)(struct addrinfo *);
+#if defined(__GLIBC__)
+extern int (*realgethostbyname_r)(const char *, struct hostent *, char *, size_t, struct hostent **, int *);
+extern int (*realgethostbyname2_r)(const char *, int, struct hostent *, char *, size_t, struct hostent **, int *);
+extern int (*realgethostbyaddr_r)(const void *, socklen_t, int, struct hostent *, char *, size_t, struct hostent **, int *);
+/* Only there when the program uses them (libanl before glibc 2.34) */
+struct gaicb;
+extern int (*realgetaddrinfo_a)(int, struct gaicb **, int, struct sigevent *);
+extern int (*realgai_suspend)(const struct gaicb *const *, int, const struct timespec *);
+extern int (*realgai_cancel)(struct gaicb *);
+#endif
+extern int (*realconnect)(int, const struct sockaddr *, socklen_t);
+extern int (*realselect)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+extern int (*realpoll)(struct pollfd *, nfds_t, int);
+extern int (*realpselect)(int, fd_set *, fd_set *, fd_set *, const struct timespec *, const sigset_t *);
+extern int (*realppoll)(struct pollfd *, nfds_t, const struct timespec *, const sigset_t *);
+extern int (*realclose)(int);
+extern int (*realgetpeername)(int, struct sockaddr *, socklen_t *);
+extern int (*realsocket)(int, int, int);
+extern int (*realsocketpair)(int, int, int, int *);
+extern int (*realaccept)(int, struct sockaddr *, socklen_t *);
+extern int (*realdup)(int);
+extern int (*realdup2)(int, int);
+extern int (*realfcntl)(int, int, ...);
+#if defined(__GLIBC__)
+/* Only in glibc 2.28 and later */
+extern int (*realfcntl64)(int, int, ...);
+#endif
+extern ssize_t (*realsend)(int, const void *, size_t, int);
+extern ssize_t (*realwrite)(int, const void *, size_t);
+extern ssize_t (*realwritev)(int, const struct iovec *, int);
+extern ssize_t (*realsendmsg)(int, const struct msghdr *, int);
+#if defined(__linux__)
+extern int (*realaccept4)(int, struct sockaddr *, socklen_t *, int);
+extern int (*realdup3)(int, int, int);
+extern int (*realepoll_ctl)(int, int, int, struct epoll_event *);
+extern int (*realepoll_wait)(int, struct epoll_event *, int, int);
+extern int (*realepoll_pwait)(int, struct epoll_event *, int, int, const sigset_t *);
+#endif
+
+/* Resolve the real functions, it only does any work the first time */
+void interpose_init(void);
+
+#endif
+
+#endif
@@ -12,11 +12,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <Block.h>
 
 #include "config.h"
 #include "common.h"
 #include "parser.h"
+#include "route_table.h"
 
 /* Global configuration variables */
 static struct serverent *currentcontext = NULL;
@@ -34,68 +34,83 @@ static int handle_local(struct parsedfile *, int, char *);
 static int handle_tordns_enabled(struct parsedfile *, int, char *);
 static int handle_tordns_deadpool_range(struct parsedfile *, int, char *);
 static int handle_tordns_cache_size(struct parsedfile *, int, char *);
+static int handle_optimistic_data(struct parsedfile *, int, char *);
+static int handle_socks5_pipeline(struct parsedfile *, int, char *);
+static int handle_handshake_reactor(struct parsedfile *, int, char *);
+static int handle_handshake_timeout(struct parsedfile *, int, char *);
+static int handle_tordns_resolve_timeout(struct parsedfile *, int, char *);
+static int handle_tordns_resolve_parallel(struct parsedfile *, int, char *);
+static int handle_tordns_cache_ttl(struct parsedfile *, int, char *);
+static int handle_tordns_negative_ttl(struct parsedfile *, int, char *);
+static int handle_tordns_remote_resolve(struct parsedfile *, int, char *);
+static int handle_tordns_deterministic(struct parsedfile *, int, char *);
+static int handle_tordns_address_key(struct parsedfile *, int, char *);
+static int handle_tordns_pool_file(struct parsedfile *, int, char *);
+static int handle_socks_dns_connections(struct parsedfile *, int, char *);
+static int handle_speculative_connect(struct parsedfile *, int, char *);
+static int handle_speculative_expiry(struct parsedfile *, int, char *);
 static int handle_defuser(struct parsedfile *, int, char *);
 static int handle_defpass(struct parsedfile *, int, char *);
 static int make_netent(char *value, struct toscks_netent **ent);
 
 // --JP/
+struct line_enumerator {
+	char	*str;		/* Remaining lines of a buffer, or NULL */
+	size_t	pos;
+	FILE	*file;		/* File being read, or NULL */
+};
+
+static void copy_line(char line[MAXLINE], const char *src)
+{
+	size_t len = strlen(src);
+	
+	if (len >= MAXLINE)
+		len = MAXLINE - 1;
+	
+	memset(line, 0, MAXLINE);
+	memcpy(line, src, len);
+}
+
 line_enumerator line_enumerator_buffer(const char *string)
 {
-	__block char		*str = strdup(string);
-	__block uint32_t	i = 0;
+	line_enumerator enumerator = calloc(1, sizeof(*enumerator));
 	
-	line_enumerator enumerator = ^ int (char line[MAXLINE]) {
-		
-		if (!str)
-			return 0;
-		
-		uint32_t j = i;
-		
-		while (1)
-		{
-			if (str[j] == '\0')
-			{
-				memset(line, 0, MAXLINE);
-				strlcpy(line, str + i, MAXLINE);
-				free(str);
-				str = NULL;
-				
-				return 1;
-			}
-			else if (str[j] == '\n')
-			{
-				str[j] = '\0';
-				memset(line, 0, MAXLINE);
-				strlcpy(line, str + i, MAXLINE);
-				i = j + 1;
-				
-				return 1;
-			}
-			
-			j++;
-		}
-	};
+	if (!enumerator)
+		return NULL;
 	
-	return Block_copy(enumerator);
+	enumerator->str = strdup(string);
+	
+	return enumerator;
 }
 
 line_enumerator line_enumerator_file(const char *path)
 {
-	__block FILE *file = fopen(path, "r");
+	line_enumerator enumerator;
+	FILE *file = fopen(path, "r");
 	
 	if (!file)
 		return NULL;
 	
-	line_enumerator enumerator = ^ int (char line[MAXLINE]) {
-		
-		if (!file)
-			return 0;
-		
+	if ((enumerator = calloc(1, sizeof(*enumerator))) == NULL)
+	{
+		fclose(file);
+		return NULL;
+	}
+	
+	enumerator->file = file;
+	
+	return enumerator;
+}
+
+int line_enumerator_next(line_enumerator enumerator, char line[MAXLINE])
+{
+	if (enumerator->file)
+	{
 		memset(line, 0, MAXLINE);
-		if (fgets(line, MAXLINE, file) == NULL)
+		if (fgets(line, MAXLINE, enumerator->file) == NULL)
 		{
-			fclose(file);
-			file = NULL;
+			fclose(enumerator->file);
+			enumerator->file = NULL;
 			return 0;
 		}
 		
@@ -105,10 +120,47 @@ line_enumerator line_enumerator_file(const char *path)
 			line[len - 1] = '\0';
 		
 		return 1;
-	};
+	}
+	
+	if (!enumerator->str)
+		return 0;
 	
+	char	*str = enumerator->str;
+	size_t	j = enumerator->pos;
 	
-	return Block_copy(enumerator);
+	while (1)
+	{
+		if (str[j] == '\0')
+		{
+			copy_line(line, str + enumerator->pos);
+			free(str);
+			enumerator->str = NULL;
+			
+			return 1;
+		}
+		else if (str[j] == '\n')
+		{
+			str[j] = '\0';
+			copy_line(line, str + enumerator->pos);
+			enumerator->pos = j + 1;
+			
+			return 1;
+		}
+		
+		j++;
+	}
+}
+
+void line_enumerator_free(line_enumerator enumerator)
+{
+	if (!enumerator)
+		return;
+	
+	if (enumerator->file)
+		fclose(enumerator->file);
+	
+	free(enumerator->str);
+	free(enumerator);
 }
 // --JP!
 
@@ -127,6 +179,16 @@ int read_config (line_enumerator liner, struct parsedfile *config) {
    /* Tordns defaults */
    config->tordns_cache_size = 256;
    config->tordns_enabled = 1;
+   config->tordns_resolve_timeout = 60;
+   config->tordns_resolve_parallel = 8;
+   /* The server doesn't tell how long an address may be kept */
+   config->tordns_cache_ttl = 600;
+   config->tordns_negative_ttl = 30;
+   /* Long enough for the connect() following a lookup, and no more */
+   config->speculative_expiry = 5;
+
+   /* The same as Tor's own SocksTimeout */
+   config->handshake_timeout = 120;
 
 //	/* If a filename wasn't provided, use the default */
 //	if (filename == NULL) {
@@ -146,7 +208,7 @@ int read_config (line_enumerator liner, struct parsedfile *config) {
 	else {
       memset(&(config->defaultserver), 0x0, sizeof(config->defaultserver));
 
-		while (liner(line)) {
+		while (line_enumerator_next(liner, line)) {
 		//while (NULL != fgets(line, MAXLINE, conf)) {
 			/* This line _SHOULD_ end in \n so we  */
 			/* just chop off the \n and hand it on */
@@ -177,6 +239,9 @@ int read_config (line_enumerator liner, struct parsedfile *config) {
         handle_tordns_deadpool_range(config, 0, "127.0.69.0/255.255.255.0");
     }
 
+	/* The networks are looked up on every connect, not walked */
+	config->routes = route_table_build(config);
+
 	return(rc);
 }
 
@@ -248,6 +313,36 @@ static int handle_line(struct parsedfile *config, char *line, int lineno) {
                 handle_tordns_deadpool_range(config, lineno, words[2]);
             } else if (!strcmp(words[0], "tordns_cache_size")) {
                 handle_tordns_cache_size(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_resolve_timeout")) {
+                handle_tordns_resolve_timeout(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_resolve_parallel")) {
+                handle_tordns_resolve_parallel(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_cache_ttl")) {
+                handle_tordns_cache_ttl(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_negative_ttl")) {
+                handle_tordns_negative_ttl(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_remote_resolve")) {
+                handle_tordns_remote_resolve(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_deterministic")) {
+                handle_tordns_deterministic(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_address_key")) {
+                handle_tordns_address_key(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "tordns_pool_file")) {
+                handle_tordns_pool_file(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "socks_dns_connections")) {
+                handle_socks_dns_connections(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "speculative_connect")) {
+                handle_speculative_connect(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "speculative_expiry")) {
+                handle_speculative_expiry(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "optimistic_data")) {
+                handle_optimistic_data(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "socks5_pipeline")) {
+                handle_socks5_pipeline(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "handshake_reactor")) {
+                handle_handshake_reactor(config, lineno, words[2]);
+            } else if (!strcmp(words[0], "handshake_timeout")) {
+                handle_handshake_timeout(config, lineno, words[2]);
             } else {
 				show_msg(MSGERR, "Invalid pair type (%s) specified "
 					   "on line %d in configuration file, "
@@ -539,6 +634,218 @@ static int handle_tordns_enabled(struct parsedfile *config, int lineno, char *va
     return 0;
 }
 
+static int handle_optimistic_data(struct parsedfile *config, int lineno, char *value)
+{
+    int val = handle_flag(value);
+    if(val == -1) {
+        show_msg(MSGERR, "Invalid value %s supplied for optimistic_data at "
+                 "line %d in config file, IGNORED\n", value, lineno);
+    } else {
+        config->optimistic_data = val;
+    }
+    return 0;
+}
+
+static int handle_socks5_pipeline(struct parsedfile *config, int lineno, char *value)
+{
+    int val = handle_flag(value);
+    if(val == -1) {
+        show_msg(MSGERR, "Invalid value %s supplied for socks5_pipeline at "
+                 "line %d in config file, IGNORED\n", value, lineno);
+    } else {
+        config->socks5_pipeline = val;
+    }
+    return 0;
+}
+
+static int handle_handshake_reactor(struct parsedfile *config, int lineno, char *value)
+{
+    int val = handle_flag(value);
+    if(val == -1) {
+        show_msg(MSGERR, "Invalid value %s supplied for handshake_reactor at "
+                 "line %d in config file, IGNORED\n", value, lineno);
+    } else {
+        config->handshake_reactor = val;
+    }
+    return 0;
+}
+
+static int handle_handshake_timeout(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long secs = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (secs < 0) || (secs > 86400)) {
+        show_msg(MSGERR, "Invalid value %s supplied for handshake_timeout at "
+                 "line %d in config file, using default %d\n", value, lineno,
+                 config->handshake_timeout);
+    } else {
+        config->handshake_timeout = (int)secs;
+    }
+    return 0;
+}
+
+static int handle_tordns_resolve_timeout(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long secs = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (secs < 0) || (secs > 86400)) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_resolve_timeout "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->tordns_resolve_timeout);
+    } else {
+        config->tordns_resolve_timeout = (int)secs;
+    }
+    return 0;
+}
+
+static int handle_tordns_resolve_parallel(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long count = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (count < 1) || (count > 256)) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_resolve_parallel "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->tordns_resolve_parallel);
+    } else {
+        config->tordns_resolve_parallel = (int)count;
+    }
+    return 0;
+}
+
+static int handle_tordns_cache_ttl(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long secs = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (secs < 0) || (secs > 604800)) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_cache_ttl "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->tordns_cache_ttl);
+    } else {
+        config->tordns_cache_ttl = (int)secs;
+    }
+    return 0;
+}
+
+static int handle_tordns_negative_ttl(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long secs = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (secs < 0) || (secs > 3600)) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_negative_ttl "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->tordns_negative_ttl);
+    } else {
+        config->tordns_negative_ttl = (int)secs;
+    }
+    return 0;
+}
+
+static int handle_tordns_remote_resolve(struct parsedfile *config, int lineno, char *value)
+{
+    int val = handle_flag(value);
+    if(val == -1) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_remote_resolve "
+                 "at line %d in config file, IGNORED\n", value, lineno);
+    } else {
+        config->tordns_remote_resolve = val;
+    }
+    return 0;
+}
+
+static int handle_tordns_deterministic(struct parsedfile *config, int lineno, char *value)
+{
+    int val = handle_flag(value);
+    if(val == -1) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_deterministic "
+                 "at line %d in config file, IGNORED\n", value, lineno);
+    } else {
+        config->tordns_deterministic = val;
+    }
+    return 0;
+}
+
+/* Up to 32 hex digits, the key's first byte first, missing ones are 0 */
+static int handle_tordns_address_key(struct parsedfile *config, int lineno, char *value)
+{
+    unsigned char key[sizeof(config->tordns_address_key)];
+    size_t i, len = strlen(value);
+    int digit;
+
+    memset(key, 0, sizeof(key));
+    for(i = 0; i < len && len <= 2 * sizeof(key); i++) {
+        if(value[i] >= '0' && value[i] <= '9') {
+            digit = value[i] - '0';
+        } else if(value[i] >= 'a' && value[i] <= 'f') {
+            digit = value[i] - 'a' + 10;
+        } else if(value[i] >= 'A' && value[i] <= 'F') {
+            digit = value[i] - 'A' + 10;
+        } else {
+            break;
+        }
+        key[i / 2] |= (unsigned char) (digit << ((i % 2) ? 0 : 4));
+    }
+    if(len == 0 || i != len) {
+        show_msg(MSGERR, "Invalid value %s supplied for tordns_address_key "
+                 "at line %d in config file, IGNORED\n", value, lineno);
+    } else {
+        memcpy(config->tordns_address_key, key, sizeof(key));
+    }
+    return 0;
+}
+
+static int handle_tordns_pool_file(struct parsedfile *config, int lineno, char *value)
+{
+    if(config->tordns_pool_file != NULL) {
+        show_msg(MSGERR, "tordns_pool_file may only be specified once, "
+                 "at line %d in config file, IGNORED\n", lineno);
+    } else {
+        config->tordns_pool_file = strdup(value);
+    }
+    return 0;
+}
+
+static int handle_socks_dns_connections(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long count = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (count < 0) || (count > 8)) {
+        show_msg(MSGERR, "Invalid value %s supplied for socks_dns_connections "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->socks_dns_connections);
+    } else {
+        config->socks_dns_connections = (int)count;
+    }
+    return 0;
+}
+
+static int handle_speculative_connect(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long count = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (count < 0) || (count > 64)) {
+        show_msg(MSGERR, "Invalid value %s supplied for speculative_connect "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->speculative_connect);
+    } else {
+        config->speculative_connect = (int)count;
+    }
+    return 0;
+}
+
+static int handle_speculative_expiry(struct parsedfile *config, int lineno, char *value)
+{
+    char *endptr;
+    long secs = strtol(value, &endptr, 10);
+    if((*endptr != '\0') || (secs < 1) || (secs > 300)) {
+        show_msg(MSGERR, "Invalid value %s supplied for speculative_expiry "
+                 "at line %d in config file, using default %d\n", value, 
+                 lineno, config->speculative_expiry);
+    } else {
+        config->speculative_expiry = (int)secs;
+    }
+    return 0;
+}
+
 static int handle_tordns_cache_size(struct parsedfile *config, int lineno, char *value)
 {
     char *endptr;
@@ -551,9 +858,9 @@ static int handle_tordns_cache_size(struct parsedfile *config, int lineno, char
         show_msg(MSGERR, "The value supplied for tordns_cache_size (%d) "
                  "is too small (<128), using default %d\n", size, 
                  config->tordns_cache_size);
-    } else if(size > 4096) {
+    } else if(size > 1048576) {
         show_msg(MSGERR, "The value supplied for tordns_cache_range (%d) "
-                 "is too large (>4096), using default %d\n", size, 
+                 "is too large (>1048576), using default %d\n", size, 
                  config->tordns_cache_size);
     } else {
         config->tordns_cache_size = (int)size;
@@ -794,6 +1101,9 @@ int is_local(struct parsedfile *config, struct in_addr *testip)
 {
 	struct toscks_netent *ent;
 
+	if (config->routes)
+		return(!route_table_is_local(config->routes, testip->s_addr));
+
 	for (ent = (config->localnets); ent != NULL; ent = ent -> next) {
 		if ((testip->s_addr & ent->localnet.s_addr) ==
 		    (ent->localip.s_addr & ent->localnet.s_addr))  {
@@ -810,7 +1120,15 @@ int pick_server(struct parsedfile *config, struct serverent **ent, struct in_add
 	struct toscks_netent *net;
    char ipbuf[64];
 
-   show_msg(MSGDEBUG, "Picking appropriate server for %s\n", inet_ntoa(*ip));
+   if (MSG_ENABLED(MSGDEBUG))
+      show_msg(MSGDEBUG, "Picking appropriate server for %s\n", inet_ntoa(*ip));
+   if (config->routes) {
+      *ent = route_table_pick(config->routes, ip->s_addr, port);
+      if (*ent == NULL)
+         *ent = &(config->defaultserver);
+      return(0);
+   }
+
 	*ent = (config->paths);
 	while (*ent != NULL) {
 		/* Go through all the servers looking for one */
@@ -819,9 +1137,11 @@ int pick_server(struct parsedfile *config, struct serverent **ent, struct in_add
                ((*ent)->address ? (*ent)->address : "(No Address)"));
 		net = (*ent)->reachnets;
 		while (net != NULL) {
-         strcpy(ipbuf, inet_ntoa(net->localip));
-         show_msg(MSGDEBUG, "Server can reach %s/%s\n", 
-                  ipbuf, inet_ntoa(net->localnet));
+         if (MSG_ENABLED(MSGDEBUG)) {
+            strcpy(ipbuf, inet_ntoa(net->localip));
+            show_msg(MSGDEBUG, "Server can reach %s/%s\n", 
+                     ipbuf, inet_ntoa(net->localnet));
+         }
 			if (((ip->s_addr & net->localnet.s_addr) ==
               (net->localip.s_addr & net->localnet.s_addr)) &&
              (!net->startport || 
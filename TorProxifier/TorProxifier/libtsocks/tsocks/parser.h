@@ -18,9 +18,31 @@ struct serverent {
 	char *defuser; /* Default username for this socks server */
 	char *defpass; /* Default password for this socks server */
 	struct toscks_netent *reachnets; /* Linked list of nets from this server */
+	int pipeline; /* PIPELINE_*, whether it takes a pipelined V5 handshake */
 	struct serverent *next; /* Pointer to next server entry */
+
+	/* Worked out once the configuration is loaded so that connecting */
+	/* needs no resolving, passwd or environment lookups              */
+	int status; /* SERVER_OK or why the server can't be used */
+	struct sockaddr_in serveraddr; /* Address to connect to */
+	char *v4req; /* V4 request header and username, up to its NUL */
+	int v4reqlen;
+	char *v5auth; /* V5 username/password message, or NULL and why */
+	int v5authlen;
+	const char *v5autherr;
 };
 
+/* Values for serverent->status */
+#define SERVER_OK               0
+#define SERVER_NO_ADDRESS       1
+#define SERVER_INVALID          2
+#define SERVER_NOT_LOCAL        3
+
+/* Values for serverent->pipeline */
+#define PIPELINE_UNKNOWN        0  /* No lock step handshake done yet */
+#define PIPELINE_YES            1
+#define PIPELINE_NO             2
+
 /* Structure representing a network */
 struct toscks_netent {
    struct in_addr localip; /* Base IP of the network */
@@ -35,17 +57,45 @@ struct parsedfile {
    struct toscks_netent *localnets;
    struct serverent defaultserver;
    struct serverent *paths;
+   struct route_table *routes;  /* localnets and the paths' reachnets, */
+                                /* indexed, or NULL                     */
    int tordns_enabled;
    int tordns_failopen;
    int tordns_cache_size;
    struct toscks_netent *tordns_deadpool_range;
+   int tordns_resolve_timeout;  /* Seconds a lookup may take, 0 for ever */
+   int tordns_resolve_parallel; /* Lookups sent to the server at once */
+   int tordns_cache_ttl;        /* Seconds resolved names are kept, 0 for */
+                                /* ever                                   */
+   int tordns_negative_ttl;     /* Seconds failed names are kept, 0 for */
+                                /* none                                 */
+   int tordns_remote_resolve;   /* Give every name a deadrange address, */
+                                /* the server resolves it on connect    */
+   int tordns_deterministic;    /* Derive deadrange addresses from a */
+                                /* keyed hash of the name            */
+   unsigned char tordns_address_key[16]; /* The key of that hash */
+   char *tordns_pool_file;      /* File the pool is kept in, shared by */
+                                /* the user's processes, or NULL       */
+   int socks_dns_connections;   /* Connections to the nameserver the */
+                                /* res_* queries are pipelined over, */
+                                /* 0 for one per query               */
+   int speculative_connect;     /* Streams opened ahead of connect(), Linux only */
+                                /* after lookups, 0 for none         */
+   int speculative_expiry;      /* Seconds they wait to be claimed */
+   int optimistic_data;    /* Let the caller write before the connect reply */
+   int socks5_pipeline;    /* Send the whole V5 handshake in one flight */
+   int handshake_reactor;  /* Negotiate non blocking sockets in a thread */
+   int handshake_timeout;  /* Seconds a negotiation may take, 0 for ever */
 };
 
-typedef int (^line_enumerator)(char line[MAXLINE]);
+/* Source of configuration lines, either a buffer or a file */
+typedef struct line_enumerator *line_enumerator;
 
 /* Functions provided by parser module */
 line_enumerator line_enumerator_buffer(const char *string);
 line_enumerator line_enumerator_file(const char *path);
+int line_enumerator_next(line_enumerator, char line[MAXLINE]);
+void line_enumerator_free(line_enumerator);
 
 int read_config(line_enumerator, struct parsedfile *);
 
@@ -0,0 +1,391 @@
+/*
+
+    reactor.c    - Thread negotiating with the socks server for non
+                   blocking sockets
+
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#if defined(__linux__)
+# include <sys/epoll.h>
+#else
+# include <sys/event.h>
+#endif
+
+#include "common.h"
+#include "parser.h"
+#include "tsocks.h"
+#include "interpose.h"
+#include "reactor.h"
+
+/* Events handled per wait */
+#define REACTOR_EVENTS          64
+
+/* The thread is started with the first request it is given and runs */
+/* for the life of the process. Without a thread, after fork() in the */
+/* child, it is started again on demand                              */
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int reactor_fd = -1;
+static int reactor_wake[2] = { -1, -1 };
+static int reactor_atfork = 0;
+static reactor_drive_t reactor_drive = NULL;
+
+/* Requests with a deadline, the first one times out first. They all */
+/* get the same timeout so adding to the tail keeps the order        */
+static struct connreq *timers_head = NULL;
+static struct connreq *timers_tail = NULL;
+
+/* Every request the thread drives, timed or not */
+static struct connreq *watched_head = NULL;
+
+static long long reactor_now(void) {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return(((long long) now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+/* The reactor mutex must be held for the timer functions */
+static void timer_link(struct connreq *conn) {
+   conn->timernext = NULL;
+   conn->timerprev = timers_tail;
+   if (timers_tail)
+      timers_tail->timernext = conn;
+   else
+      timers_head = conn;
+   timers_tail = conn;
+}
+
+static void timer_unlink(struct connreq *conn) {
+   if (conn->timerprev)
+      conn->timerprev->timernext = conn->timernext;
+   else
+      timers_head = conn->timernext;
+   if (conn->timernext)
+      conn->timernext->timerprev = conn->timerprev;
+   else
+      timers_tail = conn->timerprev;
+   conn->timernext = conn->timerprev = NULL;
+   conn->deadline = 0;
+}
+
+static void watch_link(struct connreq *conn) {
+   conn->watchprev = NULL;
+   conn->watchnext = watched_head;
+   if (watched_head)
+      watched_head->watchprev = conn;
+   watched_head = conn;
+}
+
+static void watch_unlink(struct connreq *conn) {
+   if (conn->watchprev)
+      conn->watchprev->watchnext = conn->watchnext;
+   else
+      watched_head = conn->watchnext;
+   if (conn->watchnext)
+      conn->watchnext->watchprev = conn->watchprev;
+   conn->watchnext = conn->watchprev = NULL;
+}
+
+static int set_events(int fd, int old, int events) {
+#if defined(__linux__)
+   struct epoll_event event;
+
+   memset(&event, 0x0, sizeof(event));
+   event.events = ((events & REACTOR_READ) ? EPOLLIN : 0) |
+                  ((events & REACTOR_WRITE) ? EPOLLOUT : 0);
+   event.data.fd = fd;
+
+   if (!(events & REACTOR_WATCHED))
+      return(realepoll_ctl(reactor_fd, EPOLL_CTL_DEL, fd, NULL));
+   if (!(old & REACTOR_WATCHED))
+      return(realepoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &event));
+   /* The socket may have been replaced under the fd, which drops it */
+   /* from the set                                                    */
+   if (realepoll_ctl(reactor_fd, EPOLL_CTL_MOD, fd, &event) &&
+       (errno == ENOENT))
+      return(realepoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &event));
+   return(0);
+#else
+   struct kevent changes[2];
+   int n = 0;
+
+   /* Filters are deleted and added rather than disabled, the socket */
+   /* may have been replaced under the fd which drops its filters     */
+   if ((old & REACTOR_READ) && !(events & REACTOR_READ))
+      EV_SET(&changes[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+   if ((old & REACTOR_WRITE) && !(events & REACTOR_WRITE))
+      EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+   if (n)
+      kevent(reactor_fd, changes, n, NULL, 0, NULL);
+
+   n = 0;
+   if (events & REACTOR_READ)
+      EV_SET(&changes[n++], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+   if (events & REACTOR_WRITE)
+      EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+   return(n ? kevent(reactor_fd, changes, n, NULL, 0, NULL) : 0);
+#endif
+}
+
+static void *reactor_thread(void *arg) {
+#if defined(__linux__)
+   struct epoll_event events[REACTOR_EVENTS];
+#else
+   struct kevent events[REACTOR_EVENTS];
+   struct timespec ts;
+#endif
+   struct connreq *head;
+   long long now, deadline;
+   int timeout, n, i, fd;
+   char drain[64];
+
+   for (;;) {
+      pthread_mutex_lock(&reactor_mutex);
+      timeout = -1;
+      if (timers_head) {
+         deadline = timers_head->deadline - reactor_now();
+         timeout = (deadline < 0) ? 0 : (int) deadline;
+      }
+      pthread_mutex_unlock(&reactor_mutex);
+
+#if defined(__linux__)
+      n = realepoll_wait(reactor_fd, events, REACTOR_EVENTS, timeout);
+#else
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000;
+      n = kevent(reactor_fd, NULL, 0, events, REACTOR_EVENTS,
+                 (timeout == -1) ? NULL : &ts);
+#endif
+      if ((n == -1) && (errno != EINTR)) {
+         show_msg(MSGERR, "Reactor thread failed to wait for events (%s), "
+                          "stopping\n", strerror(errno));
+         return(NULL);
+      }
+
+      for (i = 0; i < n; i++) {
+#if defined(__linux__)
+         fd = events[i].data.fd;
+#else
+         fd = (int) events[i].ident;
+#endif
+         if (fd == reactor_wake[0]) {
+            while (read(fd, drain, sizeof(drain)) > 0)
+               ;
+            continue;
+         }
+         reactor_drive(fd, 0);
+      }
+
+      /* Time out the requests whose deadline passed */
+      now = reactor_now();
+      for (;;) {
+         pthread_mutex_lock(&reactor_mutex);
+         if (!(head = timers_head) || (head->deadline > now)) {
+            pthread_mutex_unlock(&reactor_mutex);
+            break;
+         }
+         fd = head->sockid;
+         pthread_mutex_unlock(&reactor_mutex);
+
+         reactor_drive(fd, 1);
+
+         /* The request should be gone, don't spin on it if it isn't.  */
+         /* Its slot may have gone to a new request meanwhile, even one */
+         /* for the same fd, which only has to wait for its own turn   */
+         pthread_mutex_lock(&reactor_mutex);
+         if ((timers_head == head) && (head->sockid == fd) && 
+             (head->deadline <= now))
+            timer_unlink(head);
+         pthread_mutex_unlock(&reactor_mutex);
+      }
+   }
+
+   return(NULL);
+}
+
+static void reactor_prepare(void) {
+   pthread_mutex_lock(&reactor_mutex);
+}
+
+static void reactor_parent(void) {
+   pthread_mutex_unlock(&reactor_mutex);
+}
+
+/* Only the thread which forked exists in the child, so the requests */
+/* there go back to being driven by the caller's calls only          */
+static void reactor_child(void) {
+   struct connreq *conn;
+
+   while ((conn = timers_head))
+      timer_unlink(conn);
+   while ((conn = watched_head)) {
+      watch_unlink(conn);
+      conn->reactor = 0;
+   }
+   if (reactor_fd != -1) {
+      realclose(reactor_fd);
+      realclose(reactor_wake[0]);
+      realclose(reactor_wake[1]);
+      reactor_fd = reactor_wake[0] = reactor_wake[1] = -1;
+   }
+   pthread_mutex_unlock(&reactor_mutex);
+}
+
+/* The reactor mutex must be held */
+static int reactor_start(void) {
+   pthread_t thread;
+   pthread_attr_t attr;
+   sigset_t all, old;
+   int rc, i;
+
+   if (reactor_fd != -1)
+      return(0);
+
+   if (!reactor_atfork) {
+      pthread_atfork(reactor_prepare, reactor_parent, reactor_child);
+      reactor_atfork = 1;
+   }
+
+#if defined(__linux__)
+   reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+   if ((reactor_fd = kqueue()) != -1)
+      fcntl(reactor_fd, F_SETFD, FD_CLOEXEC);
+#endif
+   if (reactor_fd == -1) {
+      show_msg(MSGERR, "Could not create the reactor (%s)\n", strerror(errno));
+      return(-1);
+   }
+   if (pipe(reactor_wake)) {
+      show_msg(MSGERR, "Could not create the reactor pipe (%s)\n",
+               strerror(errno));
+      realclose(reactor_fd);
+      reactor_fd = -1;
+      return(-1);
+   }
+   for (i = 0; i < 2; i++) {
+      fcntl(reactor_wake[i], F_SETFL, O_NONBLOCK);
+      fcntl(reactor_wake[i], F_SETFD, FD_CLOEXEC);
+   }
+   set_events(reactor_wake[0], 0, REACTOR_WATCHED | REACTOR_READ);
+
+   /* The caller's signals are none of our business */
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   rc = pthread_create(&thread, &attr, reactor_thread, NULL);
+   pthread_attr_destroy(&attr);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+   if (rc) {
+      show_msg(MSGERR, "Could not start the reactor thread (%s)\n",
+               strerror(rc));
+      realclose(reactor_fd);
+      realclose(reactor_wake[0]);
+      realclose(reactor_wake[1]);
+      reactor_fd = reactor_wake[0] = reactor_wake[1] = -1;
+      return(-1);
+   }
+
+   show_msg(MSGDEBUG, "Reactor thread started\n");
+   return(0);
+}
+
+static int wanted_events(struct connreq *conn) {
+   if ((conn->state == FAILED) || (conn->state == DONE))
+      return(0);
+   /* A poll() is waiting on the socket, it drives the request until it */
+   /* returns. Were we to read the replies it wouldn't be woken up     */
+   if (conn->polled)
+      return(REACTOR_WATCHED);
+   if ((conn->state == SENDING) || (conn->state == CONNECTING))
+      return(REACTOR_WATCHED | REACTOR_WRITE);
+   if (conn->state == RECEIVING)
+      return(REACTOR_WATCHED | REACTOR_READ);
+   return(REACTOR_WATCHED);
+}
+
+int reactor_watch(struct connreq *conn, int timeout, reactor_drive_t drive) {
+   int wake = 0, events;
+
+   if (conn->reactor || !(events = wanted_events(conn)))
+      return(0);
+
+   pthread_mutex_lock(&reactor_mutex);
+   reactor_drive = drive;
+   if (reactor_start()) {
+      pthread_mutex_unlock(&reactor_mutex);
+      return(-1);
+   }
+   if (set_events(conn->sockid, 0, events)) {
+      show_msg(MSGERR, "Could not hand socket %d to the reactor (%s)\n",
+               conn->sockid, strerror(errno));
+      pthread_mutex_unlock(&reactor_mutex);
+      return(-1);
+   }
+   conn->reactor = events;
+   watch_link(conn);
+   if (timeout > 0) {
+      conn->deadline = reactor_now() + timeout;
+      /* The thread may be waiting without a timeout */
+      wake = (timers_head == NULL);
+      timer_link(conn);
+   }
+   pthread_mutex_unlock(&reactor_mutex);
+
+   if (wake)
+      write(reactor_wake[1], "", 1);
+
+   show_msg(MSGDEBUG, "Socket %d handed to the reactor\n", conn->sockid);
+   return(0);
+}
+
+/* Follow the request to its next state, it is dropped once finished */
+void reactor_update(struct connreq *conn) {
+   int events = wanted_events(conn);
+
+   if (!conn->reactor)
+      return;
+   if (!events) {
+      reactor_unwatch(conn);
+      return;
+   }
+   if ((events != conn->reactor) &&
+       !set_events(conn->sockid, conn->reactor, events))
+      conn->reactor = events;
+}
+
+void reactor_unwatch(struct connreq *conn) {
+   if (!conn->reactor)
+      return;
+
+   pthread_mutex_lock(&reactor_mutex);
+   if (reactor_fd != -1)
+      set_events(conn->sockid, conn->reactor, 0);
+   if (conn->deadline)
+      timer_unlink(conn);
+   watch_unlink(conn);
+   conn->reactor = 0;
+   pthread_mutex_unlock(&reactor_mutex);
+}
+
+int reactor_expired(struct connreq *conn) {
+   return(conn->reactor && conn->deadline &&
+          (conn->deadline <= reactor_now()));
+}
@@ -0,0 +1,27 @@
+/* reactor.h - Thread negotiating with the socks server for non blocking */
+/*             sockets, whether the caller polls them or not              */
+
+#ifndef _REACTOR_H
+
+#define _REACTOR_H	1
+
+struct connreq;
+
+/* Called from the reactor thread, with no lock held, when fd has the */
+/* events the reactor waits for or when its negotiation timed out     */
+typedef void (*reactor_drive_t)(int fd, int expired);
+
+/* Events the reactor can wait for (see connreq->reactor) */
+#define REACTOR_WATCHED         (1 << 0)
+#define REACTOR_READ            (1 << 1)
+#define REACTOR_WRITE           (1 << 2)
+
+/* The fd lock for conn must be held for all of these. timeout is in   */
+/* milliseconds, 0 for none. Returns -1 if the thread couldn't be      */
+/* started, the request is then only driven by the caller's calls      */
+int reactor_watch(struct connreq *conn, int timeout, reactor_drive_t drive);
+void reactor_update(struct connreq *conn);
+void reactor_unwatch(struct connreq *conn);
+int reactor_expired(struct connreq *conn);
+
+#endif
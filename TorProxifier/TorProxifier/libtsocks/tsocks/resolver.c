@@ -0,0 +1,656 @@
+/*
+
+    resolver.c    - Resolves names with Tor's SOCKS RESOLVE extension
+
+*/
+
+#include "config.h"
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "interpose.h"
+#include "resolver.h"
+
+/* In flight lookups are found by hashing their name */
+#define RESOLVER_BUCKETS        64
+
+#define NO_DEADLINE             (-1LL)
+
+#define RESPONSE_LEN 8
+
+#ifdef MSG_NOSIGNAL
+# define RESOLVER_SEND_FLAGS    MSG_NOSIGNAL
+#else
+# define RESOLVER_SEND_FLAGS    0
+#endif
+
+/* A lookup sent to the server, the threads asking for the same name */
+/* meanwhile wait for its answer rather than sending their own       */
+struct lookup {
+   struct lookup *next;
+   pthread_cond_t done_cond;
+   int refs;               /* The sender and the threads waiting */
+   int done;
+   int rc;
+   uint32_t addr;
+   char name[256];
+};
+
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_slots = PTHREAD_COND_INITIALIZER;
+static struct lookup *inflight[RESOLVER_BUCKETS];
+static int resolver_busy = 0;
+static int resolver_timeout = 0;
+static int resolver_parallel = 8;
+static int resolver_atfork = 0;
+
+#if defined(__GLIBC__)
+/* A getaddrinfo_a() call, its requests are handed out in order to up */
+/* to resolver_parallel threads                                       */
+struct batch {
+   struct batch *next;
+   struct gaicb **list;    /* Our copy of the caller's list */
+   int nitems;
+   int next_item;          /* First request not handed out yet */
+   int workers;            /* Threads still working on the batch */
+   int wait;               /* GAI_WAIT, the caller frees the batch */
+   struct sigevent sevp;
+   int notify;
+};
+
+static struct batch *batches = NULL;
+/* Broadcast whenever a request of a batch finishes */
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+#endif
+
+static int do_resolve(const char *hostname, uint32_t sockshost,
+                      uint16_t socksport, long long deadline,
+                      uint32_t *result_addr);
+
+static long long resolver_now(void) {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return(((long long) now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+/* Milliseconds left before deadline, -1 for none */
+static int resolver_left(long long deadline) {
+   long long left;
+
+   if (deadline == NO_DEADLINE)
+      return(-1);
+   left = deadline - resolver_now();
+   if (left <= 0)
+      return(0);
+   return((left > INT32_MAX) ? INT32_MAX : (int) left);
+}
+
+/* Wait on cond with the resolver mutex held. Returns ETIMEDOUT once the */
+/* deadline passed                                                       */
+static int resolver_wait(pthread_cond_t *cond, long long deadline) {
+   struct timeval now;
+   struct timespec until;
+   int left;
+
+   if ((left = resolver_left(deadline)) == -1)
+      return(pthread_cond_wait(cond, &resolver_mutex));
+   if (left == 0)
+      return(ETIMEDOUT);
+
+   /* Condition variables wait on the wall clock */
+   gettimeofday(&now, NULL);
+   until.tv_sec = now.tv_sec + (left / 1000);
+   until.tv_nsec = (now.tv_usec * 1000L) + ((left % 1000) * 1000000L);
+   if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+   }
+   return(pthread_cond_timedwait(cond, &resolver_mutex, &until));
+}
+
+static unsigned int name_hash(const char *name) {
+   unsigned int hash = 2166136261u;
+
+   while (*name)
+      hash = (hash ^ (unsigned char) *name++) * 16777619u;
+   return(hash % RESOLVER_BUCKETS);
+}
+
+static void lookup_release(struct lookup *lookup) {
+   if (--lookup->refs)
+      return;
+   pthread_cond_destroy(&(lookup->done_cond));
+   free(lookup);
+}
+
+static void resolver_prepare(void) {
+   pthread_mutex_lock(&resolver_mutex);
+}
+
+static void resolver_parent(void) {
+   pthread_mutex_unlock(&resolver_mutex);
+}
+
+/* The threads sending lookups are gone in the child, so are their */
+/* answers. The lookups are left to the parent to free             */
+static void resolver_child(void) {
+   memset(inflight, 0x0, sizeof(inflight));
+   resolver_busy = 0;
+#if defined(__GLIBC__)
+   batches = NULL;
+#endif
+   pthread_mutex_unlock(&resolver_mutex);
+}
+
+void resolver_setup(int timeout, int parallel) {
+   pthread_mutex_lock(&resolver_mutex);
+   if (!resolver_atfork) {
+      pthread_atfork(resolver_prepare, resolver_parent, resolver_child);
+      resolver_atfork = 1;
+   }
+   resolver_timeout = timeout;
+   resolver_parallel = parallel;
+   pthread_mutex_unlock(&resolver_mutex);
+}
+
+int resolve_remote(const char *hostname, uint32_t sockshost,
+                   uint16_t socksport, uint32_t *result)
+{
+   struct lookup *lookup, **bucket;
+   long long deadline = NO_DEADLINE;
+   uint32_t addr = 0;
+   int rc = -1;
+
+   if (strlen(hostname) >= sizeof(lookup->name)) {
+      show_msg(MSGWARN, "resolve_remote: name too long: %s\n", hostname);
+      return(-1);
+   }
+
+   pthread_mutex_lock(&resolver_mutex);
+   if (resolver_timeout)
+      deadline = resolver_now() + resolver_timeout;
+
+   bucket = &inflight[name_hash(hostname)];
+   for (lookup = *bucket; lookup; lookup = lookup->next) {
+      if (!strcmp(lookup->name, hostname))
+         break;
+   }
+
+   if (lookup) {
+      /* Somebody already asked the server, share its answer */
+      show_msg(MSGDEBUG, "resolve_remote: waiting for the lookup of %s "
+               "in flight\n", hostname);
+      lookup->refs++;
+      while (!lookup->done &&
+             (resolver_wait(&(lookup->done_cond), deadline) != ETIMEDOUT))
+         ;
+      if (lookup->done) {
+         rc = lookup->rc;
+         *result = lookup->addr;
+      } else
+         show_msg(MSGWARN, "resolve_remote: timed out resolving %s\n",
+                  hostname);
+      lookup_release(lookup);
+      pthread_mutex_unlock(&resolver_mutex);
+      return(rc);
+   }
+
+   if ((lookup = malloc(sizeof(*lookup))) == NULL) {
+      pthread_mutex_unlock(&resolver_mutex);
+      show_msg(MSGERR, "resolve_remote: could not allocate memory\n");
+      return(-1);
+   }
+   pthread_cond_init(&(lookup->done_cond), NULL);
+   lookup->refs = 1;
+   lookup->done = 0;
+   strcpy(lookup->name, hostname);
+   lookup->next = *bucket;
+   *bucket = lookup;
+
+   /* Only so many connections to the server at once */
+   while ((resolver_busy >= resolver_parallel) &&
+          (resolver_wait(&resolver_slots, deadline) != ETIMEDOUT))
+      ;
+   if (resolver_busy < resolver_parallel) {
+      resolver_busy++;
+      pthread_mutex_unlock(&resolver_mutex);
+
+      rc = do_resolve(hostname, sockshost, socksport, deadline, &addr);
+
+      pthread_mutex_lock(&resolver_mutex);
+      resolver_busy--;
+      pthread_cond_signal(&resolver_slots);
+   } else
+      show_msg(MSGWARN, "resolve_remote: timed out waiting to resolve %s\n",
+               hostname);
+
+   /* Later lookups of the name are for the pool to answer */
+   for (bucket = &inflight[name_hash(hostname)]; *bucket;
+        bucket = &((*bucket)->next)) {
+      if (*bucket == lookup) {
+         *bucket = lookup->next;
+         break;
+      }
+   }
+   lookup->done = 1;
+   lookup->rc = rc;
+   lookup->addr = addr;
+   pthread_cond_broadcast(&(lookup->done_cond));
+   lookup_release(lookup);
+   pthread_mutex_unlock(&resolver_mutex);
+
+   *result = addr;
+   return(rc);
+}
+
+static int build_socks4a_resolve_request(char *out, const char *username, const char *hostname)
+{
+  size_t len;
+  uint16_t port = htons(0);  /* port: 0. */
+  uint32_t addr = htonl(0x00000001u); /* addr: 0.0.0.1 */
+
+  len = 8 + strlen(username) + 1 + strlen(hostname) + 1;
+  out[0] = 4;      /* SOCKS version 4 */
+  out[1] = '\xF0'; /* Command: resolve. */
+
+  memcpy(out+2, &port, sizeof(port));
+  memcpy(out+4, &addr, sizeof(addr));
+  strcpy(out+8, username);
+  strcpy(out+8+strlen(username)+1, hostname);
+
+  return (int)len;
+}
+
+static int parse_socks4a_resolve_response(const char *response, size_t len, uint32_t *addr_out)
+{
+  uint8_t status;
+  uint16_t port;
+
+  if (len < RESPONSE_LEN) {
+    show_msg(MSGWARN,"Truncated socks response.\n");
+    return -1;
+  }
+  if (((uint8_t)response[0])!=0) { /* version: 0 */
+    show_msg(MSGWARN,"Nonzero version in socks response: bad format.\n");
+    return -1;
+  }
+  status = (uint8_t)response[1];
+
+  memcpy(&port, response+2, sizeof(port));
+  if (port!=0) { /* port: 0 */
+    show_msg(MSGWARN,"Nonzero port in socks response: bad format.\n");
+    return -1;
+  }
+  if (status != 90) {
+    show_msg(MSGWARN,"Bad status: socks request failed.\n");
+    return -1;
+  }
+
+  memcpy(addr_out, response+4, sizeof(*addr_out));
+
+  return 0;
+}
+
+/* Wait for s to be ready, -1 with errno set on error or timeout */
+static int wait_socket(int s, short events, long long deadline)
+{
+  struct pollfd pfd;
+  int rc;
+
+  pfd.fd = s;
+  pfd.events = events;
+  do {
+    rc = realpoll(&pfd, 1, resolver_left(deadline));
+  } while ((rc == -1) && (errno == EINTR));
+
+  if (rc == 0) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return (rc < 0) ? -1 : 0;
+}
+
+static int do_resolve(const char *hostname, uint32_t sockshost, uint16_t socksport, long long deadline, uint32_t *result_addr)
+{
+  int s;
+  struct sockaddr_in socksaddr;
+  char req[8 + 1 + 256], *cp;
+  int r, len, err;
+  socklen_t errlen = sizeof(err);
+  char response_buf[RESPONSE_LEN];
+
+  show_msg(MSGDEBUG, "do_resolve: resolving %s\n", hostname);
+
+  s = realsocket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (s<0) {
+    show_msg(MSGWARN, "do_resolve: problem creating socket\n");
+    return -1;
+  }
+  /* Non blocking, so that the lookup can't outlive its deadline */
+  fcntl(s, F_SETFD, FD_CLOEXEC);
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+  r = 1;
+  setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &r, sizeof(r));
+#endif
+
+  memset(&socksaddr, 0, sizeof(socksaddr));
+  socksaddr.sin_family = AF_INET;
+  socksaddr.sin_port = htons(socksport);
+  socksaddr.sin_addr.s_addr = htonl(sockshost);
+  if (realconnect(s, (struct sockaddr*)&socksaddr, sizeof(socksaddr))) {
+    if ((errno != EINPROGRESS) || wait_socket(s, POLLOUT, deadline) ||
+        getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &errlen) ||
+        ((errno = err) != 0)) {
+      show_msg(MSGWARN, "do_resolve: error connecting to SOCKS server (%s)\n",
+               strerror(errno));
+      goto fail;
+    }
+  }
+
+  len = build_socks4a_resolve_request(req, "", hostname);
+
+  cp = req;
+  while (len) {
+    r = (int)realsend(s, cp, len, RESOLVER_SEND_FLAGS);
+    if (r<0) {
+      if (((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) &&
+          !wait_socket(s, POLLOUT, deadline))
+        continue;
+      show_msg(MSGWARN, "do_resolve: error sending SOCKS request (%s)\n",
+               strerror(errno));
+      goto fail;
+    }
+    len -= r;
+    cp += r;
+  }
+
+  len = 0;
+  while (len < RESPONSE_LEN) {
+    r = (int)recv(s, response_buf+len, RESPONSE_LEN-len, 0);
+    if (r==0) {
+      show_msg(MSGWARN, "do_resolve: EOF while reading SOCKS response\n");
+      goto fail;
+    }
+    if (r<0) {
+      if (((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) &&
+          !wait_socket(s, POLLIN, deadline))
+        continue;
+      show_msg(MSGWARN, "do_resolve: error reading SOCKS response (%s)\n",
+               strerror(errno));
+      goto fail;
+    }
+    len += r;
+  }
+
+  realclose(s);
+
+  if (parse_socks4a_resolve_response(response_buf, RESPONSE_LEN, result_addr) < 0){
+    show_msg(MSGWARN, "do_resolve: error parsing SOCKS response\n");
+    return -1;
+  }
+
+  show_msg(MSGDEBUG, "do_resolve: success\n");
+
+  return 0;
+
+fail:
+  realclose(s);
+  return -1;
+}
+
+#if defined(__GLIBC__)
+
+/* Called with the resolver mutex held, which it may drop meanwhile */
+static void batch_work(struct batch *batch) {
+   struct gaicb *req;
+   int rc;
+
+   for (;;) {
+      /* Skip the requests cancelled meanwhile */
+      while ((batch->next_item < batch->nitems) &&
+             (((req = batch->list[batch->next_item]) == NULL) ||
+              (req->__return != EAI_INPROGRESS)))
+         batch->next_item++;
+      if (batch->next_item >= batch->nitems)
+         break;
+      batch->next_item++;
+      pthread_mutex_unlock(&resolver_mutex);
+
+      rc = p_getaddrinfo(req->ar_name, req->ar_service, req->ar_request,
+                         &(req->ar_result));
+
+      pthread_mutex_lock(&resolver_mutex);
+      req->__return = rc;
+      pthread_cond_broadcast(&batch_cond);
+   }
+}
+
+/* Called with the resolver mutex held once the batch has no workers */
+static void batch_unlink(struct batch *batch) {
+   struct batch **prev;
+
+   for (prev = &batches; *prev; prev = &((*prev)->next)) {
+      if (*prev == batch) {
+         *prev = batch->next;
+         break;
+      }
+   }
+   pthread_cond_broadcast(&batch_cond);
+}
+
+static void batch_notify(struct sigevent *sevp) {
+   switch (sevp->sigev_notify) {
+      case SIGEV_SIGNAL:
+         sigqueue(getpid(), sevp->sigev_signo, sevp->sigev_value);
+         break;
+      case SIGEV_THREAD:
+         /* We are on a thread of our own already, which is about to end */
+         sevp->sigev_notify_function(sevp->sigev_value);
+         break;
+   }
+}
+
+static void *batch_thread(void *arg) {
+   struct batch *batch = arg;
+   struct sigevent sevp;
+   int notify = 0;
+
+   pthread_mutex_lock(&resolver_mutex);
+   batch_work(batch);
+   if (--batch->workers == 0) {
+      batch_unlink(batch);
+      if (!batch->wait) {
+         notify = batch->notify;
+         sevp = batch->sevp;
+         free(batch->list);
+         free(batch);
+      }
+   }
+   pthread_mutex_unlock(&resolver_mutex);
+
+   if (notify)
+      batch_notify(&sevp);
+
+   return(NULL);
+}
+
+int resolver_getaddrinfo_a(int mode, struct gaicb *list[], int nitems,
+                           struct sigevent *sevp)
+{
+   struct batch *batch;
+   pthread_t thread;
+   pthread_attr_t attr;
+   sigset_t all, old;
+   int i, count = 0, threads, started = 0;
+
+   if ((mode != GAI_WAIT) && (mode != GAI_NOWAIT)) {
+      errno = EINVAL;
+      return(EAI_SYSTEM);
+   }
+   if ((batch = calloc(1, sizeof(*batch))) == NULL ||
+       (batch->list = malloc(nitems * sizeof(*list))) == NULL) {
+      free(batch);
+      return(EAI_MEMORY);
+   }
+
+   for (i = 0; i < nitems; i++) {
+      if ((batch->list[i] = list[i]) != NULL) {
+         list[i]->__return = EAI_INPROGRESS;
+         list[i]->ar_result = NULL;
+         count++;
+      }
+   }
+   batch->nitems = nitems;
+   batch->wait = (mode == GAI_WAIT);
+   if (sevp && (mode == GAI_NOWAIT) && (sevp->sigev_notify != SIGEV_NONE)) {
+      batch->sevp = *sevp;
+      batch->notify = 1;
+   }
+
+   pthread_mutex_lock(&resolver_mutex);
+   batch->next = batches;
+   batches = batch;
+   /* When waiting the caller takes its share of the requests. The */
+   /* threads only start working once we release the mutex          */
+   threads = (count < resolver_parallel ? count : resolver_parallel);
+
+   /* The caller's signals are none of our business */
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (i = batch->wait; i < threads; i++) {
+      if (pthread_create(&thread, &attr, batch_thread, batch))
+         break;
+      started++;
+   }
+   pthread_attr_destroy(&attr);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   batch->workers = started + ((batch->wait && threads) ? 1 : 0);
+
+   if (!batch->wait) {
+      if (count == 0) {
+         batch_unlink(batch);
+         pthread_mutex_unlock(&resolver_mutex);
+         free(batch->list);
+         free(batch);
+         return(0);
+      }
+      if (batch->workers == 0) {
+         /* Not a single thread, nothing was started */
+         batch_unlink(batch);
+         pthread_mutex_unlock(&resolver_mutex);
+         for (i = 0; i < nitems; i++) {
+            if (list[i])
+               list[i]->__return = EAI_SYSTEM;
+         }
+         free(batch->list);
+         free(batch);
+         return(EAI_AGAIN);
+      }
+      pthread_mutex_unlock(&resolver_mutex);
+      return(0);
+   }
+
+   if (threads) {
+      batch_work(batch);
+      batch->workers--;
+   }
+   while (batch->workers)
+      pthread_cond_wait(&batch_cond, &resolver_mutex);
+   batch_unlink(batch);
+   pthread_mutex_unlock(&resolver_mutex);
+
+   free(batch->list);
+   free(batch);
+   return(0);
+}
+
+int resolver_gai_suspend(const struct gaicb *const list[], int nitems,
+                         const struct timespec *timeout)
+{
+   long long deadline = NO_DEADLINE;
+   int i, pending;
+
+   if (timeout) {
+      deadline = resolver_now() + ((long long) timeout->tv_sec * 1000) +
+                 ((timeout->tv_nsec + 999999) / 1000000);
+   }
+
+   pthread_mutex_lock(&resolver_mutex);
+   for (;;) {
+      pending = 0;
+      for (i = 0; i < nitems; i++) {
+         if (list[i] == NULL)
+            continue;
+         if (list[i]->__return != EAI_INPROGRESS)
+            break;
+         pending = 1;
+      }
+      /* Either one of them is finished or none was given */
+      if ((i < nitems) || !pending)
+         break;
+      if (resolver_wait(&batch_cond, deadline) == ETIMEDOUT) {
+         pthread_mutex_unlock(&resolver_mutex);
+         return(EAI_AGAIN);
+      }
+   }
+   pthread_mutex_unlock(&resolver_mutex);
+
+   return(0);
+}
+
+int resolver_gai_cancel(struct gaicb *req)
+{
+   struct batch *batch;
+   int i, canceled = 0, running = 0;
+
+   pthread_mutex_lock(&resolver_mutex);
+   /* Requests not handed out yet are cancelled, all of them for NULL */
+   for (batch = batches; batch; batch = batch->next) {
+      for (i = 0; i < batch->nitems; i++) {
+         if (!batch->list[i] || ((req != NULL) && (batch->list[i] != req)) ||
+             (batch->list[i]->__return != EAI_INPROGRESS))
+            continue;
+         if (i < batch->next_item)
+            running = 1;
+         else {
+            batch->list[i]->__return = EAI_CANCELED;
+            canceled = 1;
+         }
+      }
+   }
+   if (canceled)
+      pthread_cond_broadcast(&batch_cond);
+   pthread_mutex_unlock(&resolver_mutex);
+
+   if (running)
+      return(EAI_NOTCANCELED);
+   return(canceled ? EAI_CANCELED : EAI_ALLDONE);
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* resolver.h - Names resolved by the SOCKS server, lookups of the same */
+/*              name are shared and the connections to it are capped    */
+
+#ifndef _RESOLVER_H
+
+#define _RESOLVER_H	1
+
+#include <stdint.h>
+
+struct gaicb;
+struct sigevent;
+struct timespec;
+
+/* timeout is in milliseconds for each lookup, 0 for none. parallel is */
+/* the number of lookups sent to the server at once                    */
+void resolver_setup(int timeout, int parallel);
+
+/* Resolve hostname through the SOCKS server at sockshost:socksport (host */
+/* byte order). The address is returned in network byte order. Returns 0  */
+/* on success, -1 if the name couldn't be resolved in time                */
+int resolve_remote(const char *hostname, uint32_t sockshost,
+                   uint16_t socksport, uint32_t *result);
+
+#if defined(__GLIBC__)
+/* glibc's asynchronous lookups, run on threads of ours through the */
+/* getaddrinfo() replacement, see getaddrinfo_a(3)                  */
+int resolver_getaddrinfo_a(int mode, struct gaicb *list[], int nitems,
+                           struct sigevent *sevp);
+int resolver_gai_suspend(const struct gaicb *const list[], int nitems,
+                         const struct timespec *timeout);
+int resolver_gai_cancel(struct gaicb *req);
+#endif
+
+#endif
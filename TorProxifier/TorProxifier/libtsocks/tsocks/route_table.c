@@ -0,0 +1,409 @@
+/*
+
+    route_table.c    - The local networks and those the SOCKS servers
+                       reach, indexed for is_local() and pick_server()
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "parser.h"
+#include "route_table.h"
+
+/* A network of the configuration, while the table is built */
+struct route_rule {
+   uint32_t key;              /* Network in host order */
+   uint32_t mask;             /* Its mask in host order */
+   int len;                   /* Bits in the mask, -1 if not contiguous */
+   int rank;                  /* Position in config->paths of the server */
+                              /* reaching it, -1 for a local network     */
+   unsigned long startport;   /* Ports reached, 0 for all of them */
+   unsigned long endport;
+};
+
+/* Everything the configuration says about one network. Buckets with */
+/* a negative len are free                                           */
+struct route_prefix {
+   uint32_t key;
+   int8_t len;
+   uint8_t local;             /* One of the local networks */
+   int32_t any_port;          /* Lowest rank reaching all its ports, -1 */
+   uint32_t first_segment;    /* Its port segments in the table's */
+   uint32_t segments;
+};
+
+/* Ports start to end of a network, sorted and not overlapping, with */
+/* the lowest rank reaching them                                     */
+struct route_segment {
+   uint16_t start;
+   uint16_t end;
+   int32_t rank;
+};
+
+struct route_table {
+   struct route_prefix *buckets;
+   uint32_t mask;             /* Number of buckets - 1 */
+   uint64_t local_lengths;    /* Bit n set if a local network is n bits */
+   uint64_t reach_lengths;    /* The same for those servers reach */
+   struct route_segment *segments;
+   struct route_rule *irregular;  /* Networks whose mask isn't contiguous */
+   int irregulars;
+   struct serverent **servers;    /* config->paths by rank */
+};
+
+static uint32_t prefix_mask(int len) {
+   return(len ? (0xFFFFFFFFu << (32 - len)) : 0);
+}
+
+static uint32_t prefix_hash(uint32_t key, int len) {
+   uint64_t hash = (((uint64_t) key << 6) | (uint64_t) len) *
+                   0x9E3779B97F4A7C15ULL;
+
+   return((uint32_t) (hash >> 32));
+}
+
+/* There are at least twice as many buckets as networks, a free one */
+/* always ends the probe                                            */
+static const struct route_prefix *find_prefix(const struct route_table *table,
+                                              uint32_t key, int len) {
+   uint32_t pos = prefix_hash(key, len) & table->mask;
+   const struct route_prefix *prefix;
+
+   for (;;) {
+      prefix = &(table->buckets[pos]);
+      if (prefix->len < 0)
+         return(NULL);
+      if ((prefix->len == len) && (prefix->key == key))
+         return(prefix);
+      pos = (pos + 1) & table->mask;
+   }
+}
+
+static int rule_reaches(const struct route_rule *rule, uint32_t haddr,
+                        unsigned int port) {
+   return(((haddr & rule->mask) == rule->key) &&
+          (!rule->startport ||
+           ((rule->startport <= port) && (rule->endport >= port))));
+}
+
+/* Lowest of the ranks, -1 standing for none */
+static int32_t lowest_rank(int32_t best, int32_t rank) {
+   return(((rank >= 0) && ((best < 0) || (rank < best))) ? rank : best);
+}
+
+/* Rank of the segment of prefix holding port, -1 if none does */
+static int32_t segment_rank(const struct route_table *table,
+                            const struct route_prefix *prefix,
+                            unsigned int port) {
+   const struct route_segment *segments =
+      table->segments + prefix->first_segment;
+   uint32_t low = 0, high = prefix->segments, mid;
+
+   while (low < high) {
+      mid = (low + high) / 2;
+      if (segments[mid].end < port)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   if ((low < prefix->segments) && (segments[low].start <= port))
+      return(segments[low].rank);
+   return(-1);
+}
+
+int route_table_is_local(const struct route_table *table, uint32_t addr) {
+   const struct route_prefix *prefix;
+   uint32_t haddr = ntohl(addr);
+   uint64_t lengths = table->local_lengths;
+   int i, len;
+
+   while (lengths) {
+      len = 63 - __builtin_clzll(lengths);
+      lengths &= ~(1ULL << len);
+      prefix = find_prefix(table, haddr & prefix_mask(len), len);
+      if (prefix && prefix->local)
+         return(1);
+   }
+   for (i = 0; i < table->irregulars; i++) {
+      if ((table->irregular[i].rank < 0) &&
+          rule_reaches(&(table->irregular[i]), haddr, 0))
+         return(1);
+   }
+
+   return(0);
+}
+
+struct serverent *route_table_pick(const struct route_table *table,
+                                   uint32_t addr, unsigned int port) {
+   const struct route_prefix *prefix;
+   uint32_t haddr = ntohl(addr);
+   uint64_t lengths = table->reach_lengths;
+   int32_t best = -1;
+   int i, len;
+
+   while (lengths && (best != 0)) {
+      len = 63 - __builtin_clzll(lengths);
+      lengths &= ~(1ULL << len);
+      prefix = find_prefix(table, haddr & prefix_mask(len), len);
+      if (prefix == NULL)
+         continue;
+      best = lowest_rank(best, prefix->any_port);
+      if (prefix->segments && port)
+         best = lowest_rank(best, segment_rank(table, prefix, port));
+   }
+   for (i = 0; i < table->irregulars; i++) {
+      if ((table->irregular[i].rank >= 0) &&
+          rule_reaches(&(table->irregular[i]), haddr, port))
+         best = lowest_rank(best, table->irregular[i].rank);
+   }
+
+   return((best < 0) ? NULL : table->servers[best]);
+}
+
+static void add_rule(struct route_rule *rule, struct toscks_netent *net,
+                     int rank) {
+   rule->mask = ntohl(net->localnet.s_addr);
+   rule->key = ntohl(net->localip.s_addr) & rule->mask;
+   rule->len = count_netmask_bits(net->localnet.s_addr);
+   rule->rank = rank;
+   rule->startport = net->startport;
+   /* Segments keep ports in 16 bits, none is above 65535 anyway */
+   rule->endport = (net->endport > 65535) ? 65535 : net->endport;
+}
+
+/* Whether rule is limited to a range of ports holding at least one */
+static int ranged_rule(const struct route_rule *rule) {
+   return((rule->rank >= 0) && rule->startport &&
+          (rule->startport <= rule->endport));
+}
+
+/* By network, then local ones first and servers in their order */
+static int compare_rules(const void *a, const void *b) {
+   const struct route_rule *r1 = a, *r2 = b;
+
+   if (r1->len != r2->len)
+      return((r1->len < r2->len) ? -1 : 1);
+   if (r1->key != r2->key)
+      return((r1->key < r2->key) ? -1 : 1);
+   if (r1->rank != r2->rank)
+      return((r1->rank < r2->rank) ? -1 : 1);
+   return(0);
+}
+
+static int compare_ports(const void *a, const void *b) {
+   unsigned long p1 = *(const unsigned long *) a;
+   unsigned long p2 = *(const unsigned long *) b;
+
+   return((p1 < p2) ? -1 : (p1 > p2));
+}
+
+/* Index of port in the n sorted bounds, where it is */
+static int find_bound(const unsigned long *bounds, int n, unsigned long port) {
+   int low = 0, high = n - 1, mid;
+
+   while (low < high) {
+      mid = (low + high) / 2;
+      if (bounds[mid] < port)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return(low);
+}
+
+static int next_unpainted(int *next, int piece) {
+   while (next[piece] != piece) {
+      next[piece] = next[next[piece]];
+      piece = next[piece];
+   }
+   return(piece);
+}
+
+/* Add the port segments of the n rules of one network, sorted by rank, */
+/* after the count segments there are. Ports are cut in pieces where a  */
+/* rule starts or ends, the lowest rank covering a piece gets it: rules */
+/* are laid in rank order over the pieces no rule took yet, each piece  */
+/* skipped once taken. Neighbouring pieces of one rank are joined again */
+static uint32_t add_segments(struct route_segment *segments, uint32_t count,
+                             const struct route_rule *rules, int n,
+                             unsigned long *bounds, int32_t *paint,
+                             int *next) {
+   uint32_t first = count;
+   int i, piece, low, high, nbounds = 0, pieces = 0;
+
+   for (i = 0; i < n; i++) {
+      if (ranged_rule(&(rules[i]))) {
+         bounds[nbounds++] = rules[i].startport;
+         bounds[nbounds++] = rules[i].endport + 1;
+      }
+   }
+   if (nbounds == 0)
+      return(count);
+   qsort(bounds, nbounds, sizeof(*bounds), compare_ports);
+   for (i = 0; i < nbounds; i++) {
+      if ((pieces == 0) || (bounds[i] != bounds[pieces - 1]))
+         bounds[pieces++] = bounds[i];
+   }
+
+   /* Piece i runs from bounds[i] to bounds[i + 1] - 1, the last */
+   /* bound stops next_unpainted()                               */
+   for (piece = 0; piece < pieces; piece++) {
+      paint[piece] = -1;
+      next[piece] = piece;
+   }
+   for (i = 0; i < n; i++) {
+      if (!ranged_rule(&(rules[i])))
+         continue;
+      low = find_bound(bounds, pieces, rules[i].startport);
+      high = find_bound(bounds, pieces, rules[i].endport + 1);
+      for (piece = next_unpainted(next, low); piece < high;
+           piece = next_unpainted(next, piece + 1)) {
+         paint[piece] = rules[i].rank;
+         next[piece] = piece + 1;
+      }
+   }
+
+   for (piece = 0; piece + 1 < pieces; piece++) {
+      if (paint[piece] < 0)
+         continue;
+      if ((count > first) && (segments[count - 1].rank == paint[piece]) &&
+          (segments[count - 1].end + 1UL == bounds[piece])) {
+         segments[count - 1].end = (uint16_t) (bounds[piece + 1] - 1);
+      } else {
+         segments[count].start = (uint16_t) bounds[piece];
+         segments[count].end = (uint16_t) (bounds[piece + 1] - 1);
+         segments[count].rank = paint[piece];
+         count++;
+      }
+   }
+   return(count);
+}
+
+struct route_table *route_table_build(struct parsedfile *config) {
+   struct route_table *table;
+   struct route_rule *rules = NULL;
+   struct route_rule swap;
+   struct route_prefix *prefix;
+   struct serverent *server;
+   struct toscks_netent *net;
+   unsigned long *bounds = NULL;
+   int32_t *paint = NULL;
+   int *next = NULL;
+   int count = 0, servers = 0, ports = 0, regular = 0, prefixes = 0;
+   int i, j, k, rank;
+   uint32_t buckets, pos, segments = 0;
+
+   for (net = config->localnets; net != NULL; net = net->next)
+      count++;
+   for (server = config->paths; server != NULL; server = server->next) {
+      servers++;
+      for (net = server->reachnets; net != NULL; net = net->next) {
+         count++;
+         if (net->startport)
+            ports++;
+      }
+   }
+
+   if ((table = calloc(1, sizeof(*table))) == NULL)
+      return(NULL);
+   rules = malloc((count + 1) * sizeof(*rules));
+   table->servers = malloc((servers + 1) * sizeof(*(table->servers)));
+   table->segments = malloc((2 * ports + 1) * sizeof(*(table->segments)));
+   bounds = malloc((2 * ports + 1) * sizeof(*bounds));
+   paint = malloc((2 * ports + 1) * sizeof(*paint));
+   next = malloc((2 * ports + 1) * sizeof(*next));
+   if (!rules || !table->servers || !table->segments || !bounds || !paint ||
+       !next)
+      goto fail;
+
+   count = 0;
+   for (net = config->localnets; net != NULL; net = net->next)
+      add_rule(&rules[count++], net, -1);
+   rank = 0;
+   for (server = config->paths; server != NULL; server = server->next) {
+      table->servers[rank] = server;
+      for (net = server->reachnets; net != NULL; net = net->next)
+         add_rule(&rules[count++], net, rank);
+      rank++;
+   }
+
+   /* Networks whose mask isn't contiguous go last, they stay rules */
+   for (i = 0; i < count; i++) {
+      if (rules[i].len >= 0) {
+         swap = rules[regular];
+         rules[regular++] = rules[i];
+         rules[i] = swap;
+      }
+   }
+   table->irregular = rules + regular;
+   table->irregulars = count - regular;
+   qsort(rules, regular, sizeof(*rules), compare_rules);
+
+   for (i = 0; i < regular; i++) {
+      if ((i == 0) || (rules[i - 1].len != rules[i].len) ||
+          (rules[i - 1].key != rules[i].key))
+         prefixes++;
+   }
+   for (buckets = 16; buckets < 2 * (uint32_t) prefixes; buckets *= 2)
+      ;
+   if ((table->buckets = malloc(buckets * sizeof(*(table->buckets)))) == NULL)
+      goto fail;
+   for (pos = 0; pos < buckets; pos++)
+      table->buckets[pos].len = -1;
+   table->mask = buckets - 1;
+
+   for (i = 0; i < regular; i = j) {
+      for (j = i; (j < regular) && (rules[j].len == rules[i].len) &&
+                  (rules[j].key == rules[i].key); j++)
+         ;
+      pos = prefix_hash(rules[i].key, rules[i].len) & table->mask;
+      while (table->buckets[pos].len >= 0)
+         pos = (pos + 1) & table->mask;
+      prefix = &(table->buckets[pos]);
+      prefix->key = rules[i].key;
+      prefix->len = (int8_t) rules[i].len;
+      prefix->local = 0;
+      prefix->any_port = -1;
+      prefix->first_segment = segments;
+      for (k = i; k < j; k++) {
+         if (rules[k].rank < 0) {
+            prefix->local = 1;
+            table->local_lengths |= 1ULL << rules[i].len;
+            continue;
+         }
+         table->reach_lengths |= 1ULL << rules[i].len;
+         if (!rules[k].startport)
+            prefix->any_port = lowest_rank(prefix->any_port, rules[k].rank);
+      }
+      segments = add_segments(table->segments, segments, rules + i, j - i,
+                              bounds, paint, next);
+      prefix->segments = segments - prefix->first_segment;
+   }
+
+   show_msg(MSGDEBUG, "Routing %d networks through %d prefixes, %d with "
+            "irregular masks\n", count, prefixes, table->irregulars);
+   free(bounds);
+   free(paint);
+   free(next);
+   return(table);
+
+fail:
+   show_msg(MSGERR, "Not enough memory to index the networks\n");
+   free(rules);
+   free(table->servers);
+   free(table->segments);
+   free(table->buckets);
+   free(bounds);
+   free(paint);
+   free(next);
+   free(table);
+   return(NULL);
+}
@@ -0,0 +1,32 @@
+/* route_table.h - The local networks and those the SOCKS servers reach, */
+/*                 indexed for is_local() and pick_server()               */
+
+#ifndef _ROUTE_TABLE_H
+
+#define _ROUTE_TABLE_H	1
+
+#include <stdint.h>
+
+struct parsedfile;
+struct serverent;
+
+/* Built once the configuration is loaded and never changed after, so  */
+/* lookups take no lock and allocate nothing. Networks are kept in a   */
+/* hash table by prefix and mask length, a lookup probes each length   */
+/* the configuration uses, so it costs at most 33 probes however many  */
+/* networks there are. The few with a mask which isn't contiguous are  */
+/* checked one by one                                                  */
+struct route_table;
+
+/* NULL if there is no memory for it, the lists are then walked */
+struct route_table *route_table_build(struct parsedfile *config);
+
+/* Whether addr (network order) is in one of config->localnets */
+int route_table_is_local(const struct route_table *table, uint32_t addr);
+
+/* The first of config->paths with a reach statement for addr (network */
+/* order) and port, NULL if none has one                              */
+struct serverent *route_table_pick(const struct route_table *table,
+                                   uint32_t addr, unsigned int port);
+
+#endif
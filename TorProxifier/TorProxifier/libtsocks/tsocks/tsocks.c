@@ -31,8 +31,6 @@
 char *progname = "libtsocks";         	   /* Name used in err msgs    */
 
 /* Header Files */
-#include <Block.h>
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -40,8 +38,10 @@ char *progname = "libtsocks";         	   /* Name used in err msgs    */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <string.h>
+#include <pthread.h>
 #include <strings.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/poll.h>
 #include <sys/time.h>
@@ -50,6 +50,14 @@ char *progname = "libtsocks";         	   /* Name used in err msgs    */
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#if defined(__linux__)
+# include <sys/epoll.h>
+#endif
 #ifdef USE_SOCKS_DNS
 # include <resolv.h>
 #endif
@@ -58,6 +66,11 @@ char *progname = "libtsocks";         	   /* Name used in err msgs    */
 #include "parser.h"
 #include "tsocks.h"
 #include "dead_pool.h"
+#include "conn_table.h"
+#include "interpose.h"
+#include "reactor.h"
+#include "resolver.h"
+#include "dns_mux.h"
 
 
 /* Global Declarations */
@@ -66,15 +79,10 @@ static dead_pool *pool = NULL;
 #endif
 
 static struct parsedfile *config;
-static struct connreq *requests = NULL;
 static int suid = 0;
 static char *conffile = NULL;
 static char *confdata = NULL;
 
-#ifdef USE_SOCKS_DNS
-int res_init(void);
-#endif
-
 /* Private Function Prototypes */
 static void _init(void);
 static int get_config(void);
@@ -86,25 +94,41 @@ static struct connreq *new_socks_request(int sockid, struct sockaddr_in *connadd
                                          struct serverent *path);
 static void kill_socks_request(struct connreq *conn);
 static int handle_request(struct connreq *conn);
-static struct connreq *find_socks_request(int sockid, int includefailed);
 static int connect_server(struct connreq *conn);
 static int send_socks_request(struct connreq *conn);
 static int send_socksv4_request(struct connreq *conn);
 static int send_socksv5_method(struct connreq *conn);
 static int send_socksv5_connect(struct connreq *conn);
+static int send_socksv5_pipelined(struct connreq *conn);
+static int build_socksv5_connect(struct connreq *conn, char *buffer);
+static void probe_pipelining(struct connreq *conn);
+static int give_up_pipelining(struct connreq *conn);
 static int send_buffer(struct connreq *conn);
 static int recv_buffer(struct connreq *conn);
 static int read_socksv5_method(struct connreq *conn);
 static int read_socksv4_req(struct connreq *conn);
 static int read_socksv5_connect(struct connreq *conn);
 static int read_socksv5_auth(struct connreq *conn);
+static int early_writable(struct connreq *conn);
+static void prepare_server(struct serverent *path, struct passwd *nixuser);
+static void drive_request(int fd, int expired);
+#if defined(__linux__)
+static int epoll_take(struct connreq *conn, int epfd, int op);
+static void epoll_sync(struct connreq *conn);
+static void epoll_release(struct connreq *conn);
+#endif
 #ifdef USE_TOR_DNS
 static int deadpool_init(void);
 static int send_socksv4a_request(struct connreq *conn, const char *onion_host);
+static void speculate(const struct addrinfo *res);
+static int claim_speculation(int fd, struct sockaddr_in *connaddr, int *rc);
+static void forget_speculation(int fd);
 #endif
 
 // --JP/
+#if defined(__APPLE__)
 #include "TPControlHelper.h"
+#endif
 
 static void __attribute((constructor)) tp_constructor()
 {
@@ -114,49 +138,6 @@ static void __attribute((constructor)) tp_constructor()
 }
 // --JP!
 
-#ifdef USE_SOCKS_DNS
-int p_res_init(void);
-#endif
-#if defined(USE_TOR_DNS) && USE_TOR_DNS
-struct hostent *	p_gethostbyname(const char *name);
-int					p_getaddrinfo(const char *hostname, const char *servname, const struct addrinfo *hints, struct addrinfo **res);
-struct hostent *	p_getipnodebyname(const char *name, int af, int flags, int *error_num);
-#endif
-
-int p_connect(int fd, const struct sockaddr *address, socklen_t address_len);
-
-int p_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
-int p_poll(struct pollfd fds[], nfds_t nfds, int timeout);
-int p_close(int fd);
-int p_getpeername(int fd, struct sockaddr *address, socklen_t *address_len);
-
-
-// From 'OS X Internal'
-typedef struct interpose_s {
-	void *new_func;
-	void *origin_func;
-} interpose_t;
-
-__attribute__((used)) static const interpose_t interposers[] __attribute__((section("__DATA,__interpose"))) = {
-	
-#if defined(USE_SOCKS_DNS) && USE_SOCKS_DNS
-	{ (void *)p_res_init, (void *)res_init },
-#endif
-	
-#if defined(USE_TOR_DNS) && USE_TOR_DNS
-	{ (void *)p_gethostbyname, (void *)gethostbyname },
-	{ (void *)p_getaddrinfo, (void *)getaddrinfo },
-	{ (void *)p_getipnodebyname, (void *)getipnodebyname },
-#endif
-
-	{ (void *)p_connect, (void *)connect },
-	{ (void *)p_select, (void *)select },
-	{ (void *)p_poll, (void *)poll },
-	{ (void *)p_close, (void *)close },
-	{ (void *)p_getpeername, (void *)getpeername },
-};
-// --JP!
-
 
 static void _init(void) {
 
@@ -205,6 +186,8 @@ static int get_environment() {
 
 static int get_config () {
    static int done = 0;
+   struct passwd *nixuser;
+   struct serverent *path;
 
    if (done)
       return(0);
@@ -252,9 +235,20 @@ static int get_config () {
 	
    read_config(liner, config);
 	
-   if (liner)
-      Block_release(liner);
+   line_enumerator_free(liner);
 	// --JP!
+
+   /* Everything connect() needs to know about the servers is worked */
+   /* out now, passwd lookups can be slow                            */
+   nixuser = getpwuid(getuid());
+   prepare_server(&(config->defaultserver), nixuser);
+   for (path = config->paths; path; path = path->next)
+      prepare_server(path, nixuser);
+
+#ifdef USE_SOCKS_DNS
+   if (config->socks_dns_connections)
+      dns_mux_setup(config->socks_dns_connections);
+#endif
 	
    if (config->paths)
       show_msg(MSGDEBUG, "First lineno for first path is %d\n", config->paths->lineno);
@@ -264,46 +258,64 @@ static int get_config () {
    return(0);
 }
 
+/* What the kernel says about fd, for the fds the conn table doesn't */
+/* know                                                              */
+static int socket_is_stream(int fd) {
+   int sock_type = -1;
+   socklen_t sock_type_len = sizeof(sock_type);
+
+   getsockopt(fd, SOL_SOCKET, SO_TYPE, (void *) &sock_type, &sock_type_len);
+   return(sock_type == SOCK_STREAM);
+}
+
+static int socket_is_connected(int fd) {
+   struct sockaddr_in peer_address;
+   socklen_t namelen = sizeof(peer_address);
+
+   return(!realgetpeername(fd, (struct sockaddr *) &peer_address, &namelen));
+}
+
 int p_connect(int fd, const struct sockaddr *address, socklen_t address_len)
 {
 	struct sockaddr_in *connaddr;
-	struct sockaddr_in peer_address;
-	struct sockaddr_in server_address;
 	int gotvalidserver = 0, rc;
-	socklen_t namelen = sizeof(peer_address);
-	int sock_type = -1;
-	socklen_t sock_type_len = sizeof(sock_type);
-	unsigned int res = -1;
+	int info;
 	struct serverent *path;
    struct connreq *newconn;
 
    get_environment();
 	
-	char *ipstr;
-	
 	connaddr = (struct sockaddr_in *) address;
-	ipstr = inet_ntoa(connaddr->sin_addr); // return the IP
-	
-  	show_msg(MSGDEBUG, "Got connection request (%s).\n", ipstr);
-
-
-	/* Get the type of the socket */
-	getsockopt(fd, SOL_SOCKET, SO_TYPE,
-		   (void *) &sock_type, &sock_type_len);
 
 	/* If this isn't an INET socket for a TCP stream we can't  */
-	/* handle it, just call the real connect now               */
-   if ((connaddr->sin_family != AF_INET) ||
-       (sock_type != SOCK_STREAM)) {
-      show_msg(MSGDEBUG, "Connection isn't a TCP stream ignoring (%d - sin_family=%d; sock_type=%d)\n", fd, connaddr->sin_family, sock_type);
-		return(connect(fd, address, address_len));
+	/* handle it, just call the real connect now. The sockets  */
+	/* made by the intercepted socket(), socketpair(), accept  */
+	/* and dup calls are known, and kept up to date, so the    */
+	/* kernel is only asked about the others                   */
+   if (connaddr->sin_family != AF_INET) {
+      show_msg(MSGDEBUG, "Connection isn't a TCP stream ignoring (%d - "
+                         "sin_family=%d)\n", fd, connaddr->sin_family);
+      rc = realconnect(fd, address, address_len);
+      /* Connecting to AF_UNSPEC dissolves the association */
+      if ((rc == 0) && (connaddr->sin_family == AF_UNSPEC) &&
+          ((info = conn_table_info(fd)) & FDINFO_CONNECTED))
+         conn_table_set_info(fd, info & ~FDINFO_CONNECTED);
+		return(rc);
+   }
+	info = conn_table_info(fd);
+   if (!(info & FDINFO_KNOWN) && socket_is_stream(fd))
+      info = FDINFO_STREAM;
+   if (!(info & FDINFO_STREAM)) {
+      show_msg(MSGDEBUG, "Connection isn't a TCP stream ignoring (%d)\n",
+               fd);
+		return(realconnect(fd, address, address_len));
    }
 
    /* If we haven't initialized yet, do it now */
    get_config();
 
    /* Are we already handling this connect? */
-   if ((newconn = find_socks_request(fd, 1))) {
+   if ((newconn = conn_table_acquire(fd))) {
       if (memcmp(&newconn->connaddr, connaddr, sizeof(*connaddr))) {
          /* Ok, they're calling connect on a socket that is in our
           * queue but this connect() isn't to the same destination, 
@@ -317,6 +329,7 @@ int p_connect(int fd, const struct sockaddr *address, socklen_t address_len)
                             "new destination, deleting old request\n",
                   newconn->sockid);
          kill_socks_request(newconn);
+         conn_table_unlock(fd);
       } else {
          /* Ok, this call to connect() is to check the status of 
           * a current non blocking connect(). */
@@ -335,24 +348,33 @@ int p_connect(int fd, const struct sockaddr *address, socklen_t address_len)
             show_msg(MSGDEBUG, "Call to connect received on current request %d\n",
                      newconn->sockid);
             rc = handle_request(newconn);
+            /* With optimistic data the socket is usable from here on */
+            if (rc && early_writable(newconn))
+               rc = 0;
+#if defined(__linux__)
+            epoll_sync(newconn);
+#endif
             errno = rc;
          }
          if ((newconn->state == FAILED) || (newconn->state == DONE))
             kill_socks_request(newconn);
+         conn_table_unlock(fd);
          return((rc ? -1 : 0));
       }
    }
 
    /* If the socket is already connected, just call connect  */
    /* and get its standard reply                             */
-   if (!getpeername(fd, (struct sockaddr *) &peer_address, &namelen)) {
+   if ((info & FDINFO_CONNECTED) ||
+       (!(info & FDINFO_KNOWN) && socket_is_connected(fd))) {
       show_msg(MSGDEBUG, "Socket is already connected, defering to "
                          "real connect\n");
-		return(connect(fd, address, address_len));
+		return(realconnect(fd, address, address_len));
    }
      
-   show_msg(MSGDEBUG, "Got connection request for socket %d to "
-                      "%s\n", fd, inet_ntoa(connaddr->sin_addr));
+   if (MSG_ENABLED(MSGDEBUG))
+      show_msg(MSGDEBUG, "Got connection request for socket %d to "
+                         "%s\n", fd, inet_ntoa(connaddr->sin_addr));
 
    /* If the address is local call realconnect */
 #ifdef USE_TOR_DNS
@@ -362,15 +384,24 @@ int p_connect(int fd, const struct sockaddr *address, socklen_t address_len)
    if (!(is_local(config, &(connaddr->sin_addr)))) {
 #endif
       show_msg(MSGDEBUG, "Connection for socket %d is local\n", fd);
-      return(connect(fd, address, address_len));
+      rc = realconnect(fd, address, address_len);
+      if ((rc == 0) && (info & FDINFO_KNOWN))
+         conn_table_set_info(fd, info | FDINFO_CONNECTED);
+      return(rc);
    }
 
+#ifdef USE_TOR_DNS
+   /* A stream opened ahead for this destination takes the socket's place */
+   if (config->speculative_connect && claim_speculation(fd, connaddr, &rc))
+      return(rc);
+#endif
+
    /* Ok, so its not local, we need a path to the net */
    pick_server(config, &path, &(connaddr->sin_addr), ntohs(connaddr->sin_port));
 
    show_msg(MSGDEBUG, "Picked server %s for connection\n",
             (path->address ? path->address : "(Not Provided)"));
-   if (path->address == NULL) {
+   if (path->status == SERVER_NO_ADDRESS) {
       if (path == &(config->defaultserver)) 
          show_msg(MSGERR, "Connection needs to be made "
                           "via default server but "
@@ -383,28 +414,20 @@ int p_connect(int fd, const struct sockaddr *address, socklen_t address_len)
                           "the server has not been "
                           "specified for this path\n",
                   path->lineno);
-   } else if ((res = resolve_ip(path->address, 0, HOSTNAMES)) == -1) {
+   } else if (path->status == SERVER_INVALID) {
       show_msg(MSGERR, "The SOCKS server (%s) listed in the configuration "
                        "file which needs to be used for this connection "
                        "is invalid\n", path->address);
-   } else {	
-      /* Construct the addr for the socks server */
-      server_address.sin_family = AF_INET; /* host byte order */
-      server_address.sin_addr.s_addr = res;
-      server_address.sin_port = htons(path->port);
-      bzero(&(server_address.sin_zero), 8);
-
+   } else if (path->status == SERVER_NOT_LOCAL) {
       /* Complain if this server isn't on a localnet */
-      if (is_local(config, &server_address.sin_addr)) {
-         show_msg(MSGERR, "SOCKS server %s (%s) is not on a local subnet!\n", 
-                  path->address, inet_ntoa(server_address.sin_addr));
-      } else 
-         gotvalidserver = 1;
-   }
+      show_msg(MSGERR, "SOCKS server %s (%s) is not on a local subnet!\n", 
+               path->address, inet_ntoa(path->serveraddr.sin_addr));
+   } else 
+      gotvalidserver = 1;
 
    /* If we haven't found a valid server we return connection refused */
    if (!gotvalidserver || 
-       !(newconn = new_socks_request(fd, connaddr, &server_address, path))) {
+       !(newconn = new_socks_request(fd, connaddr, &(path->serveraddr), path))) {
       errno = ECONNREFUSED;
       return(-1);
    } else {
@@ -415,231 +438,353 @@ int p_connect(int fd, const struct sockaddr *address, socklen_t address_len)
        * about this socket anymore. */
       if ((newconn->state == FAILED) || (newconn->state == DONE))
          kill_socks_request(newconn);
+      else if (config->handshake_reactor)
+         /* Don't wait for the caller to come back to carry on */
+         reactor_watch(newconn, config->handshake_timeout * 1000, 
+                       drive_request);
+      conn_table_unlock(fd);
       errno = rc;
       return((rc ? -1 : 0));
    }
 }
 
-int p_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout)
-{
-   int nevents = 0;
-   int rc = 0;
-   int setevents = 0;
-   int monitoring = 0;
-   struct connreq *conn, *nextconn;
-   fd_set mywritefds, myreadfds, myexceptfds;
+/* Deadlines are absolute times on the monotonic clock, in nanoseconds, 
+ * so the time spent on our own events comes off what the caller waits */
+#define NO_DEADLINE (-1LL)
 
-   /* If we're not currently managing any requests we can just 
-    * leave here */
-   if (!requests) {
-      show_msg(MSGDEBUG, "No requests waiting, calling real select\n");
-      return(select(nfds, readfds, writefds, errorfds, timeout));
+static long long monotonic_ns(void) {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return(((long long) now.tv_sec * 1000000000) + now.tv_nsec);
+}
+
+/* Returns -1 if ts isn't a valid timeout */
+static long long timespec_deadline(const struct timespec *ts) {
+   if (ts == NULL)
+      return(NO_DEADLINE);
+   if ((ts->tv_sec < 0) || (ts->tv_nsec < 0) || (ts->tv_nsec >= 1000000000))
+      return(-1);
+   return(monotonic_ns() + ((long long) ts->tv_sec * 1000000000) + ts->tv_nsec);
+}
+
+/* Wait for events on fds until deadline. When called for ppoll() or 
+ * pselect() the wait is done by ppoll() so that sigmask is applied 
+ * atomically, just as the caller asked */
+static int poll_wait(struct pollfd fds[], nfds_t nfds, long long deadline,
+                     int use_ppoll, const sigset_t *sigmask) {
+   long long left = 0;
+#if !defined(__APPLE__)
+   struct timespec ts;
+#endif
+
+   if (deadline != NO_DEADLINE) {
+      left = deadline - monotonic_ns();
+      if (left < 0)
+         left = 0;
    }
 
-   get_environment();
+#if !defined(__APPLE__)
+   if (use_ppoll) {
+      ts.tv_sec = left / 1000000000;
+      ts.tv_nsec = left % 1000000000;
+      return(realppoll(fds, nfds, (deadline == NO_DEADLINE) ? NULL : &ts, 
+                       sigmask));
+   }
+#endif
 
-   show_msg(MSGDEBUG, "Intercepted call to select with %d fds, "
-            "0x%08x 0x%08x 0x%08x, timeout %08x\n", nfds,
-            readfds, writefds, errorfds, timeout);
+   if (deadline == NO_DEADLINE)
+      return(realpoll(fds, nfds, -1));
+   /* Rounded up, we mustn't come back before the deadline */
+   left = (left + 999999) / 1000000;
+   return(realpoll(fds, nfds, (left > INT_MAX) ? INT_MAX : (int) left));
+}
 
-   for (conn = requests; conn != NULL; conn = conn->next) {
-      if ((conn->state == FAILED) || (conn->state == DONE))
-         continue;
-      conn->selectevents = 0;
-      show_msg(MSGDEBUG, "Checking requests for socks enabled socket %d\n",
-               conn->sockid);
-      conn->selectevents |= (writefds ? (FD_ISSET(conn->sockid, writefds) ? WRITE : 0) : 0);
-      conn->selectevents |= (readfds ? (FD_ISSET(conn->sockid, readfds) ? READ : 0) : 0);
-      conn->selectevents |= (errorfds ? (FD_ISSET(conn->sockid, errorfds) ? EXCEPT : 0) : 0);
-      if (conn->selectevents) {
-         show_msg(MSGDEBUG, "Socket %d was set for events\n", conn->sockid);
-         monitoring = 1;
-      }
+/* fd_sets are read as plain bitmaps. Programs with high fds allocate
+ * sets bigger than FD_SETSIZE, which FD_ISSET() can't be used on */
+#if defined(__APPLE__)
+typedef uint32_t fdset_word;
+#else
+typedef unsigned long fdset_word;
+#endif
+#define FDSET_WORD_BITS ((int) (8 * sizeof(fdset_word)))
+
+/* Up to this many fds select() doesn't allocate its poll array */
+#define SELECT_STACK_FDS 64
+
+static inline int fdset_isset(const fd_set *set, int fd) {
+   return((((const fdset_word *) set)[fd / FDSET_WORD_BITS] >> 
+           (fd % FDSET_WORD_BITS)) & 1);
+}
+
+static inline void fdset_set(fd_set *set, int fd) {
+   ((fdset_word *) set)[fd / FDSET_WORD_BITS] |= 
+      (fdset_word) 1 << (fd % FDSET_WORD_BITS);
+}
+
+static int poll_intercept(struct pollfd fds[], nfds_t nfds, long long deadline,
+                          int use_ppoll, const sigset_t *sigmask);
+
+/* select() and pselect() are run through the poll loop, with only the
+ * fds the caller selected in the array */
+static int select_intercept(int nfds, fd_set *readfds, fd_set *writefds, 
+                            fd_set *errorfds, long long deadline, 
+                            int use_ppoll, const sigset_t *sigmask) {
+   struct pollfd stackfds[SELECT_STACK_FDS], *fds = stackfds;
+   fdset_word *sets[3] = { (fdset_word *) readfds, (fdset_word *) writefds, 
+                           (fdset_word *) errorfds };
+   int words = (nfds + FDSET_WORD_BITS - 1) / FDSET_WORD_BITS;
+   fdset_word word, last;
+   int count = 0, nevents, saved, fd, w, i, found;
+   nfds_t n = 0;
+
+   /* Bits past nfds in the last word aren't ours to look at */
+   last = (nfds % FDSET_WORD_BITS) ? 
+          (((fdset_word) 1 << (nfds % FDSET_WORD_BITS)) - 1) : ~(fdset_word) 0;
+
+   for (w = 0; w < words; w++) {
+      word = 0;
+      for (i = 0; i < 3; i++)
+         if (sets[i])
+            word |= sets[i][w];
+      if (w == words - 1)
+         word &= last;
+      count += __builtin_popcountll((unsigned long long) word);
    }
 
-   if (!monitoring)
-      return(select(nfds, readfds, writefds, errorfds, timeout));
+   if ((count > SELECT_STACK_FDS) && 
+       ((fds = malloc(count * sizeof(*fds))) == NULL)) {
+      errno = ENOMEM;
+      return(-1);
+   }
+
+   for (w = 0; w < words; w++) {
+      word = 0;
+      for (i = 0; i < 3; i++)
+         if (sets[i])
+            word |= sets[i][w];
+      if (w == words - 1)
+         word &= last;
+      while (word) {
+         fd = (w * FDSET_WORD_BITS) + __builtin_ctzll((unsigned long long) word);
+         word &= word - 1;
+         fds[n].fd = fd;
+         fds[n].events = ((readfds && fdset_isset(readfds, fd)) ? POLLIN : 0) |
+                         ((writefds && fdset_isset(writefds, fd)) ? POLLOUT : 0) |
+                         ((errorfds && fdset_isset(errorfds, fd)) ? POLLPRI : 0);
+         fds[n].revents = 0;
+         n++;
+      }
+   }
 
-   /* This is our select loop. In it we repeatedly call select(). We 
-    * pass select the same fdsets as provided by the caller except we
-    * modify the fdsets for the sockets we're managing to get events
-    * we're interested in (while negotiating with the socks server). When
-    * events we're interested in happen we go off and process the result
-    * ourselves, without returning the events to the caller. The loop
-    * ends when an event which isn't one we need to handle occurs or 
-    * the select times out */
    do {
-      /* Copy the clients fd events, we'll change them as we wish */
-      if (readfds)
-         memcpy(&myreadfds, readfds, sizeof(myreadfds));
-      else
-         FD_ZERO(&myreadfds);
-      if (writefds)
-         memcpy(&mywritefds, writefds, sizeof(mywritefds));
-      else
-         FD_ZERO(&mywritefds);
-      if (errorfds)
-         memcpy(&myexceptfds, errorfds, sizeof(myexceptfds));
-      else
-         FD_ZERO(&myexceptfds);
+      if ((nevents = poll_intercept(fds, n, deadline, use_ppoll, sigmask)) <= 0)
+         break;
 
-      /* Now enable our sockets for the events WE want to hear about */
-      for (conn = requests; conn != NULL; conn = conn->next) {
-         if ((conn->state == FAILED) || (conn->state == DONE) ||
-             (conn->selectevents == 0))
-            continue;
-         /* We always want to know about socket exceptions */
-         FD_SET(conn->sockid, &myexceptfds);
-         /* If we're waiting for a connect or to be able to send
-          * on a socket we want to get write events */
-         if ((conn->state == SENDING) || (conn->state == CONNECTING))
-            FD_SET(conn->sockid,&mywritefds);
-         else
-            FD_CLR(conn->sockid,&mywritefds);
-         /* If we're waiting to receive data we want to get 
-          * read events */
-         if (conn->state == RECEIVING)
-            FD_SET(conn->sockid,&myreadfds);
-         else
-            FD_CLR(conn->sockid,&myreadfds);
+      for (i = 0; i < n; i++) {
+         if (fds[i].revents & POLLNVAL) {
+            errno = EBADF;
+            nevents = -1;
+            break;
+         }
       }
-
-      nevents = select(nfds, &myreadfds, &mywritefds, &myexceptfds, timeout);
-      /* If there were no events we must have timed out or had an error */
-      if (nevents <= 0)
+      if (nevents < 0)
          break;
 
-      /* Loop through all the sockets we're monitoring and see if 
-       * any of them have had events */
-      for (conn = requests; conn != NULL; conn = nextconn) {
-         nextconn = conn->next;
-         if ((conn->state == FAILED) || (conn->state == DONE))
+      /* Report the events the way select() does. Hangups only wake up 
+       * sockets selected for reading, errors those selected for reading
+       * or writing. Sockets with events select() ignores are left out 
+       * of the following rounds */
+      for (w = 0; w < words; w++)
+         for (i = 0; i < 3; i++)
+            if (sets[i])
+               sets[i][w] = 0;
+      nevents = 0;
+      for (i = 0; i < n; i++) {
+         if ((fds[i].fd < 0) || !fds[i].revents)
             continue;
-         show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
-         /* Clear all the events on the socket (if any), we'll reset
-          * any that are necessary later. */
-         setevents = 0;
-         if (FD_ISSET(conn->sockid, &mywritefds))  {
-            nevents--;
-            setevents |= WRITE;
-            show_msg(MSGDEBUG, "Socket had write event\n");
-            FD_CLR(conn->sockid, &mywritefds);
+         found = nevents;
+         if ((fds[i].events & POLLIN) && 
+             (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+            fdset_set(readfds, fds[i].fd);
+            nevents++;
          }
-         if (FD_ISSET(conn->sockid, &myreadfds))  {
-            nevents--;
-            setevents |= READ;
-            show_msg(MSGDEBUG, "Socket had write event\n");
-            FD_CLR(conn->sockid, &myreadfds);
+         if ((fds[i].events & POLLOUT) && 
+             (fds[i].revents & (POLLOUT | POLLERR))) {
+            fdset_set(writefds, fds[i].fd);
+            nevents++;
          }
-         if (FD_ISSET(conn->sockid, &myexceptfds))  {
-            nevents--;
-            setevents |= EXCEPT;
-            show_msg(MSGDEBUG, "Socket had except event\n");
-            FD_CLR(conn->sockid, &myexceptfds);
+         if ((fds[i].events & POLLPRI) && (fds[i].revents & POLLPRI)) {
+            fdset_set(errorfds, fds[i].fd);
+            nevents++;
          }
+         /* poll() would keep reporting it straight away */
+         if (found == nevents)
+            fds[i].fd = -1;
+      }
+   } while (nevents == 0);
 
-         if (!setevents) {
-            show_msg(MSGDEBUG, "No events on socket %d\n", conn->sockid);
-            continue;
-         }
+   if (nevents == 0) {
+      /* Timed out, nothing is set */
+      for (w = 0; w < words; w++)
+         for (i = 0; i < 3; i++)
+            if (sets[i])
+               sets[i][w] = 0;
+   }
 
-         if (setevents & EXCEPT) {
-            conn->state = FAILED;
-         } else {
-            rc = handle_request(conn);
-         }
-         /* If the connection hasn't failed or completed there is nothing
-          * to report to the client */
-         if ((conn->state != FAILED) && 
-             (conn->state != DONE))  
-            continue;
+   if (fds != stackfds) {
+      saved = errno;
+      free(fds);
+      errno = saved;
+   }
 
-         /* Ok, the connection is completed, for good or for bad. We now
-          * hand back the relevant events to the caller. We don't delete the
-          * connection though since the caller should call connect() to 
-          * check the status, we delete it then */
+   return(nevents);
+}
 
-         if (conn->state == FAILED) {
-            /* Damn, the connection failed. Whatever the events the socket
-             * was selected for we flag */
-            if (conn->selectevents & EXCEPT) {
-               FD_SET(conn->sockid, &myexceptfds);
-               nevents++;
-            }
-            if (conn->selectevents & READ) {
-               FD_SET(conn->sockid, &myreadfds);
-               nevents++;
-            }
-            if (conn->selectevents & WRITE) {
-               FD_SET(conn->sockid, &mywritefds);
-               nevents++;
-            }
-            /* We should use setsockopt to set the SO_ERROR errno for this 
-             * socket, but this isn't allowed for some silly reason which 
-             * leaves us a bit hamstrung.
-             * We don't delete the request so that hopefully we can 
-             * return the error on the socket if they call connect() on it */
-         } else {
-            /* The connection is done,  if the client selected for 
-             * writing we can go ahead and signal that now (since the socket must
-             * be ready for writing), otherwise we'll just let the select loop
-             * come around again (since we can't flag it for read, we don't know
-             * if there is any data to be read and can't be bothered checking) */
-            if (conn->selectevents & WRITE) {
-               FD_SET(conn->sockid, &mywritefds);
-               nevents++;
-            }
-         }
-      }
-   } while (nevents == 0);
+/* Whether any of the fds selected is one we're proxying */
+static int select_monitoring(int nfds, fd_set *readfds, fd_set *writefds, 
+                             fd_set *errorfds) {
+   int fd;
 
-   show_msg(MSGDEBUG, "Finished intercepting select(), %d events\n", nevents);
+   for (fd = conn_table_next(0, nfds); fd != -1; fd = conn_table_next(fd + 1, nfds)) {
+      if ((readfds && fdset_isset(readfds, fd)) ||
+          (writefds && fdset_isset(writefds, fd)) ||
+          (errorfds && fdset_isset(errorfds, fd)))
+         return(1);
+   }
+
+   return(0);
+}
+
+int p_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout)
+{
+   long long deadline = NO_DEADLINE;
+   int nevents;
+
+   /* If we're not currently managing any requests we can just 
+    * leave here */
+   if (conn_table_empty()) {
+      show_msg(MSGDEBUG, "No requests waiting, calling real select\n");
+      return(realselect(nfds, readfds, writefds, errorfds, timeout));
+   }
+
+   get_environment();
+
+   show_msg(MSGDEBUG, "Intercepted call to select with %d fds, "
+            "0x%08x 0x%08x 0x%08x, timeout %08x\n", nfds,
+            readfds, writefds, errorfds, timeout);
+
+   /* Bad arguments are left for the real select() to complain about */
+   if ((nfds <= 0) || 
+       (timeout && ((timeout->tv_sec < 0) || (timeout->tv_usec < 0) || 
+                    (timeout->tv_usec >= 1000000))) ||
+       !select_monitoring(nfds, readfds, writefds, errorfds))
+      return(realselect(nfds, readfds, writefds, errorfds, timeout));
+
+   if (timeout)
+      deadline = monotonic_ns() + ((long long) timeout->tv_sec * 1000000000) +
+                 ((long long) timeout->tv_usec * 1000);
+
+   nevents = select_intercept(nfds, readfds, writefds, errorfds, deadline, 
+                              0, NULL);
+
+#if defined(__linux__)
+   /* Linux tells the caller how much of the timeout is left */
+   if (timeout) {
+      int saved = errno;
+      long long left;
+
+      if ((left = deadline - monotonic_ns()) < 0)
+         left = 0;
+      timeout->tv_sec = left / 1000000000;
+      timeout->tv_usec = (left % 1000000000) / 1000;
+      errno = saved;
+   }
+#endif
 
-   /* Now copy our event blocks back to the client blocks */
-   if (readfds)
-      memcpy(readfds, &myreadfds, sizeof(myreadfds));
-   if (writefds)
-      memcpy(writefds, &mywritefds, sizeof(mywritefds));
-   if (errorfds)
-      memcpy(errorfds, &myexceptfds, sizeof(myexceptfds));
+   show_msg(MSGDEBUG, "Finished intercepting select(), %d events\n", nevents);
 
    return(nevents);
 }
 
-int p_poll(struct pollfd fds[], nfds_t nfds, int timeout)
+#if !defined(__APPLE__)
+int p_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, const struct timespec *timeout, const sigset_t *sigmask)
 {
-   int nevents = 0;
-   int rc = 0, i;
-   int setevents = 0;
-   int monitoring = 0;
-   struct connreq *conn, *nextconn;
+   long long deadline;
+
+   if (conn_table_empty())
+      return(realpselect(nfds, readfds, writefds, errorfds, timeout, sigmask));
+
+   get_environment();
 
+   show_msg(MSGDEBUG, "Intercepted call to pselect with %d fds\n", nfds);
+
+   if ((nfds <= 0) || ((deadline = timespec_deadline(timeout)) == -1) ||
+       !select_monitoring(nfds, readfds, writefds, errorfds))
+      return(realpselect(nfds, readfds, writefds, errorfds, timeout, sigmask));
+
+   return(select_intercept(nfds, readfds, writefds, errorfds, deadline, 
+                           1, sigmask));
+}
+#endif
+
+int p_poll(struct pollfd fds[], nfds_t nfds, int timeout)
+{
    /* If we're not currently managing any requests we can just 
     * leave here */
-   if (!requests)
-      return(poll(fds, nfds, timeout));
+   if (conn_table_empty())
+      return(realpoll(fds, nfds, timeout));
+
+   return(poll_intercept(fds, nfds, 
+                         (timeout < 0) ? NO_DEADLINE : 
+                         monotonic_ns() + ((long long) timeout * 1000000),
+                         0, NULL));
+}
+
+#if !defined(__APPLE__)
+int p_ppoll(struct pollfd fds[], nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
+{
+   long long deadline;
+
+   if (conn_table_empty() || ((deadline = timespec_deadline(timeout)) == -1))
+      return(realppoll(fds, nfds, timeout, sigmask));
+
+   return(poll_intercept(fds, nfds, deadline, 1, sigmask));
+}
+#endif
+
+static int poll_intercept(struct pollfd fds[], nfds_t nfds, long long deadline,
+                          int use_ppoll, const sigset_t *sigmask)
+{
+   int nevents = 0;
+   int rc = 0, i, saved;
+   int setevents = 0, counted, pending;
+   int monitoring = 0, finished;
+   struct connreq *conn;
 
    get_environment();
 
    show_msg(MSGDEBUG, "Intercepted call to poll with %d fds, "
-            "0x%08x timeout %d\n", nfds, fds, timeout);
-
-   for (conn = requests; conn != NULL; conn = conn->next)
-      conn->selectevents = 0;
+            "0x%08x deadline %lld\n", nfds, fds, deadline);
 
    /* Record what events on our sockets the caller was interested
-    * in */
+    * in, finished requests are recorded too so the events we restore
+    * on the way out are the ones the caller gave us */
    for (i = 0; i < nfds; i++) {
-      if (!(conn = find_socks_request(fds[i].fd, 0)))
+      if (!(conn = conn_table_acquire(fds[i].fd)))
          continue;
-      show_msg(MSGDEBUG, "Have event checks for socks enabled socket %d\n",
-               conn->sockid);
       conn->selectevents = fds[i].events;
-      monitoring = 1;
+      conn->polled = 0;
+      if ((conn->state != FAILED) && (conn->state != DONE)) {
+         show_msg(MSGDEBUG, "Have event checks for socks enabled socket %d\n",
+                  conn->sockid);
+         monitoring = 1;
+      }
+      conn_table_unlock(fds[i].fd);
    }
 
    if (!monitoring)
-      return(poll(fds, nfds, timeout));
+      return(poll_wait(fds, nfds, deadline, use_ppoll, sigmask));
 
    /* This is our poll loop. In it we repeatedly call poll(). We 
     * pass select the same event list as provided by the caller except we
@@ -648,12 +793,24 @@ int p_poll(struct pollfd fds[], nfds_t nfds, int timeout)
     * events we're interested in happen we go off and process the result
     * ourselves, without returning the events to the caller. The loop
     * ends when an event which isn't one we need to handle occurs or 
-    * the poll times out */
+    * the deadline passes, every round only waits for what is left */
    do {
+      finished = 0;
+
       /* Enable our sockets for the events WE want to hear about */
       for (i = 0; i < nfds; i++) {
-         if (!(conn = find_socks_request(fds[i].fd, 0)))
+         if (!(conn = conn_table_acquire(fds[i].fd)))
             continue;
+         if ((conn->state == FAILED) || (conn->state == DONE)) {
+            /* Another thread (or the reactor) finished it since the 
+             * last round, it has to be reported without waiting */
+            if (conn->polled)
+               finished++;
+            conn_table_unlock(fds[i].fd);
+            continue;
+         }
+         conn->polled = 1;
+         reactor_update(conn);
 
          /* We always want to know about socket exceptions but they're 
           * always returned (i.e they don't need to be in the list of 
@@ -664,55 +821,64 @@ int p_poll(struct pollfd fds[], nfds_t nfds, int timeout)
           * on a socket we want to get write events */
          if ((conn->state == SENDING) || (conn->state == CONNECTING))
             fds[i].events |= POLLOUT;
+         else if (early_writable(conn))
+            fds[i].events |= (conn->selectevents & POLLOUT);
          /* If we're waiting to receive data we want to get 
           * read events */
          if (conn->state == RECEIVING)
             fds[i].events |= POLLIN;
+         conn_table_unlock(fds[i].fd);
       }
 
-      nevents = poll(fds, nfds, timeout);
+      nevents = poll_wait(fds, nfds, (finished ? monotonic_ns() : deadline), 
+                          use_ppoll, sigmask);
       /* If there were no events we must have timed out or had an error */
-      if (nevents <= 0)
+      if ((nevents < 0) || ((nevents == 0) && !finished))
          break;
 
       /* Loop through all the sockets we're monitoring and see if 
        * any of them have had events */
-      for (conn = requests; conn != NULL; conn = nextconn) {
-         nextconn = conn->next;
-         if ((conn->state == FAILED) || (conn->state == DONE))
+      for (i = 0; i < nfds; i++) {
+         if (!(conn = conn_table_acquire(fds[i].fd)))
             continue;
-
-         /* Find the socket in the poll list */
-         for (i = 0; ((i < nfds) && (fds[i].fd != conn->sockid)); i++)
-            /* Empty Loop */;
-         if (i == nfds) 
+         pending = ((conn->state != FAILED) && (conn->state != DONE));
+         if (!pending && !conn->polled) {
+            conn_table_unlock(fds[i].fd);
             continue;
+         }
 
          show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
 
-         if (!fds[i].revents) {
+         if (pending && !fds[i].revents) {
             show_msg(MSGDEBUG, "No events on socket\n");
+            conn_table_unlock(fds[i].fd);
             continue;
          }
 
          /* Clear any read or write events on the socket, we'll reset
           * any that are necessary later. */
          setevents = fds[i].revents;
+         counted = (setevents != 0);
          if (setevents & POLLIN) {
             show_msg(MSGDEBUG, "Socket had read event\n");
             fds[i].revents &= ~POLLIN;
-            nevents--;
          }
-         if (setevents & POLLOUT) {
+         /* Once the connect request is out, with optimistic data, write 
+          * events are the caller's and left alone */
+         if ((setevents & POLLOUT) && !early_writable(conn)) {
             show_msg(MSGDEBUG, "Socket had write event\n");
             fds[i].revents &= ~POLLOUT;
-            nevents--;
          }
+         /* poll() counts sockets, not events */
+         if (counted && !fds[i].revents)
+            nevents--;
          if (setevents & (POLLERR | POLLNVAL | POLLHUP)) 
             show_msg(MSGDEBUG, "Socket had error event\n");
 
          /* Now handle this event */
-         if (setevents & (POLLERR | POLLNVAL | POLLHUP)) {
+         if (!pending) {
+            /* Already done with, only left to report */
+         } else if (setevents & (POLLERR | POLLNVAL | POLLHUP)) {
             conn->state = FAILED;
          } else {
             rc = handle_request(conn);
@@ -720,13 +886,18 @@ int p_poll(struct pollfd fds[], nfds_t nfds, int timeout)
          /* If the connection hasn't failed or completed there is nothing
           * to report to the client */
          if ((conn->state != FAILED) && 
-             (conn->state != DONE))  
+             (conn->state != DONE)) {
+            conn_table_unlock(fds[i].fd);
             continue;
+         }
 
          /* Ok, the connection is completed, for good or for bad. We now
           * hand back the relevant events to the caller. We don't delete the
           * connection though since the caller should call connect() to 
-          * check the status, we delete it then */
+          * check the status, we delete it then. From now on the socket 
+          * is polled for what the caller asked */
+         conn->polled = 0;
+         fds[i].events = conn->selectevents;
 
          if (conn->state == FAILED) {
             /* Damn, the connection failed. Just copy back the error events 
@@ -736,149 +907,1126 @@ int p_poll(struct pollfd fds[], nfds_t nfds, int timeout)
              * socket, but this isn't allowed for some silly reason which 
              * leaves us a bit hamstrung.
              * We don't delete the request so that hopefully we can 
-             * return the error on the socket if they call connect() on it */
+             * return the error on the socket if they call connect() on it.
+             * If the kernel had nothing to say (the server refused us) the
+             * caller still has to hear of it */
+            if (!fds[i].revents) {
+               fds[i].revents = POLLERR;
+               nevents++;
+            }
          } else {
             /* The connection is done,  if the client polled for 
              * writing we can go ahead and signal that now (since the socket must
              * be ready for writing), otherwise we'll just let the select loop
              * come around again (since we can't flag it for read, we don't know
              * if there is any data to be read and can't be bothered checking) */
-            if (conn->selectevents & WRITE) {
-               setevents |= POLLOUT; 
-               nevents++;
+            if (conn->selectevents & POLLOUT) {
+               if (!fds[i].revents)
+                  nevents++;
+               fds[i].revents |= POLLOUT; 
             }
          }
+         conn_table_unlock(fds[i].fd);
       }
    } while (nevents == 0);
 
    show_msg(MSGDEBUG, "Finished intercepting poll(), %d events\n", nevents);
 
-   /* Now restore the events polled in each of the blocks */
+   /* Now restore the events polled in each of the blocks, the reactor
+    * takes over the requests still going */
+   saved = errno;
    for (i = 0; i < nfds; i++) {
-      if (!(conn = find_socks_request(fds[i].fd, 1)))
+      if (!(conn = conn_table_acquire(fds[i].fd)))
          continue;
 
       fds[i].events = conn->selectevents;
+      conn->polled = 0;
+      reactor_update(conn);
+      conn_table_unlock(fds[i].fd);
    }
+   errno = saved;
 
    return(nevents);
 }
 
-int p_close(int fd)
+#if defined(__linux__)
+/* While a socket registered with epoll is negotiating with the socks
+ * server we swap the caller's registration for one of our own. Its
+ * events are tagged so that epoll_wait() can recognise them, drive the
+ * negotiation and hide them from the caller. Once the negotiation is
+ * over the caller's registration is put back and the kernel reports
+ * the socket to them as usual, edge or level triggered. The tag alone
+ * could be the caller's own data, an event is only taken for ours if
+ * the conn table says we replaced the registration of its fd in the
+ * epoll instance it came from */
+#define EPOLL_TAG         0xf5c0c5a000000000ULL
+#define EPOLL_TAG_MASK    0xffffffff00000000ULL
+
+/* Number of requests whose epoll registration we hold, epoll_wait()
+ * doesn't look at the events it returns while there are none */
+static int epoll_requests = 0;
+
+static long long monotonic_ms(void) {
+   return(monotonic_ns() / 1000000);
+}
+
+/* The fd lock for conn must be held for all of these */
+static int epoll_take(struct connreq *conn, int epfd, int op) {
+   struct epoll_event event;
+
+   /* Level triggered, so we are told again if we can't finish */
+   event.events = 0;
+   if ((conn->state == SENDING) || (conn->state == CONNECTING))
+      event.events |= EPOLLOUT;
+   if (conn->state == RECEIVING)
+      event.events |= EPOLLIN;
+   /* With optimistic data the caller's write events are passed on once
+    * the connect request is out, as they asked for them */
+   if (early_writable(conn))
+      event.events |= (conn->epevents & (EPOLLOUT | EPOLLET));
+   event.data.u64 = EPOLL_TAG | (uint32_t) conn->sockid;
+
+   return(realepoll_ctl(epfd, op, conn->sockid, &event));
+}
+
+static void epoll_release(struct connreq *conn) {
+   struct epoll_event event;
+   int rc;
+
+   if (conn->epfd == -1)
+      return;
+
+   event.events = conn->epevents;
+   event.data.u64 = conn->epdata;
+   /* EPOLLEXCLUSIVE can only be given when the fd is added */
+   if (conn->epevents & EPOLLEXCLUSIVE) {
+      realepoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->sockid, NULL);
+      rc = realepoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->sockid, &event);
+   } else 
+      rc = realepoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->sockid, &event);
+   if (rc)
+      show_msg(MSGERR, "Could not restore the epoll registration of "
+                       "socket %d (%s)\n", conn->sockid, strerror(errno));
+
+   conn->epfd = -1;
+   __atomic_fetch_sub(&epoll_requests, 1, __ATOMIC_RELAXED);
+}
+
+/* Bring our registration up to date after the request was handled */
+static void epoll_sync(struct connreq *conn) {
+   if (conn->epfd == -1)
+      return;
+
+   if (conn->state == DONE) {
+      epoll_release(conn);
+   } else if (conn->state == FAILED) {
+      /* We can't set SO_ERROR, but shutting the socket down makes
+       * the kernel signal the caller and fails their reads and writes */
+      epoll_release(conn);
+      shutdown(conn->sockid, SHUT_RDWR);
+   } else
+      epoll_take(conn, conn->epfd, EPOLL_CTL_MOD);
+}
+
+int p_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
+   struct connreq *conn;
+   struct epoll_event saved;
    int rc;
+
+   /* A socket that is watched can't be given a speculative stream */
+   if (op == EPOLL_CTL_ADD)
+      conn_table_set_polled(fd);
+
+   /* Only sockets we are negotiating for concern us. A DEL needs no
+    * event, an ADD or MOD without one is for the kernel to refuse */
+   if ((((op == EPOLL_CTL_ADD) || (op == EPOLL_CTL_MOD)) && 
+        (event == NULL)) || !(conn = conn_table_acquire(fd)))
+      return(realepoll_ctl(epfd, op, fd, event));
+
+   if ((conn->state == FAILED) || (conn->state == DONE) ||
+       ((conn->epfd != -1) && (conn->epfd != epfd))) {
+      conn_table_unlock(fd);
+      return(realepoll_ctl(epfd, op, fd, event));
+   }
+
+   switch (op) {
+      case EPOLL_CTL_ADD:
+      case EPOLL_CTL_MOD:
+         /* A MOD on a socket registered before connect() was called
+          * is where we take it over */
+         show_msg(MSGDEBUG, "Holding back epoll registration of socket "
+                            "%d until it is connected\n", fd);
+         saved = *event;
+         if (conn->epfd != -1) {
+            saved.events = conn->epevents;
+            saved.data.u64 = conn->epdata;
+         }
+         /* Our registration depends on what the caller asked for */
+         conn->epevents = event->events;
+         conn->epdata = event->data.u64;
+         rc = epoll_take(conn, epfd, op);
+         if (rc == 0) {
+            if (conn->epfd == -1)
+               __atomic_fetch_add(&epoll_requests, 1, __ATOMIC_RELAXED);
+            conn->epfd = epfd;
+            conn_table_set_epoll(fd, epfd);
+         } else {
+            conn->epevents = saved.events;
+            conn->epdata = saved.data.u64;
+         }
+         break;
+      case EPOLL_CTL_DEL:
+         rc = realepoll_ctl(epfd, op, fd, event);
+         if ((rc == 0) && (conn->epfd != -1)) {
+            conn->epfd = -1;
+            __atomic_fetch_sub(&epoll_requests, 1, __ATOMIC_RELAXED);
+         }
+         break;
+      default:
+         rc = realepoll_ctl(epfd, op, fd, event);
+         break;
+   }
+   conn_table_unlock(fd);
+
+   return(rc);
+}
+
+/* Returns 1 if there is an event for the caller in out */
+static int epoll_handle_event(int epfd, int fd, uint32_t revents,
+                              struct epoll_event *out) {
    struct connreq *conn;
+   socklen_t len = sizeof(conn->err);
+   int early;
+
+   /* The request may have been closed since the event was queued */
+   if (!(conn = conn_table_acquire(fd)))
+      return(0);
+   if ((conn->epfd != epfd) || (conn->state == FAILED) ||
+       (conn->state == DONE)) {
+      conn_table_unlock(fd);
+      return(0);
+   }
+   early = early_writable(conn) && (revents & EPOLLOUT);
+
+   show_msg(MSGDEBUG, "Socket %d had epoll events 0x%x\n", fd, revents);
+   if (revents & (EPOLLERR | EPOLLHUP)) {
+      conn->state = FAILED;
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &conn->err, &len) || 
+          !conn->err)
+         conn->err = ECONNREFUSED;
+   } else 
+      handle_request(conn);
+
+   /* If the request is over the caller's registration reports it */
+   if (early && (conn->state != FAILED) && (conn->state != DONE)) {
+      out->events = EPOLLOUT;
+      out->data.u64 = conn->epdata;
+   } else
+      early = 0;
+   epoll_sync(conn);
+
+   conn_table_unlock(fd);
+
+   return(early);
+}
+
+static int epoll_wait_events(int epfd, struct epoll_event *events, 
+                             int maxevents, int timeout, int pwait,
+                             const sigset_t *sigmask) {
+   long long deadline = 0;
+   int nevents, kept, i, fd;
+
+   if (timeout > 0)
+      deadline = monotonic_ms() + timeout;
+
+   for (;;) {
+      if (pwait)
+         nevents = realepoll_pwait(epfd, events, maxevents, timeout, sigmask);
+      else
+         nevents = realepoll_wait(epfd, events, maxevents, timeout);
+      if (nevents <= 0)
+         return(nevents);
+
+      /* Handle and drop our own events, keeping the caller's in order */
+      for (i = 0, kept = 0; i < nevents; i++) {
+         fd = (int) (events[i].data.u64 & ~EPOLL_TAG_MASK);
+         if (((events[i].data.u64 & EPOLL_TAG_MASK) == EPOLL_TAG) &&
+             (conn_table_epoll(fd) == epfd)) {
+            if (epoll_handle_event(epfd, fd, events[i].events, &events[kept]))
+               kept++;
+            continue;
+         }
+         if (kept != i)
+            events[kept] = events[i];
+         kept++;
+      }
+      if (kept)
+         return(kept);
+
+      /* Nothing for the caller yet, wait for what is left of the timeout */
+      if (timeout == 0)
+         return(0);
+      if (timeout > 0) {
+         timeout = (int) (deadline - monotonic_ms());
+         if (timeout <= 0)
+            return(0);
+      }
+   }
+}
+
+int p_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+   /* Unless we hold a registration there is nothing to filter */
+   if (__atomic_load_n(&epoll_requests, __ATOMIC_RELAXED) == 0)
+      return(realepoll_wait(epfd, events, maxevents, timeout));
+
+   return(epoll_wait_events(epfd, events, maxevents, timeout, 0, NULL));
+}
+
+int p_epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask)
+{
+   if (__atomic_load_n(&epoll_requests, __ATOMIC_RELAXED) == 0)
+      return(realepoll_pwait(epfd, events, maxevents, timeout, sigmask));
+
+   return(epoll_wait_events(epfd, events, maxevents, timeout, 1, sigmask));
+}
+#endif
+
+int p_close(int fd)
+{
+   int rc;
+   struct connreq *conn;
+
+   /* If we have this fd in our request handling table we 
+    * remove it now. This is done before the real close() while we
+    * hold the fd lock, so that another thread can't be handed the
+    * same fd and register a new request which we would then kill */
+#ifdef USE_TOR_DNS
+   forget_speculation(fd);
+#endif
+   if ((conn = conn_table_acquire(fd))) {
+      show_msg(MSGDEBUG, "Call to close() received on file descriptor "
+                         "%d which is a connection request of status %d\n",
+               conn->sockid, conn->state);
+      kill_socks_request(conn);
+      conn_table_forget(fd);
+      rc = realclose(fd);
+      conn_table_unlock(fd);
+   } else {
+      conn_table_forget(fd);
+      rc = realclose(fd);
+   }
+
+   return(rc);
+}
+
+/* Remember the type of the sockets created while we are loaded, so that
+ * connect() can classify them without asking the kernel */
+int p_socket(int domain, int type, int protocol)
+{
+   int fd;
+
+   fd = realsocket(domain, type, protocol);
+   if (fd != -1)
+      conn_table_set_info(fd, ((type & 0xff) == SOCK_STREAM) ? FDINFO_STREAM : 0);
+
+   return(fd);
+}
+
+int p_socketpair(int domain, int type, int protocol, int sv[2])
+{
+   int rc, info;
+
+   rc = realsocketpair(domain, type, protocol, sv);
+   if (rc == 0) {
+      info = FDINFO_CONNECTED | (((type & 0xff) == SOCK_STREAM) ? FDINFO_STREAM : 0);
+      conn_table_set_info(sv[0], info);
+      conn_table_set_info(sv[1], info);
+   }
+
+   return(rc);
+}
+
+int p_accept(int fd, struct sockaddr *address, socklen_t *address_len)
+{
+   int newfd;
+
+   newfd = realaccept(fd, address, address_len);
+   if (newfd != -1)
+      conn_table_set_info(newfd, FDINFO_STREAM | FDINFO_CONNECTED);
+
+   return(newfd);
+}
+
+#if defined(__linux__)
+int p_accept4(int fd, struct sockaddr *address, socklen_t *address_len, 
+              int flags)
+{
+   int newfd;
+
+   newfd = realaccept4(fd, address, address_len, flags);
+   if (newfd != -1)
+      conn_table_set_info(newfd, FDINFO_STREAM | FDINFO_CONNECTED);
+
+   return(newfd);
+}
+#endif
+
+/* newfd is now a copy of fd, whatever we knew about the fd it may have */
+/* replaced is stale                                                    */
+static void fd_duplicated(int fd, int newfd) {
+   if (fd == newfd)
+      return;
+#ifdef USE_TOR_DNS
+   forget_speculation(newfd);
+#endif
+   conn_table_forget(newfd);
+   if (conn_table_has_info(fd))
+      conn_table_set_info(newfd, conn_table_info(fd));
+}
+
+int p_dup(int fd)
+{
+   int newfd;
+
+   newfd = realdup(fd);
+   if (newfd != -1)
+      fd_duplicated(fd, newfd);
+
+   return(newfd);
+}
+
+int p_dup2(int fd, int fd2)
+{
+   int rc;
+
+   rc = realdup2(fd, fd2);
+   if (rc != -1)
+      fd_duplicated(fd, fd2);
+
+   return(rc);
+}
+
+#if defined(__linux__)
+int p_dup3(int fd, int fd2, int flags)
+{
+   int rc;
+
+   rc = realdup3(fd, fd2, flags);
+   if (rc != -1)
+      fd_duplicated(fd, fd2);
+
+   return(rc);
+}
+#endif
+
+#ifdef F_DUPFD_CLOEXEC
+#define IS_DUPFD(cmd) (((cmd) == F_DUPFD) || ((cmd) == F_DUPFD_CLOEXEC))
+#else
+#define IS_DUPFD(cmd) ((cmd) == F_DUPFD)
+#endif
+
+/* Every command takes an int, a pointer or nothing, which the real */
+/* fcntl() reads back the way it expects                            */
+int p_fcntl(int fd, int cmd, ...)
+{
+   va_list ap;
+   void *arg;
+   int rc;
+
+   va_start(ap, cmd);
+   arg = va_arg(ap, void *);
+   va_end(ap);
+
+   rc = realfcntl(fd, cmd, arg);
+   if ((rc != -1) && IS_DUPFD(cmd))
+      fd_duplicated(fd, rc);
+
+   return(rc);
+}
+
+#if defined(__GLIBC__)
+/* What programs built with 64 bit file offsets call instead */
+int p_fcntl64(int fd, int cmd, ...)
+{
+   va_list ap;
+   void *arg;
+   int rc;
+
+   va_start(ap, cmd);
+   arg = va_arg(ap, void *);
+   va_end(ap);
+
+   rc = (realfcntl64 ? realfcntl64 : realfcntl)(fd, cmd, arg);
+   if ((rc != -1) && IS_DUPFD(cmd))
+      fd_duplicated(fd, rc);
+
+   return(rc);
+}
+#endif
+
+/* The connect request has been sent, only its reply is awaited */
+static int connect_sent(struct connreq *conn) {
+   return((conn->state == RECEIVING) &&
+          ((conn->nextstate == GOTV5CONNECT) || 
+           (conn->nextstate == GOTV4REQ)));
+}
+
+/* With optimistic data the caller may write as soon as the connect
+ * request is out, Tor takes data before it has answered it */
+static int early_writable(struct connreq *conn) {
+   return(config->optimistic_data && connect_sent(conn));
+}
+
+/* Returned by early_data() when the write should go to the socket */
+#define EARLY_DATA_PASS (-2)
+
+/* Writes to a socket we are still negotiating for. Data written before
+ * the connect request was sent is queued and sent along with it, after
+ * that it goes straight to the socket. Writes to a failed request get 
+ * its error. Returns the number of bytes queued, -1 with errno set or 
+ * EARLY_DATA_PASS */
+static ssize_t early_data(int fd, const struct iovec *iov, int iovcnt) {
+   struct connreq *conn;
+   ssize_t queued = 0;
+   size_t len;
+   int i;
+
+   if (!conn_table_is_proxied(fd) || !config->optimistic_data)
+      return(EARLY_DATA_PASS);
+   if (!(conn = conn_table_acquire(fd)))
+      return(EARLY_DATA_PASS);
+
+   if ((conn->state == DONE) || connect_sent(conn)) {
+      queued = EARLY_DATA_PASS;
+   } else if (conn->state == FAILED) {
+      errno = (conn->err ? conn->err : ECONNREFUSED);
+      queued = -1;
+   } else if (conn->earlylen == EARLY_DATA_MAX) {
+      errno = EAGAIN;
+      queued = -1;
+   } else if (!conn->early && 
+              ((conn->early = malloc(EARLY_DATA_MAX)) == NULL)) {
+      errno = ENOMEM;
+      queued = -1;
+   } else {
+      for (i = 0; (i < iovcnt) && (conn->earlylen < EARLY_DATA_MAX); i++) {
+         len = iov[i].iov_len;
+         if (len > (size_t) (EARLY_DATA_MAX - conn->earlylen))
+            len = (size_t) (EARLY_DATA_MAX - conn->earlylen);
+         memcpy(conn->early + conn->earlylen, iov[i].iov_base, len);
+         conn->earlylen += (int) len;
+         queued += len;
+      }
+      show_msg(MSGDEBUG, "Queued %d bytes of early data for socket %d\n",
+               (int) queued, fd);
+   }
+   conn_table_unlock(fd);
+
+   return(queued);
+}
+
+ssize_t p_send(int fd, const void *buffer, size_t length, int flags)
+{
+   struct iovec iov;
+   ssize_t rc;
+
+   iov.iov_base = (void *) buffer;
+   iov.iov_len = length;
+   if ((rc = early_data(fd, &iov, 1)) == EARLY_DATA_PASS)
+      rc = realsend(fd, buffer, length, flags);
+
+   return(rc);
+}
+
+ssize_t p_write(int fd, const void *buffer, size_t length)
+{
+   struct iovec iov;
+   ssize_t rc;
+
+   iov.iov_base = (void *) buffer;
+   iov.iov_len = length;
+   if ((rc = early_data(fd, &iov, 1)) == EARLY_DATA_PASS)
+      rc = realwrite(fd, buffer, length);
+
+   return(rc);
+}
+
+ssize_t p_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+   ssize_t rc;
+
+   if ((rc = early_data(fd, iov, iovcnt)) == EARLY_DATA_PASS)
+      rc = realwritev(fd, iov, iovcnt);
+
+   return(rc);
+}
+
+ssize_t p_sendmsg(int fd, const struct msghdr *message, int flags)
+{
+   ssize_t rc;
+
+   /* Messages with an address or ancillary data aren't stream data, */
+   /* and a missing one is for the kernel to fail with EFAULT         */
+   if (!message || message->msg_name || message->msg_control)
+      return(realsendmsg(fd, message, flags));
+   if ((rc = early_data(fd, message->msg_iov, (int) message->msg_iovlen)) == EARLY_DATA_PASS)
+      rc = realsendmsg(fd, message, flags);
+
+   return(rc);
+}
+
+/* If we are not done setting up the connection yet, return
+ * -1 and ENOTCONN, otherwise call getpeername
+ *
+ * This is necessary since some applications, when using non-blocking connect,
+ * (like ircII) use getpeername() to find out if they are connected already.
+ *
+ * This results in races sometimes, where the client sends data to the socket
+ * before we are done with the socks connection setup.  Another solution would
+ * be to intercept send().
+ * 
+ * This could be extended to actually set the peername to the peer the
+ * client application has requested, but not for now.
+ *
+ * PP, Sat, 27 Mar 2004 11:30:23 +0100
+ */
+int p_getpeername(int fd, struct sockaddr *address, socklen_t *address_len)
+{
+   struct connreq *conn;
+   int rc;
+
+   rc = realgetpeername(fd, address, address_len);
+   if (rc == -1)
+       return rc;
+
+   /* Are we handling this connect? */
+   if ((conn = conn_table_acquire(fd))) {
+       /* While we are at it, we might was well try to do something useful */
+       handle_request(conn);
+#if defined(__linux__)
+       epoll_sync(conn);
+#endif
+
+       if (conn->state != DONE) {
+           conn_table_unlock(fd);
+           errno = ENOTCONN;
+           return(-1);
+       }
+       conn_table_unlock(fd);
+   }
+   return rc;
+}
+
+/* The reactor thread's side of a request, the socket had events or the
+ * negotiation took too long */
+static void drive_request(int fd, int expired) {
+   struct connreq *conn;
+
+   if (!(conn = conn_table_acquire(fd)))
+      return;
+   /* The fd may have been reused since the reactor was woken up */
+   if (!conn->reactor) {
+      conn_table_unlock(fd);
+      return;
+   }
+
+   if (!expired) {
+      /* The event may have been taken just before a poll() or select() */
+      /* started driving the request, reading the reply for them would */
+      /* leave them waiting for it                                      */
+      if (!conn->polled)
+         handle_request(conn);
+   } else if (reactor_expired(conn)) {
+      show_msg(MSGERR, "Negotiation with the SOCKS server for socket %d "
+                       "timed out\n", fd);
+      conn->state = FAILED;
+      conn->err = ETIMEDOUT;
+      reactor_update(conn);
+   }
+
+#if defined(__linux__)
+   epoll_sync(conn);
+#endif
+   /* Wake up anyone waiting on the socket, the request is kept for 
+    * connect() to report the error */
+   if (conn->state == FAILED)
+      shutdown(fd, SHUT_RDWR);
+
+   conn_table_unlock(fd);
+}
+
+#ifdef USE_TOR_DNS
+/* After a lookup with a port, the caller almost always connects to what
+ * it was given at once. The negotiation for it is started meanwhile on a
+ * socket of ours, which connect() then puts in place of the caller's. 
+ * That is only done to a socket the caller did nothing with but create:
+ * one with options of its own or in an epoll set would lose them. The
+ * streams nobody claimed in time are closed by the next lookup or
+ * connect() */
+#define SPECULATIVE_MAX 64
+
+/* What the caller may have set on its socket before connect(), they are */
+/* compared with what a socket we just created has                       */
+static const struct {
+   int level;
+   int name;
+} spec_options[] = {
+   { SOL_SOCKET, SO_KEEPALIVE },
+   { SOL_SOCKET, SO_LINGER },
+   { SOL_SOCKET, SO_OOBINLINE },
+   { SOL_SOCKET, SO_DONTROUTE },
+   { SOL_SOCKET, SO_REUSEADDR },
+   { SOL_SOCKET, SO_RCVBUF },
+   { SOL_SOCKET, SO_SNDBUF },
+   { SOL_SOCKET, SO_RCVLOWAT },
+   { SOL_SOCKET, SO_RCVTIMEO },
+   { SOL_SOCKET, SO_SNDTIMEO },
+#ifdef SO_PRIORITY
+   { SOL_SOCKET, SO_PRIORITY },
+#endif
+#ifdef SO_MARK
+   { SOL_SOCKET, SO_MARK },
+#endif
+#ifdef SO_BINDTODEVICE
+   { SOL_SOCKET, SO_BINDTODEVICE },
+#endif
+#ifdef SO_NOSIGPIPE
+   { SOL_SOCKET, SO_NOSIGPIPE },
+#endif
+   { IPPROTO_IP, IP_TOS },
+   { IPPROTO_IP, IP_TTL },
+   { IPPROTO_TCP, TCP_NODELAY },
+#ifdef TCP_KEEPIDLE
+   { IPPROTO_TCP, TCP_KEEPIDLE },
+#endif
+#ifdef TCP_KEEPALIVE
+   { IPPROTO_TCP, TCP_KEEPALIVE },
+#endif
+#ifdef TCP_KEEPINTVL
+   { IPPROTO_TCP, TCP_KEEPINTVL },
+#endif
+#ifdef TCP_KEEPCNT
+   { IPPROTO_TCP, TCP_KEEPCNT },
+#endif
+#ifdef TCP_USER_TIMEOUT
+   { IPPROTO_TCP, TCP_USER_TIMEOUT },
+#endif
+#ifdef TCP_CONGESTION
+   { IPPROTO_TCP, TCP_CONGESTION },
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+   { IPPROTO_TCP, TCP_NOTSENT_LOWAT },
+#endif
+};
+#define SPEC_OPTIONS      (sizeof(spec_options) / sizeof(spec_options[0]))
+#define SPEC_OPTION_SIZE  32
+
+struct spec_option {
+   socklen_t len;          /* 0 if it couldn't be read */
+   char value[SPEC_OPTION_SIZE];
+};
+
+struct speculation {
+   int used;
+   int fd;                 /* -1 while it is being opened */
+   struct sockaddr_in connaddr;
+   long long expires;      /* In milliseconds on the monotonic clock */
+};
+
+static pthread_mutex_t spec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct speculation specs[SPECULATIVE_MAX];
+static int spec_open = 0;
+static unsigned long spec_started = 0;
+static unsigned long spec_hits = 0;
+static unsigned long spec_wasted = 0;
+static struct spec_option spec_defaults[SPEC_OPTIONS];
+static int spec_defaults_read = 0;
+
+static void spec_prepare(void) {
+   pthread_mutex_lock(&spec_mutex);
+}
+
+static void spec_parent(void) {
+   pthread_mutex_unlock(&spec_mutex);
+}
+
+/* The parent may claim its streams, the child's copies would keep them */
+/* open after it closed them                                            */
+static void spec_child(void) {
+   int i;
+
+   for (i = 0; i < SPECULATIVE_MAX; i++) {
+      if (specs[i].used && (specs[i].fd != -1))
+         realclose(specs[i].fd);
+      specs[i].used = 0;
+   }
+   __atomic_store_n(&spec_open, 0, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&spec_mutex);
+}
+
+static int same_destination(const struct sockaddr_in *a, 
+                            const struct sockaddr_in *b) {
+   return((a->sin_addr.s_addr == b->sin_addr.s_addr) &&
+          (a->sin_port == b->sin_port));
+}
+
+static void read_spec_options(int fd, struct spec_option *options) {
+   unsigned int i;
+
+   memset(options, 0, SPEC_OPTIONS * sizeof(*options));
+   for (i = 0; i < SPEC_OPTIONS; i++) {
+      options[i].len = sizeof(options[i].value);
+      if (getsockopt(fd, spec_options[i].level, spec_options[i].name,
+                     options[i].value, &options[i].len))
+         options[i].len = 0;
+   }
+}
+
+/* Whether fd is still as socket() made it, as far as a stream of ours */
+/* standing in for it goes                                             */
+static int untouched_socket(int fd) {
+   struct spec_option options[SPEC_OPTIONS];
+   unsigned int i;
+
+   if (!__atomic_load_n(&spec_defaults_read, __ATOMIC_ACQUIRE) ||
+       conn_table_polled(fd))
+      return(0);
+
+   read_spec_options(fd, options);
+   for (i = 0; i < SPEC_OPTIONS; i++) {
+      if ((options[i].len != spec_defaults[i].len) ||
+          memcmp(options[i].value, spec_defaults[i].value, options[i].len)) {
+         show_msg(MSGDEBUG, "Socket %d has option %d/%d set, not giving "
+                            "it a speculative stream\n", fd,
+                  spec_options[i].level, spec_options[i].name);
+         return(0);
+      }
+   }
+
+   return(1);
+}
+
+/* Close a stream that won't be claimed */
+static void spec_close(int fd) {
+   struct connreq *conn;
+
+   if ((conn = conn_table_acquire(fd))) {
+      kill_socks_request(conn);
+      realclose(fd);
+      conn_table_unlock(fd);
+   } else
+      realclose(fd);
+   __atomic_add_fetch(&spec_wasted, 1, __ATOMIC_RELAXED);
+}
+
+/* The spec mutex must be held */
+static void spec_release(struct speculation *spec) {
+   spec->used = 0;
+   __atomic_sub_fetch(&spec_open, 1, __ATOMIC_RELAXED);
+}
+
+static void spec_expire(long long now) {
+   int i;
+
+   for (i = 0; i < SPECULATIVE_MAX; i++) {
+      if (specs[i].used && (specs[i].fd != -1) && (specs[i].expires <= now)) {
+         show_msg(MSGDEBUG, "Speculative stream on socket %d expired\n",
+                  specs[i].fd);
+         spec_close(specs[i].fd);
+         spec_release(&specs[i]);
+      }
+   }
+}
+
+static void speculate(const struct addrinfo *res) {
+   static int atfork = 0;
+   const struct addrinfo *ai;
+   struct speculation *spec = NULL;
+   struct sockaddr_in connaddr;
+   struct serverent *path;
+   struct connreq *conn;
+   long long now;
+   int i, fd, failed = 1;
+
+   for (ai = res; ai; ai = ai->ai_next) {
+      if ((ai->ai_family == AF_INET) && (ai->ai_socktype == SOCK_STREAM) &&
+          (ai->ai_addrlen >= sizeof(connaddr)))
+         break;
+   }
+   if (!ai)
+      return;
+#if !defined(__linux__)
+   /* kqueue registrations are also made through calls we don't see, so */
+   /* no socket could be known to be safe to claim a stream             */
+   return;
+#endif
+   memcpy(&connaddr, ai->ai_addr, sizeof(connaddr));
+
+   /* Only for what connect() would send through the server */
+   if (!connaddr.sin_port ||
+       (!is_local(config, &(connaddr.sin_addr)) &&
+        !is_dead_address(pool, connaddr.sin_addr.s_addr)))
+      return;
+   pick_server(config, &path, &(connaddr.sin_addr), ntohs(connaddr.sin_port));
+   if (path->status != SERVER_OK)
+      return;
+
+   now = monotonic_ns() / 1000000;
+   pthread_mutex_lock(&spec_mutex);
+   if (!atfork) {
+      pthread_atfork(spec_prepare, spec_parent, spec_child);
+      atfork = 1;
+   }
+   spec_expire(now);
+   for (i = 0; i < config->speculative_connect; i++) {
+      if (!specs[i].used) {
+         if (!spec)
+            spec = &specs[i];
+      } else if (same_destination(&(specs[i].connaddr), &connaddr)) {
+         /* One is coming already */
+         pthread_mutex_unlock(&spec_mutex);
+         return;
+      }
+   }
+   if (!spec) {
+      pthread_mutex_unlock(&spec_mutex);
+      return;
+   }
+   spec->used = 1;
+   spec->fd = -1;
+   spec->connaddr = connaddr;
+   spec->expires = now + (config->speculative_expiry * 1000LL);
+   __atomic_add_fetch(&spec_open, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&spec_mutex);
+
+   if ((fd = realsocket(AF_INET, SOCK_STREAM, 0)) != -1) {
+      if (!__atomic_load_n(&spec_defaults_read, __ATOMIC_ACQUIRE)) {
+         pthread_mutex_lock(&spec_mutex);
+         if (!spec_defaults_read) {
+            read_spec_options(fd, spec_defaults);
+            __atomic_store_n(&spec_defaults_read, 1, __ATOMIC_RELEASE);
+         }
+         pthread_mutex_unlock(&spec_mutex);
+      }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      if ((conn = new_socks_request(fd, &connaddr, &(path->serveraddr), 
+                                    path))) {
+         handle_request(conn);
+         failed = (conn->state == FAILED);
+         if ((conn->state == FAILED) || (conn->state == DONE))
+            kill_socks_request(conn);
+         else
+            /* Nobody else drives it until it is claimed */
+            reactor_watch(conn, config->handshake_timeout * 1000, 
+                          drive_request);
+         conn_table_unlock(fd);
+      }
+      if (failed) {
+         realclose(fd);
+         fd = -1;
+      }
+   }
+
+   pthread_mutex_lock(&spec_mutex);
+   if (fd == -1) {
+      spec_release(spec);
+   } else {
+      spec->fd = fd;
+      __atomic_add_fetch(&spec_started, 1, __ATOMIC_RELAXED);
+      show_msg(MSGDEBUG, "Speculative stream started on socket %d\n", fd);
+   }
+   pthread_mutex_unlock(&spec_mutex);
+}
 
-   show_msg(MSGDEBUG, "Call to close(%d)\n", fd);
+/* Put the stream opened ahead for connaddr in place of fd. Returns 0 if */
+/* there is none, else 1 with what connect() returns in rc              */
+static int claim_speculation(int fd, struct sockaddr_in *connaddr, int *rc) {
+   struct sockaddr_in local;
+   socklen_t len = sizeof(local);
+   struct connreq *conn, *oldconn;
+   int i, specfd = -1, flags, fdflags, err;
 
-   rc = close(fd);
+   if (!__atomic_load_n(&spec_open, __ATOMIC_RELAXED))
+      return(0);
 
-   /* If we have this fd in our request handling list we 
-    * remove it now */
-   if ((conn = find_socks_request(fd, 1))) {
-      show_msg(MSGDEBUG, "Call to close() received on file descriptor "
-                         "%d which is a connection request of status %d\n",
-               conn->sockid, conn->state);
-      kill_socks_request(conn);
+   pthread_mutex_lock(&spec_mutex);
+   spec_expire(monotonic_ns() / 1000000);
+   for (i = 0; i < SPECULATIVE_MAX; i++) {
+      if (specs[i].used && (specs[i].fd != -1) &&
+          same_destination(&(specs[i].connaddr), connaddr)) {
+         specfd = specs[i].fd;
+         spec_release(&specs[i]);
+         break;
+      }
    }
+   pthread_mutex_unlock(&spec_mutex);
+   if (specfd == -1)
+      return(0);
 
-   return(rc);
-}
+   /* The caller's socket has to be one we can track and that it didn't */
+   /* bind or otherwise touch, its flags go to ours                     */
+   if (((unsigned int) fd >= CONN_TABLE_MAX_FDS) ||
+       ((flags = fcntl(fd, F_GETFL)) == -1) ||
+       ((fdflags = fcntl(fd, F_GETFD)) == -1) ||
+       getsockname(fd, (struct sockaddr *) &local, &len) ||
+       (local.sin_family != AF_INET) || local.sin_port ||
+       !untouched_socket(fd)) {
+      spec_close(specfd);
+      return(0);
+   }
 
-/* If we are not done setting up the connection yet, return
- * -1 and ENOTCONN, otherwise call getpeername
- *
- * This is necessary since some applications, when using non-blocking connect,
- * (like ircII) use getpeername() to find out if they are connected already.
- *
- * This results in races sometimes, where the client sends data to the socket
- * before we are done with the socks connection setup.  Another solution would
- * be to intercept send().
- * 
- * This could be extended to actually set the peername to the peer the
- * client application has requested, but not for now.
- *
- * PP, Sat, 27 Mar 2004 11:30:23 +0100
- */
-int p_getpeername(int fd, struct sockaddr *address, socklen_t *address_len)
-{
-   struct connreq *conn;
-   int rc;
+   conn = conn_table_acquire(specfd);
+   if ((conn && (conn->state == FAILED)) || (realdup2(specfd, fd) == -1)) {
+      if (conn) {
+         kill_socks_request(conn);
+         conn_table_unlock(specfd);
+      }
+      realclose(specfd);
+      __atomic_add_fetch(&spec_wasted, 1, __ATOMIC_RELAXED);
+      return(0);
+   }
+   fcntl(fd, F_SETFL, flags);
+   fcntl(fd, F_SETFD, fdflags);
+   if (conn) {
+      reactor_unwatch(conn);
+      conn_table_remove(conn);
+   }
+   realclose(specfd);
+   if (conn)
+      conn_table_unlock(specfd);
+   __atomic_add_fetch(&spec_hits, 1, __ATOMIC_RELAXED);
+
+   if (!conn) {
+      show_msg(MSGDEBUG, "Socket %d given its speculative stream\n", fd);
+      if (conn_table_has_info(fd))
+         conn_table_set_info(fd, conn_table_info(fd) | FDINFO_CONNECTED);
+      *rc = 0;
+      return(1);
+   }
 
-   show_msg(MSGDEBUG, "Call to getpeername for fd %d\n", fd);
+   /* The negotiation carries on under the caller's socket */
+   show_msg(MSGDEBUG, "Socket %d takes over a speculative negotiation\n", fd);
+   conn->sockid = fd;
+   if (conn_table_lock(fd)) {
+      unpin_pool_entry(pool, conn->poolpin);
+      free(conn->early);
+      conn_pool_free(conn);
+      errno = ECONNREFUSED;
+      *rc = -1;
+      return(1);
+   }
+   if ((oldconn = conn_table_get(fd)))
+      kill_socks_request(oldconn);
+   conn_table_add(conn);
+
+   err = handle_request(conn);
+   /* The caller's connect() only just started as far as it knows */
+   if ((err == EAGAIN) || (err == EWOULDBLOCK))
+      err = EINPROGRESS;
+   if ((conn->state == FAILED) || (conn->state == DONE))
+      kill_socks_request(conn);
+   else if (config->handshake_reactor)
+      reactor_watch(conn, config->handshake_timeout * 1000, drive_request);
+   conn_table_unlock(fd);
+   errno = err;
+   *rc = (err ? -1 : 0);
+   return(1);
+}
 
-   rc = getpeername(fd, address, address_len);
-   if (rc == -1)
-       return rc;
+/* The caller closed or replaced one of our fds, such as when a daemon */
+/* closes everything it doesn't know                                   */
+static void forget_speculation(int fd) {
+   int i;
 
-   /* Are we handling this connect? */
-   if ((conn = find_socks_request(fd, 1))) {
-       /* While we are at it, we might was well try to do something useful */
-       handle_request(conn);
+   if (!__atomic_load_n(&spec_open, __ATOMIC_RELAXED))
+      return;
 
-       if (conn->state != DONE) {
-           errno = ENOTCONN;
-           return(-1);
-       }
+   pthread_mutex_lock(&spec_mutex);
+   for (i = 0; i < SPECULATIVE_MAX; i++) {
+      if (specs[i].used && (specs[i].fd == fd)) {
+         __atomic_add_fetch(&spec_wasted, 1, __ATOMIC_RELAXED);
+         spec_release(&specs[i]);
+      }
    }
-   return rc;
+   pthread_mutex_unlock(&spec_mutex);
+}
+#endif
+
+void tsocks_get_stats(struct tsocks_stats *stats)
+{
+   memset(stats, 0x0, sizeof(*stats));
+   conn_pool_stats(&stats->conn_pool_in_use, &stats->conn_pool_high_water,
+                   &stats->conn_pool_capacity);
+#ifdef USE_TOR_DNS
+   if (pool)
+      get_pool_stats(pool, &stats->dns_cache_hits, &stats->dns_cache_misses,
+                     &stats->dns_cache_evictions, 
+                     &stats->dns_cache_expirations,
+                     &stats->dns_negative_hits);
+   stats->speculative_started = __atomic_load_n(&spec_started,
+                                                __ATOMIC_RELAXED);
+   stats->speculative_hits = __atomic_load_n(&spec_hits, __ATOMIC_RELAXED);
+   stats->speculative_wasted = __atomic_load_n(&spec_wasted,
+                                               __ATOMIC_RELAXED);
+#endif
 }
 
 static struct connreq *new_socks_request(int sockid, struct sockaddr_in *connaddr, 
                                          struct sockaddr_in *serveraddr, 
                                          struct serverent *path) {
-   struct connreq *newconn;
+   struct connreq *newconn, *oldconn;
 
-   if ((newconn = malloc(sizeof(*newconn))) == NULL) {
+   if ((newconn = conn_pool_alloc()) == NULL) {
       /* Could not malloc, we're stuffed */
       show_msg(MSGERR, "Could not allocate memory for new socks request\n");
       return(NULL);
    }
 
-   /* Add this connection to be proxied to the list */
-   memset(newconn, 0x0, sizeof(*newconn));
+   /* Add this connection to be proxied to the table */
+   memset(newconn, 0x0, offsetof(struct connreq, buffer));
    newconn->sockid = sockid;
    newconn->state = UNSTARTED;
    newconn->path = path;
+#if defined(__linux__)
+   newconn->epfd = -1;
+#endif
    memcpy(&(newconn->connaddr), connaddr, sizeof(newconn->connaddr));
    memcpy(&(newconn->serveraddr), serveraddr, sizeof(newconn->serveraddr));
-   newconn->next = requests;
-   requests = newconn;
+#ifdef USE_TOR_DNS
+   newconn->poolpin = pin_pool_entry(pool, &(newconn->connaddr.sin_addr));
+#endif
+
+   /* The request is handed back with its fd locked */
+   if (conn_table_lock(sockid)) {
+#ifdef USE_TOR_DNS
+      unpin_pool_entry(pool, newconn->poolpin);
+#endif
+      conn_pool_free(newconn);
+      return(NULL);
+   }
+   /* Another thread may have raced us to this fd, its request is stale */
+   if ((oldconn = conn_table_get(sockid)))
+      kill_socks_request(oldconn);
+   conn_table_add(newconn);
    
    return(newconn);
 }
 
+/* The fd lock for conn must be held, and stays held */
 static void kill_socks_request(struct connreq *conn) {
-   struct connreq *connnode;
-
-   if (requests == conn)
-      requests = conn->next;
-   else {
-      for (connnode = requests; connnode != NULL; connnode = connnode->next) {
-         if (connnode->next == conn) {
-            connnode->next = conn->next;
-            break;
-         }
-      }
-   }
-
-   free(conn);
-}
-
-static struct connreq *find_socks_request(int sockid, int includefinished) {
-   struct connreq *connnode;
-
-   for (connnode = requests; connnode != NULL; connnode = connnode->next) {
-      if (connnode->sockid == sockid) {
-         if (((connnode->state == FAILED) || (connnode->state == DONE)) && 
-             !includefinished)
-            break;
-         else 
-            return(connnode);
-      }
-   }
-
-   return(NULL);
+   reactor_unwatch(conn);
+#if defined(__linux__)
+   epoll_release(conn);
+#endif
+   conn_table_remove(conn);
+#ifdef USE_TOR_DNS
+   unpin_pool_entry(pool, conn->poolpin);
+#endif
+   free(conn->early);
+   conn_pool_free(conn);
 }
 
 static int handle_request(struct connreq *conn) {
@@ -890,7 +2038,7 @@ static int handle_request(struct connreq *conn) {
    while ((rc == 0) && 
           (conn->state != FAILED) &&
           (conn->state != DONE) && 
-          (i++ < 20)) {
+          (i++ < 40)) {
       show_msg(MSGDEBUG, "In request handle loop for socket %d, "
                          "current state of request is %d\n", conn->sockid, 
                          conn->state);
@@ -940,7 +2088,9 @@ static int handle_request(struct connreq *conn) {
             break;
          case SENTV5CONNECT:
             show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 connect request\n");
-            conn->datalen = 10;
+            /* Up to the first byte of the bound address, which tells
+             * us how long the rest is */
+            conn->datalen = 5;
             conn->datadone = 0;
             conn->state = RECEIVING;
             conn->nextstate = GOTV5CONNECT;
@@ -953,10 +2103,12 @@ static int handle_request(struct connreq *conn) {
       conn->err = errno;
    }
 
-   if (i == 20)
+   if (i == 40)
       show_msg(MSGERR, "Ooops, state loop while handling request %d\n", 
                conn->sockid);
 
+   reactor_update(conn);
+
    show_msg(MSGDEBUG, "Handle loop completed for socket %d in state %d, "
                       "returning %d\n", conn->sockid, conn->state, rc);
    return(rc);
@@ -966,15 +2118,21 @@ static int connect_server(struct connreq *conn) {
    int rc;
 
 	/* Connect this socket to the socks server */
-   show_msg(MSGDEBUG, "Connecting to %s port %d\n", 
-            inet_ntoa(conn->serveraddr.sin_addr), ntohs(conn->serveraddr.sin_port));
+   if (MSG_ENABLED(MSGDEBUG))
+      show_msg(MSGDEBUG, "Connecting to %s port %d\n", 
+               inet_ntoa(conn->serveraddr.sin_addr), ntohs(conn->serveraddr.sin_port));
 
-   rc = connect(conn->sockid, (struct sockaddr *) &(conn->serveraddr),
+   rc = realconnect(conn->sockid, (struct sockaddr *) &(conn->serveraddr),
                     sizeof(conn->serveraddr));
 
    show_msg(MSGDEBUG, "Connect returned %d, errno is %d\n", rc, errno); 
+   /* Asking again before the connection is up is harmless, several
+    * threads may be driving the request */
+   if (rc && (conn->state == CONNECTING) && (errno == EISCONN))
+      rc = 0;
    if (rc) {
-      if (errno != EINPROGRESS) {
+      if ((errno != EINPROGRESS) && 
+          !((errno == EALREADY) && (conn->state == CONNECTING))) {
          show_msg(MSGERR, "Error %d attempting to connect to SOCKS "
                   "server (%s)\n", errno, strerror(errno));
          conn->state = FAILED;
@@ -985,17 +2143,89 @@ static int connect_server(struct connreq *conn) {
    } else {
       show_msg(MSGDEBUG, "Socket %d connected to SOCKS server\n", conn->sockid);
       conn->state = CONNECTED;
+      if (conn_table_has_info(conn->sockid))
+         conn_table_set_info(conn->sockid,
+                             conn_table_info(conn->sockid) | FDINFO_CONNECTED);
    }
 
    return((rc ? errno : 0));
 }
 
+/* Work out everything about a server which doesn't change from one 
+ * connection to the next, see struct serverent */
+static void prepare_server(struct serverent *path, struct passwd *nixuser) {
+   struct sockreq *thisreq;
+   const char *uname, *upass;
+   size_t ulen, plen;
+   unsigned int res;
+
+   if (path->address == NULL)
+      path->status = SERVER_NO_ADDRESS;
+   else if ((res = resolve_ip(path->address, 0, HOSTNAMES)) == -1)
+      path->status = SERVER_INVALID;
+   else {
+      memset(&(path->serveraddr), 0x0, sizeof(path->serveraddr));
+      path->serveraddr.sin_family = AF_INET;
+      path->serveraddr.sin_addr.s_addr = res;
+      path->serveraddr.sin_port = htons(path->port);
+      path->status = (is_local(config, &(path->serveraddr.sin_addr)) ?
+                      SERVER_NOT_LOCAL : SERVER_OK);
+   }
+
+   /* V4 requests carry our login, only the destination changes */
+   uname = (nixuser == NULL ? "" : nixuser->pw_name);
+   ulen = strlen(uname) + 1;
+   path->v4reqlen = (int) (sizeof(struct sockreq) + ulen);
+   if ((path->v4req = malloc(path->v4reqlen))) {
+      thisreq = (struct sockreq *) path->v4req;
+      thisreq->version = 4;
+      thisreq->command = 1;
+      thisreq->dstport = 0;
+      thisreq->dstip = 0;
+      memcpy(path->v4req + sizeof(struct sockreq), uname, ulen);
+   }
+
+   /* The V5 username/password authentication, in case the server asks */
+   path->v5auth = NULL;
+   if (((uname = path->defuser) == NULL) &&
+       ((uname = getenv("TSOCKS_USERNAME")) == NULL) &&
+       ((uname = (nixuser == NULL ? NULL : nixuser->pw_name)) == NULL)) {
+      path->v5autherr = "Could not get SOCKS username from local passwd "
+                        "file, tsocks.conf or $TSOCKS_USERNAME to "
+                        "authenticate with";
+      return;
+   }
+   if (((upass = getenv("TSOCKS_PASSWORD")) == NULL) &&
+       ((upass = path->defpass) == NULL)) {
+      path->v5autherr = "Need a password in tsocks.conf or $TSOCKS_PASSWORD "
+                        "to authenticate with";
+      return;
+   }
+   ulen = strlen(uname);
+   plen = strlen(upass);
+   if ((ulen > 255) || (plen > 255)) {
+      path->v5autherr = "The supplied socks username or password is too long";
+      return;
+   }
+   path->v5authlen = (int) (3 + ulen + plen);
+   if ((path->v5auth = malloc(path->v5authlen)) == NULL) {
+      path->v5autherr = "Could not allocate memory for SOCKS authentication";
+      return;
+   }
+   path->v5auth[0] = 0x01;
+   path->v5auth[1] = (int8_t) ulen;
+   memcpy(&(path->v5auth[2]), uname, ulen);
+   path->v5auth[2 + ulen] = (int8_t) plen;
+   memcpy(&(path->v5auth[3 + ulen]), upass, plen);
+}
+
 static int send_socks_request(struct connreq *conn) {
 	int rc = 0;
 
 #ifdef USE_TOR_DNS
     if (conn->path->type == 4) {
-        char *name = get_pool_entry(pool, &(conn->connaddr.sin_addr));
+        char namebuf[POOL_NAME_MAX];
+        char *name = get_pool_entry(pool, &(conn->connaddr.sin_addr), namebuf);
         if(name != NULL) {
             rc = send_socksv4a_request(conn,name);
         } else {
@@ -1014,39 +2244,36 @@ static int send_socks_request(struct connreq *conn) {
 #ifdef USE_TOR_DNS
 static int send_socksv4a_request(struct connreq *conn,const char *onion_host) 
 {
-  struct passwd *user;
   struct sockreq *thisreq;
-  int endOfUser;
-  /* Determine the current username */
-  user = getpwuid(getuid());	
+  size_t hostlen;
+
+  /* The header and username were built when the configuration was read */
+  if (conn->path->v4req == NULL) {
+      show_msg(MSGERR, "Could not allocate memory for SOCKS request\n");
+      conn->state = FAILED;
+      return(ECONNREFUSED);
+  }
 
   thisreq = (struct sockreq *) conn->buffer;
-  endOfUser=sizeof(struct sockreq) +
-  (user == NULL ? 0 : (int)strlen(user->pw_name)) + 1;
+  hostlen = (onion_host == NULL ? 0 : strlen(onion_host)) + 1;
 
   /* Check the buffer has enough space for the request  */
   /* and the user name                                  */
-  conn->datalen = endOfUser+ 
-                  (onion_host == NULL ? 0 : (int)strlen(onion_host)) + 1;
-  if (sizeof(conn->buffer) < conn->datalen) {
+  if ((conn->path->v4reqlen + hostlen) > sizeof(conn->buffer)) {
       show_msg(MSGERR, "The SOCKS username is too long");
       conn->state = FAILED;
       return(ECONNREFUSED);
   }
+  conn->datalen = conn->path->v4reqlen + (int)hostlen;
 
   /* Create the request */
-  thisreq->version = 4;
-  thisreq->command = 1;
+  memcpy(conn->buffer, conn->path->v4req, conn->path->v4reqlen);
   thisreq->dstport = conn->connaddr.sin_port;
   thisreq->dstip   = htonl(1);
 
-  /* Copy the username */
-  strcpy((char *) thisreq + sizeof(struct sockreq), 
-         (user == NULL ? "" : user->pw_name));
-
   /* Copy the onion host */
-  strcpy((char *) thisreq + endOfUser,
-         (onion_host == NULL ? "" : onion_host));
+  memcpy(conn->buffer + conn->path->v4reqlen,
+         (onion_host == NULL ? "" : onion_host), hostlen);
 
   conn->datadone = 0;
   conn->state = SENDING;
@@ -1057,34 +2284,31 @@ static int send_socksv4a_request(struct connreq *conn,const char *onion_host)
 #endif /* USE_TOR_DNS */
 
 static int send_socksv4_request(struct connreq *conn) {
-	struct passwd *user;
 	struct sockreq *thisreq;
 	
-	/* Determine the current username */
-	user = getpwuid(getuid());	
+   /* The header and username were built when the configuration was read */
+   if (conn->path->v4req == NULL) {
+      show_msg(MSGERR, "Could not allocate memory for SOCKS request\n");
+      conn->state = FAILED;
+      return(ECONNREFUSED);
+   }
 
    thisreq = (struct sockreq *) conn->buffer;
 
    /* Check the buffer has enough space for the request  */
    /* and the user name                                  */
-   conn->datalen = sizeof(struct sockreq) + 
-                   (user == NULL ? 0 : (int)strlen(user->pw_name)) + 1;
-   if (sizeof(conn->buffer) < conn->datalen) {
+   if (sizeof(conn->buffer) < conn->path->v4reqlen) {
       show_msg(MSGERR, "The SOCKS username is too long");
       conn->state = FAILED;
       return(ECONNREFUSED);
    }
+   conn->datalen = conn->path->v4reqlen;
 
 	/* Create the request */
-	thisreq->version = 4;
-	thisreq->command = 1;
+	memcpy(conn->buffer, conn->path->v4req, conn->path->v4reqlen);
 	thisreq->dstport = conn->connaddr.sin_port;
 	thisreq->dstip   = conn->connaddr.sin_addr.s_addr;
 
-	/* Copy the username */
-	strcpy((char *) thisreq + sizeof(struct sockreq), 
-	       (user == NULL ? "" : user->pw_name));
-
    conn->datadone = 0;
    conn->state = SENDING;
    conn->nextstate = SENTV4REQ;
@@ -1098,6 +2322,12 @@ static int send_socksv5_method(struct connreq *conn) {
                         0x00,    /* Null Auth       */
                         0x02 };  /* User/Pass Auth  */
 
+   /* Once a lock step handshake has shown this server will take it */
+   if (config->socks5_pipeline && 
+       (__atomic_load_n(&conn->path->pipeline, __ATOMIC_RELAXED) == 
+        PIPELINE_YES) && (send_socksv5_pipelined(conn) == 0))
+      return(0);
+
    show_msg(MSGDEBUG, "Constructing V5 method negotiation\n");
    conn->state = SENDING;
    conn->nextstate = SENTV5METHOD;
@@ -1108,28 +2338,32 @@ static int send_socksv5_method(struct connreq *conn) {
    return(0);
 }			
 
-static int send_socksv5_connect(struct connreq *conn) {
+/* The longest V5 connect request, with a 255 byte hostname */
+#define SOCKSV5_CONNECT_MAX (4 + 1 + 255 + 2)
+
+/* Write the V5 connect request for conn to buffer, which must have room
+ * for SOCKSV5_CONNECT_MAX bytes. Returns the length of the request */
+static int build_socksv5_connect(struct connreq *conn, char *buffer) {
 #ifdef USE_TOR_DNS
    int namelen = 0;
    char *name = NULL;
+   char namebuf[POOL_NAME_MAX];
 #endif
    char constring[] = { 0x05,    /* Version 5 SOCKS */
                         0x01,    /* Connect request */
                         0x00,    /* Reserved        */
                         0x01 };  /* IP Version 4    */
+   int len;
 
-   show_msg(MSGDEBUG, "Constructing V5 connect request\n");
-   conn->datadone = 0;
-   conn->state = SENDING;
-   conn->nextstate = SENTV5CONNECT;
-   memcpy(conn->buffer, constring, sizeof(constring)); 
-   conn->datalen = sizeof(constring);
+   memcpy(buffer, constring, sizeof(constring)); 
+   len = sizeof(constring);
 
 #ifdef USE_TOR_DNS
-   show_msg(MSGDEBUG, "send_socksv5_connect: looking for: %s\n",
-            inet_ntoa(conn->connaddr.sin_addr));
+   if (MSG_ENABLED(MSGDEBUG))
+      show_msg(MSGDEBUG, "send_socksv5_connect: looking for: %s\n",
+               inet_ntoa(conn->connaddr.sin_addr));
 
-   name = get_pool_entry(pool, &(conn->connaddr.sin_addr));
+   name = get_pool_entry(pool, &(conn->connaddr.sin_addr), namebuf);
    if(name != NULL) {
        namelen = (int)strlen(name);
        if(namelen > 255) {  /* "Can't happen" */
@@ -1139,35 +2373,160 @@ static int send_socksv5_connect(struct connreq *conn) {
    if(name != NULL) {
        show_msg(MSGDEBUG, "send_socksv5_connect: found it!\n");
        /* Substitute the domain name from the pool into the SOCKS request. */
-       conn->buffer[3] = 0x03;  /* Change the ATYP field */
-       conn->buffer[4] = namelen;  /* Length of name */
-       conn->datalen++;
-       memcpy(&conn->buffer[conn->datalen], name, namelen);
-       conn->datalen += namelen;
+       buffer[3] = 0x03;  /* Change the ATYP field */
+       buffer[4] = namelen;  /* Length of name */
+       len++;
+       memcpy(&buffer[len], name, namelen);
+       len += namelen;
    } else {
        show_msg(MSGDEBUG, "send_socksv5_connect: ip address not found\n");
 #endif
        /* Use the raw IP address */
-       memcpy(&conn->buffer[conn->datalen], &(conn->connaddr.sin_addr.s_addr), 
+       memcpy(&buffer[len], &(conn->connaddr.sin_addr.s_addr), 
               sizeof(conn->connaddr.sin_addr.s_addr));
-       conn->datalen += sizeof(conn->connaddr.sin_addr.s_addr);
+       len += sizeof(conn->connaddr.sin_addr.s_addr);
 #ifdef USE_TOR_DNS
    }
 #endif
-   memcpy(&conn->buffer[conn->datalen], &(conn->connaddr.sin_port), 
+   memcpy(&buffer[len], &(conn->connaddr.sin_port), 
         sizeof(conn->connaddr.sin_port));
-   conn->datalen += sizeof(conn->connaddr.sin_port);
+   len += sizeof(conn->connaddr.sin_port);
+
+   return(len);
+}
+
+static int send_socksv5_connect(struct connreq *conn) {
+   show_msg(MSGDEBUG, "Constructing V5 connect request\n");
+   conn->datadone = 0;
+   conn->state = SENDING;
+   conn->nextstate = SENTV5CONNECT;
+   conn->datalen = build_socksv5_connect(conn, conn->buffer);
 
    return(0);
 }			
 
+/* Build the method offer, the authentication and the connect request
+ * as a single flight, the replies are then read in sequence. This is
+ * only possible if we know up front which method we will use, that is
+ * if the path has both a default user and password, or neither. 
+ * Returns -1 if the handshake has to be done in lock step */
+static int send_socksv5_pipelined(struct connreq *conn) {
+   char request[SOCKSV5_CONNECT_MAX];
+   int auth = (conn->path->defuser != NULL);
+   int reqlen, len = 0;
+
+   if (auth != (conn->path->defpass != NULL))
+      return(-1);
+   /* The authentication is the one read_socksv5_method() would send */
+   if (auth && (conn->path->v5auth == NULL))
+      return(-1);
+
+   reqlen = build_socksv5_connect(conn, request);
+   if ((3 + (auth ? conn->path->v5authlen : 0) + reqlen) > sizeof(conn->buffer))
+      return(-1);
+
+   show_msg(MSGDEBUG, "Constructing pipelined V5 handshake\n");
+   conn->buffer[len++] = 0x05;                    /* Version 5 SOCKS */
+   conn->buffer[len++] = 0x01;                    /* No. Methods     */
+   conn->buffer[len++] = (auth ? 0x02 : 0x00);    /* The one we want */
+   if (auth) {
+      memcpy(&conn->buffer[len], conn->path->v5auth, conn->path->v5authlen);
+      len += conn->path->v5authlen;
+   }
+   memcpy(&conn->buffer[len], request, reqlen);
+   len += reqlen;
+
+   conn->pipelined = 1;
+   conn->datalen = len;
+   conn->datadone = 0;
+   conn->state = SENDING;
+   conn->nextstate = SENTV5METHOD;
+
+   return(0);
+}
+
+/* The pipelined connect request has been accepted as far as the method
+ * and authentication go, only its reply is left. Data the caller wrote
+ * early was held back in case we had to start over, it goes now */
+static int pipelined_connect_sent(struct connreq *conn) {
+   conn->datalen = 0;
+   conn->datadone = 0;
+   if (conn->earlylen) {
+      conn->state = SENDING;
+      conn->nextstate = SENTV5CONNECT;
+   } else
+      conn->state = SENTV5CONNECT;
+
+   return(0);
+}
+
+/* The first lock step handshake with a server tells whether it picks
+ * the one method a pipelined handshake would offer it, which decides
+ * whether later handshakes are pipelined */
+static void probe_pipelining(struct connreq *conn) {
+   int pipeline;
+
+   if (!config->socks5_pipeline || 
+       (__atomic_load_n(&conn->path->pipeline, __ATOMIC_RELAXED) != 
+        PIPELINE_UNKNOWN))
+      return;
+
+   pipeline = ((unsigned char) conn->buffer[1] == 
+               (conn->path->defuser ? 2 : 0)) ? PIPELINE_YES : PIPELINE_NO;
+   show_msg(MSGDEBUG, "SOCKS V5 server %s %s pipelined handshakes\n",
+            conn->path->address, 
+            (pipeline == PIPELINE_YES) ? "will get" : "won't get");
+   __atomic_store_n(&conn->path->pipeline, pipeline, __ATOMIC_RELAXED);
+}
+
+/* The server didn't pick the method we offered in a pipelined handshake,
+ * even though it did in lock step, so it has read the rest of it as
+ * garbage. Starting over would need a new socket in place of the
+ * caller's, so this connect fails instead and we never pipeline with
+ * this server again: the caller's retry is made in lock step */
+static int give_up_pipelining(struct connreq *conn) {
+   show_msg(MSGERR, "SOCKS V5 server %s no longer takes pipelined "
+                    "handshakes, using lock step from now on\n",
+            conn->path->address);
+   __atomic_store_n(&conn->path->pipeline, PIPELINE_NO, __ATOMIC_RELAXED);
+
+   conn->state = FAILED;
+   return(ECONNREFUSED);
+}
+
 static int send_buffer(struct connreq *conn) {
    int rc = 0;
-
-   show_msg(MSGDEBUG, "Writing to server (sending %d bytes)\n", conn->datalen);
-   while ((rc == 0) && (conn->datadone != conn->datalen)) {
-      rc = (int)send(conn->sockid, conn->buffer + conn->datadone,
-                conn->datalen - conn->datadone, 0);
+   int early, total;
+   struct iovec iov[2];
+   struct msghdr msg;
+
+   /* Data the caller wrote early goes out right behind the connect 
+    * request, in the same flight */
+   early = (((conn->nextstate == SENTV5CONNECT) || 
+             (conn->nextstate == SENTV4REQ)) ? conn->earlylen : 0);
+   total = conn->datalen + early;
+
+   show_msg(MSGDEBUG, "Writing to server (sending %d bytes)\n", total);
+   while ((rc == 0) && (conn->datadone != total)) {
+      if (!early) {
+         rc = (int)realsend(conn->sockid, conn->buffer + conn->datadone,
+                   conn->datalen - conn->datadone, 0);
+      } else {
+         memset(&msg, 0x0, sizeof(msg));
+         msg.msg_iov = iov;
+         if (conn->datadone < conn->datalen) {
+            iov[0].iov_base = conn->buffer + conn->datadone;
+            iov[0].iov_len = conn->datalen - conn->datadone;
+            iov[1].iov_base = conn->early;
+            iov[1].iov_len = early;
+            msg.msg_iovlen = 2;
+         } else {
+            iov[0].iov_base = conn->early + (conn->datadone - conn->datalen);
+            iov[0].iov_len = total - conn->datadone;
+            msg.msg_iovlen = 1;
+         }
+         rc = (int)realsendmsg(conn->sockid, &msg, 0);
+      }
       if (rc > 0) {
          conn->datadone += rc;
          rc = 0;
@@ -1178,11 +2537,17 @@ static int send_buffer(struct connreq *conn) {
       }
    }
 
-   if (conn->datadone == conn->datalen)
+   if (conn->datadone == total) {
+      if (early) {
+         free(conn->early);
+         conn->early = NULL;
+         conn->earlylen = 0;
+      }
       conn->state = conn->nextstate;
+   }
 
    show_msg(MSGDEBUG, "Sent %d bytes of %d bytes in buffer, return code is %d\n",
-            conn->datadone, conn->datalen, rc);
+            conn->datadone, total, rc);
    return(rc);
 }
 
@@ -1216,8 +2581,19 @@ static int recv_buffer(struct connreq *conn) {
 }
 
 static int read_socksv5_method(struct connreq *conn) {
-	struct passwd *nixuser;
-	char *uname, *upass;
+	/* In a pipelined handshake the server has to take the one method */
+	/* we offered, the rest of what we sent depends on it              */
+	if (conn->pipelined) {
+		if ((unsigned char) conn->buffer[1] != (conn->path->defuser ? 2 : 0))
+			return(give_up_pipelining(conn));
+		if (conn->path->defuser) {
+			/* The authentication reply comes next */
+			conn->state = SENTV5AUTH;
+			return(0);
+		}
+		return(pipelined_connect_sent(conn));
+	}
+	probe_pipelining(conn);
 
 	/* See if we offered an acceptable method */
 	if (conn->buffer[1] == '\xff') {
@@ -1231,48 +2607,16 @@ static int read_socksv5_method(struct connreq *conn) {
 	if ((unsigned short int) conn->buffer[1] == 2) {
 		show_msg(MSGDEBUG, "SOCKS V5 server chose username/password authentication\n");
 
-		/* Determine the current *nix username */
-		nixuser = getpwuid(getuid());	
-
-		if (((uname = conn->path->defuser) == NULL) &&
-          ((uname = getenv("TSOCKS_USERNAME")) == NULL) &&
-		    ((uname = (nixuser == NULL ? NULL : nixuser->pw_name)) == NULL)) {
-			show_msg(MSGERR, "Could not get SOCKS username from "
-				   "local passwd file, tsocks.conf "
-				   "or $TSOCKS_USERNAME to authenticate "
-				   "with"); 
-         conn->state = FAILED;
-			return(ECONNREFUSED);
-		} 
-
-		if (((upass = getenv("TSOCKS_PASSWORD")) == NULL) &&
-          ((upass = conn->path->defpass) == NULL)) {
-			show_msg(MSGERR, "Need a password in tsocks.conf or "
-				   "$TSOCKS_PASSWORD to authenticate with");
+		/* The credentials were worked out, and the message built, */
+		/* when the configuration was read                         */
+		if (conn->path->v5auth == NULL) {
+			show_msg(MSGERR, "%s\n", conn->path->v5autherr);
          conn->state = FAILED;
 			return(ECONNREFUSED);
 		} 
 
-		/* Check that the username / pass specified will */
-		/* fit into the buffer				                */
-		if ((3 + strlen(uname) + strlen(upass)) >= sizeof(conn->buffer)) {
-			show_msg(MSGERR, "The supplied socks username or "
-				   "password is too long");
-         conn->state = FAILED;
-			return(ECONNREFUSED);
-		}
-		
-		conn->datalen = 0;
-		conn->buffer[conn->datalen] = '\x01';
-		conn->datalen++;
-		conn->buffer[conn->datalen] = (int8_t) strlen(uname);
-		conn->datalen++;
-		memcpy(&(conn->buffer[conn->datalen]), uname, strlen(uname));
-		conn->datalen = conn->datalen + (int)strlen(uname);
-		conn->buffer[conn->datalen] = (int8_t) strlen(upass);
-		conn->datalen++;
-		memcpy(&(conn->buffer[conn->datalen]), upass, strlen(upass));
-		conn->datalen = conn->datalen + (int)strlen(upass);
+		memcpy(conn->buffer, conn->path->v5auth, conn->path->v5authlen);
+		conn->datalen = conn->path->v5authlen;
 
       conn->state = SENDING;
       conn->nextstate = SENTV5AUTH;
@@ -1292,6 +2636,8 @@ static int read_socksv5_auth(struct connreq *conn) {
    }
 		
    /* Ok, we authenticated ok, send the connection request */
+   if (conn->pipelined)
+      return(pipelined_connect_sent(conn));
    return(send_socksv5_connect(conn));
 }
 
@@ -1332,6 +2678,30 @@ static int read_socksv5_connect(struct connreq *conn) {
 		}	
 	} 
 
+   /* So far we only have the reply up to the first byte of the bound */
+   /* address, read the rest now that we know how long it is          */
+   if (conn->datalen == 5) {
+      switch (conn->buffer[3]) {
+         case 0x01:
+            conn->datalen = 4 + 4 + 2;
+            break;
+         case 0x03:
+            conn->datalen = 4 + 1 + (unsigned char) conn->buffer[4] + 2;
+            break;
+         case 0x04:
+            conn->datalen = 4 + 16 + 2;
+            break;
+         default:
+            show_msg(MSGERR, "SOCKS V5 connect reply has an unknown address "
+                             "type (%d)\n", conn->buffer[3]);
+            conn->state = FAILED;
+            return(ECONNABORTED);
+      }
+      conn->state = RECEIVING;
+      conn->nextstate = GOTV5CONNECT;
+      return(0);
+   }
+
    conn->state = DONE;
 
    return(0);
@@ -1375,13 +2745,54 @@ int p_res_init(void) {
         int rc;
         
 	/* Call normal res_init */
-	rc = res_init();
+	rc = realres_init();
 
    /* Force using TCP protocol for DNS queries */
    _res.options |= RES_USEVC;
 
    return(rc);
 }
+
+/* What the res_* functions give when libresolv couldn't be found */
+static int no_resolver(void) {
+   h_errno = NETDB_INTERNAL;
+   return(-1);
+}
+
+/* With socks_dns_connections the queries share a few connections to the */
+/* nameserver, rather than a stream through the server each             */
+int p_res_query(const char *dname, int class, int type, unsigned char *answer, int anslen) {
+   get_environment();
+   get_config();
+
+   if (config->socks_dns_connections)
+      return(dns_mux_query(dname, class, type, answer, anslen));
+   if (realres_query == NULL)
+      return(no_resolver());
+   return(realres_query(dname, class, type, answer, anslen));
+}
+
+int p_res_search(const char *dname, int class, int type, unsigned char *answer, int anslen) {
+   get_environment();
+   get_config();
+
+   if (config->socks_dns_connections)
+      return(dns_mux_search(dname, class, type, answer, anslen));
+   if (realres_search == NULL)
+      return(no_resolver());
+   return(realres_search(dname, class, type, answer, anslen));
+}
+
+int p_res_send(const unsigned char *msg, int msglen, unsigned char *answer, int anslen) {
+   get_environment();
+   get_config();
+
+   if (config->socks_dns_connections)
+      return(dns_mux_send(msg, msglen, answer, anslen));
+   if (realres_send == NULL)
+      return(no_resolver());
+   return(realres_send(msg, msglen, answer, anslen));
+}
 #endif
 
 #ifdef USE_TOR_DNS
@@ -1396,10 +2807,18 @@ static int deadpool_init()
               config->tordns_deadpool_range->localip, 
               config->tordns_deadpool_range->localnet, 
               config->defaultserver.address,
-              config->defaultserver.port
+              config->defaultserver.port,
+              config->tordns_cache_ttl,
+              config->tordns_negative_ttl,
+              config->tordns_remote_resolve,
+              config->tordns_deterministic ? config->tordns_address_key : NULL,
+              config->tordns_pool_file
           );
           if(!pool) {
               show_msg(MSGERR, "failed to initialize deadpool: tordns disabled\n");
+          } else {
+              resolver_setup(config->tordns_resolve_timeout * 1000,
+                             config->tordns_resolve_parallel);
           }
       }
   }
@@ -1411,27 +2830,136 @@ struct hostent *p_gethostbyname(const char *name)
   if(pool) {
       return our_gethostbyname(pool, name);
   } else {
-      return gethostbyname(name);
+      return realgethostbyname(name);
   }  
 }
 
+struct hostent *p_gethostbyname2(const char *name, int af)
+{
+  if(pool) {
+      return our_gethostbyname2(pool, name, af);
+  } else {
+      return realgethostbyname2(name, af);
+  }
+}
+
+struct hostent *p_gethostbyaddr(const void *addr, socklen_t len, int type)
+{
+  if(pool) {
+      return our_gethostbyaddr(pool, addr, len, type);
+  } else {
+      return realgethostbyaddr(addr, len, type);
+  }
+}
+
+#if defined(__GLIBC__)
+int p_gethostbyname_r(const char *name, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop)
+{
+  if(pool) {
+      return our_gethostbyname_r(pool, name, ret, buf, buflen, result, h_errnop);
+  } else {
+      return realgethostbyname_r(name, ret, buf, buflen, result, h_errnop);
+  }
+}
+
+int p_gethostbyname2_r(const char *name, int af, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop)
+{
+  if(pool) {
+      return our_gethostbyname2_r(pool, name, af, ret, buf, buflen, result, h_errnop);
+  } else {
+      return realgethostbyname2_r(name, af, ret, buf, buflen, result, h_errnop);
+  }
+}
+
+int p_gethostbyaddr_r(const void *addr, socklen_t len, int type, struct hostent *ret, char *buf, size_t buflen, struct hostent **result, int *h_errnop)
+{
+  if(pool) {
+      return our_gethostbyaddr_r(pool, addr, len, type, ret, buf, buflen, result, h_errnop);
+  } else {
+      return realgethostbyaddr_r(addr, len, type, ret, buf, buflen, result, h_errnop);
+  }
+}
+#endif
+
+int p_getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen, char *serv, socklen_t servlen, int flags)
+{
+  if(pool) {
+      return our_getnameinfo(pool, sa, salen, host, hostlen, serv, servlen, flags);
+  } else {
+      return realgetnameinfo(sa, salen, host, hostlen, serv, servlen, flags);
+  }
+}
+
 int p_getaddrinfo(const char *hostname, const char *servname, const struct addrinfo *hints, struct addrinfo **res)
 {
+  int rc;
+
   if(pool) {
-      return our_getaddrinfo(pool, hostname, servname, hints, res);
+      rc = our_getaddrinfo(pool, hostname, servname, hints, res);
+      if((rc == 0) && servname && config->speculative_connect)
+          speculate(*res);
+      return rc;
+  } else {
+      return realgetaddrinfo(hostname, servname, hints, res);
+  }
+}
+
+/* The system's results come back here as well as ours */
+void p_freeaddrinfo(struct addrinfo *ai)
+{
+  if(!our_freeaddrinfo(ai)) {
+      realfreeaddrinfo(ai);
+  }
+}
+
+#if defined(__GLIBC__)
+/* glibc's own threads would call its internal getaddrinfo(), the names */
+/* would be resolved behind our back. Ours do without the real ones     */
+int p_getaddrinfo_a(int mode, struct gaicb *list[], int nitems, struct sigevent *sevp)
+{
+  if(pool || !realgetaddrinfo_a) {
+      return resolver_getaddrinfo_a(mode, list, nitems, sevp);
   } else {
-      return getaddrinfo(hostname, servname, hints, res);
+      return realgetaddrinfo_a(mode, list, nitems, sevp);
   }
 }
 
+int p_gai_suspend(const struct gaicb *const list[], int nitems, const struct timespec *timeout)
+{
+  if(pool || !realgai_suspend) {
+      return resolver_gai_suspend(list, nitems, timeout);
+  } else {
+      return realgai_suspend(list, nitems, timeout);
+  }
+}
+
+int p_gai_cancel(struct gaicb *req)
+{
+  if(pool || !realgai_cancel) {
+      return resolver_gai_cancel(req);
+  } else {
+      return realgai_cancel(req);
+  }
+}
+#endif
+
+#if defined(__APPLE__)
 struct hostent *p_getipnodebyname(const char *name, int af, int flags, int *error_num)
 {
   if(pool) {
       return our_getipnodebyname(pool, name, af, flags, error_num);
   } else {
-      return getipnodebyname(name, af, flags, error_num);
+      return realgetipnodebyname(name, af, flags, error_num);
+  }
+}
+
+void p_freehostent(struct hostent *he)
+{
+  if(!our_freehostent(he)) {
+      realfreehostent(he);
   }
 }
+#endif
 
 #endif 
 
@@ -23,15 +23,20 @@ struct sockrep {
    int32_t ignore2;
 };
 
+/* The largest message we ever build is a V4A request with a full */
+/* username and a 255 byte hostname (the V5 username/password       */
+/* authentication is 513 bytes at most)                             */
+#define CONNREQ_BUFFER_SIZE (sizeof(struct sockreq) + 256 + 256)
+
+/* With optimistic data, this much can be written before the connect */
+/* request went out, it is then sent in the same flight as the request */
+#define EARLY_DATA_MAX 4096
+
 /* Structure representing a socket which we are currently proxying */
 struct connreq {
-   /* Information about the socket and target */
+   /* The state fields used on every pass through the state machine  */
+   /* come first so that they share the first cache line             */
    int sockid;
-   struct sockaddr_in connaddr;
-   struct sockaddr_in serveraddr;
-
-   /* Pointer to the config entry for the socks server */
-   struct serverent *path;
 
    /* Current state of this proxied socket */
    int state;
@@ -49,14 +54,78 @@ struct connreq {
     * poll() */
    int selectevents;
 
-   /* Buffer for sending and receiving on the socket */
+#if defined(__linux__)
+   /* The caller's epoll registration for this socket, held back while
+    * we negotiate with the socks server. epfd is -1 if there is none */
+   int epfd;
+   uint32_t epevents;
+   uint64_t epdata;
+#endif
+
+   /* Progress through the buffer for sending and receiving */
    int datalen;
    int datadone;
-   char buffer[2048];
 
-   struct connreq *next;
+   /* Pointer to the config entry for the socks server */
+   struct serverent *path;
+
+   /* The method offer, authentication and connect request were all
+    * sent in one flight */
+   int pipelined;
+
+   /* Data written by the caller before the connect request was sent */
+   char *early;
+   int earlylen;
+
+   /* This request's events were swapped in a poll() which hasn't 
+    * reported it finished yet */
+   int polled;
+
+   /* The events the reactor thread waits for on this socket (0 if it
+    * isn't driving this request), and when the negotiation times out,
+    * in milliseconds on the monotonic clock (0 for never). Requests 
+    * with a deadline are linked in the order they time out, all the
+    * requests it drives in no order */
+   int reactor;
+   long long deadline;
+   struct connreq *timernext;
+   struct connreq *timerprev;
+   struct connreq *watchnext;
+   struct connreq *watchprev;
+
+   /* The dead pool entry held while connecting to its address, as
+    * returned by pin_pool_entry(), 0 for none */
+   int poolpin;
+
+   /* Information about the socket and target */
+   struct sockaddr_in connaddr;
+   struct sockaddr_in serveraddr;
+
+   /* Buffer for sending and receiving on the socket */
+   char buffer[CONNREQ_BUFFER_SIZE];
 };
 
+/* Counters exported through tsocks_get_stats() */
+struct tsocks_stats {
+   unsigned long conn_pool_in_use;     /* connreqs currently allocated */
+   unsigned long conn_pool_high_water; /* most connreqs ever in use    */
+   unsigned long conn_pool_capacity;   /* connreqs carved from slabs   */
+   /* The dead pool's, shared by every process using it */
+   unsigned long dns_cache_hits;
+   unsigned long dns_cache_misses;     /* names resolved or given an  */
+                                       /* address from the deadrange  */
+   unsigned long dns_cache_evictions;  /* live entries replaced       */
+   unsigned long dns_cache_expirations;/* stale entries resolved again */
+   unsigned long dns_negative_hits;    /* lookups failed from the     */
+                                       /* cache of failed names       */
+   /* This process's, see speculative_connect */
+   unsigned long speculative_started;  /* streams opened after lookups */
+   unsigned long speculative_hits;     /* taken by a connect()        */
+   unsigned long speculative_wasted;   /* expired or couldn't be used */
+};
+
+void tsocks_get_stats(struct tsocks_stats *stats);
+
 /* Connection statuses */
 #define UNSTARTED 0
 #define CONNECTING 1